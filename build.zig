@@ -43,6 +43,58 @@ pub fn build(b: *std.Build) !void {
     const run_main_tests = b.addRunArtifact(main_tests);
     const main_tests_step = b.step("test", "Run main tests");
     main_tests_step.dependOn(&run_main_tests.step);
+
+    // The tables and their benchmarks need the plugin library.
+    const cycle = cycleModule(b) orelse return;
+
+    const bench_exe = b.addExecutable(.{
+        .name = "bench",
+        .root_source_file = .{ .path = "src/bench.zig" },
+        .target = target,
+        .optimize = .ReleaseFast,
+    });
+    bench_exe.root_module.addImport("cycle", cycle);
+
+    const table_tests = b.addTest(.{
+        .root_source_file = .{ .path = "src/tests.zig" },
+        .target = target,
+        .optimize = optimize,
+    });
+    table_tests.root_module.addImport("cycle", cycle);
+
+    const run_table_tests = b.addRunArtifact(table_tests);
+    main_tests_step.dependOn(&run_table_tests.step);
+    const table_tests_step = b.step("test-tables", "Run the tests of the object and type tables");
+    table_tests_step.dependOn(&run_table_tests.step);
+
+    const run_bench = b.addRunArtifact(bench_exe);
+    const bench_step = b.step("bench", "Run all benchmarks");
+    bench_step.dependOn(&run_bench.step);
+
+    inline for (.{ "serde", "state", "table", "store", "objects", "types" }) |suite| {
+        const run_suite = b.addRunArtifact(bench_exe);
+        run_suite.addArg(suite);
+        const suite_step = b.step("bench-" ++ suite, "Run the " ++ suite ++ " benchmarks");
+        suite_step.dependOn(&run_suite.step);
+    }
+
+    // `zig build fuzz-objects -- [iterations] [seed]`
+    const run_fuzz = b.addRunArtifact(bench_exe);
+    run_fuzz.addArgs(&.{ "objects", "fuzz" });
+    if (b.args) |args| {
+        run_fuzz.addArgs(args);
+    }
+    const fuzz_step = b.step("fuzz-objects", "Fuzz object updates with invalid mutations");
+    fuzz_step.dependOn(&run_fuzz.step);
+}
+
+/// The `cycle` plugin library isn't a package dependency yet, so it's taken from a checkout given with
+/// `-Dcycle=<path to its root source file>`. Returns null without it, leaving out the steps that need it.
+fn cycleModule(b: *std.Build) ?*std.Build.Module {
+    const path = b.option([]const u8, "cycle", "Root source file of the cycle plugin library") orelse return null;
+    return b.createModule(.{
+        .root_source_file = .{ .cwd_relative = path },
+    });
 }
 
 fn vulkanModule(b: *std.Build) !*std.Build.Module {
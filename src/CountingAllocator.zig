@@ -0,0 +1,97 @@
+//! Wraps an allocator and counts the memory that goes through it. The counters are atomic, so it's as thread
+//! safe as its parent. Counting allocators can be chained, in which case an allocation is counted by every
+//! one of them, which gives totals over groups of counters.
+const std = @import("std");
+
+parent: std.mem.Allocator,
+live_bytes: std.atomic.Value(usize) = std.atomic.Value(usize).init(0),
+peak_bytes: std.atomic.Value(usize) = std.atomic.Value(usize).init(0),
+live_allocations: std.atomic.Value(usize) = std.atomic.Value(usize).init(0),
+allocations: std.atomic.Value(usize) = std.atomic.Value(usize).init(0),
+
+pub const Stats = struct {
+    /// Bytes currently allocated, as requested rather than as held by the parent.
+    live_bytes: usize,
+    /// The most `live_bytes` ever was.
+    peak_bytes: usize,
+    live_allocations: usize,
+    /// Allocations made since the start, including those freed since.
+    allocations: usize,
+};
+
+const Self = @This();
+
+pub fn init(parent: std.mem.Allocator) Self {
+    return Self{ .parent = parent };
+}
+
+pub fn allocator(self: *Self) std.mem.Allocator {
+    return std.mem.Allocator{
+        .ptr = self,
+        .vtable = &.{
+            .alloc = alloc,
+            .resize = resize,
+            .free = free,
+        },
+    };
+}
+
+pub fn stats(self: *const Self) Stats {
+    return Stats{
+        .live_bytes = self.live_bytes.load(.monotonic),
+        .peak_bytes = self.peak_bytes.load(.monotonic),
+        .live_allocations = self.live_allocations.load(.monotonic),
+        .allocations = self.allocations.load(.monotonic),
+    };
+}
+
+fn alloc(ctx: *anyopaque, len: usize, log2_align: u8, ret_addr: usize) ?[*]u8 {
+    const self: *Self = @ptrCast(@alignCast(ctx));
+    const ptr = self.parent.rawAlloc(len, log2_align, ret_addr) orelse return null;
+    self.grow(len);
+    _ = self.live_allocations.fetchAdd(1, .monotonic);
+    _ = self.allocations.fetchAdd(1, .monotonic);
+    return ptr;
+}
+
+fn resize(ctx: *anyopaque, buf: []u8, log2_align: u8, new_len: usize, ret_addr: usize) bool {
+    const self: *Self = @ptrCast(@alignCast(ctx));
+    if (!self.parent.rawResize(buf, log2_align, new_len, ret_addr)) {
+        return false;
+    }
+    if (new_len > buf.len) {
+        self.grow(new_len - buf.len);
+    } else {
+        _ = self.live_bytes.fetchSub(buf.len - new_len, .monotonic);
+    }
+    return true;
+}
+
+fn free(ctx: *anyopaque, buf: []u8, log2_align: u8, ret_addr: usize) void {
+    const self: *Self = @ptrCast(@alignCast(ctx));
+    self.parent.rawFree(buf, log2_align, ret_addr);
+    _ = self.live_bytes.fetchSub(buf.len, .monotonic);
+    _ = self.live_allocations.fetchSub(1, .monotonic);
+}
+
+fn grow(self: *Self, len: usize) void {
+    const live = self.live_bytes.fetchAdd(len, .monotonic) + len;
+    _ = self.peak_bytes.fetchMax(live, .monotonic);
+}
+
+test {
+    var counting = Self.init(std.testing.allocator);
+    const counted = counting.allocator();
+
+    const a = try counted.alloc(u8, 100);
+    var b = try counted.alloc(u8, 50);
+    counted.free(a);
+    b = try counted.realloc(b, 10);
+    defer counted.free(b);
+
+    const s = counting.stats();
+    try std.testing.expectEqual(@as(usize, 10), s.live_bytes);
+    try std.testing.expectEqual(@as(usize, 150), s.peak_bytes);
+    try std.testing.expectEqual(@as(usize, 1), s.live_allocations);
+    try std.testing.expect(s.allocations >= 2);
+}
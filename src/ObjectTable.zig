@@ -2,73 +2,1661 @@ const std = @import("std");
 const cy = @import("cycle");
 const TypeTable = @import("TypeTable.zig");
 const Object = @import("ObjectTable/Object.zig");
+const Coalescer = @import("ObjectTable/Coalescer.zig");
+const serde = @import("ObjectTable/serde.zig");
+const Store = @import("Store.zig");
+const fixtures = @import("fixtures.zig");
 
+pub const Accounting = @import("ObjectTable/Accounting.zig");
+pub const ChangeSet = Object.ChangeSet;
+pub const Column = Object.Column;
+pub const Journal = Object.Journal;
+pub const Subscriptions = @import("ObjectTable/Subscriptions.zig");
+
+// Must be thread safe, as shards are updated in parallel and the last reader of a version frees it. Counted
+// as the `names` of `accounting`.
 allocator: std.mem.Allocator,
-schemes: Schemes,
+// Counts the memory of the table by scheme and source. Shared with snapshots, like `paths`.
+accounting: *Accounting,
+shards: []Shard,
+// Shared with snapshots, so that they can be read through handles after the table is gone.
+paths: *Paths,
+// Shared with snapshots, like `paths`, as every version of a level points to the same names.
+names: *Names,
+// Every update applied to the table is recorded here when set, which must only be done after `Store.replay`.
+store: ?*Store = null,
+
+// Objects are spread over the shards by the hash of their names. Updates to different shards don't contend,
+// and each shard is a separate versioned tree, so copying a path on write never crosses shards.
+const num_shards = 64;
+
+const Shard = struct {
+    // Held for the whole of an update, so that a snapshot never sees one halfway through.
+    mutex: std.Thread.Mutex = .{},
+    current: *Schemes,
+    // Picks the pools of the sources that the shard's objects are made with.
+    index: u8,
+    accounting: *Accounting,
+    // The arena of the shard in `Names`, which holds the names of its levels.
+    names: *std.heap.ArenaAllocator,
+    // Mutations are coalesced into `coalesced` before they are applied.
+    coalescer: Coalescer,
+    coalesced: std.ArrayList(u8),
+    // Slots of the resolved handles, by the names joined as in `joinNames`.
+    slots: std.StringHashMapUnmanaged(u24) = .{},
+    // Slots of removed objects, reused before any new slot is taken.
+    free_slots: std.ArrayListUnmanaged(u24) = .{},
+
+    fn init(allocator: std.mem.Allocator, index: u8, accounting: *Accounting, names: *std.heap.ArenaAllocator) !Shard {
+        return Shard{
+            .current = try Schemes.create(allocator),
+            .index = index,
+            .accounting = accounting,
+            .names = names,
+            .coalescer = Coalescer.init(allocator),
+            .coalesced = std.ArrayList(u8).init(allocator),
+        };
+    }
+
+    fn deinit(self: *Shard, allocator: std.mem.Allocator) void {
+        self.current.release(allocator);
+        self.coalescer.deinit();
+        self.coalesced.deinit();
+        var keys = self.slots.keyIterator();
+        while (keys.next()) |key| {
+            allocator.free(key.*);
+        }
+        self.slots.deinit(allocator);
+        self.free_slots.deinit(allocator);
+        self.* = undefined;
+    }
+
+    fn ownRoot(self: *Shard, allocator: std.mem.Allocator) !void {
+        if (self.current.isShared()) {
+            const copy = try self.current.clone(allocator);
+            self.current.release(allocator);
+            self.current = copy;
+        }
+    }
+
+    /// Must be called with the shard locked. Reserves the path of the object, so that it never moves for
+    /// as long as the handle is valid. Returns the slot of the handle.
+    fn resolve(
+        self: *Shard,
+        allocator: std.mem.Allocator,
+        paths: *ShardPaths,
+        scheme_name: []const u8,
+        source_name: []const u8,
+        object_name: []const u8,
+    ) !u24 {
+        const key = try joinNames(allocator, scheme_name, source_name, object_name);
+        const slot_gop = self.slots.getOrPut(allocator, key) catch |e| {
+            allocator.free(key);
+            return e;
+        };
+        if (slot_gop.found_existing) {
+            allocator.free(key);
+            return slot_gop.value_ptr.*;
+        }
+        errdefer {
+            self.slots.removeByPtr(slot_gop.key_ptr);
+            allocator.free(key);
+        }
+
+        try self.ownRoot(allocator);
+        const names = self.names.allocator();
+        const scheme = try self.current.reserve(allocator, names, scheme_name);
+        const sources = try self.current.ownAt(allocator, scheme);
+        const source = try sources.reserve(allocator, names, source_name);
+        const objects = try sources.ownAt(allocator, source);
+        // the object itself is only created by its first update
+        const object = objects.indexOf(object_name) orelse
+            try objects.insert(allocator, names, object_name, try ObjectNode.create(allocator, allocator, null));
+
+        const path = Path{
+            .scheme = scheme,
+            .source = source,
+            .object = object,
+        };
+        const slot = if (self.free_slots.popOrNull()) |slot| blk: {
+            _ = paths.reuse(slot, path);
+            break :blk slot;
+        } else try paths.append(allocator, path);
+        slot_gop.value_ptr.* = slot;
+        return slot;
+    }
+
+    /// Must be called with the shard locked. Releases the object at `path` and frees the slot of its handle,
+    /// if one was resolved. The names stay behind without an object, so that the indices of the other objects
+    /// don't move, and are taken up again if the object is created anew. Returns false if there was no object.
+    fn removePath(self: *Shard, allocator: std.mem.Allocator, store: ?*Store, paths: *ShardPaths, path: Path) !bool {
+        const current = self.current.getAt(path.scheme).?.getAt(path.source).?.getAt(path.object).?;
+        if (current.object == null) {
+            return false;
+        }
+
+        try self.ownRoot(allocator);
+        const sources = try self.current.ownAt(allocator, path.scheme);
+        const objects = try sources.ownAt(allocator, path.source);
+        const node = try objects.slotAt(allocator, path.object);
+        const scheme_name = self.current.nameAt(path.scheme);
+        const source_name = sources.nameAt(path.source);
+        const object_name = objects.nameAt(path.object);
+
+        const key = try joinNames(allocator, scheme_name, source_name, object_name);
+        defer allocator.free(key);
+        try self.free_slots.ensureUnusedCapacity(allocator, 1);
+
+        // Snapshots keep the version they hold, the current one drops the object right away.
+        const empty = if (node.*.isShared()) try ObjectNode.create(allocator, allocator, null) else null;
+        errdefer if (empty) |e| e.release(allocator);
+
+        var applied = false;
+        const reservation = if (store) |s| try s.reserveRemove(scheme_name, source_name, object_name) else null;
+        defer if (reservation) |r| store.?.commit(r, applied);
+
+        if (empty) |e| {
+            node.*.release(allocator);
+            node.* = e;
+        } else if (node.*.object) |*object| {
+            object.deinit(node.*.object_allocator);
+            node.*.object = null;
+        }
+        if (self.slots.fetchRemove(key)) |kv| {
+            allocator.free(kv.key);
+            if (paths.free(kv.value)) {
+                self.free_slots.appendAssumeCapacity(kv.value);
+            }
+        }
+        applied = true;
+        return true;
+    }
+
+    /// Must be called with the shard locked.
+    fn update(
+        self: *Shard,
+        allocator: std.mem.Allocator,
+        store: ?*Store,
+        type_table: *const TypeTable,
+        mutation: Mutation,
+    ) !bool {
+        try self.ownRoot(allocator);
+        const names = self.names.allocator();
+        const sources = try self.current.own(allocator, names, mutation.scheme_name);
+        const objects = try sources.own(allocator, names, mutation.source_name);
+
+        const index = objects.indexOf(mutation.object_name) orelse {
+            var applied = false;
+            const reservation = if (store) |s| try s.reserve(type_table, .Create, mutation) else null;
+            defer if (reservation) |r| store.?.commit(r, applied);
+
+            const object_allocator = try self.accounting.sourceAllocator(mutation.scheme_name, mutation.source_name, self.index);
+            var object = try Object.init(object_allocator, mutation.type_id, try type_table.get(mutation.type_id), mutation.bytes);
+            object.applier = type_table.applier(mutation.type_id);
+            object.plan = type_table.plan(mutation.type_id);
+
+            const node = ObjectNode.create(allocator, object_allocator, object) catch |e| {
+                object.deinit(object_allocator);
+                return e;
+            };
+            _ = try objects.insert(allocator, names, mutation.object_name, node);
+            applied = true;
+            return true;
+        };
+
+        return self.updateNode(allocator, store, try objects.slotAt(allocator, index), type_table, mutation, null);
+    }
+
+    /// Must be called with the shard locked.
+    fn updatePath(
+        self: *Shard,
+        allocator: std.mem.Allocator,
+        store: ?*Store,
+        path: Path,
+        type_table: *const TypeTable,
+        type_id: cy.def.TypeId,
+        bytes: []const u8,
+        changes: ?*ChangeSet,
+    ) !bool {
+        try self.ownRoot(allocator);
+        const sources = try self.current.ownAt(allocator, path.scheme);
+        const objects = try sources.ownAt(allocator, path.source);
+        return self.updateNode(allocator, store, try objects.slotAt(allocator, path.object), type_table, Mutation{
+            .scheme_name = self.current.nameAt(path.scheme),
+            .source_name = sources.nameAt(path.source),
+            .object_name = objects.nameAt(path.object),
+            .type_id = type_id,
+            .bytes = bytes,
+        }, changes);
+    }
+
+    /// Must be called with the shard locked.
+    fn ownPath(self: *Shard, allocator: std.mem.Allocator, path: Path) !OwnedPath {
+        try self.ownRoot(allocator);
+        const sources = try self.current.ownAt(allocator, path.scheme);
+        const objects = try sources.ownAt(allocator, path.source);
+        return OwnedPath{
+            .node = try objects.ownAt(allocator, path.object),
+            .scheme_name = self.current.nameAt(path.scheme),
+            .source_name = sources.nameAt(path.source),
+            .object_name = objects.nameAt(path.object),
+        };
+    }
+
+    /// Must be called with the shard locked. Returns false when there is nothing to undo or redo.
+    fn stepPath(
+        self: *Shard,
+        allocator: std.mem.Allocator,
+        store: ?*Store,
+        path: Path,
+        type_table: *const TypeTable,
+        history: Object.History,
+        changes: ?*ChangeSet,
+    ) !bool {
+        const owned = try self.ownPath(allocator, path);
+        const object = if (owned.node.object) |*object| object else return false;
+        const journal = object.journal orelse return false;
+
+        self.coalesced.clearRetainingCapacity();
+        const found = switch (history) {
+            .Undo => try journal.popUndo(&self.coalesced),
+            .Redo => try journal.popRedo(&self.coalesced),
+        };
+        if (!found) {
+            return false;
+        }
+
+        // recorded as any other mutation, so that replaying the log ends up in the same state
+        var applied = false;
+        const mutation = Mutation{
+            .scheme_name = owned.scheme_name,
+            .source_name = owned.source_name,
+            .object_name = owned.object_name,
+            .type_id = object.type_id,
+            .bytes = self.coalesced.items,
+        };
+        const reservation = if (store) |s| (s.reserve(type_table, .Mutate, mutation) catch |e| {
+            // the entry is gone, and the history doesn't lead back without it
+            journal.clear();
+            return e;
+        }) else null;
+        defer if (reservation) |r| store.?.commit(r, applied);
+
+        applied = try object.applyHistory(owned.node.object_allocator, self.coalesced.items, history, changes);
+        return applied;
+    }
+
+    fn updateNode(
+        self: *Shard,
+        allocator: std.mem.Allocator,
+        store: ?*Store,
+        node: **ObjectNode,
+        type_table: *const TypeTable,
+        mutation: Mutation,
+        changes: ?*ChangeSet,
+    ) !bool {
+        var applied = false;
+        const same_type = if (node.*.object) |object| std.meta.eql(object.type_id, mutation.type_id) else false;
+        if (!same_type) {
+            const reservation = if (store) |s| try s.reserve(type_table, .Create, mutation) else null;
+            defer if (reservation) |r| store.?.commit(r, applied);
+
+            // the whole object is new
+            const mark = if (changes) |c| c.mark() else undefined;
+            errdefer if (changes) |c| c.restore(mark);
+            if (changes) |c| {
+                try c.record(.Set, null);
+            }
+
+            const object_allocator = try self.accounting.sourceAllocator(mutation.scheme_name, mutation.source_name, self.index);
+            var object = try Object.init(object_allocator, mutation.type_id, try type_table.get(mutation.type_id), mutation.bytes);
+            errdefer object.deinit(object_allocator);
+            object.applier = type_table.applier(mutation.type_id);
+            object.plan = type_table.plan(mutation.type_id);
+
+            // the history is kept, but none of it applies to the new type
+            if (node.*.object) |prev| {
+                if (prev.journal) |journal| {
+                    journal.clear();
+                    object.journal = journal.acquire();
+                }
+            }
 
-const Schemes = std.StringArrayHashMap(Sources);
-const Sources = std.StringArrayHashMap(Objects);
-const Objects = std.StringArrayHashMap(Object);
+            const new_node = try ObjectNode.create(allocator, object_allocator, object);
+            node.*.release(allocator);
+            node.* = new_node;
+            applied = true;
+            return true;
+        }
+
+        if (node.*.isShared()) {
+            const copy = try node.*.clone(allocator);
+            node.*.release(allocator);
+            node.* = copy;
+        }
+        const object = &node.*.object.?;
+        self.coalesced.clearRetainingCapacity();
+        try self.coalescer.coalesce(object.type, mutation.bytes, &self.coalesced);
+
+        // the coalesced mutation is recorded, which is often smaller
+        var coalesced = mutation;
+        coalesced.bytes = self.coalesced.items;
+        const reservation = if (store) |s| try s.reserve(type_table, .Mutate, coalesced) else null;
+        defer if (reservation) |r| store.?.commit(r, applied);
+
+        applied = try object.updateChanges(node.*.object_allocator, self.coalesced.items, changes);
+        return applied;
+    }
+};
+
+const OwnedPath = struct {
+    node: *ObjectNode,
+    scheme_name: []const u8,
+    source_name: []const u8,
+    object_name: []const u8,
+};
+
+fn shardOf(scheme_name: []const u8, source_name: []const u8, object_name: []const u8) usize {
+    var hasher = std.hash.Wyhash.init(0);
+    hasher.update(scheme_name);
+    hasher.update(&.{0});
+    hasher.update(source_name);
+    hasher.update(&.{0});
+    hasher.update(object_name);
+    return @intCast(hasher.final() % num_shards);
+}
+
+fn joinNames(allocator: std.mem.Allocator, scheme_name: []const u8, source_name: []const u8, object_name: []const u8) ![]u8 {
+    return std.mem.join(allocator, "\x00", &.{ scheme_name, source_name, object_name });
+}
+
+// Every level of the table is reference counted and shared between versions. A node held by more than one
+// version is never changed: the writer copies it first, so an update only copies the path from the root
+// down to the object it changes. Within a level that path goes down its `Vector` of children, and copying a
+// level copies neither its children nor its names, which every version of it looks up in one `NameIndex`.
+const Schemes = Level(Sources);
+const Sources = Level(Objects);
+const Objects = Level(ObjectNode);
+
+fn Level(comptime Child: type) type {
+    return struct {
+        refs: std.atomic.Value(usize),
+        index: *NameIndex,
+        children: Vector(Child) = .{},
+
+        const Node = @This();
+
+        fn create(allocator: std.mem.Allocator) !*Node {
+            const index = try NameIndex.create(allocator);
+            errdefer index.release(allocator);
+            const node = try allocator.create(Node);
+            node.* = Node{
+                .refs = std.atomic.Value(usize).init(1),
+                .index = index,
+            };
+            return node;
+        }
+
+        /// The copy shares every child and every name with the original, so it costs the same however many
+        /// children there are.
+        fn clone(node: *const Node, allocator: std.mem.Allocator) !*Node {
+            const copy = try allocator.create(Node);
+            copy.* = Node{
+                .refs = std.atomic.Value(usize).init(1),
+                .index = node.index.acquire(),
+                .children = node.children.share(),
+            };
+            return copy;
+        }
+
+        fn acquire(node: *Node) *Node {
+            _ = node.refs.fetchAdd(1, .monotonic);
+            return node;
+        }
+
+        fn release(node: *Node, allocator: std.mem.Allocator) void {
+            if (node.refs.fetchSub(1, .acq_rel) != 1) {
+                return;
+            }
+
+            node.children.release(allocator);
+            node.index.release(allocator);
+            allocator.destroy(node);
+        }
+
+        fn isShared(node: *const Node) bool {
+            return node.refs.load(.acquire) > 1;
+        }
+
+        fn count(node: *const Node) u32 {
+            return node.children.len;
+        }
+
+        fn nameAt(node: *const Node, index: u32) []const u8 {
+            std.debug.assert(index < node.children.len);
+            return node.index.nameAt(index);
+        }
+
+        /// Returns the index of the child under `name` in this version.
+        fn indexOf(node: *const Node, name: []const u8) ?u32 {
+            const index = node.index.find(name) orelse return null;
+            // added by a later version
+            return if (index < node.children.len) index else null;
+        }
+
+        fn get(node: *const Node, name: []const u8) ?*Child {
+            return node.children.get(node.indexOf(name) orelse return null);
+        }
+
+        fn getAt(node: *const Node, index: u32) ?*Child {
+            return if (index < node.children.len) node.children.get(index) else null;
+        }
+
+        /// Returns the child under `name` for the writer, creating it if it doesn't exist and copying it if
+        /// another version holds it.
+        fn own(node: *Node, allocator: std.mem.Allocator, names: std.mem.Allocator, name: []const u8) !*Child {
+            return node.ownAt(allocator, try node.reserve(allocator, names, name));
+        }
+
+        /// Returns the index of the child under `name`, creating it if it doesn't exist. Children are never
+        /// removed, so the index is the same in every later version.
+        fn reserve(node: *Node, allocator: std.mem.Allocator, names: std.mem.Allocator, name: []const u8) !u32 {
+            return node.indexOf(name) orelse node.insert(allocator, names, name, try Child.create(allocator));
+        }
+
+        /// Adds `child` under `name`, which must not be in the level yet, and returns its index. The name is
+        /// copied into `names`. `child` is released if this fails.
+        fn insert(node: *Node, allocator: std.mem.Allocator, names: std.mem.Allocator, name: []const u8, child: *Child) !u32 {
+            errdefer child.release(allocator);
+            // Only the latest version is written to, which holds every name of the index.
+            std.debug.assert(node.index.count == node.children.len);
+
+            try node.index.ensureUnusedCapacity(allocator);
+            const key = try names.dupe(u8, name);
+            errdefer names.free(key);
+            try node.children.push(allocator, child);
+            return node.index.append(key);
+        }
+
+        /// Returns the slot of the child at `index` for the writer, which may replace the child in it.
+        fn slotAt(node: *Node, allocator: std.mem.Allocator, index: u32) !**Child {
+            return node.children.ownSlot(allocator, index);
+        }
+
+        /// Returns the child at `index` for the writer, copying it if another version holds it.
+        fn ownAt(node: *Node, allocator: std.mem.Allocator, index: u32) !*Child {
+            const child = try node.slotAt(allocator, index);
+            if (child.*.isShared()) {
+                const copy = try child.*.clone(allocator);
+                child.*.release(allocator);
+                child.* = copy;
+            }
+            return child.*;
+        }
+    };
+}
+
+// The children of a level by index, in a persistent radix tree. Its nodes are reference counted and shared
+// between the versions of the level, and a leaf holds a reference to each of its children. Taking the slot
+// of a child for the writer copies the nodes down to it that another version holds, so the first write to
+// a level after a snapshot copies a few nodes of 32 slots rather than every child.
+fn Vector(comptime Child: type) type {
+    return struct {
+        root: ?*Node = null,
+        // The index bits below the slots of `root`, zero while the root is a leaf.
+        shift: u5 = 0,
+        len: u32 = 0,
+
+        const bits = 5;
+        const width = 1 << bits;
+        const mask = width - 1;
+
+        // A node may hold more children than the versions that share it, as a node is only filled in while
+        // one version holds it, so its slots are empty until filled.
+        const Node = struct {
+            refs: std.atomic.Value(usize),
+            slots: union {
+                branches: [width]?*Node,
+                leaves: [width]?*Child,
+            },
+        };
+
+        const Tree = @This();
+
+        fn share(self: Tree) Tree {
+            if (self.root) |root| {
+                _ = root.refs.fetchAdd(1, .monotonic);
+            }
+            return self;
+        }
+
+        fn release(self: *Tree, allocator: std.mem.Allocator) void {
+            if (self.root) |root| {
+                releaseNode(allocator, root, self.shift);
+            }
+            self.* = undefined;
+        }
+
+        fn get(self: Tree, index: u32) *Child {
+            std.debug.assert(index < self.len);
+            var node = self.root.?;
+            var shift = self.shift;
+            while (shift > 0) : (shift -= bits) {
+                node = node.slots.branches[(index >> shift) & mask].?;
+            }
+            return node.slots.leaves[index & mask].?;
+        }
+
+        fn push(self: *Tree, allocator: std.mem.Allocator, child: *Child) !void {
+            if (self.root) |root| {
+                if (self.len >> self.shift == width) {
+                    const grown = try createNode(allocator, self.shift + bits);
+                    grown.slots.branches[0] = root;
+                    self.root = grown;
+                    self.shift += bits;
+                }
+            }
+            const slot = try self.leafSlot(allocator, self.len);
+            slot.* = child;
+            self.len += 1;
+        }
+
+        /// Returns the slot of the child at `index` for the writer.
+        fn ownSlot(self: *Tree, allocator: std.mem.Allocator, index: u32) !**Child {
+            std.debug.assert(index < self.len);
+            const slot = try self.leafSlot(allocator, index);
+            return &slot.*.?;
+        }
+
+        fn leafSlot(self: *Tree, allocator: std.mem.Allocator, index: u32) !*?*Child {
+            var node = try ownNode(allocator, &self.root, self.shift);
+            var shift = self.shift;
+            while (shift > 0) : (shift -= bits) {
+                node = try ownNode(allocator, &node.slots.branches[(index >> shift) & mask], shift - bits);
+            }
+            return &node.slots.leaves[index & mask];
+        }
+
+        // Makes the node in `slot`, at `shift`, one that only this version holds, creating it if it's empty.
+        fn ownNode(allocator: std.mem.Allocator, slot: *?*Node, shift: u5) !*Node {
+            const node = slot.* orelse {
+                const created = try createNode(allocator, shift);
+                slot.* = created;
+                return created;
+            };
+            if (node.refs.load(.acquire) == 1) {
+                return node;
+            }
+
+            const copy = try allocator.create(Node);
+            copy.* = Node{
+                .refs = std.atomic.Value(usize).init(1),
+                .slots = node.slots,
+            };
+            if (shift == 0) {
+                for (copy.slots.leaves) |leaf| {
+                    if (leaf) |child| _ = child.acquire();
+                }
+            } else {
+                for (copy.slots.branches) |branch| {
+                    if (branch) |b| _ = b.refs.fetchAdd(1, .monotonic);
+                }
+            }
+            releaseNode(allocator, node, shift);
+            slot.* = copy;
+            return copy;
+        }
+
+        fn createNode(allocator: std.mem.Allocator, shift: u5) !*Node {
+            const node = try allocator.create(Node);
+            node.* = Node{
+                .refs = std.atomic.Value(usize).init(1),
+                .slots = if (shift == 0) .{ .leaves = .{null} ** width } else .{ .branches = .{null} ** width },
+            };
+            return node;
+        }
+
+        fn releaseNode(allocator: std.mem.Allocator, node: *Node, shift: u5) void {
+            if (node.refs.fetchSub(1, .acq_rel) != 1) {
+                return;
+            }
+
+            if (shift == 0) {
+                for (node.slots.leaves) |leaf| {
+                    if (leaf) |child| child.release(allocator);
+                }
+            } else {
+                for (node.slots.branches) |branch| {
+                    if (branch) |b| releaseNode(allocator, b, shift - bits);
+                }
+            }
+            allocator.destroy(node);
+        }
+    };
+}
+
+// The names of a level, shared by every version of it. Children are only ever appended, so a name keeps its
+// index, and a version holds the names below its number of children. Only the writer of the shard appends, with
+// the shard locked, while snapshots look names up without it: the names are kept in chunks that double in size
+// and never move, as in `ShardPaths`, and the table of their indices is replaced rather than rehashed in place
+// when it grows. The tables it replaced stay until the index is released, which at most doubles its size.
+const NameIndex = struct {
+    refs: std.atomic.Value(usize),
+    chunks: [max_chunks]?[*][]const u8 = .{null} ** max_chunks,
+    // Only read by the writer. Readers find the indices in `table`.
+    count: u32 = 0,
+    table: std.atomic.Value(*Table),
+
+    const first_chunk_bits = 4;
+    const max_chunks = @bitSizeOf(u32) - first_chunk_bits + 1;
+    const min_slots = 8;
+
+    const Table = struct {
+        // The index of a name plus one, zero for an empty slot. At most half of them are taken.
+        slots: []std.atomic.Value(u32),
+        // The table this one replaced.
+        prev: ?*Table,
+    };
+
+    fn create(allocator: std.mem.Allocator) !*NameIndex {
+        const table = try createTable(allocator, min_slots, null);
+        errdefer destroyTable(allocator, table);
+        const index = try allocator.create(NameIndex);
+        index.* = NameIndex{
+            .refs = std.atomic.Value(usize).init(1),
+            .table = std.atomic.Value(*Table).init(table),
+        };
+        return index;
+    }
+
+    fn acquire(index: *NameIndex) *NameIndex {
+        _ = index.refs.fetchAdd(1, .monotonic);
+        return index;
+    }
+
+    fn release(index: *NameIndex, allocator: std.mem.Allocator) void {
+        if (index.refs.fetchSub(1, .acq_rel) != 1) {
+            return;
+        }
+
+        for (index.chunks, 0..) |chunk, i| {
+            if (chunk) |c| {
+                allocator.free(c[0..chunkLen(i)]);
+            }
+        }
+        var table: ?*Table = index.table.raw;
+        while (table) |t| {
+            table = t.prev;
+            destroyTable(allocator, t);
+        }
+        allocator.destroy(index);
+    }
+
+    fn chunkLen(chunk: usize) usize {
+        return @as(usize, 1) << @intCast(first_chunk_bits + chunk);
+    }
+
+    fn locate(i: u32) struct { usize, usize } {
+        const n = @as(u64, i) + (1 << first_chunk_bits);
+        const chunk = std.math.log2_int(u64, n) - first_chunk_bits;
+        return .{ chunk, @intCast(n - chunkLen(chunk)) };
+    }
+
+    fn nameAt(index: *const NameIndex, i: u32) []const u8 {
+        const chunk, const offset = locate(i);
+        return index.chunks[chunk].?[offset];
+    }
+
+    fn find(index: *const NameIndex, name: []const u8) ?u32 {
+        const table = index.table.load(.acquire);
+        const mask = table.slots.len - 1;
+        var slot = @as(usize, @truncate(std.hash.Wyhash.hash(0, name))) & mask;
+        while (true) : (slot = (slot + 1) & mask) {
+            const entry = table.slots[slot].load(.acquire);
+            if (entry == 0) {
+                return null;
+            }
+            if (std.mem.eql(u8, index.nameAt(entry - 1), name)) {
+                return entry - 1;
+            }
+        }
+    }
+
+    /// Must be called with the shard locked. Makes room for one more name, so that `append` can't fail.
+    fn ensureUnusedCapacity(index: *NameIndex, allocator: std.mem.Allocator) !void {
+        if (index.count == std.math.maxInt(u32)) {
+            return error.TooManyNames;
+        }
+        const chunk, _ = locate(index.count);
+        if (index.chunks[chunk] == null) {
+            index.chunks[chunk] = (try allocator.alloc([]const u8, chunkLen(chunk))).ptr;
+        }
+
+        const table = index.table.raw;
+        if ((@as(usize, index.count) + 1) * 2 <= table.slots.len) {
+            return;
+        }
+        const grown = try createTable(allocator, table.slots.len * 2, table);
+        for (0..index.count) |i| {
+            insertSlot(grown, index.nameAt(@intCast(i)), @intCast(i));
+        }
+        index.table.store(grown, .release);
+    }
+
+    /// Must be called with the shard locked, after `ensureUnusedCapacity`. Returns the index of the name.
+    fn append(index: *NameIndex, name: []const u8) u32 {
+        const i = index.count;
+        const chunk, const offset = locate(i);
+        index.chunks[chunk].?[offset] = name;
+        insertSlot(index.table.raw, name, i);
+        index.count = i + 1;
+        return i;
+    }
+
+    // The name is published by the store to its slot.
+    fn insertSlot(table: *Table, name: []const u8, i: u32) void {
+        const mask = table.slots.len - 1;
+        var slot = @as(usize, @truncate(std.hash.Wyhash.hash(0, name))) & mask;
+        while (table.slots[slot].raw != 0) {
+            slot = (slot + 1) & mask;
+        }
+        table.slots[slot].store(i + 1, .release);
+    }
+
+    fn createTable(allocator: std.mem.Allocator, len: usize, prev: ?*Table) !*Table {
+        const slots = try allocator.alloc(std.atomic.Value(u32), len);
+        errdefer allocator.free(slots);
+        @memset(slots, std.atomic.Value(u32).init(0));
+        const table = try allocator.create(Table);
+        table.* = Table{
+            .slots = slots,
+            .prev = prev,
+        };
+        return table;
+    }
+
+    fn destroyTable(allocator: std.mem.Allocator, table: *Table) void {
+        allocator.free(table.slots);
+        allocator.destroy(table);
+    }
+};
+
+const ObjectNode = struct {
+    refs: std.atomic.Value(usize),
+    // The allocator `object` was made with, a pool of its source. Every call to the object that allocates is
+    // given this one.
+    object_allocator: std.mem.Allocator,
+    // null until the first update of an object that a handle was resolved to
+    object: ?Object,
+
+    fn create(allocator: std.mem.Allocator, object_allocator: std.mem.Allocator, object: ?Object) !*ObjectNode {
+        const node = try allocator.create(ObjectNode);
+        node.* = ObjectNode{
+            .refs = std.atomic.Value(usize).init(1),
+            .object_allocator = object_allocator,
+            .object = object,
+        };
+        return node;
+    }
+
+    /// Copies the object for the writer. Its strings are shared with the original, so an object held by a
+    /// snapshot only pays for the containers and columns of its state on its next update.
+    fn clone(node: *const ObjectNode, allocator: std.mem.Allocator) !*ObjectNode {
+        const original = if (node.object) |*object| object else return create(allocator, node.object_allocator, null);
+        var object = try original.clone(node.object_allocator);
+        errdefer object.deinit(node.object_allocator);
+        return create(allocator, node.object_allocator, object);
+    }
+
+    fn acquire(node: *ObjectNode) *ObjectNode {
+        _ = node.refs.fetchAdd(1, .monotonic);
+        return node;
+    }
+
+    fn release(node: *ObjectNode, allocator: std.mem.Allocator) void {
+        if (node.refs.fetchSub(1, .acq_rel) != 1) {
+            return;
+        }
+
+        if (node.object) |*object| {
+            object.deinit(node.object_allocator);
+        }
+        allocator.destroy(node);
+    }
+
+    fn isShared(node: *const ObjectNode) bool {
+        return node.refs.load(.acquire) > 1;
+    }
+};
+
+// The names of the levels of every shard. Children are never removed from a level, so a name is kept from its
+// first version until the table and every snapshot are gone, and freed with the arena of its shard. Each
+// arena is only allocated from by the writer of its shard, with the shard locked.
+const Names = struct {
+    refs: std.atomic.Value(usize),
+    shards: [num_shards]std.heap.ArenaAllocator,
+
+    fn create(allocator: std.mem.Allocator) !*Names {
+        const names = try allocator.create(Names);
+        names.refs = std.atomic.Value(usize).init(1);
+        for (&names.shards) |*arena| {
+            arena.* = std.heap.ArenaAllocator.init(allocator);
+        }
+        return names;
+    }
+
+    fn acquire(names: *Names) *Names {
+        _ = names.refs.fetchAdd(1, .monotonic);
+        return names;
+    }
+
+    fn release(names: *Names, allocator: std.mem.Allocator) void {
+        if (names.refs.fetchSub(1, .acq_rel) != 1) {
+            return;
+        }
+
+        for (&names.shards) |*arena| {
+            arena.deinit();
+        }
+        allocator.destroy(names);
+    }
+};
+
+/// Addresses an object without its names. Resolving the names once with `resolve` takes the string hashing
+/// off every later update and read, which only index into arrays.
+pub const ObjectHandle = packed struct(u64) {
+    slot: u24,
+    shard: u8,
+    // A handle is only valid while its generation matches the one of its slot.
+    generation: u32,
+};
+
+// Indices of an object down the levels of its shard.
+const Path = struct {
+    scheme: u32,
+    source: u32,
+    object: u32,
+    generation: u32 = 0,
+};
+
+const Paths = struct {
+    refs: std.atomic.Value(usize),
+    shards: [num_shards]ShardPaths,
+
+    fn create(allocator: std.mem.Allocator) !*Paths {
+        const paths = try allocator.create(Paths);
+        paths.* = Paths{
+            .refs = std.atomic.Value(usize).init(1),
+            .shards = [_]ShardPaths{.{}} ** num_shards,
+        };
+        return paths;
+    }
+
+    fn acquire(paths: *Paths) *Paths {
+        _ = paths.refs.fetchAdd(1, .monotonic);
+        return paths;
+    }
+
+    fn release(paths: *Paths, allocator: std.mem.Allocator) void {
+        if (paths.refs.fetchSub(1, .acq_rel) != 1) {
+            return;
+        }
+
+        for (&paths.shards) |*shard_paths| {
+            shard_paths.deinit(allocator);
+        }
+        allocator.destroy(paths);
+    }
+
+    fn get(paths: *const Paths, handle: ObjectHandle) ?Path {
+        if (handle.shard >= num_shards) {
+            return null;
+        }
+        const path = paths.shards[handle.shard].get(handle.slot) orelse return null;
+        return if (path.generation == handle.generation) path else null;
+    }
+};
+
+// Paths are written by the writer of a shard and read by snapshots without its lock. They are stored in
+// chunks that double in size and never move, so a path stays put once its slot is published in `count`.
+//
+// The slot of a removed object is reused for a later one. Its generation goes up by one when it's freed and
+// again when it's reused, so that handles, which only ever hold even generations, never match a free slot or
+// one that's being rewritten.
+const ShardPaths = struct {
+    chunks: [max_chunks]?[*]SlotPath = .{null} ** max_chunks,
+    count: std.atomic.Value(u32) = std.atomic.Value(u32).init(0),
+
+    const first_chunk_bits = 6;
+    const max_chunks = @bitSizeOf(u24) - first_chunk_bits + 1;
+
+    // A reader loads the generation before and after the indices, and only trusts them if it didn't change
+    // in between.
+    const SlotPath = struct {
+        generation: std.atomic.Value(u32),
+        scheme: std.atomic.Value(u32),
+        source: std.atomic.Value(u32),
+        object: std.atomic.Value(u32),
+    };
+
+    fn deinit(self: *ShardPaths, allocator: std.mem.Allocator) void {
+        for (self.chunks, 0..) |chunk, i| {
+            if (chunk) |c| {
+                allocator.free(c[0..chunkLen(i)]);
+            }
+        }
+        self.* = undefined;
+    }
+
+    fn chunkLen(chunk: usize) usize {
+        return @as(usize, 1) << @intCast(first_chunk_bits + chunk);
+    }
+
+    fn locate(slot: u24) struct { usize, usize } {
+        const i = @as(u32, slot) + (1 << first_chunk_bits);
+        const chunk = std.math.log2_int(u32, i) - first_chunk_bits;
+        return .{ chunk, i - chunkLen(chunk) };
+    }
+
+    fn at(self: *const ShardPaths, slot: u24) *SlotPath {
+        const chunk, const offset = locate(slot);
+        return &self.chunks[chunk].?[offset];
+    }
+
+    fn get(self: *const ShardPaths, slot: u24) ?Path {
+        if (slot >= self.count.load(.acquire)) {
+            return null;
+        }
+        const p = self.at(slot);
+        const generation = p.generation.load(.acquire);
+        const path = Path{
+            .scheme = p.scheme.load(.acquire),
+            .source = p.source.load(.acquire),
+            .object = p.object.load(.acquire),
+            .generation = generation,
+        };
+        // Rewritten while it was read, which only happens to a slot that was freed, so a handle
+        // can't have matched it anyway.
+        return if (p.generation.load(.acquire) == generation) path else null;
+    }
+
+    /// Must be called with the shard locked.
+    fn append(self: *ShardPaths, allocator: std.mem.Allocator, path: Path) !u24 {
+        const count = self.count.raw;
+        if (count > std.math.maxInt(u24)) {
+            return error.TooManyHandles;
+        }
+        const slot: u24 = @intCast(count);
+        const chunk, const offset = locate(slot);
+        if (self.chunks[chunk] == null) {
+            self.chunks[chunk] = (try allocator.alloc(SlotPath, chunkLen(chunk))).ptr;
+        }
+        self.chunks[chunk].?[offset] = SlotPath{
+            .generation = std.atomic.Value(u32).init(0),
+            .scheme = std.atomic.Value(u32).init(path.scheme),
+            .source = std.atomic.Value(u32).init(path.source),
+            .object = std.atomic.Value(u32).init(path.object),
+        };
+        self.count.store(count + 1, .release);
+        return slot;
+    }
+
+    /// Must be called with the shard locked. Invalidates every handle to the slot. Returns false if the slot
+    /// has run out of generations, in which case it must never be reused.
+    fn free(self: *ShardPaths, slot: u24) bool {
+        const p = self.at(slot);
+        const generation = p.generation.raw + 1;
+        p.generation.store(generation, .release);
+        return generation != std.math.maxInt(u32);
+    }
+
+    /// Must be called with the shard locked, on a slot given up by `free`. Returns the generation of the
+    /// handles to the new path.
+    fn reuse(self: *ShardPaths, slot: u24, path: Path) u32 {
+        const p = self.at(slot);
+        p.scheme.store(path.scheme, .release);
+        p.source.store(path.source, .release);
+        p.object.store(path.object, .release);
+        const generation = p.generation.raw + 1;
+        p.generation.store(generation, .release);
+        return generation;
+    }
+};
+
+/// An immutable version of the table, safe to read from any thread until it is deinitialized.
+pub const Snapshot = struct {
+    allocator: std.mem.Allocator,
+    roots: []*Schemes,
+    paths: *Paths,
+    names: *Names,
+    // Released last, as releasing the rest goes through its counters.
+    accounting: *Accounting,
+
+    pub fn deinit(self: *Snapshot) void {
+        for (self.roots) |root| {
+            root.release(self.allocator);
+        }
+        self.allocator.free(self.roots);
+        self.paths.release(self.allocator);
+        self.names.release(self.allocator);
+        self.accounting.release();
+        self.* = undefined;
+    }
+
+    pub fn get(self: Snapshot, scheme_name: []const u8, source_name: []const u8, object_name: []const u8) ?*const Object {
+        const schemes = self.roots[shardOf(scheme_name, source_name, object_name)];
+        const sources = schemes.get(scheme_name) orelse return null;
+        const objects = sources.get(source_name) orelse return null;
+        const node = objects.get(object_name) orelse return null;
+        return if (node.object) |*object| object else null;
+    }
+
+    /// Returns null for handles that are no longer valid and for objects without their first update yet,
+    /// including those updated after the snapshot was taken.
+    pub fn getHandle(self: Snapshot, handle: ObjectHandle) ?*const Object {
+        const path = self.paths.get(handle) orelse return null;
+        const sources = self.roots[handle.shard].getAt(path.scheme) orelse return null;
+        const objects = sources.getAt(path.source) orelse return null;
+        const node = objects.getAt(path.object) orelse return null;
+        return if (node.object) |*object| object else null;
+    }
+
+    /// Aggregates the values of the column at `path` in every object of the scheme that has one there,
+    /// counting only those that match `filter` if set.
+    pub fn aggregate(self: Snapshot, scheme_name: []const u8, path: []const ChangeSet.Step, filter: ?Column.Filter) Column.Aggregate {
+        var result = Column.Aggregate{};
+        for (self.roots) |root| {
+            const sources = root.get(scheme_name) orelse continue;
+            for (0..sources.count()) |source| {
+                const objects = sources.getAt(@intCast(source)).?;
+                for (0..objects.count()) |index| {
+                    const node = objects.getAt(@intCast(index)).?;
+                    const object = if (node.object) |*object| object else continue;
+                    const column = object.column(path) orelse continue;
+                    result.merge(column.aggregate(filter));
+                }
+            }
+        }
+        return result;
+    }
+};
+
+/// One update of a batch, with the same arguments as `update`.
+pub const Mutation = struct {
+    scheme_name: []const u8,
+    source_name: []const u8,
+    object_name: []const u8,
+    type_id: cy.def.TypeId,
+    bytes: []const u8,
+};
 
 const Self = @This();
 
-pub fn init(allocator: std.mem.Allocator) Self {
+pub fn init(parent_allocator: std.mem.Allocator) !Self {
+    const accounting = try Accounting.create(parent_allocator);
+    errdefer accounting.release();
+    const allocator = accounting.names.allocator();
+
+    const paths = try Paths.create(allocator);
+    errdefer paths.release(allocator);
+    const names = try Names.create(allocator);
+    errdefer names.release(allocator);
+
+    const shards = try allocator.alloc(Shard, num_shards);
+    var initialized: usize = 0;
+    errdefer {
+        for (shards[0..initialized]) |*shard| {
+            shard.deinit(allocator);
+        }
+        allocator.free(shards);
+    }
+
+    while (initialized < shards.len) : (initialized += 1) {
+        shards[initialized] = try Shard.init(allocator, @intCast(initialized), accounting, &names.shards[initialized]);
+    }
+
     return Self{
         .allocator = allocator,
-        .schemes = Schemes.init(allocator),
+        .accounting = accounting,
+        .shards = shards,
+        .paths = paths,
+        .names = names,
     };
 }
 
+/// Objects still held by snapshots are freed once those are deinitialized.
 pub fn deinit(self: *Self) void {
-    var scheme_iter = self.schemes.iterator();
-    while (scheme_iter.next()) |scheme| {
-        var source_iter = scheme.value_ptr.iterator();
-        while (source_iter.next()) |source| {
-            var object_iter = source.value_ptr.iterator();
-            while (object_iter.next()) |object| {
-                self.allocator.free(object.key_ptr.*);
-            }
-            source.deinit();
-            self.allocator.free(source.key_ptr.*);
-        }
-        scheme.deinit();
-        self.allocator.free(scheme.key_ptr.*);
+    for (self.shards) |*shard| {
+        shard.deinit(self.allocator);
     }
-    self.schemes.deinit();
+    self.allocator.free(self.shards);
+    self.paths.release(self.allocator);
+    self.names.release(self.allocator);
+    self.accounting.release();
     self.* = undefined;
 }
 
+/// Returns the current version of the table. Every shard is locked while it's taken, and `updateBatch` holds
+/// the lock of every shard it touches until the whole batch is applied, so the snapshot never sees only part
+/// of a batch. Later updates leave it unchanged.
+pub fn snapshot(self: *Self) !Snapshot {
+    const roots = try self.allocator.alloc(*Schemes, self.shards.len);
+
+    for (self.shards) |*shard| {
+        shard.mutex.lock();
+    }
+    defer for (self.shards) |*shard| {
+        shard.mutex.unlock();
+    };
+
+    for (self.shards, roots) |*shard, *root| {
+        root.* = shard.current.acquire();
+    }
+    return Snapshot{
+        .allocator = self.allocator,
+        .roots = roots,
+        .paths = self.paths.acquire(),
+        .names = self.names.acquire(),
+        .accounting = self.accounting.acquire(),
+    };
+}
+
+pub fn coalesceStats(self: *Self) Coalescer.Stats {
+    var stats = Coalescer.Stats{};
+    for (self.shards) |*shard| {
+        shard.mutex.lock();
+        defer shard.mutex.unlock();
+
+        inline for (std.meta.fields(Coalescer.Stats)) |f| {
+            @field(stats, f.name) += @field(shard.coalescer.stats, f.name);
+        }
+    }
+    return stats;
+}
+
+/// Creates the object from `bytes` when it doesn't exist yet or its type changed, otherwise coalesces
+/// `bytes` and applies it to the object as a mutation.
 pub fn update(
     self: *Self,
     scheme_name: []const u8,
     source_name: []const u8,
     object_name: []const u8,
     type_table: *const TypeTable,
+    type_id: cy.def.TypeId,
+    bytes: []const u8,
+) !bool {
+    const shard = &self.shards[shardOf(scheme_name, source_name, object_name)];
+    shard.mutex.lock();
+    defer shard.mutex.unlock();
+
+    return shard.update(self.allocator, self.store, type_table, Mutation{
+        .scheme_name = scheme_name,
+        .source_name = source_name,
+        .object_name = object_name,
+        .type_id = type_id,
+        .bytes = bytes,
+    });
+}
+
+/// Returns the handle of the object, which doesn't have to exist yet. Resolving the same names again returns
+/// the same handle.
+pub fn resolve(self: *Self, scheme_name: []const u8, source_name: []const u8, object_name: []const u8) !ObjectHandle {
+    const shard_index = shardOf(scheme_name, source_name, object_name);
+    const shard = &self.shards[shard_index];
+    shard.mutex.lock();
+    defer shard.mutex.unlock();
+
+    const paths = &self.paths.shards[shard_index];
+    const slot = try shard.resolve(self.allocator, paths, scheme_name, source_name, object_name);
+    return ObjectHandle{
+        .slot = slot,
+        .shard = @intCast(shard_index),
+        .generation = paths.get(slot).?.generation,
+    };
+}
+
+// Locks the shard of the handle and returns it with the path of the object. The path is only looked up once
+// the shard is locked, as its slot is reused for another object if this one is removed.
+fn lockHandle(self: *Self, handle: ObjectHandle) !struct { *Shard, Path } {
+    if (handle.shard >= num_shards) {
+        return error.InvalidHandle;
+    }
+    const shard = &self.shards[handle.shard];
+    shard.mutex.lock();
+    const path = self.paths.get(handle) orelse {
+        shard.mutex.unlock();
+        return error.InvalidHandle;
+    };
+    return .{ shard, path };
+}
+
+/// Same as `update`, addressing the object by a handle from `resolve`.
+pub fn updateHandle(
+    self: *Self,
+    handle: ObjectHandle,
+    type_table: *const TypeTable,
+    type_id: cy.def.TypeId,
     bytes: []const u8,
 ) !bool {
-    const scheme_gop = try self.schemes.getOrPut(scheme_name);
-    if (!scheme_gop.found_existing) {
-        scheme_gop.key_ptr.* = try self.allocator.dupe(u8, scheme_name);
-        scheme_gop.value_ptr.* = Sources.init(self.allocator);
+    const shard, const path = try self.lockHandle(handle);
+    defer shard.mutex.unlock();
+
+    return shard.updatePath(self.allocator, self.store, path, type_table, type_id, bytes, null);
+}
+
+/// Same as `updateHandle`, also adding the parts of the object that were changed to `changes`, which a
+/// failed or invalid update leaves as it was. Creating the object or changing its type changes all of it.
+pub fn updateHandleChanges(
+    self: *Self,
+    handle: ObjectHandle,
+    type_table: *const TypeTable,
+    type_id: cy.def.TypeId,
+    bytes: []const u8,
+    changes: *ChangeSet,
+) !bool {
+    const shard, const path = try self.lockHandle(handle);
+    defer shard.mutex.unlock();
+
+    return shard.updatePath(self.allocator, self.store, path, type_table, type_id, bytes, changes);
+}
+
+/// Starts keeping the undo history of the object, in at most `budget` bytes. Updates to the object are recorded
+/// in it from then on, however the object is addressed.
+pub fn keepJournal(self: *Self, handle: ObjectHandle, budget: usize) !void {
+    const shard, const path = try self.lockHandle(handle);
+    defer shard.mutex.unlock();
+
+    const owned = try shard.ownPath(self.allocator, path);
+    const object = if (owned.node.object) |*object| object else return error.ObjectNotFound;
+    try object.keepJournal(owned.node.object_allocator, budget);
+}
+
+/// Undoes the latest update to the object that hasn't been undone yet, adding the parts it changed to
+/// `changes` if given. Returns false when there is nothing to undo.
+pub fn undo(self: *Self, handle: ObjectHandle, type_table: *const TypeTable, changes: ?*ChangeSet) !bool {
+    return self.step(handle, type_table, .Undo, changes);
+}
+
+/// Redoes the latest update to the object that was undone. Returns false when there is nothing to redo.
+pub fn redo(self: *Self, handle: ObjectHandle, type_table: *const TypeTable, changes: ?*ChangeSet) !bool {
+    return self.step(handle, type_table, .Redo, changes);
+}
+
+fn step(self: *Self, handle: ObjectHandle, type_table: *const TypeTable, history: Object.History, changes: ?*ChangeSet) !bool {
+    const shard, const path = try self.lockHandle(handle);
+    defer shard.mutex.unlock();
+
+    return shard.stepPath(self.allocator, self.store, path, type_table, history, changes);
+}
+
+/// The memory taken up by the undo history of the object, null if it isn't kept.
+pub fn journalUsage(self: *Self, handle: ObjectHandle) !?Journal.Usage {
+    const shard, const path = try self.lockHandle(handle);
+    defer shard.mutex.unlock();
+
+    const sources = shard.current.getAt(path.scheme) orelse return null;
+    const objects = sources.getAt(path.source) orelse return null;
+    const node = objects.getAt(path.object) orelse return null;
+    const object = if (node.object) |*object| object else return null;
+    return object.journalUsage();
+}
+
+/// Applies `mutations` on `pool`, one task per shard. Mutations to the same shard, and so to the same object,
+/// are applied in the order they're given. `results` receives the result of each mutation. If any mutation
+/// fails with an error, the error of the first such shard is returned once every shard is done.
+///
+/// Every shard the batch touches is locked before any of it is applied and unlocked once all of it is, so a
+/// snapshot taken meanwhile sees either none of the batch or all of it. The shards are locked in order, as
+/// `snapshot` does.
+pub fn updateBatch(
+    self: *Self,
+    pool: *std.Thread.Pool,
+    type_table: *const TypeTable,
+    mutations: []const Mutation,
+    results: []bool,
+) !void {
+    std.debug.assert(results.len == mutations.len);
+
+    // Sorts the mutations by shard with a counting sort, which keeps their order within each shard.
+    var starts = [_]usize{0} ** (num_shards + 1);
+    const shard_indices = try self.allocator.alloc(u8, mutations.len);
+    defer self.allocator.free(shard_indices);
+    for (mutations, shard_indices) |mutation, *shard_index| {
+        shard_index.* = @intCast(shardOf(mutation.scheme_name, mutation.source_name, mutation.object_name));
+        starts[shard_index.* + 1] += 1;
+    }
+    for (1..starts.len) |i| {
+        starts[i] += starts[i - 1];
     }
-    const sources: *Sources = scheme_gop.value_ptr;
 
-    const source_gop = try sources.getOrPut(source_name);
-    if (!source_gop.found_existing) {
-        source_gop.key_ptr.* = try self.allocator.dupe(u8, source_name);
-        source_gop.value_ptr.* = Objects.init(self.allocator);
+    const order = try self.allocator.alloc(usize, mutations.len);
+    defer self.allocator.free(order);
+    var next = starts;
+    for (shard_indices, 0..) |shard_index, i| {
+        order[next[shard_index]] = i;
+        next[shard_index] += 1;
     }
-    const objects: *Objects = source_gop.value_ptr;
 
-    const object_gop = try objects.getOrPut(object_name);
-    if (!object_gop.found_existing) {
-        object_gop.key_ptr.* = try self.allocator.dupe(u8, object_name);
-        object_gop.value_ptr.* = try Object.init(self.allocator);
+    // the tasks apply their mutations under these locks, held by this thread on their behalf
+    for (0..num_shards) |shard_index| {
+        if (starts[shard_index + 1] > starts[shard_index]) {
+            self.shards[shard_index].mutex.lock();
+        }
+    }
+    defer for (0..num_shards) |shard_index| {
+        if (starts[shard_index + 1] > starts[shard_index]) {
+            self.shards[shard_index].mutex.unlock();
+        }
+    };
+
+    var errors = [_]?anyerror{null} ** num_shards;
+    var wait_group = std.Thread.WaitGroup{};
+    for (0..num_shards) |shard_index| {
+        const batch = order[starts[shard_index]..starts[shard_index + 1]];
+        if (batch.len == 0) {
+            continue;
+        }
+
+        const task = BatchTask{
+            .allocator = self.allocator,
+            .store = self.store,
+            .shard = &self.shards[shard_index],
+            .type_table = type_table,
+            .mutations = mutations,
+            .order = batch,
+            .results = results,
+            .err = &errors[shard_index],
+        };
+        wait_group.start();
+        pool.spawn(BatchTask.run, .{ task, &wait_group }) catch {
+            // applied right here instead when the task can't be queued
+            task.run(&wait_group);
+        };
+    }
+    wait_group.wait();
+
+    for (errors) |err| {
+        if (err) |e| {
+            return e;
+        }
     }
+}
+
+const BatchTask = struct {
+    allocator: std.mem.Allocator,
+    store: ?*Store,
+    shard: *Shard,
+    type_table: *const TypeTable,
+    mutations: []const Mutation,
+    order: []const usize,
+    results: []bool,
+    err: *?anyerror,
+
+    // The shard is already locked by `updateBatch`.
+    fn run(task: BatchTask, wait_group: *std.Thread.WaitGroup) void {
+        defer wait_group.finish();
+
+        for (task.order) |i| {
+            task.results[i] = task.shard.update(task.allocator, task.store, task.type_table, task.mutations[i]) catch |e| blk: {
+                if (task.err.* == null) {
+                    task.err.* = e;
+                }
+                break :blk false;
+            };
+        }
+    }
+};
+
+/// Removes the object, releasing its state unless a snapshot still holds it. Handles to it become invalid, and
+/// resolving the names again returns a new handle. Returns false if the object didn't exist.
+pub fn remove(self: *Self, scheme_name: []const u8, source_name: []const u8, object_name: []const u8) !bool {
+    const shard_index = shardOf(scheme_name, source_name, object_name);
+    const shard = &self.shards[shard_index];
+    shard.mutex.lock();
+    defer shard.mutex.unlock();
+
+    // Names are only ever added with a resolve or an update, neither of which happened if one is missing.
+    const scheme = shard.current.indexOf(scheme_name) orelse return false;
+    const sources = shard.current.getAt(scheme).?;
+    const source = sources.indexOf(source_name) orelse return false;
+    const objects = sources.getAt(source).?;
+    const object = objects.indexOf(object_name) orelse return false;
+
+    return shard.removePath(self.allocator, self.store, &self.paths.shards[shard_index], Path{
+        .scheme = scheme,
+        .source = source,
+        .object = object,
+    });
+}
+
+/// Same as `remove`, addressing the object by a handle from `resolve`.
+pub fn removeHandle(self: *Self, handle: ObjectHandle) !bool {
+    const shard, const path = try self.lockHandle(handle);
+    defer shard.mutex.unlock();
 
-    try Object.update(object_gop.value_ptr, self.allocator, bytes);
+    return shard.removePath(self.allocator, self.store, &self.paths.shards[handle.shard], path);
 }
 
-pub fn remove(self: *Self) !void {
-    _ = self;
+test "handles" {
+    const allocator = std.testing.allocator;
+
+    var type_table = TypeTable.init(allocator);
+    defer type_table.deinit();
+
+    const type_id = try fixtures.registerObject(&type_table);
+
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    try cy.chan.write(@as([]const u8, "text"), &value);
+
+    var table = try Self.init(allocator);
+    defer table.deinit();
+
+    const handle = try table.resolve("scheme", "source", "obj");
+    try std.testing.expectEqual(handle, try table.resolve("scheme", "source", "obj"));
+
+    var before = try table.snapshot();
+    defer before.deinit();
+    try std.testing.expect(before.getHandle(handle) == null);
+    try std.testing.expect(before.get("scheme", "source", "obj") == null);
+
+    try std.testing.expect(try table.updateHandle(handle, &type_table, type_id, value.items));
+
+    var after = try table.snapshot();
+    defer after.deinit();
+    try std.testing.expect(after.getHandle(handle) != null);
+    try std.testing.expect(after.getHandle(handle) == after.get("scheme", "source", "obj"));
+    try std.testing.expect(before.getHandle(handle) == null);
+
+    var stale = handle;
+    stale.generation += 1;
+    try std.testing.expect(after.getHandle(stale) == null);
+    try std.testing.expectError(error.InvalidHandle, table.updateHandle(stale, &type_table, type_id, value.items));
+
+    // the slot is reused for the next handle, under a new generation
+    try std.testing.expect(try table.removeHandle(handle));
+    try std.testing.expect(!try table.remove("scheme", "source", "obj"));
+    try std.testing.expectError(error.InvalidHandle, table.updateHandle(handle, &type_table, type_id, value.items));
+    try std.testing.expect(after.get("scheme", "source", "obj") != null);
+
+    const again = try table.resolve("scheme", "source", "obj");
+    try std.testing.expectEqual(handle.slot, again.slot);
+    try std.testing.expect(again.generation != handle.generation);
+    try std.testing.expect(try table.updateHandle(again, &type_table, type_id, value.items));
+
+    var recreated = try table.snapshot();
+    defer recreated.deinit();
+    try std.testing.expect(recreated.getHandle(again) != null);
+    try std.testing.expect(recreated.getHandle(again) != after.get("scheme", "source", "obj"));
+}
+
+test "batch" {
+    const allocator = std.testing.allocator;
+    const objects = 32;
+
+    var type_table = TypeTable.init(allocator);
+    defer type_table.deinit();
+
+    const type_id = try fixtures.registerObject(&type_table);
+
+    // the value, two appends and a deletion past the end, which is rejected
+    var bytes: [4]std.ArrayList(u8) = undefined;
+    for (&bytes) |*b| {
+        b.* = std.ArrayList(u8).init(allocator);
+    }
+    defer for (&bytes) |*b| {
+        b.deinit();
+    };
+    try cy.chan.write(@as([]const u8, "text"), &bytes[0]);
+    for (bytes[1..3], [_][]const u8{ "a", "b" }) |*b, text| {
+        try b.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+        try serde.writeStringOp(b, .Append, 0, text);
+    }
+    try bytes[3].appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    try serde.writeStringOp(&bytes[3], .Delete, 1000, "x");
+
+    var name_bufs: [objects][16]u8 = undefined;
+    var names: [objects][]const u8 = undefined;
+    for (&name_bufs, &names, 0..) |*buf, *name, i| {
+        name.* = try std.fmt.bufPrint(buf, "obj-{d}", .{i});
+    }
+
+    // interleaved across the objects, so that every shard gets its mutations out of a shared order
+    var mutations = std.ArrayList(Mutation).init(allocator);
+    defer mutations.deinit();
+    for (bytes) |b| {
+        for (names) |name| {
+            try mutations.append(Mutation{
+                .scheme_name = "scheme",
+                .source_name = "source",
+                .object_name = name,
+                .type_id = type_id,
+                .bytes = b.items,
+            });
+        }
+    }
+    const results = try allocator.alloc(bool, mutations.items.len);
+    defer allocator.free(results);
+
+    var pool: std.Thread.Pool = undefined;
+    try pool.init(.{ .allocator = allocator, .n_jobs = 4 });
+    defer pool.deinit();
+
+    var table = try Self.init(allocator);
+    defer table.deinit();
+    try table.updateBatch(&pool, &type_table, mutations.items, results);
+
+    for (results, 0..) |result, i| {
+        try std.testing.expectEqual(i / objects != 3, result);
+    }
+    var snapshot = try table.snapshot();
+    defer snapshot.deinit();
+    for (names) |name| {
+        const rope = snapshot.get("scheme", "source", name).?.text().?;
+        var buf: [6]u8 = undefined;
+        try std.testing.expectEqual(buf.len, rope.len());
+        rope.read(0, &buf);
+        try std.testing.expectEqualStrings("textab", &buf);
+    }
+
+    // an object of an unknown type fails the batch, which still applies the rest of it
+    const failing = [_]Mutation{
+        mutations.items[objects],
+        Mutation{
+            .scheme_name = "scheme",
+            .source_name = "source",
+            .object_name = "unknown",
+            .type_id = .{ .scheme = 7, .name = 0, .version = 0 },
+            .bytes = bytes[0].items,
+        },
+    };
+    try std.testing.expectError(error.SchemeNotDefined, table.updateBatch(&pool, &type_table, &failing, results[0..2]));
+    try std.testing.expect(results[0]);
+    try std.testing.expect(!results[1]);
+
+    var after = try table.snapshot();
+    defer after.deinit();
+    try std.testing.expectEqual(@as(usize, 7), after.get("scheme", "source", names[0]).?.text().?.len());
+    try std.testing.expect(after.get("scheme", "source", "unknown") == null);
+    try std.testing.expectEqual(@as(usize, 6), snapshot.get("scheme", "source", names[0]).?.text().?.len());
+}
+
+test "snapshots" {
+    const allocator = std.testing.allocator;
+
+    var type_table = TypeTable.init(allocator);
+    defer type_table.deinit();
+
+    const type_id = try fixtures.registerObject(&type_table);
+
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    try cy.chan.write(@as([]const u8, "text"), &value);
+
+    var append = std.ArrayList(u8).init(allocator);
+    defer append.deinit();
+    try append.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    try serde.writeStringOp(&append, .Append, 0, "x");
+
+    var table = try Self.init(allocator);
+    defer table.deinit();
+    try std.testing.expect(try table.update("scheme", "source", "a", &type_table, type_id, value.items));
+
+    var before = try table.snapshot();
+    const held = table.accounting.sourceStateBytes("scheme", "source").?;
+
+    try std.testing.expect(try table.update("scheme", "source", "a", &type_table, type_id, append.items));
+    try std.testing.expect(try table.update("scheme", "source", "b", &type_table, type_id, value.items));
+
+    // the path to the object was copied, the names along it were not
+    const shard = shardOf("scheme", "source", "a");
+    const current = table.shards[shard].current;
+    try std.testing.expect(current != before.roots[shard]);
+    try std.testing.expectEqual(before.roots[shard].nameAt(0).ptr, current.nameAt(0).ptr);
+    const objects = current.get("scheme").?.get("source").?;
+    const held_objects = before.roots[shard].get("scheme").?.get("source").?;
+    try std.testing.expect(objects != held_objects);
+    try std.testing.expectEqual(held_objects.nameAt(0).ptr, objects.nameAt(0).ptr);
+    try std.testing.expectEqual(held_objects.index, objects.index);
+
+    try std.testing.expectEqual(@as(usize, 4), before.get("scheme", "source", "a").?.text().?.len());
+    try std.testing.expect(before.get("scheme", "source", "b") == null);
+
+    var after = try table.snapshot();
+    defer after.deinit();
+    try std.testing.expectEqual(@as(usize, 5), after.get("scheme", "source", "a").?.text().?.len());
+    try std.testing.expect(after.get("scheme", "source", "b") != null);
+
+    // the version of the object only the released snapshot held is freed with it
+    const live = table.accounting.sourceStateBytes("scheme", "source").?;
+    try std.testing.expect(live > held);
+    const levels = table.accounting.names.stats().live_allocations;
+    before.deinit();
+    try std.testing.expect(table.accounting.sourceStateBytes("scheme", "source").? < live);
+    try std.testing.expect(table.accounting.names.stats().live_allocations < levels);
+    try std.testing.expectEqual(@as(usize, 5), after.get("scheme", "source", "a").?.text().?.len());
+
+    // The first write after a snapshot copies the nodes down to the object, however many objects the source
+    // has, and shares the rope of the string rather than copying it.
+    var name_buf: [16]u8 = undefined;
+    for (0..20_000) |i| {
+        const name = try std.fmt.bufPrint(&name_buf, "many{d}", .{i});
+        try std.testing.expect(try table.update("scheme", "many", name, &type_table, type_id, value.items));
+    }
+    const text = try allocator.alloc(u8, 64 * 1024);
+    defer allocator.free(text);
+    @memset(text, 'x');
+    var large = std.ArrayList(u8).init(allocator);
+    defer large.deinit();
+    try cy.chan.write(@as([]const u8, text), &large);
+    try std.testing.expect(try table.update("scheme", "many", "large", &type_table, type_id, large.items));
+
+    var held_many = try table.snapshot();
+    defer held_many.deinit();
+    const levels_before = table.accounting.names.stats().live_bytes;
+    const state_before = table.accounting.sourceStateBytes("scheme", "many").?;
+    try std.testing.expect(try table.update("scheme", "many", "large", &type_table, type_id, append.items));
+    try std.testing.expect(table.accounting.names.stats().live_bytes - levels_before < 4 * 1024);
+    try std.testing.expect(table.accounting.sourceStateBytes("scheme", "many").? - state_before < 16 * 1024);
+    try std.testing.expectEqual(@as(usize, 64 * 1024), held_many.get("scheme", "many", "large").?.text().?.len());
 }
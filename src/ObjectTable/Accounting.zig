@@ -0,0 +1,227 @@
+//! Counts the memory held by an `ObjectTable`, to tell which schemes and sources it goes to. The state of each
+//! object is allocated from the pools of its source, which hold their slabs through the counter of the
+//! source. That is chained to the counter of its scheme and that to `state`. Everything else the table
+//! allocates, such as the levels leading to the objects, the names in them and the paths of handles, goes
+//! through `names`.
+//!
+//! The counters see the slabs that the pools hold, which is the memory a source keeps resident. The bytes of
+//! state in them are given by `sourceStateBytes`.
+//!
+//! Shared with snapshots, since the last version holding an object may only be released after the table is
+//! gone, and still has to go through the pool it was allocated from.
+const std = @import("std");
+const CountingAllocator = @import("../CountingAllocator.zig");
+const Object = @import("Object.zig");
+
+allocator: std.mem.Allocator,
+refs: std.atomic.Value(usize),
+names: CountingAllocator,
+state: CountingAllocator,
+// Guards the schemes and sources, which are added by updates to any shard.
+mutex: std.Thread.Mutex = .{},
+// Counters are boxed so that the allocators pointing to them stay valid as the maps grow. They are kept until
+// the accounting is released, even once nothing is left in them.
+schemes: std.StringArrayHashMapUnmanaged(*Scheme) = .{},
+
+const Scheme = struct {
+    counter: CountingAllocator,
+    sources: std.StringArrayHashMapUnmanaged(*Source) = .{},
+};
+
+// The objects of a source share its pools, each used by the shards with the same index modulo the number of
+// pools, so that the writers of a parallel batch rarely meet on the same one. Releasing the source releases
+// the slabs of its pools in bulk.
+const Source = struct {
+    counter: CountingAllocator,
+    pools: [pools_per_source]Object.StatePool,
+};
+
+const pools_per_source = 8;
+
+const Self = @This();
+
+pub fn create(allocator: std.mem.Allocator) !*Self {
+    const self = try allocator.create(Self);
+    self.* = Self{
+        .allocator = allocator,
+        .refs = std.atomic.Value(usize).init(1),
+        .names = CountingAllocator.init(allocator),
+        .state = CountingAllocator.init(allocator),
+    };
+    return self;
+}
+
+pub fn acquire(self: *Self) *Self {
+    _ = self.refs.fetchAdd(1, .monotonic);
+    return self;
+}
+
+pub fn release(self: *Self) void {
+    if (self.refs.fetchSub(1, .acq_rel) != 1) {
+        return;
+    }
+
+    for (self.schemes.keys(), self.schemes.values()) |scheme_name, scheme| {
+        for (scheme.sources.keys(), scheme.sources.values()) |source_name, source| {
+            for (&source.pools) |*pool| {
+                pool.deinit();
+            }
+            self.allocator.free(source_name);
+            self.allocator.destroy(source);
+        }
+        scheme.sources.deinit(self.allocator);
+        self.allocator.free(scheme_name);
+        self.allocator.destroy(scheme);
+    }
+    self.schemes.deinit(self.allocator);
+    self.allocator.destroy(self);
+}
+
+/// Returns the allocator to make the state of an object in the source with, from the pool of the table's
+/// shard `shard`. Every version of the object has to be made with the same one.
+pub fn sourceAllocator(self: *Self, scheme_name: []const u8, source_name: []const u8, shard: usize) !std.mem.Allocator {
+    self.mutex.lock();
+    defer self.mutex.unlock();
+
+    const scheme_gop = try self.schemes.getOrPut(self.allocator, scheme_name);
+    if (!scheme_gop.found_existing) {
+        errdefer self.schemes.swapRemoveAt(scheme_gop.index);
+        const key = try self.allocator.dupe(u8, scheme_name);
+        errdefer self.allocator.free(key);
+
+        const scheme = try self.allocator.create(Scheme);
+        scheme.* = Scheme{ .counter = CountingAllocator.init(self.state.allocator()) };
+        scheme_gop.key_ptr.* = key;
+        scheme_gop.value_ptr.* = scheme;
+    }
+    const scheme = scheme_gop.value_ptr.*;
+
+    const source_gop = try scheme.sources.getOrPut(self.allocator, source_name);
+    if (!source_gop.found_existing) {
+        errdefer scheme.sources.swapRemoveAt(source_gop.index);
+        const key = try self.allocator.dupe(u8, source_name);
+        errdefer self.allocator.free(key);
+
+        const source = try self.allocator.create(Source);
+        source.* = Source{
+            .counter = CountingAllocator.init(scheme.counter.allocator()),
+            .pools = undefined,
+        };
+        for (&source.pools) |*pool| {
+            pool.* = Object.StatePool.init(source.counter.allocator());
+        }
+        source_gop.key_ptr.* = key;
+        source_gop.value_ptr.* = source;
+    }
+    return source_gop.value_ptr.*.pools[shard % pools_per_source].allocator();
+}
+
+/// The memory of every object in the scheme, null if none was ever created.
+pub fn schemeUsage(self: *Self, scheme_name: []const u8) ?CountingAllocator.Stats {
+    self.mutex.lock();
+    defer self.mutex.unlock();
+
+    const scheme = self.schemes.get(scheme_name) orelse return null;
+    return scheme.counter.stats();
+}
+
+/// The memory of every object in the source, null if none was ever created.
+pub fn sourceUsage(self: *Self, scheme_name: []const u8, source_name: []const u8) ?CountingAllocator.Stats {
+    self.mutex.lock();
+    defer self.mutex.unlock();
+
+    const scheme = self.schemes.get(scheme_name) orelse return null;
+    const source = scheme.sources.get(source_name) orelse return null;
+    return source.counter.stats();
+}
+
+/// The bytes of state the objects of the source hold in its pools, out of those in `sourceUsage`. Null if
+/// no object of the source was ever created.
+pub fn sourceStateBytes(self: *Self, scheme_name: []const u8, source_name: []const u8) ?usize {
+    self.mutex.lock();
+    defer self.mutex.unlock();
+
+    const scheme = self.schemes.get(scheme_name) orelse return null;
+    const source = scheme.sources.get(source_name) orelse return null;
+    return stateBytes(source);
+}
+
+fn stateBytes(source: *Source) usize {
+    var bytes: usize = 0;
+    for (&source.pools) |*pool| {
+        bytes += pool.usage().live_bytes;
+    }
+    return bytes;
+}
+
+/// Writes every counter as a JSON object, with the schemes and their sources nested by name.
+pub fn writeJson(self: *Self, writer: anytype) !void {
+    self.mutex.lock();
+    defer self.mutex.unlock();
+
+    var json = std.json.writeStream(writer, .{ .whitespace = .indent_2 });
+    defer json.deinit();
+
+    try json.beginObject();
+    try json.objectField("names");
+    try json.write(self.names.stats());
+    try json.objectField("state");
+    try json.write(self.state.stats());
+    try json.objectField("schemes");
+    try json.beginObject();
+    for (self.schemes.keys(), self.schemes.values()) |scheme_name, scheme| {
+        try json.objectField(scheme_name);
+        try json.beginObject();
+        try json.objectField("total");
+        try json.write(scheme.counter.stats());
+        try json.objectField("sources");
+        try json.beginObject();
+        for (scheme.sources.keys(), scheme.sources.values()) |source_name, source| {
+            try json.objectField(source_name);
+            try json.beginObject();
+            try json.objectField("held");
+            try json.write(source.counter.stats());
+            try json.objectField("state_bytes");
+            try json.write(stateBytes(source));
+            try json.endObject();
+        }
+        try json.endObject();
+        try json.endObject();
+    }
+    try json.endObject();
+    try json.endObject();
+}
+
+test {
+    const allocator = std.testing.allocator;
+
+    const accounting = try Self.create(allocator);
+    defer accounting.release();
+
+    const slab_size = Object.StatePool.slab_size;
+
+    // shards a pool apart share it
+    const a = try accounting.sourceAllocator("scheme", "a", 0);
+    try std.testing.expect(a.ptr == (try accounting.sourceAllocator("scheme", "a", pools_per_source)).ptr);
+    try std.testing.expect(a.ptr != (try accounting.sourceAllocator("scheme", "a", 1)).ptr);
+    const b = try accounting.sourceAllocator("scheme", "b", 0);
+    const bytes = try a.alloc(u8, 100);
+    defer a.free(bytes);
+    // the emptied slab is kept as a spare
+    b.free(try b.alloc(u8, 50));
+
+    try std.testing.expectEqual(@as(usize, slab_size), accounting.sourceUsage("scheme", "a").?.live_bytes);
+    try std.testing.expectEqual(@as(usize, 2 * slab_size), accounting.schemeUsage("scheme").?.live_bytes);
+    try std.testing.expect(accounting.sourceStateBytes("scheme", "a").? >= 100);
+    try std.testing.expect(accounting.sourceStateBytes("scheme", "a").? < slab_size);
+    try std.testing.expectEqual(@as(usize, slab_size), accounting.sourceUsage("scheme", "b").?.live_bytes);
+    try std.testing.expectEqual(@as(usize, 0), accounting.sourceStateBytes("scheme", "b").?);
+    try std.testing.expect(accounting.sourceUsage("other", "a") == null);
+
+    var json = std.ArrayList(u8).init(allocator);
+    defer json.deinit();
+    try accounting.writeJson(json.writer());
+    const parsed = try std.json.parseFromSlice(std.json.Value, allocator, json.items, .{});
+    defer parsed.deinit();
+    try std.testing.expect(parsed.value.object.get("schemes").?.object.get("scheme") != null);
+}
@@ -0,0 +1,175 @@
+//! The parts of an object touched by an update, as paths of struct fields, array and list indices, map keys
+//! and union variants from the root of the object. A change at a path covers everything below it, so a
+//! consumer only has to look at what's under the paths it cares about instead of the whole object.
+const std = @import("std");
+const cy = @import("cycle");
+const serde = @import("serde.zig");
+
+allocator: std.mem.Allocator,
+// the steps of every change, one after the other
+steps: std.ArrayListUnmanaged(Step) = .{},
+changes: std.ArrayListUnmanaged(Change) = .{},
+// the path currently visited by the update
+stack: std.ArrayListUnmanaged(Step) = .{},
+// Holds the bytes of the keys in the steps, which stay put until `clear`.
+keys: std.heap.ArenaAllocator,
+
+pub const Step = union(enum) {
+    Field: u16,
+    Index: u64,
+    Key: []const u8,
+    Variant: u16,
+};
+
+pub const Kind = enum {
+    /// The value at the path was replaced as a whole.
+    Set,
+    /// The string at the path was edited.
+    Text,
+    /// An item was inserted into a list at the index the path ends in, which moves every later item.
+    Insert,
+    /// The list item or map entry that the path ends in was removed. Later list items move.
+    Remove,
+};
+
+pub const Entry = struct {
+    kind: Kind,
+    path: []const Step,
+};
+
+/// The changes recorded so far, which `restore` goes back to.
+pub const Mark = struct {
+    changes: usize,
+    steps: usize,
+};
+
+const Change = struct {
+    kind: Kind,
+    start: u32,
+    len: u32,
+};
+
+const Error = std.mem.Allocator.Error;
+
+const Self = @This();
+
+pub fn init(allocator: std.mem.Allocator) Self {
+    return Self{
+        .allocator = allocator,
+        .keys = std.heap.ArenaAllocator.init(allocator),
+    };
+}
+
+pub fn deinit(self: *Self) void {
+    self.steps.deinit(self.allocator);
+    self.changes.deinit(self.allocator);
+    self.stack.deinit(self.allocator);
+    self.keys.deinit();
+    self.* = undefined;
+}
+
+pub fn clear(self: *Self) void {
+    self.steps.clearRetainingCapacity();
+    self.changes.clearRetainingCapacity();
+    std.debug.assert(self.stack.items.len == 0);
+    _ = self.keys.reset(.retain_capacity);
+}
+
+pub fn count(self: *const Self) usize {
+    return self.changes.items.len;
+}
+
+pub fn get(self: *const Self, i: usize) Entry {
+    const change = self.changes.items[i];
+    return Entry{
+        .kind = change.kind,
+        .path = self.steps.items[change.start..][0..change.len],
+    };
+}
+
+pub fn mark(self: *const Self) Mark {
+    return Mark{
+        .changes = self.changes.items.len,
+        .steps = self.steps.items.len,
+    };
+}
+
+/// Drops the changes recorded since `m`, those of an update that was rolled back.
+pub fn restore(self: *Self, m: Mark) void {
+    self.changes.shrinkRetainingCapacity(m.changes);
+    self.steps.shrinkRetainingCapacity(m.steps);
+}
+
+/// Descends into `step` of the path currently visited, until the matching `leave`.
+pub fn enter(self: *Self, step: Step) Error!void {
+    const owned = switch (step) {
+        .Key => |key| Step{ .Key = try self.keys.allocator().dupe(u8, key) },
+        else => step,
+    };
+    try self.stack.append(self.allocator, owned);
+}
+
+pub fn leave(self: *Self) void {
+    _ = self.stack.pop();
+}
+
+/// Records a change at the path currently visited, extended by `last` if given.
+pub fn record(self: *Self, kind: Kind, last: ?Step) Error!void {
+    const owned_last = if (last) |step| switch (step) {
+        .Key => |key| Step{ .Key = try self.keys.allocator().dupe(u8, key) },
+        else => step,
+    } else null;
+    const len = self.stack.items.len + @intFromBool(owned_last != null);
+    try self.steps.ensureUnusedCapacity(self.allocator, len);
+    try self.changes.ensureUnusedCapacity(self.allocator, 1);
+
+    const start = self.steps.items.len;
+    self.steps.appendSliceAssumeCapacity(self.stack.items);
+    if (owned_last) |step| {
+        self.steps.appendAssumeCapacity(step);
+    }
+    self.changes.appendAssumeCapacity(Change{
+        .kind = kind,
+        .start = @intCast(start),
+        .len = @intCast(len),
+    });
+}
+
+/// Records the changes of a mutation of a type without state, which an update doesn't walk otherwise.
+pub fn recordMutation(self: *Self, t: cy.def.Type, bytes: []const u8) Error!void {
+    switch (t) {
+        .Array => |info| {
+            var ops = serde.MutateArray.init(bytes).iterator();
+            while (ops.next()) |op| {
+                try self.enter(.{ .Index = op.fieldValue(.index) });
+                defer self.leave();
+                try self.recordMutation(info.child.*, op.fieldBytes(.elem));
+            }
+        },
+        .Struct => |info| try self.recordFields(info, bytes),
+        .Tuple => |info| try self.recordFields(info, bytes),
+        .Union => |info| {
+            const mut = serde.Union(void).init(bytes);
+            const tag = mut.tagValue();
+            const field = serde.MutateUnionField.init(mut.fieldBytes());
+            if (tag >= info.fields.len or field.tag() == .New) {
+                return self.record(.Set, null);
+            }
+
+            try self.enter(.{ .Variant = tag });
+            defer self.leave();
+            try self.recordMutation(info.fields[tag].type, field.fieldBytes());
+        },
+        else => try self.record(.Set, null),
+    }
+}
+
+fn recordFields(self: *Self, info: anytype, bytes: []const u8) Error!void {
+    var fields = serde.ElemIterator.init(bytes);
+    for (info.fields, 0..) |f, i| {
+        const value = serde.readOptional(fields.next()) orelse continue;
+        try self.enter(.{ .Field = @intCast(i) });
+        defer self.leave();
+        try self.recordMutation(f.type, value);
+    }
+}
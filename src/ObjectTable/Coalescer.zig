@@ -0,0 +1,866 @@
+//! Rewrites mutations into equivalent ones with fewer ops before they are applied to an object. Adjacent
+//! string edits are merged, insertions that are deleted again right away are cancelled, and repeated
+//! mutations of the same array index, list index or map key are folded into one.
+//!
+//! A rewrite never changes whether a mutation is valid: ops are only combined when the result checks the
+//! same bounds as the ops it replaces, which is why, for example, an insertion into a string that is
+//! deleted again leaves an empty insertion behind.
+const std = @import("std");
+const cy = @import("cycle");
+const serde = @import("serde.zig");
+const Object = @import("Object.zig");
+
+// holds every intermediate rewrite, reset once a rewrite has been copied out
+arena: std.heap.ArenaAllocator,
+stats: Stats = .{},
+
+pub const Stats = struct {
+    /// Mutations passed through `coalesce`.
+    mutations: u64 = 0,
+    /// Pairs of mutations combined by `merge`.
+    merged_mutations: u64 = 0,
+    bytes_in: u64 = 0,
+    bytes_out: u64 = 0,
+    /// Adjacent string edits combined into one.
+    merged_edits: u64 = 0,
+    /// Insertions cancelled by the deletion that followed them.
+    cancelled: u64 = 0,
+    /// Repeated mutations of the same array index, list index or map key folded into one.
+    folded: u64 = 0,
+};
+
+const Error = std.mem.Allocator.Error;
+
+const StringIndex = @TypeOf(serde.MutateStringInsertOp.init(undefined).fieldValue(.index));
+const StringLen = @TypeOf(serde.MutateStringDeleteOp.init(undefined).fieldValue(.len));
+const ArrayIndex = @TypeOf(serde.MutateArrayOp.init(undefined).fieldValue(.index));
+const ListIndex = @TypeOf(serde.MutateListMutateOp.init(undefined).fieldValue(.index));
+const ListDeleteIndex = @TypeOf(serde.MutateListOp.init(undefined).fieldValue(.Delete));
+
+const writeElem = serde.writeElem;
+const beginElem = serde.beginElem;
+const endElem = serde.endElem;
+
+const Self = @This();
+
+pub fn init(allocator: std.mem.Allocator) Self {
+    return Self{
+        .arena = std.heap.ArenaAllocator.init(allocator),
+    };
+}
+
+pub fn deinit(self: *Self) void {
+    self.arena.deinit();
+    self.* = undefined;
+}
+
+/// Writes a mutation of `t` with the same effect as `bytes` to `out`.
+pub fn coalesce(self: *Self, t: cy.def.Type, bytes: []const u8, out: *std.ArrayList(u8)) !void {
+    defer _ = self.arena.reset(.retain_capacity);
+
+    const result = try self.coalesceMutation(t, bytes);
+    try out.appendSlice(result);
+
+    self.stats.mutations += 1;
+    self.stats.bytes_in += bytes.len;
+    self.stats.bytes_out += result.len;
+}
+
+/// Writes a single mutation of `t` with the effect of applying `a` and then `b` to `out`. Returns false
+/// without writing anything when the two can't be combined without knowing the state they apply to.
+///
+/// The result is applied all or nothing, so this is for callers that would reject `a` along with `b`.
+pub fn merge(self: *Self, t: cy.def.Type, a: []const u8, b: []const u8, out: *std.ArrayList(u8)) !bool {
+    defer _ = self.arena.reset(.retain_capacity);
+
+    const result = try self.mergeMutations(t, a, b) orelse return false;
+    try out.appendSlice(result);
+
+    self.stats.merged_mutations += 1;
+    return true;
+}
+
+fn allocator(self: *Self) std.mem.Allocator {
+    return self.arena.allocator();
+}
+
+fn coalesceMutation(self: *Self, t: cy.def.Type, bytes: []const u8) Error![]const u8 {
+    if (!Object.typeHasState(t)) {
+        return bytes;
+    }
+
+    return switch (t) {
+        .Void, .Bool, .Int, .Float, .Enum, .Ref, .Any => bytes,
+        .String => self.coalesceString(bytes),
+        .Optional => |info| blk: {
+            const opt = serde.MutateOptional.init(bytes);
+            if (opt.tag() != .Mutate) {
+                break :blk bytes;
+            }
+            break :blk self.writeUnion(opt.tagValue(), try self.coalesceMutation(info.child.*, opt.fieldBytes()));
+        },
+        .Array => |info| self.coalesceArray(info.child.*, bytes),
+        .List => |info| self.coalesceList(info.child.*, bytes),
+        .Map => |info| self.coalesceMap(info.value.*, bytes),
+        .Struct => |info| self.coalesceStruct(info, bytes),
+        .Tuple => |info| self.coalesceStruct(info, bytes),
+        .Union => |info| blk: {
+            const mut = serde.Union(void).init(bytes);
+            const tag = mut.tagValue();
+            if (tag >= info.fields.len) {
+                // left for the update to reject
+                break :blk bytes;
+            }
+
+            const field = serde.MutateUnionField.init(mut.fieldBytes());
+            if (field.tag() != .Mutate) {
+                break :blk bytes;
+            }
+
+            const child = try self.coalesceMutation(info.fields[tag].type, field.fieldBytes());
+            break :blk self.writeUnion(tag, try self.writeUnion(field.tagValue(), child));
+        },
+    };
+}
+
+fn coalesceStruct(self: *Self, info: anytype, bytes: []const u8) Error![]const u8 {
+    var out = std.ArrayList(u8).init(self.allocator());
+    var fields = serde.ElemIterator.init(bytes);
+    for (info.fields) |f| {
+        const field_bytes = fields.next();
+        const value = serde.readOptional(field_bytes) orelse {
+            try writeElem(&out, field_bytes);
+            continue;
+        };
+
+        const start = try beginElem(&out);
+        try out.append(1);
+        try out.appendSlice(try self.coalesceMutation(f.type, value));
+        endElem(&out, start);
+    }
+    return out.items;
+}
+
+const Edit = struct {
+    tag: serde.MutateStringOp.Tag,
+    index: u64 = 0,
+    len: u64 = 0,
+    // the text of every edit is kept back to back in the order of the edits, so the last edit's text
+    // can always be extended in place
+    text_start: usize = 0,
+    text_len: usize = 0,
+};
+
+fn coalesceString(self: *Self, bytes: []const u8) Error![]const u8 {
+    var edits = std.ArrayList(Edit).init(self.allocator());
+    var texts = std.ArrayList(u8).init(self.allocator());
+
+    var ops = serde.MutateString.init(bytes).iterator();
+    while (ops.next()) |op| {
+        switch (op.tag()) {
+            .Append, .Prepend => {
+                const text = cy.chan.read([]const u8, op.fieldBytes());
+                try self.pushEdit(&edits, &texts, Edit{ .tag = op.tag() }, text);
+            },
+            .Insert => {
+                const ins = serde.MutateStringInsertOp.init(op.fieldBytes());
+                const text = cy.chan.read([]const u8, ins.fieldBytes(.elem));
+                try self.pushEdit(&edits, &texts, Edit{ .tag = .Insert, .index = ins.fieldValue(.index) }, text);
+            },
+            .Delete => {
+                const del = serde.MutateStringDeleteOp.init(op.fieldBytes());
+                try self.pushEdit(&edits, &texts, Edit{
+                    .tag = .Delete,
+                    .index = del.fieldValue(.index),
+                    .len = del.fieldValue(.len),
+                }, "");
+            },
+        }
+    }
+
+    var out = std.ArrayList(u8).init(self.allocator());
+    try out.appendSlice(std.mem.asBytes(&edits.items.len));
+    for (edits.items) |edit| {
+        const op = try beginElem(&out);
+        try out.appendSlice(std.mem.asBytes(&@as(u16, @intFromEnum(edit.tag))));
+
+        const payload = try beginElem(&out);
+        const text = texts.items[edit.text_start..][0..edit.text_len];
+        switch (edit.tag) {
+            .Append, .Prepend => {
+                try writeElem(&out, text);
+            },
+            .Insert => {
+                try writeElem(&out, std.mem.asBytes(&@as(StringIndex, @intCast(edit.index))));
+                const elem = try beginElem(&out);
+                try writeElem(&out, text);
+                endElem(&out, elem);
+            },
+            .Delete => {
+                try writeElem(&out, std.mem.asBytes(&@as(StringIndex, @intCast(edit.index))));
+                try writeElem(&out, std.mem.asBytes(&@as(StringLen, @intCast(edit.len))));
+            },
+        }
+        endElem(&out, payload);
+        endElem(&out, op);
+    }
+    return out.items;
+}
+
+fn pushEdit(self: *Self, edits: *std.ArrayList(Edit), texts: *std.ArrayList(u8), edit: Edit, text: []const u8) Error!void {
+    if (edits.items.len > 0) {
+        const top = &edits.items[edits.items.len - 1];
+        switch (edit.tag) {
+            .Append => if (top.tag == .Append) {
+                try texts.appendSlice(text);
+                top.text_len += text.len;
+                self.stats.merged_edits += 1;
+                return;
+            },
+            .Prepend => if (top.tag == .Prepend) {
+                try texts.insertSlice(top.text_start, text);
+                top.text_len += text.len;
+                self.stats.merged_edits += 1;
+                return;
+            },
+            .Insert => if (top.tag == .Insert) {
+                if (edit.index == top.index + top.text_len) {
+                    try texts.appendSlice(text);
+                    top.text_len += text.len;
+                    self.stats.merged_edits += 1;
+                    return;
+                }
+                if (edit.index == top.index) {
+                    try texts.insertSlice(top.text_start, text);
+                    top.text_len += text.len;
+                    self.stats.merged_edits += 1;
+                    return;
+                }
+            },
+            // An empty deletion still checks its index, so it's never combined.
+            .Delete => if (edit.len > 0) switch (top.tag) {
+                .Append => {},
+                .Prepend => if (edit.index == 0 and edit.len == top.text_len) {
+                    texts.shrinkRetainingCapacity(top.text_start);
+                    _ = edits.pop();
+                    self.stats.cancelled += 1;
+                    return;
+                },
+                .Insert => if (edit.index == top.index and edit.len == top.text_len) {
+                    texts.shrinkRetainingCapacity(top.text_start);
+                    if (top.index == 0) {
+                        _ = edits.pop();
+                    } else {
+                        // the empty insertion keeps the bounds check of the original one
+                        top.text_len = 0;
+                    }
+                    self.stats.cancelled += 1;
+                    return;
+                },
+                .Delete => {
+                    if (edit.index == top.index) {
+                        top.len += edit.len;
+                        self.stats.merged_edits += 1;
+                        return;
+                    }
+                    if (top.len > 0 and edit.index + edit.len == top.index) {
+                        top.index = edit.index;
+                        top.len += edit.len;
+                        self.stats.merged_edits += 1;
+                        return;
+                    }
+                },
+            },
+        }
+    }
+
+    var pushed = edit;
+    pushed.text_start = texts.items.len;
+    pushed.text_len = text.len;
+    try edits.append(pushed);
+    try texts.appendSlice(text);
+}
+
+const IndexedOp = struct {
+    index: u64,
+    payload: []const u8,
+};
+
+fn coalesceArray(self: *Self, child: cy.def.Type, bytes: []const u8) Error![]const u8 {
+    var pending = std.ArrayList(IndexedOp).init(self.allocator());
+
+    var ops = serde.MutateArray.init(bytes).iterator();
+    while (ops.next()) |op| {
+        const index = op.fieldValue(.index);
+        const elem = try self.coalesceMutation(child, op.fieldBytes(.elem));
+
+        if (pending.items.len > 0) {
+            const top = &pending.items[pending.items.len - 1];
+            if (top.index == index) {
+                if (try self.mergeMutations(child, top.payload, elem)) |merged| {
+                    top.payload = merged;
+                    self.stats.folded += 1;
+                    continue;
+                }
+            }
+        }
+        try pending.append(IndexedOp{ .index = index, .payload = elem });
+    }
+
+    var out = std.ArrayList(u8).init(self.allocator());
+    try out.appendSlice(std.mem.asBytes(&pending.items.len));
+    for (pending.items) |op| {
+        const start = try beginElem(&out);
+        try writeElem(&out, std.mem.asBytes(&@as(ArrayIndex, @intCast(op.index))));
+        try writeElem(&out, op.payload);
+        endElem(&out, start);
+    }
+    return out.items;
+}
+
+const ListOp = struct {
+    tag: serde.MutateListOp.Tag,
+    index: u64 = 0,
+    // the original payload, or the element mutation of a `Mutate`
+    payload: []const u8,
+};
+
+fn coalesceList(self: *Self, child: cy.def.Type, bytes: []const u8) Error![]const u8 {
+    var pending = std.ArrayList(ListOp).init(self.allocator());
+    // a new element could be an invalid union, in which case dropping it would change the outcome
+    const cancellable = !typeHasUnion(child);
+
+    var ops = serde.MutateList.init(bytes).iterator();
+    while (ops.next()) |op| {
+        const top: ?*ListOp = if (pending.items.len > 0) &pending.items[pending.items.len - 1] else null;
+        switch (op.tag()) {
+            .Append, .Prepend => {
+                try pending.append(ListOp{ .tag = op.tag(), .payload = op.fieldBytes() });
+            },
+            .Insert => {
+                const ins = serde.MutateListInsertOp.init(op.fieldBytes());
+                try pending.append(ListOp{ .tag = .Insert, .index = ins.fieldValue(.index), .payload = op.fieldBytes() });
+            },
+            .Delete => {
+                const index = op.fieldValue(.Delete);
+                if (top) |t| {
+                    const inserted_first = t.tag == .Prepend or (t.tag == .Insert and t.index == 0);
+                    if (cancellable and index == 0 and inserted_first) {
+                        _ = pending.pop();
+                        self.stats.cancelled += 1;
+                        continue;
+                    }
+                }
+                try pending.append(ListOp{ .tag = .Delete, .index = index, .payload = op.fieldBytes() });
+            },
+            .Mutate => {
+                const mut = serde.MutateListMutateOp.init(op.fieldBytes());
+                const index = mut.fieldValue(.index);
+                const elem = try self.coalesceMutation(child, mut.fieldBytes(.elem));
+                if (top) |t| {
+                    if (t.tag == .Mutate and t.index == index) {
+                        if (try self.mergeMutations(child, t.payload, elem)) |merged| {
+                            t.payload = merged;
+                            self.stats.folded += 1;
+                            continue;
+                        }
+                    }
+                }
+                try pending.append(ListOp{ .tag = .Mutate, .index = index, .payload = elem });
+            },
+        }
+    }
+
+    var out = std.ArrayList(u8).init(self.allocator());
+    try out.appendSlice(std.mem.asBytes(&pending.items.len));
+    for (pending.items) |op| {
+        const start = try beginElem(&out);
+        try out.appendSlice(std.mem.asBytes(&@as(u16, @intFromEnum(op.tag))));
+        if (op.tag == .Mutate) {
+            const payload = try beginElem(&out);
+            try writeElem(&out, std.mem.asBytes(&@as(ListIndex, @intCast(op.index))));
+            try writeElem(&out, op.payload);
+            endElem(&out, payload);
+        } else {
+            try writeElem(&out, op.payload);
+        }
+        endElem(&out, start);
+    }
+    return out.items;
+}
+
+const MapOp = struct {
+    tag: serde.MutateMapOp.Tag,
+    key: []const u8 = "",
+    // the original payload, or the value mutation of a `Mutate`
+    payload: []const u8,
+};
+
+fn coalesceMap(self: *Self, value: cy.def.Type, bytes: []const u8) Error![]const u8 {
+    var pending = std.ArrayList(MapOp).init(self.allocator());
+    // a replaced value could be an invalid union, in which case dropping it would change the outcome
+    const replaceable = !typeHasUnion(value);
+
+    var ops = serde.MutateMap.init(bytes).iterator();
+    while (ops.next()) |op| {
+        const top: ?*MapOp = if (pending.items.len > 0) &pending.items[pending.items.len - 1] else null;
+        switch (op.tag()) {
+            .Put => {
+                const key = serde.MapEntry.init(op.fieldBytes()).fieldBytes(.key);
+                if (top) |t| {
+                    if (replaceable and t.tag == .Put and std.mem.eql(u8, t.key, key)) {
+                        t.payload = op.fieldBytes();
+                        self.stats.folded += 1;
+                        continue;
+                    }
+                }
+                try pending.append(MapOp{ .tag = .Put, .key = key, .payload = op.fieldBytes() });
+            },
+            .Remove => {
+                try pending.append(MapOp{ .tag = .Remove, .payload = op.fieldBytes() });
+            },
+            .Mutate => {
+                const entry = serde.MapEntry.init(op.fieldBytes());
+                const key = entry.fieldBytes(.key);
+                const mutation = try self.coalesceMutation(value, entry.fieldBytes(.value));
+                if (top) |t| {
+                    if (t.tag == .Mutate and std.mem.eql(u8, t.key, key)) {
+                        if (try self.mergeMutations(value, t.payload, mutation)) |merged| {
+                            t.payload = merged;
+                            self.stats.folded += 1;
+                            continue;
+                        }
+                    }
+                }
+                try pending.append(MapOp{ .tag = .Mutate, .key = key, .payload = mutation });
+            },
+        }
+    }
+
+    var out = std.ArrayList(u8).init(self.allocator());
+    try out.appendSlice(std.mem.asBytes(&pending.items.len));
+    for (pending.items) |op| {
+        const start = try beginElem(&out);
+        try out.appendSlice(std.mem.asBytes(&@as(u16, @intFromEnum(op.tag))));
+        if (op.tag == .Mutate) {
+            const payload = try beginElem(&out);
+            try writeElem(&out, op.key);
+            try writeElem(&out, op.payload);
+            endElem(&out, payload);
+        } else {
+            try writeElem(&out, op.payload);
+        }
+        endElem(&out, start);
+    }
+    return out.items;
+}
+
+fn mergeMutations(self: *Self, t: cy.def.Type, a: []const u8, b: []const u8) Error!?[]const u8 {
+    if (!Object.typeHasState(t)) {
+        return b;
+    }
+
+    switch (t) {
+        .Void, .Bool, .Int, .Float, .Enum, .Ref, .Any => return b,
+        // op lists run one after the other, so they're joined and coalesced again
+        .String, .Array, .List, .Map => {
+            var joined = std.ArrayList(u8).init(self.allocator());
+            const len = cy.chan.read(usize, a) + cy.chan.read(usize, b);
+            try joined.appendSlice(std.mem.asBytes(&len));
+            try joined.appendSlice(a[@sizeOf(usize)..]);
+            try joined.appendSlice(b[@sizeOf(usize)..]);
+            return try self.coalesceMutation(t, joined.items);
+        },
+        .Optional => |info| {
+            const opt_a = serde.MutateOptional.init(a);
+            const opt_b = serde.MutateOptional.init(b);
+            switch (opt_b.tag()) {
+                .New, .None => {
+                    const replaceable = switch (opt_a.tag()) {
+                        .New => !typeHasUnion(info.child.*),
+                        .None => true,
+                        // fails when the optional is empty
+                        .Mutate => false,
+                    };
+                    return if (replaceable) b else null;
+                },
+                .Mutate => {
+                    if (opt_a.tag() != .Mutate) {
+                        return null;
+                    }
+                    const child = try self.mergeMutations(info.child.*, opt_a.fieldBytes(), opt_b.fieldBytes()) orelse return null;
+                    return try self.writeUnion(opt_b.tagValue(), child);
+                },
+            }
+        },
+        .Struct => |info| return self.mergeStruct(info, a, b),
+        .Tuple => |info| return self.mergeStruct(info, a, b),
+        .Union => |info| {
+            const mut_a = serde.Union(void).init(a);
+            const mut_b = serde.Union(void).init(b);
+            const tag_a = mut_a.tagValue();
+            const tag_b = mut_b.tagValue();
+            if (tag_a >= info.fields.len or tag_b >= info.fields.len) {
+                return null;
+            }
+
+            const field_a = serde.MutateUnionField.init(mut_a.fieldBytes());
+            const field_b = serde.MutateUnionField.init(mut_b.fieldBytes());
+            switch (field_b.tag()) {
+                .New => {
+                    const replaceable = field_a.tag() == .New and !typeHasUnion(info.fields[tag_a].type);
+                    return if (replaceable) b else null;
+                },
+                .Mutate => {
+                    if (field_a.tag() != .Mutate or tag_a != tag_b) {
+                        return null;
+                    }
+                    const child = try self.mergeMutations(info.fields[tag_b].type, field_a.fieldBytes(), field_b.fieldBytes()) orelse return null;
+                    return try self.writeUnion(tag_b, try self.writeUnion(field_b.tagValue(), child));
+                },
+            }
+        },
+    }
+}
+
+fn mergeStruct(self: *Self, info: anytype, a: []const u8, b: []const u8) Error!?[]const u8 {
+    var out = std.ArrayList(u8).init(self.allocator());
+    var fields_a = serde.ElemIterator.init(a);
+    var fields_b = serde.ElemIterator.init(b);
+    for (info.fields) |f| {
+        const field_a = fields_a.next();
+        const field_b = fields_b.next();
+
+        const value_a = serde.readOptional(field_a) orelse {
+            try writeElem(&out, field_b);
+            continue;
+        };
+        const value_b = serde.readOptional(field_b) orelse {
+            try writeElem(&out, field_a);
+            continue;
+        };
+
+        const merged = try self.mergeMutations(f.type, value_a, value_b) orelse return null;
+        const start = try beginElem(&out);
+        try out.append(1);
+        try out.appendSlice(merged);
+        endElem(&out, start);
+    }
+    return out.items;
+}
+
+fn writeUnion(self: *Self, tag: u16, payload: []const u8) Error![]const u8 {
+    var out = std.ArrayList(u8).init(self.allocator());
+    try out.appendSlice(std.mem.asBytes(&tag));
+    try writeElem(&out, payload);
+    return out.items;
+}
+
+/// Whether creating a value of `t` can fail on an invalid union tag.
+fn typeHasUnion(t: cy.def.Type) bool {
+    return switch (t) {
+        .Void, .Bool, .String, .Int, .Float, .Enum, .Ref, .Any => false,
+        .Union => true,
+        .Optional => |info| typeHasUnion(info.child.*),
+        .Array => |info| typeHasUnion(info.child.*),
+        .List => |info| typeHasUnion(info.child.*),
+        .Map => |info| typeHasUnion(info.value.*),
+        .Struct => |info| for (info.fields) |f| {
+            if (typeHasUnion(f.type)) break true;
+        } else false,
+        .Tuple => |info| for (info.fields) |f| {
+            if (typeHasUnion(f.type)) break true;
+        } else false,
+    };
+}
+
+// Writes a string mutation that appends `text`.
+fn writeTestAppend(out: *std.ArrayList(u8), text: []const u8) !void {
+    try out.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    try serde.writeStringOp(out, .Append, 0, text);
+}
+
+// Applies `mutations` one after the other to an object and `result` to another, which have to end up the same.
+fn expectSameEffect(t: cy.def.Type, value: []const u8, mutations: []const []const u8, result: []const u8) !void {
+    const allocator = std.testing.allocator;
+    var expected = try Object.init(allocator, @bitCast(@as(u64, 0)), t, value);
+    defer expected.deinit(allocator);
+    var actual = try Object.init(allocator, @bitCast(@as(u64, 0)), t, value);
+    defer actual.deinit(allocator);
+
+    for (mutations) |mutation| {
+        try std.testing.expect(try expected.update(allocator, mutation));
+    }
+    try std.testing.expect(try actual.update(allocator, result));
+    try std.testing.expect(expected.eql(&actual));
+}
+
+test "string edits" {
+    const allocator = std.testing.allocator;
+
+    var coalescer = Self.init(allocator);
+    defer coalescer.deinit();
+
+    var in = std.ArrayList(u8).init(allocator);
+    defer in.deinit();
+    var out = std.ArrayList(u8).init(allocator);
+    defer out.deinit();
+
+    try in.appendSlice(std.mem.asBytes(&@as(usize, 6)));
+    try serde.writeStringOp(&in, .Append, 0, "h");
+    try serde.writeStringOp(&in, .Append, 0, "i");
+    try serde.writeStringOp(&in, .Insert, 3, "ab");
+    try serde.writeStringOp(&in, .Delete, 3, "ab");
+    try serde.writeStringOp(&in, .Prepend, 0, "x");
+    try serde.writeStringOp(&in, .Delete, 0, "x");
+
+    try coalescer.coalesce(.String, in.items, &out);
+
+    const ops = serde.MutateString.init(out.items);
+    try std.testing.expectEqual(@as(usize, 2), ops.len());
+
+    const append = ops.elem(0);
+    try std.testing.expectEqual(serde.MutateStringOp.Tag.Append, append.tag());
+    try std.testing.expectEqualStrings("hi", cy.chan.read([]const u8, append.fieldBytes()));
+
+    // the cancelled insertion keeps its index check
+    const insert = serde.MutateStringInsertOp.init(ops.elem(1).fieldBytes());
+    try std.testing.expectEqual(@as(StringIndex, 3), insert.fieldValue(.index));
+    try std.testing.expectEqualStrings("", cy.chan.read([]const u8, insert.fieldBytes(.elem)));
+
+    try std.testing.expectEqual(@as(u64, 1), coalescer.stats.merged_edits);
+    try std.testing.expectEqual(@as(u64, 2), coalescer.stats.cancelled);
+}
+
+test "list ops" {
+    const allocator = std.testing.allocator;
+    const t = cy.def.Type{
+        .List = cy.def.Type.List{ .child = &@as(cy.def.Type, .String) },
+    };
+
+    var coalescer = Self.init(allocator);
+    defer coalescer.deinit();
+
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    try value.appendSlice(std.mem.asBytes(&@as(usize, 3)));
+    for ([_][]const u8{ "a", "b", "c" }) |item| {
+        try serde.writeString(&value, item);
+    }
+
+    var in = std.ArrayList(u8).init(allocator);
+    defer in.deinit();
+    var out = std.ArrayList(u8).init(allocator);
+    defer out.deinit();
+    var scratch = std.ArrayList(u8).init(allocator);
+    defer scratch.deinit();
+    var elem = std.ArrayList(u8).init(allocator);
+    defer elem.deinit();
+
+    // prepends an item and deletes it again, appends to the second item twice and then appends an item
+    try in.appendSlice(std.mem.asBytes(&@as(usize, 5)));
+    try serde.writeElem(&scratch, "x");
+    try serde.writeOp(&in, @intFromEnum(serde.MutateListOp.Tag.Prepend), scratch.items);
+    try serde.writeOp(&in, @intFromEnum(serde.MutateListOp.Tag.Delete), std.mem.asBytes(&@as(ListDeleteIndex, 0)));
+    for ([_][]const u8{ "1", "2" }) |text| {
+        scratch.clearRetainingCapacity();
+        try serde.writeElem(&scratch, std.mem.asBytes(&@as(ListIndex, 1)));
+        elem.clearRetainingCapacity();
+        try writeTestAppend(&elem, text);
+        try serde.writeElem(&scratch, elem.items);
+        try serde.writeOp(&in, @intFromEnum(serde.MutateListOp.Tag.Mutate), scratch.items);
+    }
+    scratch.clearRetainingCapacity();
+    try serde.writeElem(&scratch, "z");
+    try serde.writeOp(&in, @intFromEnum(serde.MutateListOp.Tag.Append), scratch.items);
+
+    try coalescer.coalesce(t, in.items, &out);
+
+    const ops = serde.MutateList.init(out.items);
+    try std.testing.expectEqual(@as(usize, 2), ops.len());
+    try std.testing.expectEqual(serde.MutateListOp.Tag.Mutate, ops.elem(0).tag());
+    try std.testing.expectEqual(serde.MutateListOp.Tag.Append, ops.elem(1).tag());
+    try std.testing.expectEqual(@as(u64, 1), coalescer.stats.cancelled);
+    try std.testing.expectEqual(@as(u64, 1), coalescer.stats.folded);
+    try expectSameEffect(t, value.items, &.{in.items}, out.items);
+}
+
+test "array and map ops" {
+    const allocator = std.testing.allocator;
+    const t = cy.def.Type{
+        .Struct = cy.def.Type.Struct{
+            .fields = &[_]cy.def.Type.Struct.Field{
+                .{
+                    .name = "names",
+                    .type = cy.def.Type{
+                        .Array = cy.def.Type.Array{ .len = 3, .child = &@as(cy.def.Type, .String) },
+                    },
+                },
+                .{
+                    .name = "entries",
+                    .type = cy.def.Type{
+                        .Map = cy.def.Type.Map{
+                            .key = &@as(cy.def.Type, .String),
+                            .value = &@as(cy.def.Type, .String),
+                        },
+                    },
+                },
+            },
+        },
+    };
+
+    var coalescer = Self.init(allocator);
+    defer coalescer.deinit();
+
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    const names = try serde.beginElem(&value);
+    for ([_][]const u8{ "a", "b", "c" }) |name| {
+        try serde.writeString(&value, name);
+    }
+    serde.endElem(&value, names);
+    const entries = try serde.beginElem(&value);
+    try value.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    const entry = try serde.beginElem(&value);
+    try serde.writeElem(&value, "k");
+    try serde.writeString(&value, "v");
+    serde.endElem(&value, entry);
+    serde.endElem(&value, entries);
+
+    var in = std.ArrayList(u8).init(allocator);
+    defer in.deinit();
+    var out = std.ArrayList(u8).init(allocator);
+    defer out.deinit();
+    var scratch = std.ArrayList(u8).init(allocator);
+    defer scratch.deinit();
+    var elem = std.ArrayList(u8).init(allocator);
+    defer elem.deinit();
+
+    // appends to the last name twice
+    const array = try serde.beginElem(&in);
+    try in.append(1);
+    try in.appendSlice(std.mem.asBytes(&@as(usize, 2)));
+    for ([_][]const u8{ "1", "2" }) |text| {
+        const op = try serde.beginElem(&in);
+        try serde.writeElem(&in, std.mem.asBytes(&@as(ArrayIndex, 2)));
+        elem.clearRetainingCapacity();
+        try writeTestAppend(&elem, text);
+        try serde.writeElem(&in, elem.items);
+        serde.endElem(&in, op);
+    }
+    serde.endElem(&in, array);
+
+    // puts the same key twice and then appends to its value twice
+    const map = try serde.beginElem(&in);
+    try in.append(1);
+    try in.appendSlice(std.mem.asBytes(&@as(usize, 4)));
+    for ([_][]const u8{ "v1", "v2" }) |text| {
+        scratch.clearRetainingCapacity();
+        try serde.writeElem(&scratch, "k");
+        try serde.writeString(&scratch, text);
+        try serde.writeOp(&in, @intFromEnum(serde.MutateMapOp.Tag.Put), scratch.items);
+    }
+    for ([_][]const u8{ "!", "?" }) |text| {
+        scratch.clearRetainingCapacity();
+        try serde.writeElem(&scratch, "k");
+        elem.clearRetainingCapacity();
+        try writeTestAppend(&elem, text);
+        try serde.writeElem(&scratch, elem.items);
+        try serde.writeOp(&in, @intFromEnum(serde.MutateMapOp.Tag.Mutate), scratch.items);
+    }
+    serde.endElem(&in, map);
+
+    try coalescer.coalesce(t, in.items, &out);
+
+    var fields = serde.ElemIterator.init(out.items);
+    try std.testing.expectEqual(@as(usize, 1), serde.MutateArray.init(serde.readOptional(fields.next()).?).len());
+    try std.testing.expectEqual(@as(usize, 2), serde.MutateMap.init(serde.readOptional(fields.next()).?).len());
+    try std.testing.expectEqual(@as(u64, 3), coalescer.stats.folded);
+    try expectSameEffect(t, value.items, &.{in.items}, out.items);
+}
+
+test "merge" {
+    const allocator = std.testing.allocator;
+    const t = cy.def.Type{
+        .Struct = cy.def.Type.Struct{
+            .fields = &[_]cy.def.Type.Struct.Field{
+                .{ .name = "name", .type = .String },
+                .{
+                    .name = "items",
+                    .type = cy.def.Type{
+                        .List = cy.def.Type.List{ .child = &@as(cy.def.Type, .String) },
+                    },
+                },
+            },
+        },
+    };
+
+    var coalescer = Self.init(allocator);
+    defer coalescer.deinit();
+
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    try serde.writeString(&value, "ab");
+    const items = try serde.beginElem(&value);
+    try value.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    try serde.writeString(&value, "x");
+    serde.endElem(&value, items);
+
+    var scratch = std.ArrayList(u8).init(allocator);
+    defer scratch.deinit();
+
+    // appends to the name and an item
+    var a = std.ArrayList(u8).init(allocator);
+    defer a.deinit();
+    var field = try serde.beginElem(&a);
+    try a.append(1);
+    try writeTestAppend(&a, "c");
+    serde.endElem(&a, field);
+    field = try serde.beginElem(&a);
+    try a.append(1);
+    try a.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    try serde.writeElem(&scratch, "y");
+    try serde.writeOp(&a, @intFromEnum(serde.MutateListOp.Tag.Append), scratch.items);
+    serde.endElem(&a, field);
+
+    // appends to the name again and deletes the first item
+    var b = std.ArrayList(u8).init(allocator);
+    defer b.deinit();
+    field = try serde.beginElem(&b);
+    try b.append(1);
+    try writeTestAppend(&b, "d");
+    serde.endElem(&b, field);
+    field = try serde.beginElem(&b);
+    try b.append(1);
+    try b.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    try serde.writeOp(&b, @intFromEnum(serde.MutateListOp.Tag.Delete), std.mem.asBytes(&@as(ListDeleteIndex, 0)));
+    serde.endElem(&b, field);
+
+    var out = std.ArrayList(u8).init(allocator);
+    defer out.deinit();
+    try std.testing.expect(try coalescer.merge(t, a.items, b.items, &out));
+    try expectSameEffect(t, value.items, &.{ a.items, b.items }, out.items);
+    try std.testing.expectEqual(@as(u64, 1), coalescer.stats.merged_mutations);
+
+    // replacing an optional after mutating it depends on whether it holds a value, so it isn't merged
+    const optional = cy.def.Type{
+        .Optional = cy.def.Type.Optional{ .child = &@as(cy.def.Type, .String) },
+    };
+    var mutate = std.ArrayList(u8).init(allocator);
+    defer mutate.deinit();
+    scratch.clearRetainingCapacity();
+    try writeTestAppend(&scratch, "e");
+    try mutate.appendSlice(std.mem.asBytes(&@as(u16, @intFromEnum(serde.MutateOptional.Tag.Mutate))));
+    try serde.writeElem(&mutate, scratch.items);
+    var new = std.ArrayList(u8).init(allocator);
+    defer new.deinit();
+    scratch.clearRetainingCapacity();
+    try serde.writeElem(&scratch, "f");
+    try new.appendSlice(std.mem.asBytes(&@as(u16, @intFromEnum(serde.MutateOptional.Tag.New))));
+    try serde.writeElem(&new, scratch.items);
+
+    out.clearRetainingCapacity();
+    try std.testing.expect(!try coalescer.merge(optional, mutate.items, new.items, &out));
+    try std.testing.expectEqual(@as(usize, 0), out.items.len);
+    try std.testing.expectEqual(@as(u64, 1), coalescer.stats.merged_mutations);
+}
@@ -0,0 +1,330 @@
+//! The values of an array or list of scalars in an object's state, packed one after the other at their own
+//! width and aligned for vector loads. Bools are kept as bytes and enums as their index.
+//!
+//! Aggregates run over the packed values with vector kernels, so that a query over many objects reads each
+//! of their columns once, without decoding their values one by one.
+const std = @import("std");
+const cy = @import("cycle");
+
+kind: Kind,
+bytes: std.ArrayListAlignedUnmanaged(u8, alignment) = .{},
+
+pub const alignment = 64;
+
+pub const Kind = enum {
+    Bool,
+    U8,
+    I8,
+    U16,
+    I16,
+    U32,
+    I32,
+    U64,
+    I64,
+    F32,
+    F64,
+    Enum,
+};
+
+pub fn Elem(comptime kind: Kind) type {
+    return switch (kind) {
+        .Bool, .U8 => u8,
+        .I8 => i8,
+        .U16 => u16,
+        .I16 => i16,
+        .U32, .Enum => u32,
+        .I32 => i32,
+        .U64 => u64,
+        .I64 => i64,
+        .F32 => f32,
+        .F64 => f64,
+    };
+}
+
+/// Only values matching the filter are aggregated.
+pub const Filter = struct {
+    op: enum { Lt, Le, Eq, Ne, Ge, Gt },
+    value: f64,
+};
+
+/// Integers are summed exactly within a column, wrapping at 64 bits, and converted once the column is done.
+pub const Aggregate = struct {
+    count: u64 = 0,
+    sum: f64 = 0,
+    min: f64 = std.math.inf(f64),
+    max: f64 = -std.math.inf(f64),
+
+    pub fn merge(self: *Aggregate, other: Aggregate) void {
+        self.count += other.count;
+        self.sum += other.sum;
+        self.min = @min(self.min, other.min);
+        self.max = @max(self.max, other.max);
+    }
+};
+
+const Self = @This();
+
+/// Returns the kind of the column that holds an array or list of `child`, or null if its values aren't kept.
+pub fn kindOf(child: cy.def.Type) ?Kind {
+    return switch (child) {
+        .Bool => .Bool,
+        .Enum => .Enum,
+        .Int => |info| if (info.signedness == .signed) switch (info.bits) {
+            1...8 => .I8,
+            9...16 => .I16,
+            17...32 => .I32,
+            33...64 => .I64,
+            else => null,
+        } else switch (info.bits) {
+            1...8 => .U8,
+            9...16 => .U16,
+            17...32 => .U32,
+            33...64 => .U64,
+            else => null,
+        },
+        .Float => |info| switch (info.bits) {
+            32 => .F32,
+            64 => .F64,
+            else => null,
+        },
+        else => null,
+    };
+}
+
+pub fn init(kind: Kind) Self {
+    return Self{ .kind = kind };
+}
+
+pub fn deinit(self: *Self, allocator: std.mem.Allocator) void {
+    self.bytes.deinit(allocator);
+    self.* = undefined;
+}
+
+pub fn clone(self: *const Self, allocator: std.mem.Allocator) !Self {
+    return Self{
+        .kind = self.kind,
+        .bytes = try self.bytes.clone(allocator),
+    };
+}
+
+pub fn width(self: *const Self) usize {
+    return switch (self.kind) {
+        inline else => |kind| @sizeOf(Elem(kind)),
+    };
+}
+
+pub fn len(self: *const Self) usize {
+    return self.bytes.items.len / self.width();
+}
+
+pub fn eql(self: *const Self, other: *const Self) bool {
+    return self.kind == other.kind and std.mem.eql(u8, self.bytes.items, other.bytes.items);
+}
+
+/// The value at `index` as it's written in a mutation. Only bools, integers and floats are written at the
+/// width they're kept at, enums are written at the width of their type.
+pub fn valueBytes(self: *const Self, index: usize) ?[]const u8 {
+    if (self.kind == .Enum) {
+        return null;
+    }
+    const w = self.width();
+    return self.bytes.items[index * w ..][0..w];
+}
+
+pub fn ensureUnusedCapacity(self: *Self, allocator: std.mem.Allocator, count: usize) !void {
+    try self.bytes.ensureUnusedCapacity(allocator, count * self.width());
+}
+
+/// Inserts the value in `value_bytes`, a value of the column's type as written in a mutation.
+pub fn insert(self: *Self, allocator: std.mem.Allocator, index: usize, value_bytes: []const u8) !void {
+    try self.ensureUnusedCapacity(allocator, 1);
+    self.insertAssumeCapacity(index, value_bytes);
+}
+
+pub fn insertAssumeCapacity(self: *Self, index: usize, value_bytes: []const u8) void {
+    const w = self.width();
+    self.bytes.items.len += w;
+    const items = self.bytes.items;
+    std.mem.copyBackwards(u8, items[(index + 1) * w ..], items[index * w .. items.len - w]);
+    self.decode(items[index * w ..][0..w], value_bytes);
+}
+
+/// Removes the value at `index`, copying it into `removed`. Its room is kept, so that inserting it back
+/// can't fail.
+pub fn remove(self: *Self, index: usize, removed: *[8]u8) void {
+    const w = self.width();
+    const items = self.bytes.items;
+    @memcpy(removed[0..w], items[index * w ..][0..w]);
+    std.mem.copyForwards(u8, items[index * w ..], items[(index + 1) * w ..]);
+    self.bytes.items.len -= w;
+}
+
+/// Restores a value taken out by `remove`.
+pub fn restore(self: *Self, index: usize, removed: *const [8]u8) void {
+    const w = self.width();
+    self.bytes.items.len += w;
+    const items = self.bytes.items;
+    std.mem.copyBackwards(u8, items[(index + 1) * w ..], items[index * w .. items.len - w]);
+    @memcpy(items[index * w ..][0..w], removed[0..w]);
+}
+
+/// Sets the value at `index` from `value_bytes`, copying the previous one into `prev`.
+pub fn set(self: *Self, index: usize, value_bytes: []const u8, prev: *[8]u8) void {
+    const w = self.width();
+    const slot = self.bytes.items[index * w ..][0..w];
+    @memcpy(prev[0..w], slot);
+    self.decode(slot, value_bytes);
+}
+
+/// Sets the value at `index` back to one copied out by `set`.
+pub fn reset(self: *Self, index: usize, prev: *const [8]u8) void {
+    const w = self.width();
+    @memcpy(self.bytes.items[index * w ..][0..w], prev[0..w]);
+}
+
+// Values are read from however many bytes they were written with, so that odd widths and enums of any
+// size end up at the width of the column.
+fn decode(self: *const Self, slot: []u8, value_bytes: []const u8) void {
+    var raw: [8]u8 = .{0} ** 8;
+    const n = @min(value_bytes.len, raw.len);
+    @memcpy(raw[0..n], value_bytes[0..n]);
+    switch (self.kind) {
+        .Bool => slot[0] = @intFromBool(raw[0] != 0),
+        inline .I8, .I16, .I32, .I64 => |kind| {
+            // sign extended from the last byte written
+            if (n > 0 and n < raw.len and raw[n - 1] & 0x80 != 0) {
+                @memset(raw[n..], 0xff);
+            }
+            const value: Elem(kind) = @truncate(std.mem.readInt(i64, &raw, .little));
+            @memcpy(slot, std.mem.asBytes(&value));
+        },
+        inline .U8, .U16, .U32, .U64, .Enum => |kind| {
+            const value: Elem(kind) = @truncate(std.mem.readInt(u64, &raw, .little));
+            @memcpy(slot, std.mem.asBytes(&value));
+        },
+        .F32, .F64 => @memcpy(slot, raw[0..slot.len]),
+    }
+}
+
+pub fn values(self: *const Self, comptime kind: Kind) []const Elem(kind) {
+    std.debug.assert(self.kind == kind);
+    const items: []align(alignment) const u8 = self.bytes.items;
+    return std.mem.bytesAsSlice(Elem(kind), items);
+}
+
+pub fn aggregate(self: *const Self, filter: ?Filter) Aggregate {
+    return switch (self.kind) {
+        inline else => |kind| aggregateValues(Elem(kind), self.values(kind), filter),
+    };
+}
+
+fn aggregateValues(comptime T: type, items: []const T, filter: ?Filter) Aggregate {
+    const is_float = @typeInfo(T) == .Float;
+    const Sum = if (is_float) f64 else if (@typeInfo(T).Int.signedness == .signed) i64 else u64;
+    const n = std.simd.suggestVectorLength(T) orelse 1;
+    const V = @Vector(n, T);
+
+    var sums: @Vector(n, Sum) = @splat(0);
+    var counts: @Vector(n, u64) = @splat(0);
+    var mins: V = @splat(if (is_float) std.math.inf(T) else std.math.maxInt(T));
+    var maxs: V = @splat(if (is_float) -std.math.inf(T) else std.math.minInt(T));
+
+    var i: usize = 0;
+    while (i + n <= items.len) : (i += n) {
+        const v: V = items[i..][0..n].*;
+        const keep = if (filter) |f| matches(n, widen(n, T, f64, v), f) else @as(@Vector(n, bool), @splat(true));
+        const wide = widen(n, T, Sum, v);
+        sums = if (is_float) sums + @select(Sum, keep, wide, @as(@Vector(n, Sum), @splat(0))) else sums +% @select(Sum, keep, wide, @as(@Vector(n, Sum), @splat(0)));
+        counts += @select(u64, keep, @as(@Vector(n, u64), @splat(1)), @as(@Vector(n, u64), @splat(0)));
+        mins = @min(mins, @select(T, keep, v, @as(V, @splat(if (is_float) std.math.inf(T) else std.math.maxInt(T)))));
+        maxs = @max(maxs, @select(T, keep, v, @as(V, @splat(if (is_float) -std.math.inf(T) else std.math.minInt(T)))));
+    }
+
+    var sum: Sum = 0;
+    var result = Aggregate{};
+    for (0..n) |lane| {
+        if (is_float) sum += sums[lane] else sum +%= sums[lane];
+        result.count += counts[lane];
+    }
+    var min: T = @reduce(.Min, mins);
+    var max: T = @reduce(.Max, maxs);
+
+    for (items[i..]) |item| {
+        if (filter) |f| {
+            const keep = matches(1, widen(1, T, f64, @as(@Vector(1, T), @splat(item))), f);
+            if (!keep[0]) continue;
+        }
+        if (is_float) sum += item else sum +%= item;
+        result.count += 1;
+        min = @min(min, item);
+        max = @max(max, item);
+    }
+
+    if (result.count > 0) {
+        result.sum = if (is_float) sum else @floatFromInt(sum);
+        result.min = if (is_float) min else @floatFromInt(min);
+        result.max = if (is_float) max else @floatFromInt(max);
+    }
+    return result;
+}
+
+fn widen(comptime n: comptime_int, comptime T: type, comptime W: type, v: @Vector(n, T)) @Vector(n, W) {
+    if (@typeInfo(T) == .Float) {
+        return @floatCast(v);
+    }
+    if (@typeInfo(W) == .Float) {
+        return @floatFromInt(v);
+    }
+    return @intCast(v);
+}
+
+fn matches(comptime n: comptime_int, v: @Vector(n, f64), filter: Filter) @Vector(n, bool) {
+    const value: @Vector(n, f64) = @splat(filter.value);
+    return switch (filter.op) {
+        .Lt => v < value,
+        .Le => v <= value,
+        .Eq => v == value,
+        .Ne => v != value,
+        .Ge => v >= value,
+        .Gt => v > value,
+    };
+}
+
+test {
+    const allocator = std.testing.allocator;
+
+    var column = Self.init(.I16);
+    defer column.deinit(allocator);
+    // more values than fit a vector, so that the tail is aggregated on its own
+    for (0..100) |i| {
+        const value: i16 = @as(i16, @intCast(i)) - 50;
+        try column.insert(allocator, column.len(), std.mem.asBytes(&value));
+    }
+
+    const all = column.aggregate(null);
+    try std.testing.expectEqual(@as(u64, 100), all.count);
+    try std.testing.expectEqual(@as(f64, -50), all.sum);
+    try std.testing.expectEqual(@as(f64, -50), all.min);
+    try std.testing.expectEqual(@as(f64, 49), all.max);
+
+    const positive = column.aggregate(.{ .op = .Gt, .value = 0 });
+    try std.testing.expectEqual(@as(u64, 49), positive.count);
+    try std.testing.expectEqual(@as(f64, 49 * 50 / 2), positive.sum);
+    try std.testing.expectEqual(@as(f64, 1), positive.min);
+
+    var removed: [8]u8 = undefined;
+    column.remove(0, &removed);
+    try std.testing.expectEqual(@as(i16, -49), column.values(.I16)[0]);
+    column.restore(0, &removed);
+    try std.testing.expectEqual(@as(i16, -50), column.values(.I16)[0]);
+
+    // a narrower value is sign extended
+    column.set(1, &.{0xfe}, &removed);
+    try std.testing.expectEqual(@as(i16, -2), column.values(.I16)[1]);
+    column.reset(1, &removed);
+    try std.testing.expectEqual(@as(i16, -49), column.values(.I16)[1]);
+
+    const none = column.aggregate(.{ .op = .Gt, .value = 1000 });
+    try std.testing.expectEqual(@as(u64, 0), none.count);
+    try std.testing.expect(std.math.isInf(none.min));
+}
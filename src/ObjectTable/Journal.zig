@@ -0,0 +1,219 @@
+//! The undo and redo history of an object, as the mutations that undo and redo its updates.
+//!
+//! Each side is a ring buffer of entries in a fixed share of the memory budget. Once a side is full, its
+//! oldest entries are dropped to make room, so a long editing session keeps its most recent history in
+//! bounded memory. An entry is undone by applying it as a mutation, which costs the same as the update it
+//! undoes.
+//!
+//! A journal is shared by the versions of its object in snapshots, which only ever read the current
+//! version's state, so it's reference counted rather than copied with the object.
+const std = @import("std");
+
+allocator: std.mem.Allocator,
+refs: std.atomic.Value(usize),
+undos: Ring,
+redos: Ring,
+
+pub const Usage = struct {
+    undo_entries: usize,
+    redo_entries: usize,
+    /// Bytes taken up by entries.
+    used_bytes: usize,
+    /// Bytes held for the ring buffers.
+    reserved_bytes: usize,
+};
+
+const Self = @This();
+
+/// Half of `budget` goes to each side of the history.
+pub fn create(allocator: std.mem.Allocator, budget: usize) !*Self {
+    const self = try allocator.create(Self);
+    self.* = Self{
+        .allocator = allocator,
+        .refs = std.atomic.Value(usize).init(1),
+        .undos = Ring{ .capacity = budget / 2 },
+        .redos = Ring{ .capacity = budget / 2 },
+    };
+    return self;
+}
+
+pub fn acquire(self: *Self) *Self {
+    _ = self.refs.fetchAdd(1, .monotonic);
+    return self;
+}
+
+pub fn release(self: *Self) void {
+    if (self.refs.fetchSub(1, .acq_rel) != 1) {
+        return;
+    }
+
+    self.undos.deinit(self.allocator);
+    self.redos.deinit(self.allocator);
+    self.allocator.destroy(self);
+}
+
+/// Records the mutation that undoes a new update, which leaves nothing to redo.
+pub fn record(self: *Self, inverse: []const u8) !void {
+    self.redos.clear();
+    try self.undos.push(self.allocator, inverse);
+}
+
+/// Records the mutation that undoes a redone update, keeping the rest of what there is to redo.
+pub fn pushUndo(self: *Self, inverse: []const u8) !void {
+    try self.undos.push(self.allocator, inverse);
+}
+
+/// Records the mutation that redoes an undone update.
+pub fn pushRedo(self: *Self, inverse: []const u8) !void {
+    try self.redos.push(self.allocator, inverse);
+}
+
+/// Moves the latest entry to undo into `out`, returns false if there is none.
+pub fn popUndo(self: *Self, out: *std.ArrayList(u8)) !bool {
+    return self.undos.pop(out);
+}
+
+/// Moves the latest entry to redo into `out`, returns false if there is none.
+pub fn popRedo(self: *Self, out: *std.ArrayList(u8)) !bool {
+    return self.redos.pop(out);
+}
+
+/// Forgets the whole history, once it no longer leads back to earlier states of the object.
+pub fn clear(self: *Self) void {
+    self.undos.clear();
+    self.redos.clear();
+}
+
+pub fn usage(self: *const Self) Usage {
+    return Usage{
+        .undo_entries = self.undos.count,
+        .redo_entries = self.redos.count,
+        .used_bytes = self.undos.used + self.redos.used,
+        .reserved_bytes = self.undos.buf.len + self.redos.buf.len,
+    };
+}
+
+// Entries are framed by their length on both sides, so that the newest can be popped from the back and the
+// oldest dropped from the front. Entries wrap around the end of the buffer.
+const Ring = struct {
+    buf: []u8 = &.{},
+    capacity: usize,
+    start: usize = 0,
+    used: usize = 0,
+    count: usize = 0,
+
+    const frame_len = 2 * @sizeOf(u32);
+
+    fn deinit(ring: *Ring, allocator: std.mem.Allocator) void {
+        allocator.free(ring.buf);
+        ring.* = undefined;
+    }
+
+    fn clear(ring: *Ring) void {
+        ring.start = 0;
+        ring.used = 0;
+        ring.count = 0;
+    }
+
+    // An entry larger than the whole ring can never be kept, in which case the ring is left empty rather
+    // than with a gap in its history.
+    fn push(ring: *Ring, allocator: std.mem.Allocator, entry: []const u8) !void {
+        const len = entry.len + frame_len;
+        if (len > ring.capacity or entry.len > std.math.maxInt(u32)) {
+            ring.clear();
+            return;
+        }
+        if (ring.buf.len == 0) {
+            ring.buf = try allocator.alloc(u8, ring.capacity);
+        }
+
+        while (ring.buf.len - ring.used < len) {
+            ring.dropOldest();
+        }
+
+        const frame = std.mem.toBytes(@as(u32, @intCast(entry.len)));
+        var at = ring.start + ring.used;
+        at = ring.write(at, &frame);
+        at = ring.write(at, entry);
+        _ = ring.write(at, &frame);
+        ring.used += len;
+        ring.count += 1;
+    }
+
+    fn pop(ring: *Ring, out: *std.ArrayList(u8)) !bool {
+        if (ring.count == 0) {
+            return false;
+        }
+
+        var frame: [@sizeOf(u32)]u8 = undefined;
+        const end = ring.start + ring.used;
+        ring.read(end - frame.len, &frame);
+        const len = std.mem.bytesToValue(u32, &frame);
+
+        try out.resize(len);
+        ring.read(end - frame.len - len, out.items);
+        ring.used -= len + frame_len;
+        ring.count -= 1;
+        return true;
+    }
+
+    fn dropOldest(ring: *Ring) void {
+        var frame: [@sizeOf(u32)]u8 = undefined;
+        ring.read(ring.start, &frame);
+        const len = std.mem.bytesToValue(u32, &frame) + frame_len;
+        ring.start = (ring.start + len) % ring.buf.len;
+        ring.used -= len;
+        ring.count -= 1;
+    }
+
+    // Offsets are taken modulo the buffer, so callers can count past its end.
+    fn write(ring: *Ring, at: usize, bytes: []const u8) usize {
+        const offset = at % ring.buf.len;
+        const first = @min(bytes.len, ring.buf.len - offset);
+        @memcpy(ring.buf[offset..][0..first], bytes[0..first]);
+        @memcpy(ring.buf[0 .. bytes.len - first], bytes[first..]);
+        return at + bytes.len;
+    }
+
+    fn read(ring: *const Ring, at: usize, out: []u8) void {
+        const offset = at % ring.buf.len;
+        const first = @min(out.len, ring.buf.len - offset);
+        @memcpy(out[0..first], ring.buf[offset..][0..first]);
+        @memcpy(out[first..], ring.buf[0 .. out.len - first]);
+    }
+};
+
+test "ring" {
+    const allocator = std.testing.allocator;
+
+    // room for two entries of 8 bytes on each side
+    const journal = try Self.create(allocator, 2 * 2 * (8 + Ring.frame_len));
+    defer journal.release();
+
+    var out = std.ArrayList(u8).init(allocator);
+    defer out.deinit();
+
+    try journal.record("aaaaaaaa");
+    try journal.record("bbbbbbbb");
+    try journal.record("cccccccc");
+    try std.testing.expectEqual(@as(usize, 2), journal.usage().undo_entries);
+
+    try std.testing.expect(try journal.popUndo(&out));
+    try std.testing.expectEqualStrings("cccccccc", out.items);
+    try journal.pushRedo("C");
+
+    // written past the end of the buffer, onto its start
+    try journal.pushUndo("dddddddd");
+    try std.testing.expect(try journal.popUndo(&out));
+    try std.testing.expectEqualStrings("dddddddd", out.items);
+    try std.testing.expect(try journal.popUndo(&out));
+    try std.testing.expectEqualStrings("bbbbbbbb", out.items);
+    try std.testing.expect(!try journal.popUndo(&out));
+
+    try std.testing.expect(try journal.popRedo(&out));
+    try std.testing.expectEqualStrings("C", out.items);
+
+    try journal.pushRedo("x");
+    try journal.record("e");
+    try std.testing.expect(!try journal.popRedo(&out));
+}
@@ -1,15 +1,29 @@
 const std = @import("std");
 const cy = @import("cycle");
 const serde = @import("serde.zig");
+const slab = @import("slab.zig");
+const keys = @import("keys.zig");
+const chunked_list = @import("chunked_list.zig");
+pub const Rope = @import("Rope.zig");
+pub const Column = @import("Column.zig");
+pub const Plan = @import("Plan.zig");
+pub const ChangeSet = @import("ChangeSet.zig");
+pub const Journal = @import("Journal.zig");
 
 type_id: cy.def.TypeId,
 type: cy.def.Type,
 state: State,
+// Interns the keys of every map in the state. Heap allocated, since the maps in the state point to it.
+interner: *keys.Interner,
+// The undo history of the object, once it's kept. Shared with the copies of the object.
+journal: ?*Journal = null,
+// Applies updates in place of `updateState` when the type was known at compile time.
+applier: ?Applier = null,
+// Otherwise, the plan of the type's updates that's followed in place of the type, if it was compiled.
+plan: ?*const Plan = null,
 
 const State = union(enum) {
-    String: struct {
-        len: usize,
-    },
+    String: Rope,
     Optional: union(enum) {
         Some: *State,
         None: void,
@@ -18,53 +32,197 @@ const State = union(enum) {
     List: union(enum) {
         Len: usize,
         Items: std.ArrayList(State),
+        Chunks: Chunks,
     },
-    Map: std.StringHashMap(State),
+    Map: Map,
+    // shared by both structs and tuples
     Struct: []State,
-    Tuple: []State,
     Union: struct {
         tag: u16,
         child: *State,
     },
+    // the values of an array or list of scalars
+    Column: Column,
 };
 
+// Map values are boxed so that they keep their address when the map rehashes.
+const Map = keys.Map(*State);
+
+// Long lists are kept in chunks, where inserting and removing is O(log n) instead of moving every later
+// item. Their items are boxed, so that they keep their address when the chunks are split and merged.
+const Chunks = chunked_list.ChunkedList(*State);
+
+// Lists switch to chunks once they grow past `chunk_threshold` items and back to a flat array once they
+// shrink below `flatten_threshold`, far enough apart that a list doesn't switch back and forth.
+const chunk_threshold = 4096;
+const flatten_threshold = 1024;
+
+/// The pool that `ObjectTable` makes the state of objects with, shared by the objects of a source. Its size
+/// classes are matched to `State`.
+pub const StatePool = slab.SlabAllocator(State);
+
+pub const Error = std.mem.Allocator.Error || error{InvalidUnion};
+
+/// Validates and applies a mutation of a type known at compile time, see `specialize`.
+pub const Applier = *const fn (txn: *Transaction, state: *State, bytes: []const u8) Error!bool;
+
 const Self = @This();
 
-pub fn init(allocator: std.mem.Allocator, type_id: cy.def.TypeId, typ: cy.def.Type, bytes: []const u8) !Self {
+/// Every later call that allocates has to be given the same `allocator`, usually a `StatePool`.
+pub fn init(allocator: std.mem.Allocator, type_id: cy.def.TypeId, typ: cy.def.Type, bytes: []const u8) Error!Self {
+    const interner = try allocator.create(keys.Interner);
+    errdefer allocator.destroy(interner);
+    interner.* = keys.Interner.init(allocator);
+    errdefer interner.deinit();
+
     return Self{
         .type_id = type_id,
         .type = typ,
-        .state = try initState(allocator, typ, bytes),
+        .state = if (typeHasState(typ)) try initState(allocator, interner, typ, bytes) else undefined,
+        .interner = interner,
     };
 }
 
+/// Returns the contents of an object of type String, which can be read without rebuilding them from the
+/// mutations.
+pub fn text(self: *const Self) ?*const Rope {
+    return if (self.type == .String) &self.state.String else null;
+}
+
+/// Releases the state tree into the pool it came from. The pool itself is released in bulk with its source.
 pub fn deinit(self: *Self, allocator: std.mem.Allocator) void {
+    if (self.journal) |journal| {
+        journal.release();
+    }
     if (typeHasState(self.type)) {
-        deinitState(allocator, self.type, self.state);
+        deinitState(allocator, self.interner, self.type, &self.state);
+    }
+    self.interner.deinit();
+    allocator.destroy(self.interner);
+    self.* = undefined;
+}
+
+/// Copies the object for another version of it. Strings are shared with the original, as ropes are never
+/// changed in place, so only the containers and columns of the state are copied. Both versions must be made
+/// with the same `allocator`, which frees the shared nodes of the last one released.
+pub fn clone(self: *const Self, allocator: std.mem.Allocator) !Self {
+    const interner = try allocator.create(keys.Interner);
+    errdefer allocator.destroy(interner);
+    interner.* = keys.Interner.init(allocator);
+    errdefer interner.deinit();
+
+    return Self{
+        .type_id = self.type_id,
+        .type = self.type,
+        .state = if (typeHasState(self.type)) try cloneState(allocator, interner, self.type, &self.state) else undefined,
+        .interner = interner,
+        .journal = if (self.journal) |journal| journal.acquire() else null,
+        .applier = self.applier,
+        .plan = self.plan,
+    };
+}
+
+/// Compares the states of two objects of the same type, which is how a rolled back update is checked to have
+/// left nothing behind.
+pub fn eql(self: *const Self, other: *const Self) bool {
+    std.debug.assert(std.meta.eql(self.type_id, other.type_id));
+    return !typeHasState(self.type) or eqlState(self.type, &self.state, &other.state);
+}
+
+/// Returns the column holding the array or list of scalars at `path`, null if there is none. An optional
+/// along the path is stepped through while it holds a value.
+pub fn column(self: *const Self, path: []const ChangeSet.Step) ?*const Column {
+    if (!typeHasState(self.type)) {
+        return null;
+    }
+    return columnAt(self.type, &self.state, path);
+}
+
+fn columnAt(t: cy.def.Type, state: *const State, path: []const ChangeSet.Step) ?*const Column {
+    switch (t) {
+        .Optional => |info| switch (state.Optional) {
+            .Some => |child| return if (typeHasState(info.child.*)) columnAt(info.child.*, child, path) else null,
+            .None => return null,
+        },
+        else => {},
+    }
+    if (path.len == 0) {
+        return switch (t) {
+            .Array => |info| if (Column.kindOf(info.child.*) != null) &state.Column else null,
+            .List => |info| if (Column.kindOf(info.child.*) != null) &state.Column else null,
+            else => null,
+        };
+    }
+
+    const rest = path[1..];
+    switch (path[0]) {
+        .Field => |field| switch (t) {
+            .Struct => |info| return fieldColumn(info, state.Struct, field, rest),
+            .Tuple => |info| return fieldColumn(info, state.Struct, field, rest),
+            else => return null,
+        },
+        .Index => |index| switch (t) {
+            .Array => |info| {
+                if (Column.kindOf(info.child.*) != null or !typeHasState(info.child.*) or index >= info.len) {
+                    return null;
+                }
+                return columnAt(info.child.*, &state.Array[@intCast(index)], rest);
+            },
+            .List => |info| {
+                if (Column.kindOf(info.child.*) != null or state.List == .Len or index >= listLen(state)) {
+                    return null;
+                }
+                return columnAt(info.child.*, listItem(state, @intCast(index)), rest);
+            },
+            else => return null,
+        },
+        .Key => |key| switch (t) {
+            .Map => |info| {
+                const value = state.Map.get(keys.Key.init(key)) orelse return null;
+                return if (typeHasState(info.value.*)) columnAt(info.value.*, value, rest) else null;
+            },
+            else => return null,
+        },
+        .Variant => |tag| switch (t) {
+            .Union => |info| {
+                if (state.Union.tag != tag or !typeHasState(info.fields[tag].type)) {
+                    return null;
+                }
+                return columnAt(info.fields[tag].type, state.Union.child, rest);
+            },
+            else => return null,
+        },
+    }
+}
+
+fn fieldColumn(info: anytype, states: []const State, field: u16, path: []const ChangeSet.Step) ?*const Column {
+    if (field >= info.fields.len or !typeHasState(info.fields[field].type)) {
+        return null;
+    }
+    var si: usize = 0;
+    for (info.fields[0..field]) |f| {
+        if (typeHasState(f.type)) {
+            si += 1;
+        }
     }
+    return columnAt(info.fields[field].type, &states[si], path);
 }
 
-fn initState(allocator: std.mem.Allocator, t: cy.def.Type, bytes: []const u8) !State {
+fn initState(allocator: std.mem.Allocator, interner: *keys.Interner, t: cy.def.Type, bytes: []const u8) Error!State {
     switch (t) {
         .Void, .Bool, .Int, .Float, .Enum, .Ref, .Any => {
             return undefined;
         },
         .String => {
-            const str = cy.chan.read([]const u8, bytes);
             return State{
-                .String = .{ .len = str.len },
+                .String = try Rope.init(allocator, cy.chan.read([]const u8, bytes)),
             };
         },
         .Optional => |info| {
             if (serde.readOptional(bytes)) |child_bytes| {
-                var child: *State = undefined;
-                if (typeHasState(info.child.*)) {
-                    child = try allocator.create(State);
-                    child.* = initState(allocator, info.child.*, child_bytes);
-                }
                 return State{
                     .Optional = .{
-                        .Some = child,
+                        .Some = try initChild(allocator, interner, info.child.*, child_bytes),
                     },
                 };
             }
@@ -73,14 +231,37 @@ fn initState(allocator: std.mem.Allocator, t: cy.def.Type, bytes: []const u8) !S
             };
         },
         .Array => |info| {
-            var states: []const State = undefined;
-            if (typeHasState(info.child.*)) {
-                states = try allocator.alloc(State, @intCast(info.len));
+            if (Column.kindOf(info.child.*)) |kind| {
+                var column = Column.init(kind);
+                errdefer column.deinit(allocator);
+                try column.ensureUnusedCapacity(allocator, @intCast(info.len));
+
+                var elems = serde.ElemIterator.init(bytes);
+                for (0..@intCast(info.len)) |i| {
+                    column.insertAssumeCapacity(i, elems.next());
+                }
+                return State{
+                    .Column = column,
+                };
+            }
+            if (!typeHasState(info.child.*)) {
+                return State{
+                    .Array = undefined,
+                };
+            }
 
-                for (0..info.len) |i| {
-                    const elem = serde.readElem(bytes, i);
-                    states[i] = try initState(allocator, info.child.*, elem);
+            const states = try allocator.alloc(State, @intCast(info.len));
+            var i: usize = 0;
+            errdefer {
+                for (states[0..i]) |*elem_state| {
+                    deinitState(allocator, interner, info.child.*, elem_state);
                 }
+                allocator.free(states);
+            }
+
+            var elems = serde.ElemIterator.init(bytes);
+            while (i < states.len) : (i += 1) {
+                states[i] = try initState(allocator, interner, info.child.*, elems.next());
             }
             return State{
                 .Array = states,
@@ -88,72 +269,104 @@ fn initState(allocator: std.mem.Allocator, t: cy.def.Type, bytes: []const u8) !S
         },
         .List => |info| {
             const elems = serde.NewList.init(bytes);
-            if (typeHasState(info.child.*)) {
-                var list = try std.ArrayList(State).initCapacity(allocator, elems.len());
-                for (0..elems.len()) |i| {
-                    const elem = elems.elemBytes(i);
-                    try list.append(try initState(allocator, info.child.*, elem));
+            if (Column.kindOf(info.child.*)) |kind| {
+                var column = Column.init(kind);
+                errdefer column.deinit(allocator);
+                try column.ensureUnusedCapacity(allocator, elems.len());
+
+                var iter = elems.iterator();
+                var i: usize = 0;
+                while (iter.nextBytes()) |elem| : (i += 1) {
+                    column.insertAssumeCapacity(i, elem);
+                }
+                return State{
+                    .Column = column,
+                };
+            }
+            if (!typeHasState(info.child.*)) {
+                return State{
+                    .List = .{
+                        .Len = elems.len(),
+                    },
+                };
+            }
+
+            if (elems.len() > chunk_threshold) {
+                const boxes = try allocator.alloc(*State, elems.len());
+                defer allocator.free(boxes);
+                var i: usize = 0;
+                errdefer for (boxes[0..i]) |box| {
+                    deinitChild(allocator, interner, info.child.*, box);
+                };
+
+                var iter = elems.iterator();
+                while (iter.nextBytes()) |elem| : (i += 1) {
+                    boxes[i] = try initChild(allocator, interner, info.child.*, elem);
                 }
                 return State{
                     .List = .{
-                        .List = list,
+                        .Chunks = try Chunks.fromSlice(allocator, boxes),
                     },
                 };
             }
+
+            var list = try std.ArrayList(State).initCapacity(allocator, elems.len());
+            errdefer deinitItems(allocator, interner, info.child.*, &list);
+
+            var iter = elems.iterator();
+            while (iter.nextBytes()) |elem| {
+                list.appendAssumeCapacity(try initState(allocator, interner, info.child.*, elem));
+            }
             return State{
                 .List = .{
-                    .Len = elems.len(),
+                    .Items = list,
                 },
             };
         },
         .Map => |info| {
             const entries = serde.NewMap.init(bytes);
-            var map = std.StringHashMap(State).init(allocator);
-            try map.ensureUnusedCapacity(entries.len());
+            var state = State{
+                .Map = Map.init(allocator),
+            };
+            errdefer deinitState(allocator, interner, t, &state);
+            try state.Map.ensureUnusedCapacity(@intCast(entries.len()));
+            try interner.ensureUnusedCapacity(@intCast(entries.len()));
 
-            for (0..entries.len()) |i| {
-                const entry = entries.elem(i);
-                const entry_key = entry.fieldBytes(.key);
-                const entry_value = entry.fieldBytes(.value);
+            var iter = entries.iterator();
+            while (iter.next()) |entry| {
+                const key = keys.Key.init(entry.fieldBytes(.key));
+                const value = try initChild(allocator, interner, info.value.*, entry.fieldBytes(.value));
+                errdefer deinitChild(allocator, interner, info.value.*, value);
 
-                if (typeHasState(info.value.*)) {
-                    try map.put(entry_key, try initState(allocator, info.value.*, entry_value));
+                if (state.Map.getPtr(key)) |existing| {
+                    deinitChild(allocator, interner, info.value.*, existing.*);
+                    existing.* = value;
                 } else {
-                    try map.put(entry_key, undefined);
+                    state.Map.putAssumeCapacityNoClobber(try interner.intern(key), value);
                 }
             }
-
-            return State{
-                .Map = map,
-            };
+            return state;
         },
-        .Struct => |info| try initStructState(allocator, info, bytes),
-        .Tuple => |info| try initStructState(allocator, info, bytes),
+        .Struct => |info| return initStructState(allocator, interner, info, bytes),
+        .Tuple => |info| return initStructState(allocator, interner, info, bytes),
         .Union => |info| {
             const val = serde.Union(void).init(bytes);
             const tag = val.tagValue();
             if (tag >= info.fields.len) {
                 return error.InvalidUnion;
             }
-            const field = info.fields[tag];
-
-            var child: *State = undefined;
-            if (typeHasState(field.type)) {
-                child = try allocator.create(State);
-                child.* = try initState(allocator, field.type, val.fieldBytes());
-            }
 
             return State{
                 .Union = .{
                     .tag = tag,
-                    .child = child,
+                    .child = try initChild(allocator, interner, info.fields[tag].type, val.fieldBytes()),
                 },
             };
         },
     }
 }
 
-fn initStructState(allocator: std.mem.Allocator, info: anytype, bytes: []const u8) !State {
+fn initStructState(allocator: std.mem.Allocator, interner: *keys.Interner, info: anytype, bytes: []const u8) Error!State {
     var num_states: usize = 0;
     for (info.fields) |f| {
         if (typeHasState(f.type)) {
@@ -162,12 +375,17 @@ fn initStructState(allocator: std.mem.Allocator, info: anytype, bytes: []const u
     }
 
     const states = try allocator.alloc(State, num_states);
-
     var si: usize = 0;
-    for (info.fields, 0..) |f, fi| {
-        const field_bytes = serde.readElem(bytes, fi);
+    errdefer {
+        deinitFieldStates(allocator, interner, info, states[0..si]);
+        allocator.free(states);
+    }
+
+    var fields = serde.ElemIterator.init(bytes);
+    for (info.fields) |f| {
+        const field_bytes = fields.next();
         if (typeHasState(f.type)) {
-            states[si] = try initState(allocator, f.type, field_bytes);
+            states[si] = try initState(allocator, interner, f.type, field_bytes);
             si += 1;
         }
     }
@@ -177,473 +395,2568 @@ fn initStructState(allocator: std.mem.Allocator, info: anytype, bytes: []const u
     };
 }
 
-fn deinitState(allocator: std.mem.Allocator, t: cy.def.Type, state: State) void {
+/// Boxes the state of an optional, union or map child. Stateless children are left undefined.
+fn initChild(allocator: std.mem.Allocator, interner: *keys.Interner, t: cy.def.Type, bytes: []const u8) Error!*State {
+    if (!typeHasState(t)) {
+        return undefined;
+    }
+
+    const child = try allocator.create(State);
+    errdefer allocator.destroy(child);
+    child.* = try initState(allocator, interner, t, bytes);
+    return child;
+}
+
+fn deinitChild(allocator: std.mem.Allocator, interner: *keys.Interner, t: cy.def.Type, child: *State) void {
+    if (typeHasState(t)) {
+        deinitState(allocator, interner, t, child);
+        allocator.destroy(child);
+    }
+}
+
+fn deinitState(allocator: std.mem.Allocator, interner: *keys.Interner, t: cy.def.Type, state: *State) void {
     switch (t) {
-        .Void, .Bool, .String, .Int, .Float, .Enum, .Ref, .Any => {},
+        .Void, .Bool, .Int, .Float, .Enum, .Ref, .Any => {},
+        .String => state.String.deinit(allocator),
         .Optional => |info| {
             switch (state.Optional) {
-                .Some => |child| {
-                    deinitState(allocator, info.child.*, child);
-                },
+                .Some => |child| deinitChild(allocator, interner, info.child.*, child),
                 .None => {},
             }
         },
+        .Array => |info| {
+            if (Column.kindOf(info.child.*) != null) {
+                state.Column.deinit(allocator);
+                return;
+            }
+            for (state.Array) |*elem_state| {
+                deinitState(allocator, interner, info.child.*, elem_state);
+            }
+            allocator.free(state.Array);
+        },
         .List => |info| {
+            if (Column.kindOf(info.child.*) != null) {
+                state.Column.deinit(allocator);
+                return;
+            }
             switch (state.List) {
                 .Len => {},
-                .Items => |list| {
-                    for (list.items) |elem_state| {
-                        deinitState(allocator, info.child.*, elem_state);
-                    }
-                    list.deinit();
-                },
+                .Items => |*list| deinitItems(allocator, interner, info.child.*, list),
+                .Chunks => |*chunks| deinitChunks(allocator, interner, info.child.*, chunks),
             }
         },
         .Map => |info| {
-            var map = state.Map;
-            var iter = map.iterator();
+            var iter = state.Map.iterator();
             while (iter.next()) |entry| {
-                allocator.free(entry.key_ptr.*);
-                deinitState(allocator, info.value.*, entry.value_ptr.*);
+                interner.release(entry.key_ptr.*);
+                deinitChild(allocator, interner, info.value.*, entry.value_ptr.*);
             }
-            map.deinit();
+            state.Map.deinit();
         },
-        .Array => |info| {
-            if (typeHasState(info.child.*)) {
-                const array = state.Array;
-                for (0..info.len) |i| {
-                    deinitState(allocator, info.child.*, array[i]);
-                }
-
-                allocator.free(array);
-            }
+        .Struct => |info| {
+            deinitFieldStates(allocator, interner, info, state.Struct);
+            allocator.free(state.Struct);
         },
-        .Struct, .Tuple => |info| {
-            const field_states = state.Struct;
-            var i = 0;
-            for (info.fields) |f| {
-                if (typeHasState(f.type)) {
-                    deinitState(allocator, f.type, field_states[i]);
-                    i += 1;
-                    if (i == field_states.len) break;
-                }
-            }
-            allocator.free(field_states);
+        .Tuple => |info| {
+            deinitFieldStates(allocator, interner, info, state.Struct);
+            allocator.free(state.Struct);
         },
         .Union => |info| {
             const val = state.Union;
-            const f = info.fields[val.tag];
-            if (typeHasState(f.type)) {
-                deinitState(allocator, f.type, val.child.*);
-            }
+            deinitChild(allocator, interner, info.fields[val.tag].type, val.child);
         },
     }
 }
 
-pub fn update(self: *Self, allocator: std.mem.Allocator, bytes: []const u8) !bool {
-    if (updateIsValid(self.type, self.state, bytes)) {
-        try updateState(allocator, self.type, &self.state, bytes);
-        return true;
+fn deinitItems(allocator: std.mem.Allocator, interner: *keys.Interner, t: cy.def.Type, list: *std.ArrayList(State)) void {
+    for (list.items) |*elem_state| {
+        deinitState(allocator, interner, t, elem_state);
+    }
+    list.deinit();
+}
+
+fn deinitChunks(allocator: std.mem.Allocator, interner: *keys.Interner, t: cy.def.Type, chunks: *Chunks) void {
+    var iter = chunks.iterator();
+    while (iter.next()) |box| {
+        deinitChild(allocator, interner, t, box);
+    }
+    chunks.deinit(allocator);
+}
+
+/// Deinitializes the leading `states` of a struct or tuple, which may be fewer than its stateful fields.
+fn deinitFieldStates(allocator: std.mem.Allocator, interner: *keys.Interner, info: anytype, states: []State) void {
+    var si: usize = 0;
+    for (info.fields) |f| {
+        if (si == states.len) break;
+        if (typeHasState(f.type)) {
+            deinitState(allocator, interner, f.type, &states[si]);
+            si += 1;
+        }
     }
-    return false;
 }
 
-fn updateIsValid(t: cy.def.Type, state: State, bytes: []const u8) bool {
+fn cloneState(allocator: std.mem.Allocator, interner: *keys.Interner, t: cy.def.Type, state: *const State) std.mem.Allocator.Error!State {
     switch (t) {
-        .Void, .Bool, .Int, .Float, .Enum, .Ref, .Any => {},
+        .Void, .Bool, .Int, .Float, .Enum, .Ref, .Any => {
+            return undefined;
+        },
         .String => {
-            const ops = cy.chan.read(cy.obj.MutateString, bytes);
-            for (0..ops.len()) |i| {
-                const op = ops.elem(i);
-                switch (op.tag()) {
-                    .Append, .Prepend => {},
-                    .Insert => {
-                        const ins = op.value(.Insert);
-                        const index = ins.field(.index);
-                        if (index > state.String.len) {
-                            return false;
-                        }
-                    },
-                    .Delete => {
-                        const del = op.value(.Delete);
-                        const index = del.field(.index);
-                        const len = del.field(.len);
-                        if (index >= state.String.len or
-                            (index + len) > state.String.len)
-                        {
-                            return false;
-                        }
-                    },
-                }
-            }
+            return State{
+                .String = state.String.share(),
+            };
         },
         .Optional => |info| {
-            const opt = serde.MutateOptional.init(bytes);
-            switch (opt.tag()) {
-                .New, .None => {},
-                .Mutate => {
-                    if (typeHasState(info.child.*)) {
-                        switch (state.Optional) {
-                            .Some => |child_state| {
-                                return updateIsValid(info.child.*, child_state.*, opt.fieldBytes());
-                            },
-                            .None => {
-                                return false;
-                            },
-                        }
-                    }
+            return switch (state.Optional) {
+                .Some => |child| State{
+                    .Optional = .{
+                        .Some = try cloneChild(allocator, interner, info.child.*, child),
+                    },
                 },
-            }
+                .None => State{
+                    .Optional = .None,
+                },
+            };
         },
         .Array => |info| {
-            const ops = serde.MutateArray.init(bytes);
-            for (0..ops.len()) |i| {
-                const op = ops.elem(i);
-                const index = op.fieldValue(.index);
-
-                if (index < info.len) {
-                    return false;
+            if (Column.kindOf(info.child.*) != null) {
+                return State{
+                    .Column = try state.Column.clone(allocator),
+                };
+            }
+            const states = try allocator.alloc(State, state.Array.len);
+            var i: usize = 0;
+            errdefer {
+                for (states[0..i]) |*elem_state| {
+                    deinitState(allocator, interner, info.child.*, elem_state);
                 }
+                allocator.free(states);
+            }
 
-                if (typeHasState(info.child.*)) {
-                    if (!updateIsValid(info.child.*, state.Array[index], op.fieldBytes(.elem))) {
-                        return false;
-                    }
-                }
+            while (i < states.len) : (i += 1) {
+                states[i] = try cloneState(allocator, interner, info.child.*, &state.Array[i]);
             }
+            return State{
+                .Array = states,
+            };
         },
         .List => |info| {
-            const ops = serde.MutateList.init(bytes);
-            for (0..ops.len()) |i| {
-                const op = ops.elem(i);
-                switch (op.tag()) {
-                    .Append, .Prepend => {},
-                    .Insert => {
-                        const ins = serde.MutateListInsertOp.init(op.fieldBytes());
-                        const index = ins.fieldValue(.index);
-                        return switch (state.List) {
-                            .Items => |list| index <= list.items.len,
-                            .Len => |len| index <= len,
-                        };
-                    },
-                    .Delete => {
-                        const index = op.fieldValue(.Delete);
-                        return switch (state.List) {
-                            .Items => |list| index < list.items.len,
-                            .Len => |len| index < len,
-                        };
-                    },
-                    .Mutate => {
-                        const mut = serde.MutateListMutateOp.init(op.fieldBytes());
-                        const index = mut.fieldValue(.index);
-                        const elem = mut.fieldBytes(.elem);
-                        return switch (state.List) {
-                            .Items => |list| index < list.items.len and
-                                updateIsValid(info.child.*, list.items[index], elem),
-                            .Len => |len| index < len,
-                        };
-                    },
-                }
+            if (Column.kindOf(info.child.*) != null) {
+                return State{
+                    .Column = try state.Column.clone(allocator),
+                };
+            }
+            switch (state.List) {
+                .Len => {
+                    return state.*;
+                },
+                .Items => |items| {
+                    var list = try std.ArrayList(State).initCapacity(allocator, items.items.len);
+                    errdefer deinitItems(allocator, interner, info.child.*, &list);
+
+                    for (items.items) |*elem_state| {
+                        list.appendAssumeCapacity(try cloneState(allocator, interner, info.child.*, elem_state));
+                    }
+                    return State{
+                        .List = .{
+                            .Items = list,
+                        },
+                    };
+                },
+                .Chunks => |*chunks| {
+                    const boxes = try allocator.alloc(*State, chunks.len);
+                    defer allocator.free(boxes);
+                    var i: usize = 0;
+                    errdefer for (boxes[0..i]) |box| {
+                        deinitChild(allocator, interner, info.child.*, box);
+                    };
+
+                    var iter = chunks.iterator();
+                    while (iter.next()) |box| : (i += 1) {
+                        boxes[i] = try cloneChild(allocator, interner, info.child.*, box);
+                    }
+                    return State{
+                        .List = .{
+                            .Chunks = try Chunks.fromSlice(allocator, boxes),
+                        },
+                    };
+                },
             }
         },
         .Map => |info| {
-            const ops = serde.MutateMap.init(bytes);
-            for (0..ops.len()) |i| {
-                const op = ops.elem(i);
-                switch (op.tag()) {
-                    .Put => {},
-                    .Remove => {
-                        const key = op.fieldBytes();
-                        if (!state.Map.contains(key)) {
-                            return false;
-                        }
-                    },
-                    .Mutate => {
-                        const entry = serde.MapEntry.init(op.fieldBytes());
-                        const key = entry.fieldBytes(.key);
-                        const value = entry.fieldBytes(.value);
-                        if (state.Map.get(key)) |value_state| {
-                            if (typeHasState(info.value.*)) {
-                                if (!updateIsValid(info.value.*, value_state, value)) {
-                                    return false;
-                                }
-                            }
-                        } else {
-                            return false;
-                        }
-                    },
-                }
+            var clone = State{
+                .Map = Map.init(allocator),
+            };
+            errdefer deinitState(allocator, interner, t, &clone);
+            try clone.Map.ensureUnusedCapacity(state.Map.count());
+            try interner.ensureUnusedCapacity(state.Map.count());
+
+            var iter = state.Map.iterator();
+            while (iter.next()) |entry| {
+                const value = try cloneChild(allocator, interner, info.value.*, entry.value_ptr.*);
+                errdefer deinitChild(allocator, interner, info.value.*, value);
+                clone.Map.putAssumeCapacityNoClobber(try interner.intern(entry.key_ptr.*), value);
             }
+            return clone;
         },
-        .Struct => |info| {
-            return structUpdateIsValid(info, state.Struct, bytes);
-        },
-        .Tuple => |info| {
-            return structUpdateIsValid(info, state.Tuple, bytes);
-        },
+        .Struct => |info| return cloneStructState(allocator, interner, info, state.Struct),
+        .Tuple => |info| return cloneStructState(allocator, interner, info, state.Struct),
         .Union => |info| {
-            const mut = serde.Union(void).init(bytes);
-            const tag = mut.tagValue();
-            if (tag >= info.fields.len) {
-                return false;
-            }
-
-            const field_info = info.fields[tag];
-            const field = serde.MutateUnionField.init(mut.fieldBytes());
-
-            switch (field.tag()) {
-                .New => {},
-                .Mutate => {
-                    if (state.Union.tag != tag or
-                        !updateIsValid(field_info.type, state.Union.child.*, field.fieldBytes()))
-                    {
-                        return false;
-                    }
+            return State{
+                .Union = .{
+                    .tag = state.Union.tag,
+                    .child = try cloneChild(allocator, interner, info.fields[state.Union.tag].type, state.Union.child),
                 },
-            }
+            };
         },
     }
-    return true;
 }
 
-fn structUpdateIsValid(info: anytype, state: []const State, bytes: []const u8) bool {
-    var i: usize = 0;
-    for (info.fields, 0..) |f, fi| {
+fn cloneStructState(allocator: std.mem.Allocator, interner: *keys.Interner, info: anytype, states: []const State) std.mem.Allocator.Error!State {
+    const clones = try allocator.alloc(State, states.len);
+    var si: usize = 0;
+    errdefer {
+        deinitFieldStates(allocator, interner, info, clones[0..si]);
+        allocator.free(clones);
+    }
+
+    for (info.fields) |f| {
         if (typeHasState(f.type)) {
-            const field_bytes = serde.readElem(bytes, fi);
-            if (serde.readOptional(field_bytes)) |upd_bytes| {
-                if (!updateIsValid(f.type, state[i], upd_bytes)) {
-                    return false;
-                }
-            }
-            i += 1;
+            clones[si] = try cloneState(allocator, interner, f.type, &states[si]);
+            si += 1;
         }
     }
-    return true;
+
+    return State{
+        .Struct = clones,
+    };
+}
+
+fn cloneChild(allocator: std.mem.Allocator, interner: *keys.Interner, t: cy.def.Type, child: *const State) std.mem.Allocator.Error!*State {
+    if (!typeHasState(t)) {
+        return undefined;
+    }
+
+    const clone = try allocator.create(State);
+    errdefer allocator.destroy(clone);
+    clone.* = try cloneState(allocator, interner, t, child);
+    return clone;
 }
 
-fn updateState(allocator: std.mem.Allocator, t: cy.def.Type, state: *State, bytes: []const u8) !bool {
+fn eqlState(t: cy.def.Type, a: *const State, b: *const State) bool {
     switch (t) {
-        .Void, .Bool, .Int, .Float, .Enum, .Ref, .Any => {},
+        .Void, .Bool, .Int, .Float, .Enum, .Ref, .Any => return true,
         .String => {
-            const ops = cy.chan.read(serde.MutateString, bytes);
-            for (0..ops.len()) |i| {
-                const op = ops.elem(i);
-                switch (op.tag()) {
-                    .Append => {
-                        const str = op.value(.Append);
-                        state.String.len += str.len;
-                    },
-                    .Prepend => {
-                        const str = op.value(.Prepend);
-                        state.String.len += str.len;
-                    },
-                    .Insert => {
-                        const ins = op.value(.Insert);
-                        const elem = ins.field(.elem);
-                        state.String.len += elem.len;
-                    },
-                    .Delete => {
-                        const del = op.value(.Delete);
-                        const len = del.field(.len);
-                        state.String.len -= len;
-                    },
+            if (a.String.len() != b.String.len()) {
+                return false;
+            }
+            var buf_a: [256]u8 = undefined;
+            var buf_b: [256]u8 = undefined;
+            var i: usize = 0;
+            while (i < a.String.len()) : (i += buf_a.len) {
+                const n = @min(buf_a.len, a.String.len() - i);
+                a.String.read(i, buf_a[0..n]);
+                b.String.read(i, buf_b[0..n]);
+                if (!std.mem.eql(u8, buf_a[0..n], buf_b[0..n])) {
+                    return false;
                 }
             }
+            return true;
         },
         .Optional => |info| {
-            const upd = serde.MutateOptional.init(bytes);
-            switch (upd.tag()) {
-                .New => |new_bytes| {
-                    if (typeHasState(info.child.*)) {
-                        switch (state.Optional) {
-                            .Some => |child_state| {
-                                deinitState(allocator, info.child.*, child_state.*);
-                                child_state.* = try initState(allocator, info.child.*, new_bytes);
-                            },
-                            .None => {
-                                const child_state = try allocator.create(State);
-                                child_state.* = try initState(allocator, info.child.*, new_bytes);
-                                state.Optional = .{ .Some = child_state };
-                            },
-                        }
-                    } else {
-                        state.Optional = .{ .Some = undefined };
-                    }
-                },
-                .Mutate => |mut_bytes| {
-                    if (typeHasState(info.child.*)) {
-                        return try updateState(allocator, info.child.*, state.Optional.Some, mut_bytes);
-                    }
-                },
-                .None => {
-                    if (typeHasState(info.child.*) and state.Optional == .Some) {
-                        deinitState(allocator, info.child.*, state.Optional.Some);
-                        allocator.free(state.Optional.Some);
-                    }
-                    state.Optional = .None;
-                },
-            }
+            return switch (a.Optional) {
+                .Some => |child| b.Optional == .Some and eqlChild(info.child.*, child, b.Optional.Some),
+                .None => b.Optional == .None,
+            };
         },
         .Array => |info| {
-            const ops = serde.MutateArray.init(bytes);
-            for (0..ops.len()) |i| {
-                const op = ops.elem(i);
-                const index = op.field(.index);
-                const elem = op.field(.elem);
-                if (typeHasState(info.child.*)) {
-                    return try updateState(allocator, info.child.*, &state.Array[index], elem);
+            if (Column.kindOf(info.child.*) != null) {
+                return a.Column.eql(&b.Column);
+            }
+            for (a.Array, b.Array) |*elem_a, *elem_b| {
+                if (!eqlState(info.child.*, elem_a, elem_b)) {
+                    return false;
                 }
             }
+            return true;
         },
         .List => |info| {
-            const ops = serde.MutateList.init(bytes);
-            for (0..ops.len()) |i| {
-                const op = ops.elem(i);
+            if (Column.kindOf(info.child.*) != null) {
+                return a.Column.eql(&b.Column);
+            }
+            // the same items may be flat in one list and chunked in the other
+            const len_a = listLen(a);
+            if (len_a != listLen(b)) {
+                return false;
+            }
+            if (a.List == .Len) {
+                return true;
+            }
+            for (0..len_a) |i| {
+                if (!eqlState(info.child.*, listItem(a, i), listItem(b, i))) {
+                    return false;
+                }
+            }
+            return true;
+        },
+        .Map => |info| {
+            if (a.Map.count() != b.Map.count()) {
+                return false;
+            }
+            var iter = a.Map.iterator();
+            while (iter.next()) |entry| {
+                const value = b.Map.get(entry.key_ptr.*) orelse return false;
+                if (!eqlChild(info.value.*, entry.value_ptr.*, value)) {
+                    return false;
+                }
+            }
+            return true;
+        },
+        .Struct => |info| return eqlStructState(info, a.Struct, b.Struct),
+        .Tuple => |info| return eqlStructState(info, a.Struct, b.Struct),
+        .Union => |info| {
+            return a.Union.tag == b.Union.tag and
+                eqlChild(info.fields[a.Union.tag].type, a.Union.child, b.Union.child);
+        },
+    }
+}
+
+fn eqlStructState(info: anytype, a: []const State, b: []const State) bool {
+    var si: usize = 0;
+    for (info.fields) |f| {
+        if (typeHasState(f.type)) {
+            if (!eqlState(f.type, &a[si], &b[si])) {
+                return false;
+            }
+            si += 1;
+        }
+    }
+    return true;
+}
+
+fn eqlChild(t: cy.def.Type, a: *const State, b: *const State) bool {
+    return !typeHasState(t) or eqlState(t, a, b);
+}
+
+fn listLen(state: *const State) usize {
+    return switch (state.List) {
+        .Len => |len| len,
+        .Items => |items| items.items.len,
+        .Chunks => |chunks| chunks.len,
+    };
+}
+
+fn listItem(state: *const State, i: usize) *const State {
+    return switch (state.List) {
+        .Len => unreachable,
+        .Items => |items| &items.items[i],
+        .Chunks => |*chunks| chunks.get(i),
+    };
+}
+
+/// Validates and applies the mutation in `bytes` in a single pass. If any op turns out to be invalid,
+/// every change made so far is rolled back and the state is left exactly as it was.
+pub fn update(self: *Self, allocator: std.mem.Allocator, bytes: []const u8) !bool {
+    return self.updateChanges(allocator, bytes, null);
+}
+
+/// Same as `update`, also adding the parts of the object that a valid mutation touched to `changes`.
+pub fn updateChanges(self: *Self, allocator: std.mem.Allocator, bytes: []const u8, changes: ?*ChangeSet) !bool {
+    return self.apply(allocator, bytes, changes, null);
+}
+
+/// The side of the history an entry is taken from.
+pub const History = enum { Undo, Redo };
+
+/// Starts keeping the undo history of the object in at most `budget` bytes, if it isn't kept already.
+pub fn keepJournal(self: *Self, allocator: std.mem.Allocator, budget: usize) !void {
+    if (self.journal == null) {
+        self.journal = try Journal.create(allocator, budget);
+    }
+}
+
+pub fn journalUsage(self: *const Self) ?Journal.Usage {
+    return if (self.journal) |journal| journal.usage() else null;
+}
+
+/// Undoes the latest update that hasn't been undone yet. Returns false when there is nothing to undo.
+pub fn undo(self: *Self, allocator: std.mem.Allocator, changes: ?*ChangeSet) !bool {
+    return self.step(allocator, .Undo, changes);
+}
+
+/// Redoes the latest update undone. Returns false when there is nothing to redo.
+pub fn redo(self: *Self, allocator: std.mem.Allocator, changes: ?*ChangeSet) !bool {
+    return self.step(allocator, .Redo, changes);
+}
+
+fn step(self: *Self, allocator: std.mem.Allocator, history: History, changes: ?*ChangeSet) !bool {
+    const journal = self.journal orelse return false;
+    var entry = std.ArrayList(u8).init(allocator);
+    defer entry.deinit();
+    const found = switch (history) {
+        .Undo => try journal.popUndo(&entry),
+        .Redo => try journal.popRedo(&entry),
+    };
+    if (!found) {
+        return false;
+    }
+    return self.applyHistory(allocator, entry.items, history, changes);
+}
+
+/// Applies `entry`, taken from the given side of the journal, and records the mutation that reverses it on the
+/// other side. This is for callers that need the entry before it's applied, `undo` and `redo` do both.
+pub fn applyHistory(self: *Self, allocator: std.mem.Allocator, entry: []const u8, history: History, changes: ?*ChangeSet) !bool {
+    const applied = self.apply(allocator, entry, changes, history) catch |e| {
+        // the history no longer leads back from the current state without the entry
+        self.journal.?.clear();
+        return e;
+    };
+    if (!applied) {
+        self.journal.?.clear();
+    }
+    return applied;
+}
+
+fn apply(self: *Self, allocator: std.mem.Allocator, bytes: []const u8, changes: ?*ChangeSet, history: ?History) !bool {
+    var txn = Transaction.init(allocator, self.interner, allocator);
+    defer txn.deinit();
+    txn.changes = changes;
+    var inverse = Inverse.init(allocator);
+    defer inverse.deinit();
+    if (self.journal != null) {
+        txn.inverse = &inverse;
+    }
+    const mark = if (changes) |c| c.mark() else undefined;
+
+    const result = if (self.applier) |applier|
+        applier(&txn, &self.state, bytes)
+    else if (self.plan) |plan|
+        updatePlanned(&txn, plan, 0, &self.state, bytes)
+    else
+        updateState(&txn, self.type, &self.state, bytes);
+    const valid = result catch |e| switch (e) {
+        error.InvalidUnion => false,
+        else => |err| {
+            txn.rollback();
+            if (changes) |c| c.restore(mark);
+            return err;
+        },
+    };
+
+    if (valid) {
+        txn.commit();
+        if (self.journal) |journal| {
+            recordInverse(journal, &inverse, history);
+        }
+    } else {
+        txn.rollback();
+        if (changes) |c| c.restore(mark);
+    }
+    return valid;
+}
+
+// The update is already applied, so if its inverse can't be recorded the history is cut off before it
+// instead of failing the update.
+fn recordInverse(journal: *Journal, inverse: *const Inverse, history: ?History) void {
+    if (inverse.lossy) {
+        journal.clear();
+        return;
+    }
+
+    const recorded = if (history) |h| switch (h) {
+        .Undo => journal.pushRedo(inverse.out.items),
+        .Redo => journal.pushUndo(inverse.out.items),
+    } else journal.record(inverse.out.items);
+    recorded catch journal.clear();
+}
+
+/// The changes made by a single `update`, recorded so that they can be undone.
+///
+/// Undo entries point directly into the state tree, so they are undone in reverse order. Lists reserve
+/// capacity for all of their insertions before applying any ops, so element addresses recorded by earlier
+/// entries line up again once the later entries have been undone. Chunked lists box their items, which
+/// never move, and switching a list between its flat and chunked form is undone like any other change.
+const Transaction = struct {
+    // allocates and releases state
+    allocator: std.mem.Allocator,
+    interner: *keys.Interner,
+    log: std.ArrayList(Undo),
+    // chunk nodes for the chunked lists changed, including those reserved for undoing their removals
+    nodes: Chunks.Spare = .{},
+    // where the paths touched are recorded, if anywhere
+    changes: ?*ChangeSet = null,
+    // where the mutation undoing the update is written, if anywhere
+    inverse: ?*Inverse = null,
+
+    const Undo = union(enum) {
+        /// `len` held `prev` before the change.
+        Len: struct {
+            len: *usize,
+            prev: usize,
+        },
+        /// `state` held `prev` before the change. `prev` is released on commit.
+        Replace: struct {
+            type: cy.def.Type,
+            state: *State,
+            prev: State,
+        },
+        /// A new element was inserted into `list` at `index`.
+        ListInsert: struct {
+            type: cy.def.Type,
+            list: *std.ArrayList(State),
+            index: usize,
+        },
+        /// `elem` was removed from `list` at `index`. It is released on commit.
+        ListRemove: struct {
+            type: cy.def.Type,
+            list: *std.ArrayList(State),
+            index: usize,
+            elem: State,
+        },
+        /// The contents of the string in `state` were `prev` before the change. `prev` is released on commit.
+        Text: struct {
+            state: *State,
+            prev: Rope,
+        },
+        /// A new item was inserted into `list` at `index`.
+        ChunkInsert: struct {
+            type: cy.def.Type,
+            list: *Chunks,
+            index: usize,
+        },
+        /// `elem` was removed from `list` at `index`. It is released on commit.
+        ChunkRemove: struct {
+            type: cy.def.Type,
+            list: *Chunks,
+            index: usize,
+            elem: *State,
+        },
+        /// The items of the list in `state` were moved from `flat` into chunks. `flat` is released on commit.
+        ListChunked: struct {
+            state: *State,
+            flat: std.ArrayList(State),
+        },
+        /// The items of the list in `state` were moved from `chunks` into a flat array. `chunks` is released
+        /// on commit.
+        ListFlattened: struct {
+            state: *State,
+            chunks: Chunks,
+        },
+        /// A new entry was put into `map` under `key`.
+        MapPut: struct {
+            type: cy.def.Type,
+            map: *Map,
+            key: keys.Key,
+        },
+        /// The entry was removed from `map`. It is released on commit.
+        MapRemove: struct {
+            type: cy.def.Type,
+            map: *Map,
+            key: keys.Key,
+            value: *State,
+        },
+        /// A value was inserted into `column` at `index`.
+        ColumnInsert: struct {
+            column: *Column,
+            index: usize,
+        },
+        /// `value` was removed from `column` at `index`.
+        ColumnRemove: struct {
+            column: *Column,
+            index: usize,
+            value: [8]u8,
+        },
+        /// The value at `index` in `column` was `prev` before the change.
+        ColumnSet: struct {
+            column: *Column,
+            index: usize,
+            prev: [8]u8,
+        },
+    };
+
+    fn init(allocator: std.mem.Allocator, interner: *keys.Interner, log_allocator: std.mem.Allocator) Transaction {
+        return Transaction{
+            .allocator = allocator,
+            .interner = interner,
+            .log = std.ArrayList(Undo).init(log_allocator),
+        };
+    }
+
+    fn deinit(self: *Transaction) void {
+        self.log.deinit();
+        self.nodes.deinit(self.allocator);
+        self.* = undefined;
+    }
+
+    /// Must be called before making the change recorded by `push`, so that recording it can't fail.
+    fn reserve(self: *Transaction) !void {
+        try self.log.ensureUnusedCapacity(1);
+    }
+
+    fn push(self: *Transaction, undo: Undo) void {
+        self.log.appendAssumeCapacity(undo);
+    }
+
+    fn enter(self: *Transaction, step: ChangeSet.Step) !void {
+        if (self.changes) |changes| {
+            try changes.enter(step);
+        }
+    }
+
+    fn leave(self: *Transaction) void {
+        if (self.changes) |changes| {
+            changes.leave();
+        }
+    }
+
+    fn change(self: *Transaction, kind: ChangeSet.Kind, last: ?ChangeSet.Step) !void {
+        if (self.changes) |changes| {
+            try changes.record(kind, last);
+        }
+    }
+
+    fn commit(self: *Transaction) void {
+        for (self.log.items) |*undo| {
+            switch (undo.*) {
+                .Len, .ListInsert, .ChunkInsert, .MapPut, .ColumnInsert, .ColumnRemove, .ColumnSet => {},
+                .Replace => |*r| deinitState(self.allocator, self.interner, r.type, &r.prev),
+                .ListRemove => |*r| deinitState(self.allocator, self.interner, r.type, &r.elem),
+                .ChunkRemove => |r| deinitChild(self.allocator, self.interner, r.type, r.elem),
+                .Text => |*r| r.prev.deinit(self.allocator),
+                // the items themselves now live in the other form
+                .ListChunked => |*r| r.flat.deinit(),
+                .ListFlattened => |*r| {
+                    var iter = r.chunks.iterator();
+                    while (iter.next()) |box| {
+                        self.allocator.destroy(box);
+                    }
+                    r.chunks.deinit(self.allocator);
+                },
+                .MapRemove => |r| {
+                    self.interner.release(r.key);
+                    deinitChild(self.allocator, self.interner, r.type, r.value);
+                },
+            }
+        }
+        self.log.clearRetainingCapacity();
+    }
+
+    fn rollback(self: *Transaction) void {
+        var i = self.log.items.len;
+        while (i > 0) {
+            i -= 1;
+            switch (self.log.items[i]) {
+                .Len => |r| {
+                    r.len.* = r.prev;
+                },
+                .Replace => |r| {
+                    deinitState(self.allocator, self.interner, r.type, r.state);
+                    r.state.* = r.prev;
+                },
+                .ListInsert => |r| {
+                    var elem = r.list.orderedRemove(r.index);
+                    deinitState(self.allocator, self.interner, r.type, &elem);
+                },
+                .ListRemove => |r| {
+                    // the removal left its slot as spare capacity
+                    r.list.insert(r.index, r.elem) catch unreachable;
+                },
+                .Text => |r| {
+                    r.state.String.deinit(self.allocator);
+                    r.state.String = r.prev;
+                },
+                .ChunkInsert => |r| {
+                    const elem = r.list.removeUnreserved(&self.nodes, r.index);
+                    deinitChild(self.allocator, self.interner, r.type, elem);
+                },
+                .ChunkRemove => |r| {
+                    r.list.insertReserved(&self.nodes, r.index, r.elem);
+                },
+                .ListChunked => |r| {
+                    var chunks = r.state.List.Chunks;
+                    var iter = chunks.iterator();
+                    var i: usize = 0;
+                    while (iter.next()) |box| : (i += 1) {
+                        r.flat.items[i] = box.*;
+                        self.allocator.destroy(box);
+                    }
+                    chunks.deinit(self.allocator);
+                    r.state.* = State{
+                        .List = .{ .Items = r.flat },
+                    };
+                },
+                .ListFlattened => |r| {
+                    var flat = r.state.List.Items;
+                    var iter = r.chunks.iterator();
+                    var i: usize = 0;
+                    while (iter.next()) |box| : (i += 1) {
+                        box.* = flat.items[i];
+                    }
+                    flat.deinit();
+                    r.state.* = State{
+                        .List = .{ .Chunks = r.chunks },
+                    };
+                },
+                .MapPut => |r| {
+                    const kv = r.map.fetchRemove(r.key).?;
+                    self.interner.release(kv.key);
+                    deinitChild(self.allocator, self.interner, r.type, kv.value);
+                },
+                .MapRemove => |r| {
+                    r.map.putAssumeCapacityNoClobber(r.key, r.value);
+                },
+                .ColumnInsert => |r| {
+                    var removed: [8]u8 = undefined;
+                    r.column.remove(r.index, &removed);
+                },
+                .ColumnRemove => |r| {
+                    // the removal left its room as spare capacity
+                    r.column.restore(r.index, &r.value);
+                },
+                .ColumnSet => |r| {
+                    r.column.reset(r.index, &r.prev);
+                },
+            }
+        }
+        self.log.clearRetainingCapacity();
+    }
+};
+
+// The integer types of the indices and lengths in mutations.
+const StringIndex = @TypeOf(serde.MutateStringInsertOp.init(undefined).fieldValue(.index));
+const StringLen = @TypeOf(serde.MutateStringDeleteOp.init(undefined).fieldValue(.len));
+const ArrayIndex = @TypeOf(serde.MutateArrayOp.init(undefined).fieldValue(.index));
+const ListIndex = @TypeOf(serde.MutateListMutateOp.init(undefined).fieldValue(.index));
+const ListInsertIndex = @TypeOf(serde.MutateListInsertOp.init(undefined).fieldValue(.index));
+const ListDeleteIndex = @TypeOf(serde.MutateListOp.init(undefined).fieldValue(.Delete));
+
+/// Writes the mutation that undoes an update while the update is applied. Each op is inverted against the
+/// state right before it applies, and the inverted ops of an op list are written in reverse order, so that
+/// the result applies to the state the update leaves behind.
+const Inverse = struct {
+    out: std.ArrayList(u8),
+    // where each inverted op of the op lists being written starts, innermost list last
+    starts: std.ArrayList(usize),
+    /// Set once the update replaced something the state doesn't hold, such as the value of a scalar, which
+    /// no mutation can restore.
+    lossy: bool = false,
+
+    // An op of an op list, a union of its tag and payload.
+    const Op = struct {
+        op: usize,
+        payload: usize,
+    };
+
+    // An op that mutates a child, whose inverted mutation goes into `elem` within the payload.
+    const MutateOp = struct {
+        op: Op,
+        elem: usize,
+    };
+
+    fn init(allocator: std.mem.Allocator) Inverse {
+        return Inverse{
+            .out = std.ArrayList(u8).init(allocator),
+            .starts = std.ArrayList(usize).init(allocator),
+        };
+    }
+
+    fn deinit(self: *Inverse) void {
+        self.out.deinit();
+        self.starts.deinit();
+        self.* = undefined;
+    }
+
+    // Elements are written in place, with their length filled in once they're complete.
+    fn begin(self: *Inverse) Error!usize {
+        const start = self.out.items.len;
+        try self.out.appendNTimes(0, @sizeOf(usize));
+        return start;
+    }
+
+    fn end(self: *Inverse, start: usize) void {
+        const len = self.out.items.len - start - @sizeOf(usize);
+        @memcpy(self.out.items[start..][0..@sizeOf(usize)], std.mem.asBytes(&len));
+    }
+
+    fn writeElem(self: *Inverse, bytes: []const u8) Error!void {
+        try self.out.appendSlice(std.mem.asBytes(&bytes.len));
+        try self.out.appendSlice(bytes);
+    }
+
+    fn writeTag(self: *Inverse, tag: u16) Error!void {
+        try self.out.appendSlice(std.mem.asBytes(&tag));
+    }
+
+    /// Starts an op list of `count` ops, returns what to pass to `endOps`.
+    fn beginOps(self: *Inverse, count: usize) Error!usize {
+        try self.out.appendSlice(std.mem.asBytes(&count));
+        return self.starts.items.len;
+    }
+
+    fn beginOp(self: *Inverse, tag: u16) Error!Op {
+        try self.starts.append(self.out.items.len);
+        const op = try self.begin();
+        try self.writeTag(tag);
+        return Op{
+            .op = op,
+            .payload = try self.begin(),
+        };
+    }
+
+    fn endOp(self: *Inverse, op: Op) void {
+        self.end(op.payload);
+        self.end(op.op);
+    }
+
+    /// Reverses the order of the ops written since `beginOps`.
+    fn endOps(self: *Inverse, base: usize) Error!void {
+        const starts = self.starts.items[base..];
+        defer self.starts.shrinkRetainingCapacity(base);
+        if (starts.len < 2) {
+            return;
+        }
+
+        const first = starts[0];
+        const ops = try self.out.allocator.dupe(u8, self.out.items[first..]);
+        defer self.out.allocator.free(ops);
+
+        var at = first;
+        var op_end = ops.len;
+        var i = starts.len;
+        while (i > 0) {
+            i -= 1;
+            const op = ops[starts[i] - first .. op_end];
+            @memcpy(self.out.items[at..][0..op.len], op);
+            at += op.len;
+            op_end = starts[i] - first;
+        }
+    }
+
+    /// Writes the op that undoes `Delete` of `len` bytes at `index` from `rope`, which must not be applied yet.
+    fn writeTextInsert(self: *Inverse, rope: Rope, index: usize, len: usize) Error!void {
+        const op = try self.beginOp(@intFromEnum(serde.MutateStringOp.Tag.Insert));
+        try self.writeElem(std.mem.asBytes(&@as(StringIndex, @intCast(index))));
+        const elem = try self.begin();
+        try self.out.appendSlice(std.mem.asBytes(&len));
+        try self.out.resize(self.out.items.len + len);
+        rope.read(index, self.out.items[self.out.items.len - len ..]);
+        self.end(elem);
+        self.endOp(op);
+    }
+
+    /// Writes the op that undoes inserting `len` bytes at `index`.
+    fn writeTextDelete(self: *Inverse, index: usize, len: usize) Error!void {
+        if (len == 0) {
+            // an empty deletion still checks its index, which an empty insertion at the start never fails
+            const op = try self.beginOp(@intFromEnum(serde.MutateStringOp.Tag.Insert));
+            try self.writeElem(std.mem.asBytes(&@as(StringIndex, 0)));
+            const elem = try self.begin();
+            try self.writeElem("");
+            self.end(elem);
+            self.endOp(op);
+            return;
+        }
+
+        const op = try self.beginOp(@intFromEnum(serde.MutateStringOp.Tag.Delete));
+        try self.writeElem(std.mem.asBytes(&@as(StringIndex, @intCast(index))));
+        try self.writeElem(std.mem.asBytes(&@as(StringLen, @intCast(len))));
+        self.endOp(op);
+    }
+
+    fn writeListDelete(self: *Inverse, index: usize) Error!void {
+        const op = try self.beginOp(@intFromEnum(serde.MutateListOp.Tag.Delete));
+        try self.out.appendSlice(std.mem.asBytes(&@as(ListDeleteIndex, @intCast(index))));
+        self.endOp(op);
+    }
+
+    /// Writes the op that inserts `state` back at `index`. `state` is null for items without state.
+    fn writeListInsert(self: *Inverse, t: cy.def.Type, index: usize, state: ?*const State) Error!void {
+        const op = try self.beginOp(@intFromEnum(serde.MutateListOp.Tag.Insert));
+        try self.writeElem(std.mem.asBytes(&@as(ListInsertIndex, @intCast(index))));
+        const elem = try self.begin();
+        try self.writeChild(t, state);
+        self.end(elem);
+        self.endOp(op);
+    }
+
+    /// Writes the op that inserts the value at `index` in `column` back, before it's removed.
+    fn writeColumnInsert(self: *Inverse, column: *const Column, index: usize) Error!void {
+        const op = try self.beginOp(@intFromEnum(serde.MutateListOp.Tag.Insert));
+        try self.writeElem(std.mem.asBytes(&@as(ListInsertIndex, @intCast(index))));
+        const elem = try self.begin();
+        try self.writeColumnValue(column, index);
+        self.end(elem);
+        self.endOp(op);
+    }
+
+    /// Writes the value at `index` in `column`, which is also the mutation that sets it back.
+    fn writeColumnValue(self: *Inverse, column: *const Column, index: usize) Error!void {
+        const value = column.valueBytes(index) orelse {
+            self.lossy = true;
+            return;
+        };
+        try self.out.appendSlice(value);
+    }
+
+    /// Starts the op mutating the item at `index`, whose inverted mutation is written next.
+    fn beginListMutate(self: *Inverse, index: u64) Error!MutateOp {
+        const op = try self.beginOp(@intFromEnum(serde.MutateListOp.Tag.Mutate));
+        try self.writeElem(std.mem.asBytes(&@as(ListIndex, @intCast(index))));
+        return MutateOp{
+            .op = op,
+            .elem = try self.begin(),
+        };
+    }
+
+    /// Starts the op mutating the value under `key`, whose inverted mutation is written next.
+    fn beginMapMutate(self: *Inverse, key: []const u8) Error!MutateOp {
+        const op = try self.beginOp(@intFromEnum(serde.MutateMapOp.Tag.Mutate));
+        try self.writeElem(key);
+        return MutateOp{
+            .op = op,
+            .elem = try self.begin(),
+        };
+    }
+
+    fn endMutate(self: *Inverse, m: MutateOp) void {
+        self.end(m.elem);
+        self.endOp(m.op);
+    }
+
+    /// Starts the op mutating the array element at `index`, whose inverted mutation is written next. Array
+    /// ops aren't unions, but are ended the same way.
+    fn beginArrayOp(self: *Inverse, index: ArrayIndex) Error!Op {
+        try self.starts.append(self.out.items.len);
+        const op = try self.begin();
+        try self.writeElem(std.mem.asBytes(&index));
+        return Op{
+            .op = op,
+            .payload = try self.begin(),
+        };
+    }
+
+    /// Starts the mutation of the variant `tag` of a union, whose inverted mutation is written next.
+    fn beginUnionMutate(self: *Inverse, tag: u16) Error!Op {
+        try self.writeTag(tag);
+        const field = try self.begin();
+        try self.writeTag(@intFromEnum(serde.MutateUnionField.Tag.Mutate));
+        return Op{
+            .op = field,
+            .payload = try self.begin(),
+        };
+    }
+
+    /// Writes the mutation that sets a union back to the variant `tag` holding `child`.
+    fn writeUnionNew(self: *Inverse, tag: u16, t: cy.def.Type, child: *const State) Error!void {
+        try self.writeTag(tag);
+        const field = try self.begin();
+        try self.writeTag(@intFromEnum(serde.MutateUnionField.Tag.New));
+        const payload = try self.begin();
+        try self.writeChild(t, child);
+        self.end(payload);
+        self.end(field);
+    }
+
+    /// Writes the mutation that sets the optional in `state` back to what it holds now.
+    fn writeOptional(self: *Inverse, t: cy.def.Type, state: *const State) Error!void {
+        switch (state.Optional) {
+            .Some => |child| {
+                try self.writeTag(@intFromEnum(serde.MutateOptional.Tag.New));
+                const payload = try self.begin();
+                try self.writeChild(t, child);
+                self.end(payload);
+            },
+            .None => {
+                try self.writeTag(@intFromEnum(serde.MutateOptional.Tag.None));
+                try self.writeElem("");
+            },
+        }
+    }
+
+    /// Writes the op that puts `value` back under `key`. `value` is null for values without state.
+    fn writeMapPut(self: *Inverse, t: cy.def.Type, key: []const u8, value: ?*const State) Error!void {
+        const op = try self.beginOp(@intFromEnum(serde.MutateMapOp.Tag.Put));
+        try self.writeElem(key);
+        const elem = try self.begin();
+        try self.writeChild(t, value);
+        self.end(elem);
+        self.endOp(op);
+    }
+
+    fn writeMapRemove(self: *Inverse, key: []const u8) Error!void {
+        const op = try self.beginOp(@intFromEnum(serde.MutateMapOp.Tag.Remove));
+        try self.out.appendSlice(key);
+        self.endOp(op);
+    }
+
+    /// Writes the inverse of a mutation of a type without state, which is only known for mutations that
+    /// don't set any value.
+    fn writeStateless(self: *Inverse, t: cy.def.Type, bytes: []const u8) Error!void {
+        switch (t) {
+            .Void => try self.out.appendSlice(bytes),
+            .Array => |info| {
+                const ops = serde.MutateArray.init(bytes);
+                const base = try self.beginOps(ops.len());
+                var iter = ops.iterator();
+                while (iter.next()) |op| {
+                    const inverse_op = try self.beginArrayOp(op.fieldValue(.index));
+                    try self.writeStateless(info.child.*, op.fieldBytes(.elem));
+                    self.endOp(inverse_op);
+                }
+                try self.endOps(base);
+            },
+            .Struct => |info| try self.writeStatelessFields(info, bytes),
+            .Tuple => |info| try self.writeStatelessFields(info, bytes),
+            else => self.lossy = true,
+        }
+    }
+
+    fn writeStatelessFields(self: *Inverse, info: anytype, bytes: []const u8) Error!void {
+        var fields = serde.ElemIterator.init(bytes);
+        for (info.fields) |f| {
+            const value = serde.readOptional(fields.next()) orelse {
+                try self.writeElem(&.{0});
+                continue;
+            };
+            const field = try self.beginField();
+            try self.writeStateless(f.type, value);
+            self.end(field);
+        }
+    }
+
+    /// Starts the mutation of a struct field that is present, whose inverted mutation is written next.
+    fn beginField(self: *Inverse) Error!usize {
+        const field = try self.begin();
+        try self.out.append(1);
+        return field;
+    }
+
+    /// Writes the value of a child, which is only there for types with state.
+    fn writeChild(self: *Inverse, t: cy.def.Type, state: ?*const State) Error!void {
+        if (typeHasState(t)) {
+            try self.writeValue(t, state.?);
+        } else {
+            try self.writeEmptyValue(t);
+        }
+    }
+
+    /// Writes the value held by `state`, which must be of a type with state.
+    fn writeValue(self: *Inverse, t: cy.def.Type, state: *const State) Error!void {
+        switch (t) {
+            .Void, .Bool, .Int, .Float, .Enum, .Ref, .Any => unreachable,
+            .String => {
+                const rope = state.String;
+                try self.out.appendSlice(std.mem.asBytes(&rope.len()));
+                try self.out.resize(self.out.items.len + rope.len());
+                rope.read(0, self.out.items[self.out.items.len - rope.len() ..]);
+            },
+            .Optional => |info| switch (state.Optional) {
+                .Some => |child| {
+                    try self.out.append(1);
+                    try self.writeChild(info.child.*, child);
+                },
+                .None => try self.out.append(0),
+            },
+            .Array => |info| {
+                if (Column.kindOf(info.child.*) != null) {
+                    return self.writeColumn(&state.Column);
+                }
+                for (state.Array) |*elem_state| {
+                    const elem = try self.begin();
+                    try self.writeValue(info.child.*, elem_state);
+                    self.end(elem);
+                }
+            },
+            .List => |info| if (Column.kindOf(info.child.*) != null) {
+                const len = state.Column.len();
+                try self.out.appendSlice(std.mem.asBytes(&len));
+                try self.writeColumn(&state.Column);
+            } else switch (state.List) {
+                .Len => |len| {
+                    try self.out.appendSlice(std.mem.asBytes(&len));
+                    for (0..len) |_| {
+                        const elem = try self.begin();
+                        try self.writeEmptyValue(info.child.*);
+                        self.end(elem);
+                    }
+                },
+                .Items => |list| {
+                    try self.out.appendSlice(std.mem.asBytes(&list.items.len));
+                    for (list.items) |*item| {
+                        const elem = try self.begin();
+                        try self.writeValue(info.child.*, item);
+                        self.end(elem);
+                    }
+                },
+                .Chunks => |chunks| {
+                    try self.out.appendSlice(std.mem.asBytes(&chunks.len));
+                    var iter = chunks.iterator();
+                    while (iter.next()) |item| {
+                        const elem = try self.begin();
+                        try self.writeValue(info.child.*, item);
+                        self.end(elem);
+                    }
+                },
+            },
+            .Map => |info| {
+                const count: usize = state.Map.count();
+                try self.out.appendSlice(std.mem.asBytes(&count));
+                var iter = state.Map.iterator();
+                while (iter.next()) |kv| {
+                    const entry = try self.begin();
+                    try self.writeElem(kv.key_ptr.bytes);
+                    const value = try self.begin();
+                    try self.writeChild(info.value.*, kv.value_ptr.*);
+                    self.end(value);
+                    self.end(entry);
+                }
+            },
+            .Struct => |info| try self.writeFields(info, state.Struct),
+            .Tuple => |info| try self.writeFields(info, state.Struct),
+            .Union => |info| {
+                const tag = state.Union.tag;
+                try self.writeTag(tag);
+                const payload = try self.begin();
+                try self.writeChild(info.fields[tag].type, state.Union.child);
+                self.end(payload);
+            },
+        }
+    }
+
+    fn writeColumn(self: *Inverse, column: *const Column) Error!void {
+        for (0..column.len()) |i| {
+            const elem = try self.begin();
+            try self.writeColumnValue(column, i);
+            self.end(elem);
+        }
+    }
+
+    fn writeFields(self: *Inverse, info: anytype, states: []const State) Error!void {
+        var si: usize = 0;
+        for (info.fields) |f| {
+            const field = try self.begin();
+            if (typeHasState(f.type)) {
+                try self.writeValue(f.type, &states[si]);
+                si += 1;
+            } else {
+                try self.writeEmptyValue(f.type);
+            }
+            self.end(field);
+        }
+    }
+
+    // A type without state only has a single value if it's made of nothing but `Void`, otherwise the value
+    // isn't known.
+    fn writeEmptyValue(self: *Inverse, t: cy.def.Type) Error!void {
+        switch (t) {
+            .Void => {},
+            .Array => |info| for (0..@intCast(info.len)) |_| {
+                const elem = try self.begin();
+                try self.writeEmptyValue(info.child.*);
+                self.end(elem);
+            },
+            .Struct => |info| for (info.fields) |f| {
+                const field = try self.begin();
+                try self.writeEmptyValue(f.type);
+                self.end(field);
+            },
+            .Tuple => |info| for (info.fields) |f| {
+                const field = try self.begin();
+                try self.writeEmptyValue(f.type);
+                self.end(field);
+            },
+            else => self.lossy = true,
+        }
+    }
+};
+
+fn updateState(txn: *Transaction, t: cy.def.Type, state: *State, bytes: []const u8) Error!bool {
+    if (!typeHasState(t)) {
+        return updateStateless(txn, t, bytes);
+    }
+
+    switch (t) {
+        .Void, .Bool, .Int, .Float, .Enum, .Ref, .Any => {},
+        .String => return updateText(txn, state, bytes),
+        .Optional => |info| {
+            const opt = serde.MutateOptional.init(bytes);
+            if (txn.inverse) |inverse| {
+                // a mutation of the child is inverted along with it below
+                if (opt.tag() != .Mutate) {
+                    try inverse.writeOptional(info.child.*, state);
+                }
+            }
+            switch (opt.tag()) {
+                .New => {
+                    const child = try initChild(txn.allocator, txn.interner, info.child.*, opt.fieldBytes());
+                    errdefer deinitChild(txn.allocator, txn.interner, info.child.*, child);
+
+                    try txn.reserve();
+                    txn.push(.{ .Replace = .{ .type = t, .state = state, .prev = state.* } });
+                    state.* = State{
+                        .Optional = .{ .Some = child },
+                    };
+                    try txn.change(.Set, null);
+                },
+                .Mutate => {
+                    const child = switch (state.Optional) {
+                        .Some => |child| child,
+                        .None => return false,
+                    };
+                    const inverse = txn.inverse orelse return updateState(txn, info.child.*, child, opt.fieldBytes());
+                    try inverse.writeTag(@intFromEnum(serde.MutateOptional.Tag.Mutate));
+                    const payload = try inverse.begin();
+                    if (!try updateState(txn, info.child.*, child, opt.fieldBytes())) {
+                        return false;
+                    }
+                    inverse.end(payload);
+                },
+                .None => {
+                    try txn.reserve();
+                    txn.push(.{ .Replace = .{ .type = t, .state = state, .prev = state.* } });
+                    state.* = State{
+                        .Optional = .None,
+                    };
+                    try txn.change(.Set, null);
+                },
+            }
+        },
+        .Array => |info| {
+            if (Column.kindOf(info.child.*) != null) {
+                return updateArrayColumn(txn, &state.Column, serde.MutateArray.init(bytes));
+            }
+            const ops = serde.MutateArray.init(bytes);
+            const base = if (txn.inverse) |inverse| try inverse.beginOps(ops.len()) else undefined;
+            var iter = ops.iterator();
+            while (iter.next()) |op| {
+                const index = op.fieldValue(.index);
+                if (index >= info.len) {
+                    return false;
+                }
+
+                try txn.enter(.{ .Index = index });
+                defer txn.leave();
+                const elem = if (txn.inverse) |inverse| try inverse.beginArrayOp(index) else undefined;
+                if (!try updateState(txn, info.child.*, &state.Array[@intCast(index)], op.fieldBytes(.elem))) {
+                    return false;
+                }
+                if (txn.inverse) |inverse| {
+                    inverse.endOp(elem);
+                }
+            }
+            if (txn.inverse) |inverse| {
+                try inverse.endOps(base);
+            }
+        },
+        .List => |info| {
+            if (Column.kindOf(info.child.*) != null) {
+                return updateListColumn(txn, &state.Column, serde.MutateList.init(bytes));
+            }
+            const ops = serde.MutateList.init(bytes);
+            const base = if (txn.inverse) |inverse| try inverse.beginOps(ops.len()) else undefined;
+            const valid = switch (state.List) {
+                .Len => |*len| try updateListLen(txn, info.child.*, len, ops),
+                .Items, .Chunks => try updateListItems(txn, info.child.*, state, ops),
+            };
+            if (valid) {
+                if (txn.inverse) |inverse| {
+                    try inverse.endOps(base);
+                }
+            }
+            return valid;
+        },
+        .Map => |info| {
+            const ops = serde.MutateMap.init(bytes);
+
+            // Reserving every put up front, in both the map and the interner, means that a batch of puts
+            // grows each table at most once and that putting an entry below can't fail halfway through.
+            var puts: u32 = 0;
+            var iter = ops.iterator();
+            while (iter.next()) |op| {
+                if (op.tag() == .Put) {
+                    puts += 1;
+                }
+            }
+            try state.Map.ensureUnusedCapacity(puts);
+            try txn.interner.ensureUnusedCapacity(puts);
+
+            const base = if (txn.inverse) |inverse| try inverse.beginOps(ops.len()) else undefined;
+            iter = ops.iterator();
+            while (iter.next()) |op| {
                 switch (op.tag()) {
-                    .Append => {
-                        const elem = op.value(.Append);
-                        if (typeHasState(info.child.*)) {
-                            try state.List.Items.append(try initState(allocator, info.child.*, elem));
-                        } else {
-                            state.List.Len += 1;
-                        }
-                    },
-                    .Prepend => {
-                        const elem = op.value(.Prepend);
-                        if (typeHasState(info.child.*)) {
-                            try state.List.Items.insert(0, try initState(allocator, info.child.*, elem));
-                        } else {
-                            state.List.Len += 1;
-                        }
-                    },
-                    .Insert => {
-                        const ins = op.value(.Insert);
-                        const index = ins.field(.index);
-                        const elem = ins.field(.elem);
-                        if (typeHasState(info.child.*)) {
-                            try state.List.Items.insert(@intCast(index), try initState(allocator, info.child.*, elem));
-                        } else {
-                            state.List.Len += 1;
+                    .Put => {
+                        const entry = serde.MapEntry.init(op.fieldBytes());
+                        if (txn.inverse) |inverse| {
+                            const key = entry.fieldBytes(.key);
+                            if (state.Map.get(keys.Key.init(key))) |existing| {
+                                try inverse.writeMapPut(info.value.*, key, existing);
+                            } else {
+                                try inverse.writeMapRemove(key);
+                            }
                         }
+                        try putEntry(txn, info.value.*, &state.Map, keys.Key.init(entry.fieldBytes(.key)), entry.fieldBytes(.value));
+                        try txn.change(.Set, .{ .Key = entry.fieldBytes(.key) });
                     },
-                    .Delete => {
-                        const index = op.value(.Delete);
-                        if (typeHasState(info.child.*)) {
-                            const elem = state.List.Items.orderedRemove(index);
-                            deinitState(allocator, info.child.*, elem);
-                        } else {
-                            state.List.Len -= 1;
+                    .Remove => {
+                        try txn.reserve();
+                        const kv = state.Map.fetchRemove(keys.Key.init(op.fieldBytes())) orelse return false;
+                        txn.push(.{ .MapRemove = .{
+                            .type = info.value.*,
+                            .map = &state.Map,
+                            .key = kv.key,
+                            .value = kv.value,
+                        } });
+                        try txn.change(.Remove, .{ .Key = op.fieldBytes() });
+                        if (txn.inverse) |inverse| {
+                            // the removed value is only released on commit
+                            try inverse.writeMapPut(info.value.*, op.fieldBytes(), kv.value);
                         }
                     },
                     .Mutate => {
-                        const mut = op.value(.Mutate);
-                        const index = mut.field(.index);
-                        const elem = mut.field(.elem);
-                        if (typeHasState(info.child.*)) {
-                            try updateState(allocator, info.child.*, &state.List.Items.items[index], elem);
+                        const entry = serde.MapEntry.init(op.fieldBytes());
+                        const value = state.Map.get(keys.Key.init(entry.fieldBytes(.key))) orelse return false;
+                        try txn.enter(.{ .Key = entry.fieldBytes(.key) });
+                        defer txn.leave();
+                        const inverse_op = if (txn.inverse) |inverse| try inverse.beginMapMutate(entry.fieldBytes(.key)) else undefined;
+                        if (!try updateState(txn, info.value.*, value, entry.fieldBytes(.value))) {
+                            return false;
+                        }
+                        if (txn.inverse) |inverse| {
+                            inverse.endMutate(inverse_op);
                         }
                     },
                 }
-            }
-        },
-        .Map => |info| {
-            const ops = serde.MutateMap.init(bytes);
-            for (0..ops.len()) |i| {
-                const op = ops.elem(i);
-                switch (op.tag()) {
-                    .Put => {
-                        const put = op.value(.Put);
-                        const key = put.field(.key);
-                        const value = put.field(.value);
-                        const gop = try state.Map.getOrPut(key);
-                        if (typeHasState(info.value.*)) {
-                            if (gop.found_existing) {
-                                deinitState(allocator, info.value.*, gop.value_ptr.*);
-                            }
-                            gop.value_ptr.* = try initState(allocator, info.value.*, value);
-                        }
+            }
+            if (txn.inverse) |inverse| {
+                try inverse.endOps(base);
+            }
+        },
+        .Struct => |info| return updateStructState(txn, info, state.Struct, bytes),
+        .Tuple => |info| return updateStructState(txn, info, state.Struct, bytes),
+        .Union => |info| {
+            const mut = serde.Union(void).init(bytes);
+            const tag = mut.tagValue();
+            if (tag >= info.fields.len) {
+                return false;
+            }
+
+            const field_type = info.fields[tag].type;
+            const field = serde.MutateUnionField.init(mut.fieldBytes());
+
+            switch (field.tag()) {
+                .New => {
+                    if (txn.inverse) |inverse| {
+                        const prev = state.Union.tag;
+                        try inverse.writeUnionNew(prev, info.fields[prev].type, state.Union.child);
+                    }
+
+                    const child = try initChild(txn.allocator, txn.interner, field_type, field.fieldBytes());
+                    errdefer deinitChild(txn.allocator, txn.interner, field_type, child);
+
+                    try txn.reserve();
+                    txn.push(.{ .Replace = .{ .type = t, .state = state, .prev = state.* } });
+                    state.* = State{
+                        .Union = .{
+                            .tag = tag,
+                            .child = child,
+                        },
+                    };
+                    try txn.change(.Set, null);
+                },
+                .Mutate => {
+                    if (state.Union.tag != tag) {
+                        return false;
+                    }
+                    try txn.enter(.{ .Variant = tag });
+                    defer txn.leave();
+                    const inverse = txn.inverse orelse return updateState(txn, field_type, state.Union.child, field.fieldBytes());
+                    const inverse_field = try inverse.beginUnionMutate(tag);
+                    if (!try updateState(txn, field_type, state.Union.child, field.fieldBytes())) {
+                        return false;
+                    }
+                    inverse.endOp(inverse_field);
+                },
+            }
+        },
+    }
+    return true;
+}
+
+// There's no state to update, so the mutation is only recorded.
+fn updateStateless(txn: *Transaction, t: cy.def.Type, bytes: []const u8) Error!bool {
+    if (txn.changes) |changes| {
+        try changes.recordMutation(t, bytes);
+    }
+    if (txn.inverse) |inverse| {
+        try inverse.writeStateless(t, bytes);
+    }
+    return true;
+}
+
+fn updateText(txn: *Transaction, state: *State, bytes: []const u8) Error!bool {
+    // The edits go to a new version of the contents, which shares everything they don't touch with the
+    // current one. The current version is what's restored on rollback.
+    try txn.reserve();
+    var rope = state.String.share();
+    const valid = editText(txn.allocator, &rope, bytes, txn.inverse) catch |e| {
+        rope.deinit(txn.allocator);
+        return e;
+    };
+    if (!valid) {
+        rope.deinit(txn.allocator);
+        return false;
+    }
+
+    txn.push(.{ .Text = .{ .state = state, .prev = state.String } });
+    state.String = rope;
+    try txn.change(.Text, null);
+    return true;
+}
+
+fn editText(allocator: std.mem.Allocator, rope: *Rope, bytes: []const u8, inverse: ?*Inverse) Error!bool {
+    const ops = serde.MutateString.init(bytes);
+    const base = if (inverse) |inv| try inv.beginOps(ops.len()) else undefined;
+    var iter = ops.iterator();
+    while (iter.next()) |op| {
+        switch (op.tag()) {
+            .Append => {
+                const text = cy.chan.read([]const u8, op.fieldBytes());
+                if (inverse) |inv| {
+                    try inv.writeTextDelete(rope.len(), text.len);
+                }
+                try rope.insert(allocator, rope.len(), text);
+            },
+            .Prepend => {
+                const text = cy.chan.read([]const u8, op.fieldBytes());
+                if (inverse) |inv| {
+                    try inv.writeTextDelete(0, text.len);
+                }
+                try rope.insert(allocator, 0, text);
+            },
+            .Insert => {
+                const ins = serde.MutateStringInsertOp.init(op.fieldBytes());
+                const index = ins.fieldValue(.index);
+                if (index > rope.len()) {
+                    return false;
+                }
+                const text = cy.chan.read([]const u8, ins.fieldBytes(.elem));
+                if (inverse) |inv| {
+                    try inv.writeTextDelete(@intCast(index), text.len);
+                }
+                try rope.insert(allocator, @intCast(index), text);
+            },
+            .Delete => {
+                const del = serde.MutateStringDeleteOp.init(op.fieldBytes());
+                const index = del.fieldValue(.index);
+                const len = del.fieldValue(.len);
+                if (index >= rope.len() or len > rope.len() - index) {
+                    return false;
+                }
+                if (inverse) |inv| {
+                    try inv.writeTextInsert(rope.*, @intCast(index), @intCast(len));
+                }
+                try rope.delete(allocator, @intCast(index), @intCast(len));
+            },
+        }
+    }
+    if (inverse) |inv| {
+        try inv.endOps(base);
+    }
+    return true;
+}
+
+fn updateListLen(txn: *Transaction, t: cy.def.Type, len: *usize, ops: serde.MutateList) Error!bool {
+    try txn.reserve();
+    txn.push(.{ .Len = .{ .len = len, .prev = len.* } });
+
+    var iter = ops.iterator();
+    while (iter.next()) |op| {
+        switch (op.tag()) {
+            .Append => {
+                try txn.change(.Insert, .{ .Index = len.* });
+                if (txn.inverse) |inverse| {
+                    try inverse.writeListDelete(len.*);
+                }
+                len.* += 1;
+            },
+            .Prepend => {
+                try txn.change(.Insert, .{ .Index = 0 });
+                if (txn.inverse) |inverse| {
+                    try inverse.writeListDelete(0);
+                }
+                len.* += 1;
+            },
+            .Insert => {
+                const ins = serde.MutateListInsertOp.init(op.fieldBytes());
+                const index = ins.fieldValue(.index);
+                if (index > len.*) {
+                    return false;
+                }
+                try txn.change(.Insert, .{ .Index = index });
+                if (txn.inverse) |inverse| {
+                    try inverse.writeListDelete(@intCast(index));
+                }
+                len.* += 1;
+            },
+            .Delete => {
+                const index = op.fieldValue(.Delete);
+                if (index >= len.*) {
+                    return false;
+                }
+                try txn.change(.Remove, .{ .Index = index });
+                if (txn.inverse) |inverse| {
+                    try inverse.writeListInsert(t, @intCast(index), null);
+                }
+                len.* -= 1;
+            },
+            .Mutate => {
+                const mut = serde.MutateListMutateOp.init(op.fieldBytes());
+                const index = mut.fieldValue(.index);
+                if (index >= len.*) {
+                    return false;
+                }
+                if (txn.changes) |changes| {
+                    try changes.enter(.{ .Index = index });
+                    defer changes.leave();
+                    try changes.recordMutation(t, mut.fieldBytes(.elem));
+                }
+                if (txn.inverse) |inverse| {
+                    const inverse_op = try inverse.beginListMutate(index);
+                    try inverse.writeStateless(t, mut.fieldBytes(.elem));
+                    inverse.endMutate(inverse_op);
+                }
+            },
+        }
+    }
+    return true;
+}
+
+fn updateArrayColumn(txn: *Transaction, column: *Column, ops: serde.MutateArray) Error!bool {
+    const base = if (txn.inverse) |inverse| try inverse.beginOps(ops.len()) else undefined;
+    var iter = ops.iterator();
+    while (iter.next()) |op| {
+        const index = op.fieldValue(.index);
+        if (index >= column.len()) {
+            return false;
+        }
+        if (txn.inverse) |inverse| {
+            const inverse_op = try inverse.beginArrayOp(index);
+            try inverse.writeColumnValue(column, @intCast(index));
+            inverse.endOp(inverse_op);
+        }
+        try setColumnValue(txn, column, @intCast(index), op.fieldBytes(.elem));
+    }
+    if (txn.inverse) |inverse| {
+        try inverse.endOps(base);
+    }
+    return true;
+}
+
+fn updateListColumn(txn: *Transaction, column: *Column, ops: serde.MutateList) Error!bool {
+    // Reserving every insertion up front means that no op allocates, and that undoing a removal always finds
+    // room for the value.
+    var inserts: usize = 0;
+    var iter = ops.iterator();
+    while (iter.next()) |op| {
+        switch (op.tag()) {
+            .Append, .Prepend, .Insert => {
+                inserts += 1;
+            },
+            .Delete, .Mutate => {},
+        }
+    }
+    try column.ensureUnusedCapacity(txn.allocator, inserts);
+
+    const base = if (txn.inverse) |inverse| try inverse.beginOps(ops.len()) else undefined;
+    iter = ops.iterator();
+    while (iter.next()) |op| {
+        switch (op.tag()) {
+            .Append => try insertColumnValue(txn, column, column.len(), op.fieldBytes()),
+            .Prepend => try insertColumnValue(txn, column, 0, op.fieldBytes()),
+            .Insert => {
+                const ins = serde.MutateListInsertOp.init(op.fieldBytes());
+                const index = ins.fieldValue(.index);
+                if (index > column.len()) {
+                    return false;
+                }
+                try insertColumnValue(txn, column, @intCast(index), ins.fieldBytes(.elem));
+            },
+            .Delete => {
+                const index = op.fieldValue(.Delete);
+                if (index >= column.len()) {
+                    return false;
+                }
+                if (txn.inverse) |inverse| {
+                    try inverse.writeColumnInsert(column, @intCast(index));
+                }
+
+                try txn.reserve();
+                var removed: [8]u8 = undefined;
+                column.remove(@intCast(index), &removed);
+                txn.push(.{ .ColumnRemove = .{
+                    .column = column,
+                    .index = @intCast(index),
+                    .value = removed,
+                } });
+                try txn.change(.Remove, .{ .Index = index });
+            },
+            .Mutate => {
+                const mut = serde.MutateListMutateOp.init(op.fieldBytes());
+                const index = mut.fieldValue(.index);
+                if (index >= column.len()) {
+                    return false;
+                }
+                if (txn.inverse) |inverse| {
+                    const inverse_op = try inverse.beginListMutate(index);
+                    try inverse.writeColumnValue(column, @intCast(index));
+                    inverse.endMutate(inverse_op);
+                }
+                try setColumnValue(txn, column, @intCast(index), mut.fieldBytes(.elem));
+            },
+        }
+    }
+    if (txn.inverse) |inverse| {
+        try inverse.endOps(base);
+    }
+    return true;
+}
 
-                        if (!gop.found_existing) {
-                            gop.key_ptr.* = try allocator.dupe(u8, key);
-                        }
-                    },
-                    .Remove => {
-                        const key = op.value(.Remove);
-                        const kv = state.Map.fetchRemove(key).?;
-                        allocator.free(kv.key);
-                        if (typeHasState(info.value.*)) {
-                            deinitState(allocator, info.value.*, kv.value);
-                        }
-                    },
-                    .Mutate => {
-                        const mut = op.value(.Mutate);
-                        const key = mut.field(.key);
-                        const value = mut.field(.value);
-                        const ptr = state.Map.getPtr(key).?;
-                        if (typeHasState(info.value.*)) {
-                            try updateState(allocator, info.value.*, ptr, value);
-                        }
-                    },
+fn insertColumnValue(txn: *Transaction, column: *Column, index: usize, bytes: []const u8) Error!void {
+    if (txn.inverse) |inverse| {
+        try inverse.writeListDelete(index);
+    }
+    try txn.reserve();
+    column.insertAssumeCapacity(index, bytes);
+    txn.push(.{ .ColumnInsert = .{
+        .column = column,
+        .index = index,
+    } });
+    try txn.change(.Insert, .{ .Index = index });
+}
+
+// The mutation of a scalar is its new value.
+fn setColumnValue(txn: *Transaction, column: *Column, index: usize, bytes: []const u8) Error!void {
+    try txn.reserve();
+    var prev: [8]u8 = undefined;
+    column.set(index, bytes, &prev);
+    txn.push(.{ .ColumnSet = .{
+        .column = column,
+        .index = index,
+        .prev = prev,
+    } });
+    try txn.change(.Set, .{ .Index = index });
+}
+
+fn updateListItems(txn: *Transaction, t: cy.def.Type, state: *State, ops: serde.MutateList) Error!bool {
+    var inserts: usize = 0;
+    var iter = ops.iterator();
+    while (iter.next()) |op| {
+        switch (op.tag()) {
+            .Append, .Prepend, .Insert => {
+                inserts += 1;
+            },
+            .Delete, .Mutate => {},
+        }
+    }
+
+    switch (state.List) {
+        .Len => unreachable,
+        .Items => |list| if (list.items.len + inserts > chunk_threshold) try chunkItems(txn, state),
+        .Chunks => |chunks| if (chunks.len + inserts < flatten_threshold) try flattenItems(txn, state),
+    }
+    switch (state.List) {
+        .Len => unreachable,
+        .Items => |*list| return updateFlatItems(txn, t, list, ops, inserts),
+        .Chunks => |*chunks| return updateChunks(txn, t, chunks, ops, inserts),
+    }
+}
+
+fn chunkItems(txn: *Transaction, state: *State) Error!void {
+    try txn.reserve();
+    const flat = state.List.Items;
+
+    const boxes = try txn.allocator.alloc(*State, flat.items.len);
+    defer txn.allocator.free(boxes);
+    var i: usize = 0;
+    errdefer for (boxes[0..i]) |box| {
+        txn.allocator.destroy(box);
+    };
+    while (i < boxes.len) : (i += 1) {
+        boxes[i] = try txn.allocator.create(State);
+        boxes[i].* = flat.items[i];
+    }
+
+    const chunks = try Chunks.fromSlice(txn.allocator, boxes);
+    txn.push(.{ .ListChunked = .{ .state = state, .flat = flat } });
+    state.* = State{
+        .List = .{ .Chunks = chunks },
+    };
+}
+
+fn flattenItems(txn: *Transaction, state: *State) Error!void {
+    try txn.reserve();
+    const chunks = state.List.Chunks;
+
+    var flat = try std.ArrayList(State).initCapacity(txn.allocator, chunks.len);
+    var iter = chunks.iterator();
+    while (iter.next()) |box| {
+        flat.appendAssumeCapacity(box.*);
+    }
+
+    txn.push(.{ .ListFlattened = .{ .state = state, .chunks = chunks } });
+    state.* = State{
+        .List = .{ .Items = flat },
+    };
+}
+
+fn updateFlatItems(txn: *Transaction, t: cy.def.Type, list: *std.ArrayList(State), ops: serde.MutateList, inserts: usize) Error!bool {
+    // Reserving every insertion up front keeps the list from reallocating while the transaction holds
+    // pointers to its elements.
+    try list.ensureUnusedCapacity(inserts);
+
+    var iter = ops.iterator();
+    while (iter.next()) |op| {
+        switch (op.tag()) {
+            .Append => try insertItem(txn, t, list, list.items.len, op.fieldBytes()),
+            .Prepend => try insertItem(txn, t, list, 0, op.fieldBytes()),
+            .Insert => {
+                const ins = serde.MutateListInsertOp.init(op.fieldBytes());
+                const index = ins.fieldValue(.index);
+                if (index > list.items.len) {
+                    return false;
+                }
+                try insertItem(txn, t, list, @intCast(index), ins.fieldBytes(.elem));
+            },
+            .Delete => {
+                const index = op.fieldValue(.Delete);
+                if (index >= list.items.len) {
+                    return false;
+                }
+                if (txn.inverse) |inverse| {
+                    try inverse.writeListInsert(t, @intCast(index), &list.items[@intCast(index)]);
+                }
+
+                try txn.reserve();
+                const elem = list.orderedRemove(@intCast(index));
+                txn.push(.{ .ListRemove = .{
+                    .type = t,
+                    .list = list,
+                    .index = @intCast(index),
+                    .elem = elem,
+                } });
+                try txn.change(.Remove, .{ .Index = index });
+            },
+            .Mutate => {
+                const mut = serde.MutateListMutateOp.init(op.fieldBytes());
+                const index = mut.fieldValue(.index);
+                if (index >= list.items.len) {
+                    return false;
+                }
+
+                try txn.enter(.{ .Index = index });
+                defer txn.leave();
+                const inverse_op = if (txn.inverse) |inverse| try inverse.beginListMutate(index) else undefined;
+                if (!try updateState(txn, t, &list.items[@intCast(index)], mut.fieldBytes(.elem))) {
+                    return false;
+                }
+                if (txn.inverse) |inverse| {
+                    inverse.endMutate(inverse_op);
+                }
+            },
+        }
+    }
+    return true;
+}
+
+fn updateChunks(txn: *Transaction, t: cy.def.Type, chunks: *Chunks, ops: serde.MutateList, inserts: usize) Error!bool {
+    try txn.nodes.prepare(txn.allocator, chunks.len + inserts);
+
+    var iter = ops.iterator();
+    while (iter.next()) |op| {
+        switch (op.tag()) {
+            .Append => try insertChunkItem(txn, t, chunks, chunks.len, op.fieldBytes()),
+            .Prepend => try insertChunkItem(txn, t, chunks, 0, op.fieldBytes()),
+            .Insert => {
+                const ins = serde.MutateListInsertOp.init(op.fieldBytes());
+                const index = ins.fieldValue(.index);
+                if (index > chunks.len) {
+                    return false;
+                }
+                try insertChunkItem(txn, t, chunks, @intCast(index), ins.fieldBytes(.elem));
+            },
+            .Delete => {
+                const index = op.fieldValue(.Delete);
+                if (index >= chunks.len) {
+                    return false;
+                }
+                if (txn.inverse) |inverse| {
+                    try inverse.writeListInsert(t, @intCast(index), chunks.get(@intCast(index)));
+                }
+
+                try txn.reserve();
+                const elem = try chunks.remove(&txn.nodes, txn.allocator, @intCast(index));
+                txn.push(.{ .ChunkRemove = .{
+                    .type = t,
+                    .list = chunks,
+                    .index = @intCast(index),
+                    .elem = elem,
+                } });
+                try txn.change(.Remove, .{ .Index = index });
+            },
+            .Mutate => {
+                const mut = serde.MutateListMutateOp.init(op.fieldBytes());
+                const index = mut.fieldValue(.index);
+                if (index >= chunks.len) {
+                    return false;
+                }
+
+                try txn.enter(.{ .Index = index });
+                defer txn.leave();
+                const inverse_op = if (txn.inverse) |inverse| try inverse.beginListMutate(index) else undefined;
+                if (!try updateState(txn, t, chunks.get(@intCast(index)), mut.fieldBytes(.elem))) {
+                    return false;
+                }
+                if (txn.inverse) |inverse| {
+                    inverse.endMutate(inverse_op);
+                }
+            },
+        }
+    }
+    return true;
+}
+
+fn insertChunkItem(txn: *Transaction, t: cy.def.Type, chunks: *Chunks, index: usize, bytes: []const u8) Error!void {
+    if (txn.inverse) |inverse| {
+        try inverse.writeListDelete(index);
+    }
+    const elem = try initChild(txn.allocator, txn.interner, t, bytes);
+    errdefer deinitChild(txn.allocator, txn.interner, t, elem);
+
+    try txn.reserve();
+    try chunks.insert(&txn.nodes, txn.allocator, index, elem);
+    txn.push(.{ .ChunkInsert = .{
+        .type = t,
+        .list = chunks,
+        .index = index,
+    } });
+    try txn.change(.Insert, .{ .Index = index });
+}
+
+fn insertItem(txn: *Transaction, t: cy.def.Type, list: *std.ArrayList(State), index: usize, bytes: []const u8) Error!void {
+    if (txn.inverse) |inverse| {
+        try inverse.writeListDelete(index);
+    }
+    var elem = try initState(txn.allocator, txn.interner, t, bytes);
+    errdefer deinitState(txn.allocator, txn.interner, t, &elem);
+
+    try txn.reserve();
+    try list.insert(index, elem);
+    txn.push(.{ .ListInsert = .{
+        .type = t,
+        .list = list,
+        .index = index,
+    } });
+    try txn.change(.Insert, .{ .Index = index });
+}
+
+/// `key` is hashed once by the caller, the cached hash is reused for the lookup, interning and insertion.
+fn putEntry(txn: *Transaction, t: cy.def.Type, map: *Map, key: keys.Key, bytes: []const u8) Error!void {
+    try txn.reserve();
+
+    if (map.get(key)) |existing| {
+        if (typeHasState(t)) {
+            const value = try initState(txn.allocator, txn.interner, t, bytes);
+            txn.push(.{ .Replace = .{ .type = t, .state = existing, .prev = existing.* } });
+            existing.* = value;
+        }
+        return;
+    }
+
+    const value = try initChild(txn.allocator, txn.interner, t, bytes);
+    errdefer deinitChild(txn.allocator, txn.interner, t, value);
+
+    const owned_key = try txn.interner.intern(key);
+    map.putAssumeCapacityNoClobber(owned_key, value);
+    txn.push(.{ .MapPut = .{
+        .type = t,
+        .map = map,
+        .key = owned_key,
+    } });
+}
+
+fn updateStructState(txn: *Transaction, info: anytype, states: []State, bytes: []const u8) Error!bool {
+    var si: usize = 0;
+    var fields = serde.ElemIterator.init(bytes);
+    for (info.fields, 0..) |f, i| {
+        const field_bytes = fields.next();
+        if (typeHasState(f.type)) {
+            if (serde.readOptional(field_bytes)) |value| {
+                try txn.enter(.{ .Field = @intCast(i) });
+                defer txn.leave();
+                const field = if (txn.inverse) |inverse| try inverse.beginField() else undefined;
+                if (!try updateState(txn, f.type, &states[si], value)) {
+                    return false;
+                }
+                if (txn.inverse) |inverse| {
+                    inverse.end(field);
                 }
+            } else if (txn.inverse) |inverse| {
+                try inverse.writeElem(&.{0});
             }
-        },
-        .Struct => |info| try updateStructState(allocator, info, state.Struct, bytes),
-        .Tuple => |info| try updateStructState(allocator, info, state.Tuple, bytes),
-        .Union => |info| {
-            const mut = serde.Union(void).init(bytes);
-            const tag = mut.tagValue();
+            si += 1;
+        } else {
+            const value = serde.readOptional(field_bytes) orelse {
+                if (txn.inverse) |inverse| {
+                    try inverse.writeElem(&.{0});
+                }
+                continue;
+            };
+            if (txn.changes) |changes| {
+                try changes.enter(.{ .Field = @intCast(i) });
+                defer changes.leave();
+                try changes.recordMutation(f.type, value);
+            }
+            if (txn.inverse) |inverse| {
+                const field = try inverse.beginField();
+                try inverse.writeStateless(f.type, value);
+                inverse.end(field);
+            }
+        }
+    }
+    return true;
+}
 
-            const field_info = info.fields[tag];
-            const value = serde.MutateUnionField.init(mut.fieldBytes());
+/// Returns the applier of updates to objects of type `t`, which must be the type they're created with.
+/// Structs, tuples and arrays are walked at compile time: the fields without state are known up front, and
+/// where each field's state is, without looking at the types of the fields on every update. Everything else
+/// is left to `updateState`.
+pub fn specialize(comptime t: cy.def.Type) Applier {
+    return &struct {
+        fn apply(txn: *Transaction, state: *State, bytes: []const u8) Error!bool {
+            return updateStatic(txn, t, state, bytes);
+        }
+    }.apply;
+}
 
-            switch (value.tag()) {
-                .New => {
-                    const current_field_info = info.fields[state.Union.tag];
-                    if (typeHasState(current_field_info.type)) {
-                        deinitState(allocator, current_field_info.type, state.Union.child.*);
-                        state.Union.child.* = undefined;
-                    }
+fn updateStatic(txn: *Transaction, comptime t: cy.def.Type, state: *State, bytes: []const u8) Error!bool {
+    if (comptime !typeHasState(t)) {
+        return updateState(txn, t, state, bytes);
+    }
+    switch (t) {
+        .Struct => |info| return updateStaticFields(txn, info, state.Struct, bytes),
+        .Tuple => |info| return updateStaticFields(txn, info, state.Struct, bytes),
+        .Array => |info| {
+            if (comptime Column.kindOf(info.child.*) != null) {
+                return updateArrayColumn(txn, &state.Column, serde.MutateArray.init(bytes));
+            }
+            const ops = serde.MutateArray.init(bytes);
+            const base = if (txn.inverse) |inverse| try inverse.beginOps(ops.len()) else undefined;
+            var iter = ops.iterator();
+            while (iter.next()) |op| {
+                const index = op.fieldValue(.index);
+                if (index >= info.len) {
+                    return false;
+                }
 
-                    state.Union.tag = tag;
-                    if (typeHasState(field_info.type)) {
-                        state.Union.child.* = try initState(allocator, field_info.type, value.fieldBytes());
-                    }
-                },
-                .Mutate => {
-                    try updateState(allocator, field_info.type, state.Union.child, value.fieldBytes());
-                },
+                try txn.enter(.{ .Index = index });
+                defer txn.leave();
+                const elem = if (txn.inverse) |inverse| try inverse.beginArrayOp(index) else undefined;
+                if (!try updateStatic(txn, info.child.*, &state.Array[@intCast(index)], op.fieldBytes(.elem))) {
+                    return false;
+                }
+                if (txn.inverse) |inverse| {
+                    inverse.endOp(elem);
+                }
             }
+            if (txn.inverse) |inverse| {
+                try inverse.endOps(base);
+            }
+            return true;
         },
+        else => return updateState(txn, t, state, bytes),
     }
 }
 
-fn updateStructState(allocator: std.mem.Allocator, info: anytype, state: []State, bytes: []const u8) !void {
-    var si: usize = 0;
-    for (info.fields, 0..) |field, fi| {
-        if (typeHasState(field.type)) {
-            const field_bytes = serde.readElem(bytes, fi);
+fn updateStaticFields(txn: *Transaction, comptime info: anytype, states: []State, bytes: []const u8) Error!bool {
+    comptime var si: usize = 0;
+    var fields = serde.ElemIterator.init(bytes);
+    inline for (info.fields, 0..) |f, i| {
+        const field_bytes = fields.next();
+        if (comptime typeHasState(f.type)) {
             if (serde.readOptional(field_bytes)) |value| {
-                try updateState(allocator, field.type, &state[si], value);
+                try txn.enter(.{ .Field = i });
+                defer txn.leave();
+                const field = if (txn.inverse) |inverse| try inverse.beginField() else undefined;
+                if (!try updateStatic(txn, f.type, &states[si], value)) {
+                    return false;
+                }
+                if (txn.inverse) |inverse| {
+                    inverse.end(field);
+                }
+            } else if (txn.inverse) |inverse| {
+                try inverse.writeElem(&.{0});
             }
             si += 1;
+        } else if (serde.readOptional(field_bytes)) |value| {
+            if (txn.changes) |changes| {
+                try changes.enter(.{ .Field = i });
+                defer changes.leave();
+                try changes.recordMutation(f.type, value);
+            }
+            if (txn.inverse) |inverse| {
+                const field = try inverse.beginField();
+                try inverse.writeStateless(f.type, value);
+                inverse.end(field);
+            }
+        } else if (txn.inverse) |inverse| {
+            try inverse.writeElem(&.{0});
+        }
+    }
+    return true;
+}
+
+/// Applies an update by following the step `index` of `plan`, compiled for the type of `state`.
+fn updatePlanned(txn: *Transaction, plan: *const Plan, index: u32, state: *State, bytes: []const u8) Error!bool {
+    const step = plan.steps[index];
+    switch (step.op) {
+        .Skip => return updateStateless(txn, step.type, bytes),
+        .String => return updateText(txn, state, bytes),
+        .ArrayColumn => return updateArrayColumn(txn, &state.Column, serde.MutateArray.init(bytes)),
+        .ListColumn => return updateListColumn(txn, &state.Column, serde.MutateList.init(bytes)),
+        .Array => {
+            const ops = serde.MutateArray.init(bytes);
+            const base = if (txn.inverse) |inverse| try inverse.beginOps(ops.len()) else undefined;
+            var iter = ops.iterator();
+            while (iter.next()) |op| {
+                const elem_index = op.fieldValue(.index);
+                if (elem_index >= step.len) {
+                    return false;
+                }
+
+                try txn.enter(.{ .Index = elem_index });
+                defer txn.leave();
+                const elem = if (txn.inverse) |inverse| try inverse.beginArrayOp(elem_index) else undefined;
+                if (!try updatePlanned(txn, plan, step.arg, &state.Array[@intCast(elem_index)], op.fieldBytes(.elem))) {
+                    return false;
+                }
+                if (txn.inverse) |inverse| {
+                    inverse.endOp(elem);
+                }
+            }
+            if (txn.inverse) |inverse| {
+                try inverse.endOps(base);
+            }
+            return true;
+        },
+        .Struct => return updatePlannedFields(txn, plan, plan.fields[step.arg..][0..step.len], state.Struct, bytes),
+        .Generic => return updateState(txn, step.type, state, bytes),
+    }
+}
+
+fn updatePlannedFields(txn: *Transaction, plan: *const Plan, fields: []const Plan.Field, states: []State, bytes: []const u8) Error!bool {
+    var iter = serde.ElemIterator.init(bytes);
+    for (fields, 0..) |f, i| {
+        const value = serde.readOptional(iter.next()) orelse {
+            if (txn.inverse) |inverse| {
+                try inverse.writeElem(&.{0});
+            }
+            continue;
+        };
+        const step = plan.steps[f.step];
+        if (step.op == .Skip) {
+            if (txn.changes) |changes| {
+                try changes.enter(.{ .Field = @intCast(i) });
+                defer changes.leave();
+                try changes.recordMutation(step.type, value);
+            }
+            if (txn.inverse) |inverse| {
+                const field = try inverse.beginField();
+                try inverse.writeStateless(step.type, value);
+                inverse.end(field);
+            }
+            continue;
+        }
+
+        try txn.enter(.{ .Field = @intCast(i) });
+        defer txn.leave();
+        const field = if (txn.inverse) |inverse| try inverse.beginField() else undefined;
+        if (!try updatePlanned(txn, plan, f.step, &states[f.slot], value)) {
+            return false;
+        }
+        if (txn.inverse) |inverse| {
+            inverse.end(field);
         }
     }
+    return true;
 }
 
-fn typeHasState(t: cy.def.Type) bool {
+pub fn typeHasState(t: cy.def.Type) bool {
     return switch (t) {
         .Void, .Bool, .Int, .Float, .Enum, .Ref, .Any => false,
         .String, .Optional, .List, .Map => true,
-        .Array => |info| typeHasState(info.child.*),
+        .Array => |info| typeHasState(info.child.*) or Column.kindOf(info.child.*) != null,
         .Struct => |info| for (info.fields) |f| {
             if (typeHasState(f.type)) break true;
         } else false,
         .Tuple => |info| for (info.fields) |f| {
-            if (typeHasState(f)) break true;
+            if (typeHasState(f.type)) break true;
         } else false,
         .Union => |info| for (info.fields) |f| {
             if (typeHasState(f.type)) break true;
         } else false,
     };
 }
+
+fn expectText(expected: []const u8, rope: Rope) !void {
+    var buf: [16]u8 = undefined;
+    rope.read(0, buf[0..rope.len()]);
+    try std.testing.expectEqualStrings(expected, buf[0..rope.len()]);
+}
+
+// Edits the name, puts an entry and inserts and deletes items, all of which is valid, and then deletes an item
+// past the end of the list if `fail` is set.
+fn writeRollbackMutation(out: *std.ArrayList(u8), len: usize, fail: bool) !void {
+    var op = std.ArrayList(u8).init(std.testing.allocator);
+    defer op.deinit();
+
+    const name = try serde.beginElem(out);
+    try out.append(1);
+    try out.appendSlice(std.mem.asBytes(&@as(usize, 2)));
+    try serde.writeStringOp(out, .Append, 0, "cd");
+    try serde.writeStringOp(out, .Delete, 0, "a");
+    serde.endElem(out, name);
+
+    const entries = try serde.beginElem(out);
+    try out.append(1);
+    try out.appendSlice(std.mem.asBytes(&@as(usize, 2)));
+    for ([_][]const u8{ "k", "new" }) |key| {
+        op.clearRetainingCapacity();
+        try serde.writeElem(&op, key);
+        try serde.writeString(&op, "w");
+        try serde.writeOp(out, @intFromEnum(serde.MutateMapOp.Tag.Put), op.items);
+    }
+    serde.endElem(out, entries);
+
+    const items = try serde.beginElem(out);
+    try out.append(1);
+    try out.appendSlice(std.mem.asBytes(&@as(usize, if (fail) 4 else 3)));
+    op.clearRetainingCapacity();
+    try serde.writeElem(&op, std.mem.asBytes(&@as(ListInsertIndex, 1)));
+    try serde.writeString(&op, "y");
+    try serde.writeOp(out, @intFromEnum(serde.MutateListOp.Tag.Insert), op.items);
+    try serde.writeOp(out, @intFromEnum(serde.MutateListOp.Tag.Delete), std.mem.asBytes(&@as(ListDeleteIndex, 0)));
+    op.clearRetainingCapacity();
+    try serde.writeElem(&op, "z");
+    try serde.writeOp(out, @intFromEnum(serde.MutateListOp.Tag.Append), op.items);
+    if (fail) {
+        try serde.writeOp(out, @intFromEnum(serde.MutateListOp.Tag.Delete), std.mem.asBytes(&@as(ListDeleteIndex, @intCast(len + 10))));
+    }
+    serde.endElem(out, items);
+}
+
+test "rollback" {
+    const allocator = std.testing.allocator;
+    const t = cy.def.Type{
+        .Struct = cy.def.Type.Struct{
+            .fields = &[_]cy.def.Type.Struct.Field{
+                .{ .name = "name", .type = .String },
+                .{
+                    .name = "entries",
+                    .type = cy.def.Type{
+                        .Map = cy.def.Type.Map{
+                            .key = &@as(cy.def.Type, .String),
+                            .value = &@as(cy.def.Type, .String),
+                        },
+                    },
+                },
+                .{
+                    .name = "items",
+                    .type = cy.def.Type{
+                        .List = cy.def.Type.List{ .child = &@as(cy.def.Type, .String) },
+                    },
+                },
+            },
+        },
+    };
+
+    // a flat list, one that the update would chunk and one that's chunked already
+    for ([_]usize{ 3, chunk_threshold, chunk_threshold + 100 }) |len| {
+        var value = std.ArrayList(u8).init(allocator);
+        defer value.deinit();
+        try serde.writeString(&value, "ab");
+        const entries = try serde.beginElem(&value);
+        try value.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+        const entry = try serde.beginElem(&value);
+        try serde.writeElem(&value, "k");
+        try serde.writeString(&value, "v");
+        serde.endElem(&value, entry);
+        serde.endElem(&value, entries);
+        const items = try serde.beginElem(&value);
+        try value.appendSlice(std.mem.asBytes(&len));
+        for (0..len) |_| {
+            try serde.writeString(&value, "x");
+        }
+        serde.endElem(&value, items);
+
+        var object = try Self.init(allocator, @bitCast(@as(u64, 0)), t, value.items);
+        defer object.deinit(allocator);
+        try object.keepJournal(allocator, 4096);
+        var before = try object.clone(allocator);
+        defer before.deinit(allocator);
+
+        var mutation = std.ArrayList(u8).init(allocator);
+        defer mutation.deinit();
+        try writeRollbackMutation(&mutation, len, true);
+        try std.testing.expect(!try object.update(allocator, mutation.items));
+        try std.testing.expect(object.eql(&before));
+        try std.testing.expectEqual(std.meta.activeTag(before.state.Struct[2].List), std.meta.activeTag(object.state.Struct[2].List));
+        try std.testing.expectEqual(@as(usize, 0), object.journalUsage().?.undo_entries);
+
+        // without the failing op the same changes apply, and undoing them gets back to the same state
+        mutation.clearRetainingCapacity();
+        try writeRollbackMutation(&mutation, len, false);
+        try std.testing.expect(try object.update(allocator, mutation.items));
+        try std.testing.expect(!object.eql(&before));
+        try std.testing.expect(try object.undo(allocator, null));
+        try std.testing.expect(object.eql(&before));
+    }
+}
+
+test "undo and redo" {
+    const allocator = std.testing.allocator;
+    const t = cy.def.Type{
+        .Struct = cy.def.Type.Struct{
+            .fields = &[_]cy.def.Type.Struct.Field{
+                .{ .name = "flag", .type = .Bool },
+                .{ .name = "name", .type = .String },
+                .{
+                    .name = "tags",
+                    .type = cy.def.Type{
+                        .List = cy.def.Type.List{ .child = &@as(cy.def.Type, .String) },
+                    },
+                },
+            },
+        },
+    };
+
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    var scratch = std.ArrayList(u8).init(allocator);
+    defer scratch.deinit();
+    var text = std.ArrayList(u8).init(allocator);
+    defer text.deinit();
+
+    try serde.writeElem(&value, &.{0});
+    try serde.writeElem(&text, "ab");
+    try serde.writeElem(&value, text.items);
+    try scratch.appendSlice(std.mem.asBytes(&@as(usize, 2)));
+    for ([_][]const u8{ "x", "yz" }) |tag| {
+        text.clearRetainingCapacity();
+        try serde.writeElem(&text, tag);
+        try serde.writeElem(&scratch, text.items);
+    }
+    try serde.writeElem(&value, scratch.items);
+
+    var object = try Self.init(allocator, @bitCast(@as(u64, 0)), t, value.items);
+    defer object.deinit(allocator);
+    try object.keepJournal(allocator, 4096);
+
+    // appending to the name and removing the first tag
+    var mutation = std.ArrayList(u8).init(allocator);
+    defer mutation.deinit();
+    try serde.writeElem(&mutation, &.{0});
+    scratch.clearRetainingCapacity();
+    try scratch.append(1);
+    try scratch.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    text.clearRetainingCapacity();
+    try serde.writeElem(&text, "cd");
+    try serde.writeOp(&scratch, @intFromEnum(serde.MutateStringOp.Tag.Append), text.items);
+    try serde.writeElem(&mutation, scratch.items);
+    scratch.clearRetainingCapacity();
+    try scratch.append(1);
+    try scratch.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    try serde.writeOp(&scratch, @intFromEnum(serde.MutateListOp.Tag.Delete), std.mem.asBytes(&@as(ListDeleteIndex, 0)));
+    try serde.writeElem(&mutation, scratch.items);
+
+    try std.testing.expect(try object.update(allocator, mutation.items));
+    try expectText("abcd", object.state.Struct[0].String);
+    try std.testing.expectEqual(@as(usize, 1), object.journalUsage().?.undo_entries);
+
+    try std.testing.expect(try object.undo(allocator, null));
+    try expectText("ab", object.state.Struct[0].String);
+    try std.testing.expectEqual(@as(usize, 2), object.state.Struct[1].List.Items.items.len);
+    try expectText("x", object.state.Struct[1].List.Items.items[0].String);
+    try std.testing.expect(!try object.undo(allocator, null));
+
+    try std.testing.expect(try object.redo(allocator, null));
+    try expectText("abcd", object.state.Struct[0].String);
+    try std.testing.expectEqual(@as(usize, 1), object.state.Struct[1].List.Items.items.len);
+    try expectText("yz", object.state.Struct[1].List.Items.items[0].String);
+    try std.testing.expect(!try object.redo(allocator, null));
+
+    // the previous value of a scalar isn't kept, so setting one cuts off the history
+    mutation.clearRetainingCapacity();
+    try serde.writeElem(&mutation, &.{ 1, 1 });
+    try serde.writeElem(&mutation, &.{0});
+    try serde.writeElem(&mutation, &.{0});
+    try std.testing.expect(try object.update(allocator, mutation.items));
+    try std.testing.expect(!try object.undo(allocator, null));
+}
+
+test "columns" {
+    const allocator = std.testing.allocator;
+    const u32_type = cy.def.Type{ .Int = cy.def.Type.Int{ .signedness = .unsigned, .bits = 32 } };
+    const i16_type = cy.def.Type{ .Int = cy.def.Type.Int{ .signedness = .signed, .bits = 16 } };
+    const t = cy.def.Type{
+        .Struct = cy.def.Type.Struct{
+            .fields = &[_]cy.def.Type.Struct.Field{
+                .{
+                    .name = "counts",
+                    .type = cy.def.Type{
+                        .List = cy.def.Type.List{ .child = &u32_type },
+                    },
+                },
+                .{
+                    .name = "offsets",
+                    .type = cy.def.Type{
+                        .Array = cy.def.Type.Array{ .len = 3, .child = &i16_type },
+                    },
+                },
+            },
+        },
+    };
+
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    var scratch = std.ArrayList(u8).init(allocator);
+    defer scratch.deinit();
+
+    try scratch.appendSlice(std.mem.asBytes(&@as(usize, 3)));
+    for ([_]u32{ 1, 2, 3 }) |count| {
+        try serde.writeElem(&scratch, std.mem.asBytes(&count));
+    }
+    try serde.writeElem(&value, scratch.items);
+    scratch.clearRetainingCapacity();
+    for ([_]i16{ -1, 5, 7 }) |offset| {
+        try serde.writeElem(&scratch, std.mem.asBytes(&offset));
+    }
+    try serde.writeElem(&value, scratch.items);
+
+    var object = try Self.init(allocator, @bitCast(@as(u64, 0)), t, value.items);
+    defer object.deinit(allocator);
+    try object.keepJournal(allocator, 4096);
+    var original = try object.clone(allocator);
+    defer original.deinit(allocator);
+
+    // appending 10 and removing the first count, and setting the first offset to -4
+    var mutation = std.ArrayList(u8).init(allocator);
+    defer mutation.deinit();
+    scratch.clearRetainingCapacity();
+    try scratch.append(1);
+    try scratch.appendSlice(std.mem.asBytes(&@as(usize, 2)));
+    try serde.writeOp(&scratch, @intFromEnum(serde.MutateListOp.Tag.Append), std.mem.asBytes(&@as(u32, 10)));
+    try serde.writeOp(&scratch, @intFromEnum(serde.MutateListOp.Tag.Delete), std.mem.asBytes(&@as(ListDeleteIndex, 0)));
+    try serde.writeElem(&mutation, scratch.items);
+    const counts_end = mutation.items.len;
+    var op = std.ArrayList(u8).init(allocator);
+    defer op.deinit();
+    try serde.writeElem(&op, std.mem.asBytes(&@as(ArrayIndex, 0)));
+    try serde.writeElem(&op, std.mem.asBytes(&@as(i16, -4)));
+    scratch.clearRetainingCapacity();
+    try scratch.append(1);
+    try scratch.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    try serde.writeElem(&scratch, op.items);
+    try serde.writeElem(&mutation, scratch.items);
+
+    try std.testing.expect(try object.update(allocator, mutation.items));
+    const counts = object.column(&.{.{ .Field = 0 }}).?.aggregate(null);
+    try std.testing.expectEqual(@as(u64, 3), counts.count);
+    try std.testing.expectEqual(@as(f64, 15), counts.sum);
+    try std.testing.expectEqual(@as(f64, 2), counts.min);
+    try std.testing.expectEqual(@as(f64, 10), counts.max);
+    const negative = object.column(&.{.{ .Field = 1 }}).?.aggregate(.{ .op = .Lt, .value = 0 });
+    try std.testing.expectEqual(@as(u64, 1), negative.count);
+    try std.testing.expectEqual(@as(f64, -4), negative.sum);
+    try std.testing.expect(object.column(&.{ .{ .Field = 1 }, .{ .Index = 0 } }) == null);
+
+    // the previous values are kept in the column, so unlike other scalars they can be undone
+    try std.testing.expect(try object.undo(allocator, null));
+    try std.testing.expect(object.eql(&original));
+
+    // an offset out of bounds rolls back the counts changed before it
+    op.clearRetainingCapacity();
+    try serde.writeElem(&op, std.mem.asBytes(&@as(ArrayIndex, 3)));
+    try serde.writeElem(&op, std.mem.asBytes(&@as(i16, 0)));
+    scratch.clearRetainingCapacity();
+    try scratch.append(1);
+    try scratch.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    try serde.writeElem(&scratch, op.items);
+    mutation.shrinkRetainingCapacity(counts_end);
+    try serde.writeElem(&mutation, scratch.items);
+    try std.testing.expect(!try object.update(allocator, mutation.items));
+    try std.testing.expect(object.eql(&original));
+}
+
+test "specialized" {
+    const allocator = std.testing.allocator;
+    const i16_type = cy.def.Type{ .Int = cy.def.Type.Int{ .signedness = .signed, .bits = 16 } };
+    const t = cy.def.Type{
+        .Struct = cy.def.Type.Struct{
+            .fields = &[_]cy.def.Type.Struct.Field{
+                .{ .name = "flag", .type = .Bool },
+                .{ .name = "name", .type = .String },
+                .{
+                    .name = "offsets",
+                    .type = cy.def.Type{
+                        .Array = cy.def.Type.Array{ .len = 2, .child = &i16_type },
+                    },
+                },
+            },
+        },
+    };
+
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    var scratch = std.ArrayList(u8).init(allocator);
+    defer scratch.deinit();
+
+    try serde.writeElem(&value, &.{0});
+    try serde.writeElem(&scratch, "ab");
+    try serde.writeElem(&value, scratch.items);
+    scratch.clearRetainingCapacity();
+    for ([_]i16{ 1, 2 }) |offset| {
+        try serde.writeElem(&scratch, std.mem.asBytes(&offset));
+    }
+    try serde.writeElem(&value, scratch.items);
+
+    var generic = try Self.init(allocator, @bitCast(@as(u64, 0)), t, value.items);
+    defer generic.deinit(allocator);
+    var specialized = try Self.init(allocator, @bitCast(@as(u64, 0)), t, value.items);
+    defer specialized.deinit(allocator);
+    specialized.applier = specialize(t);
+
+    // setting the flag and the second offset, and then the same with an offset out of bounds
+    for ([_]ArrayIndex{ 1, 2 }, [_]bool{ true, false }) |index, valid| {
+        var mutation = std.ArrayList(u8).init(allocator);
+        defer mutation.deinit();
+        try serde.writeElem(&mutation, &.{ 1, 1 });
+        try serde.writeElem(&mutation, &.{0});
+        var op = std.ArrayList(u8).init(allocator);
+        defer op.deinit();
+        try serde.writeElem(&op, std.mem.asBytes(&index));
+        try serde.writeElem(&op, std.mem.asBytes(&@as(i16, 9)));
+        scratch.clearRetainingCapacity();
+        try scratch.append(1);
+        try scratch.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+        try serde.writeElem(&scratch, op.items);
+        try serde.writeElem(&mutation, scratch.items);
+
+        try std.testing.expectEqual(valid, try generic.update(allocator, mutation.items));
+        try std.testing.expectEqual(valid, try specialized.update(allocator, mutation.items));
+        try std.testing.expect(generic.eql(&specialized));
+    }
+    try std.testing.expectEqual(@as(i16, 9), specialized.state.Struct[1].Column.values(.I16)[1]);
+}
+
+test "planned" {
+    const allocator = std.testing.allocator;
+    const u32_type = cy.def.Type{ .Int = cy.def.Type.Int{ .signedness = .unsigned, .bits = 32 } };
+    const inner = cy.def.Type{
+        .Struct = cy.def.Type.Struct{
+            .fields = &[_]cy.def.Type.Struct.Field{
+                .{ .name = "id", .type = u32_type },
+                .{ .name = "name", .type = .String },
+            },
+        },
+    };
+    const t = cy.def.Type{
+        .Struct = cy.def.Type.Struct{
+            .fields = &[_]cy.def.Type.Struct.Field{
+                .{ .name = "flag", .type = .Bool },
+                .{ .name = "inner", .type = inner },
+                .{
+                    .name = "names",
+                    .type = cy.def.Type{
+                        .Array = cy.def.Type.Array{ .len = 2, .child = &@as(cy.def.Type, .String) },
+                    },
+                },
+            },
+        },
+    };
+
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    var scratch = std.ArrayList(u8).init(allocator);
+    defer scratch.deinit();
+    var text = std.ArrayList(u8).init(allocator);
+    defer text.deinit();
+
+    try serde.writeElem(&value, &.{0});
+    try serde.writeElem(&scratch, std.mem.asBytes(&@as(u32, 7)));
+    try serde.writeElem(&text, "ab");
+    try serde.writeElem(&scratch, text.items);
+    try serde.writeElem(&value, scratch.items);
+    scratch.clearRetainingCapacity();
+    for ([_][]const u8{ "x", "y" }) |name| {
+        text.clearRetainingCapacity();
+        try serde.writeElem(&text, name);
+        try serde.writeElem(&scratch, text.items);
+    }
+    try serde.writeElem(&value, scratch.items);
+
+    var plan = try Plan.init(allocator, t);
+    defer plan.deinit(allocator);
+
+    var generic = try Self.init(allocator, @bitCast(@as(u64, 0)), t, value.items);
+    defer generic.deinit(allocator);
+    try generic.keepJournal(allocator, 4096);
+    var planned = try Self.init(allocator, @bitCast(@as(u64, 0)), t, value.items);
+    defer planned.deinit(allocator);
+    try planned.keepJournal(allocator, 4096);
+    planned.plan = &plan;
+
+    // appending "cd" to the inner name
+    var append = std.ArrayList(u8).init(allocator);
+    defer append.deinit();
+    try append.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    text.clearRetainingCapacity();
+    try serde.writeElem(&text, "cd");
+    try serde.writeOp(&append, @intFromEnum(serde.MutateStringOp.Tag.Append), text.items);
+
+    // setting the flag and appending to the inner name and to the second name, and then the same with a
+    // name out of bounds
+    for ([_]ArrayIndex{ 1, 2 }, [_]bool{ true, false }) |index, valid| {
+        var mutation = std.ArrayList(u8).init(allocator);
+        defer mutation.deinit();
+        try serde.writeElem(&mutation, &.{ 1, 1 });
+        scratch.clearRetainingCapacity();
+        try scratch.append(1);
+        try serde.writeElem(&scratch, &.{0});
+        text.clearRetainingCapacity();
+        try text.append(1);
+        try text.appendSlice(append.items);
+        try serde.writeElem(&scratch, text.items);
+        try serde.writeElem(&mutation, scratch.items);
+
+        var op = std.ArrayList(u8).init(allocator);
+        defer op.deinit();
+        try serde.writeElem(&op, std.mem.asBytes(&index));
+        try serde.writeElem(&op, append.items);
+        scratch.clearRetainingCapacity();
+        try scratch.append(1);
+        try scratch.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+        try serde.writeElem(&scratch, op.items);
+        try serde.writeElem(&mutation, scratch.items);
+
+        try std.testing.expectEqual(valid, try generic.update(allocator, mutation.items));
+        try std.testing.expectEqual(valid, try planned.update(allocator, mutation.items));
+        try std.testing.expect(generic.eql(&planned));
+    }
+    try expectText("abcd", planned.state.Struct[0].Struct[0].String);
+    try expectText("ycd", planned.state.Struct[1].Array[1].String);
+
+    // both record the same inverse
+    try std.testing.expect(try generic.undo(allocator, null));
+    try std.testing.expect(try planned.undo(allocator, null));
+    try std.testing.expect(generic.eql(&planned));
+    try expectText("y", planned.state.Struct[1].Array[1].String);
+}
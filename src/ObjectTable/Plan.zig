@@ -0,0 +1,186 @@
+//! The updates to a type known only at runtime, compiled once into a flat list of steps that `Object`
+//! follows instead of the type. Following the type means asking, at every struct on every update, which of
+//! its fields have state, and the answer is in the whole subtree of each field. The plan answers it once.
+//!
+//! Steps are in pre-order, like the nodes of a `StateTape.Layout`. The fields of a struct or tuple are next
+//! to each other in `fields`, each with its step and where its state is, so that a field without state is
+//! skipped on a single load. Optionals, maps, unions and lists of values with state are left to `Object`,
+//! which updates them along their type as it does without a plan.
+const std = @import("std");
+const cy = @import("cycle");
+const Column = @import("Column.zig");
+const Object = @import("Object.zig");
+
+steps: []const Step,
+fields: []const Field,
+
+pub const Op = enum(u8) {
+    // no state, the mutation is only recorded
+    Skip,
+    String,
+    // arrays and lists of scalars
+    ArrayColumn,
+    ListColumn,
+    Array,
+    // shared by structs and tuples
+    Struct,
+    // updated along the type
+    Generic,
+};
+
+pub const Step = struct {
+    op: Op,
+    /// Array: the step of the elements. Struct: the index of the first field in `fields`.
+    arg: u32 = 0,
+    /// Array: the number of elements. Struct: the number of fields.
+    len: u32 = 0,
+    /// The type the step updates, for the steps that leave the update to `Object`.
+    type: cy.def.Type,
+};
+
+pub const Field = struct {
+    step: u32,
+    /// The index of the field's state among those of its struct, for fields with state.
+    slot: u32,
+};
+
+const Self = @This();
+
+pub fn init(allocator: std.mem.Allocator, t: cy.def.Type) !Self {
+    var builder = Builder{
+        .steps = std.ArrayList(Step).init(allocator),
+        .fields = std.ArrayList(Field).init(allocator),
+    };
+    errdefer {
+        builder.steps.deinit();
+        builder.fields.deinit();
+    }
+
+    _ = try builder.add(t);
+
+    const steps = try builder.steps.toOwnedSlice();
+    errdefer allocator.free(steps);
+    return Self{
+        .steps = steps,
+        .fields = try builder.fields.toOwnedSlice(),
+    };
+}
+
+pub fn deinit(self: *Self, allocator: std.mem.Allocator) void {
+    allocator.free(self.steps);
+    allocator.free(self.fields);
+    self.* = undefined;
+}
+
+const Builder = struct {
+    steps: std.ArrayList(Step),
+    fields: std.ArrayList(Field),
+
+    fn add(self: *Builder, t: cy.def.Type) std.mem.Allocator.Error!u32 {
+        const index: u32 = @intCast(self.steps.items.len);
+        try self.steps.append(undefined);
+
+        const step: Step = switch (t) {
+            .Void, .Bool, .Int, .Float, .Enum, .Ref, .Any => Step{ .op = .Skip, .type = t },
+            .String => Step{ .op = .String, .type = t },
+            .Array => |info| blk: {
+                if (Column.kindOf(info.child.*) != null) {
+                    break :blk Step{ .op = .ArrayColumn, .type = t };
+                }
+                const child = try self.add(info.child.*);
+                if (self.steps.items[child].op == .Skip) {
+                    // the element's step is left in place, unused
+                    break :blk Step{ .op = .Skip, .type = t };
+                }
+                break :blk Step{
+                    .op = .Array,
+                    .arg = child,
+                    .len = @intCast(info.len),
+                    .type = t,
+                };
+            },
+            .List => |info| Step{
+                .op = if (Column.kindOf(info.child.*) != null) .ListColumn else .Generic,
+                .type = t,
+            },
+            .Optional, .Map => Step{ .op = .Generic, .type = t },
+            .Union => Step{ .op = if (Object.typeHasState(t)) .Generic else .Skip, .type = t },
+            .Struct => |info| try self.addFields(t, info.fields),
+            .Tuple => |info| try self.addFields(t, info.fields),
+        };
+
+        self.steps.items[index] = step;
+        return index;
+    }
+
+    fn addFields(self: *Builder, t: cy.def.Type, fields: anytype) std.mem.Allocator.Error!Step {
+        // the fields of a struct are contiguous, so they're reserved before any nested fields are added
+        const start: u32 = @intCast(self.fields.items.len);
+        try self.fields.appendNTimes(undefined, fields.len);
+
+        var slot: u32 = 0;
+        for (fields, 0..) |f, i| {
+            const child = try self.add(f.type);
+            self.fields.items[start + i] = Field{ .step = child, .slot = slot };
+            if (self.steps.items[child].op != .Skip) {
+                slot += 1;
+            }
+        }
+
+        if (slot == 0) {
+            return Step{ .op = .Skip, .type = t };
+        }
+        return Step{
+            .op = .Struct,
+            .arg = start,
+            .len = @intCast(fields.len),
+            .type = t,
+        };
+    }
+};
+
+test {
+    const allocator = std.testing.allocator;
+
+    const u32_type = cy.def.Type{ .Int = cy.def.Type.Int{ .signedness = .unsigned, .bits = 32 } };
+    const point = cy.def.Type{
+        .Tuple = cy.def.Type.Tuple{
+            .fields = &[_]cy.def.Type.Tuple.Field{ .{ .type = u32_type }, .{ .type = u32_type } },
+        },
+    };
+    const t = cy.def.Type{
+        .Struct = cy.def.Type.Struct{
+            .fields = &[_]cy.def.Type.Struct.Field{
+                .{ .name = "at", .type = point },
+                .{ .name = "name", .type = .String },
+                .{
+                    .name = "names",
+                    .type = cy.def.Type{ .Array = cy.def.Type.Array{ .len = 3, .child = &@as(cy.def.Type, .String) } },
+                },
+                .{
+                    .name = "values",
+                    .type = cy.def.Type{ .List = cy.def.Type.List{ .child = &u32_type } },
+                },
+            },
+        },
+    };
+
+    var plan = try Self.init(allocator, t);
+    defer plan.deinit(allocator);
+
+    const root = plan.steps[0];
+    try std.testing.expectEqual(Op.Struct, root.op);
+    const fields = plan.fields[root.arg..][0..root.len];
+    try std.testing.expectEqual(Op.Skip, plan.steps[fields[0].step].op);
+    try std.testing.expectEqual(Op.String, plan.steps[fields[1].step].op);
+    try std.testing.expectEqual(@as(u32, 0), fields[1].slot);
+
+    const names = plan.steps[fields[2].step];
+    try std.testing.expectEqual(Op.Array, names.op);
+    try std.testing.expectEqual(@as(u32, 3), names.len);
+    try std.testing.expectEqual(Op.String, plan.steps[names.arg].op);
+    try std.testing.expectEqual(@as(u32, 1), fields[2].slot);
+
+    try std.testing.expectEqual(Op.ListColumn, plan.steps[fields[3].step].op);
+    try std.testing.expectEqual(@as(u32, 2), fields[3].slot);
+}
@@ -0,0 +1,479 @@
+//! The contents of a string in an object's state, kept as a persistent rope: a balanced tree of byte
+//! chunks that is never changed in place. An edit splits and joins the tree in O(log n), building a new
+//! version that shares every untouched node with the old one, so holding on to the previous version costs
+//! nothing and going back to it is just a matter of keeping its root. The versions of an object in different
+//! snapshots share their ropes the same way.
+//!
+//! Indices are byte offsets into the UTF-8 contents, as in `MutateString` ops.
+const std = @import("std");
+
+root: ?*Node = null,
+
+// Chunks hold at most this many bytes. Edits that leave two small chunks next to each other merge them.
+const max_chunk = 1024;
+
+const Node = struct {
+    // A version holds a reference to its root, and every branch to its children. Atomic, since a version
+    // held by a snapshot is released on the thread of its reader while the writer edits a later one.
+    refs: std.atomic.Value(u32),
+    // chunks are at height 0
+    height: u8,
+    len: usize,
+    data: union {
+        chunk: []u8,
+        branch: struct {
+            left: *Node,
+            right: *Node,
+        },
+    },
+};
+
+pub const Error = std.mem.Allocator.Error;
+
+const Self = @This();
+
+pub fn init(allocator: std.mem.Allocator, bytes: []const u8) Error!Self {
+    return Self{
+        .root = try build(allocator, bytes),
+    };
+}
+
+/// Drops this version. Nodes shared with other versions stay alive.
+pub fn deinit(self: *Self, allocator: std.mem.Allocator) void {
+    if (self.root) |root| {
+        release(allocator, root);
+    }
+    self.* = undefined;
+}
+
+/// Returns another reference to the same version, which has to be deinitialized on its own.
+pub fn share(self: Self) Self {
+    return Self{
+        .root = if (self.root) |root| acquire(root) else null,
+    };
+}
+
+pub fn len(self: Self) usize {
+    return if (self.root) |root| root.len else 0;
+}
+
+/// Inserts `bytes` before the byte at `index`. The version is left unchanged if this fails.
+pub fn insert(self: *Self, allocator: std.mem.Allocator, index: usize, bytes: []const u8) Error!void {
+    std.debug.assert(index <= self.len());
+    if (bytes.len == 0) {
+        return;
+    }
+
+    const inserted = try build(allocator, bytes);
+    const left, const right = split(allocator, self.root, index) catch |e| {
+        release(allocator, inserted.?);
+        return e;
+    };
+    const head = join(allocator, left, inserted) catch |e| {
+        releaseOptional(allocator, right);
+        return e;
+    };
+    self.replace(allocator, try join(allocator, head, right));
+}
+
+/// Removes `count` bytes from `index` on. The version is left unchanged if this fails.
+pub fn delete(self: *Self, allocator: std.mem.Allocator, index: usize, count: usize) Error!void {
+    std.debug.assert(index + count <= self.len());
+    if (count == 0) {
+        return;
+    }
+
+    const left, const rest = try split(allocator, self.root, index);
+    const removed, const right = split(allocator, rest, count) catch |e| {
+        releaseOptional(allocator, left);
+        releaseOptional(allocator, rest);
+        return e;
+    };
+    releaseOptional(allocator, rest);
+    releaseOptional(allocator, removed);
+    self.replace(allocator, try join(allocator, left, right));
+}
+
+fn replace(self: *Self, allocator: std.mem.Allocator, root: ?*Node) void {
+    releaseOptional(allocator, self.root);
+    self.root = root;
+}
+
+/// Copies the bytes from `index` on into `out`.
+pub fn read(self: Self, index: usize, out: []u8) void {
+    std.debug.assert(index + out.len <= self.len());
+    var writer = struct {
+        out: []u8,
+        written: usize = 0,
+
+        fn chunk(w: *@This(), bytes: []const u8) void {
+            @memcpy(w.out[w.written..][0..bytes.len], bytes);
+            w.written += bytes.len;
+        }
+    }{ .out = out };
+    if (self.root) |root| {
+        visit(root, index, index + out.len, &writer);
+    }
+}
+
+/// Appends the codepoints of the bytes in `start..end` to `out`, ready to be passed on as UTF-32 text.
+/// Only the range is decoded, straight from the chunks. Invalid UTF-8, including sequences cut off by the
+/// bounds of the range, is decoded as U+FFFD.
+pub fn readUtf32(self: Self, start: usize, end: usize, out: *std.ArrayList(u32)) Error!void {
+    std.debug.assert(start <= end and end <= self.len());
+    // at most one codepoint per byte
+    try out.ensureUnusedCapacity(end - start);
+
+    var decoder = Utf8Decoder{ .out = out };
+    if (self.root) |root| {
+        visit(root, start, end, &decoder);
+    }
+    decoder.finish();
+}
+
+const replacement_char = 0xfffd;
+
+const Utf8Decoder = struct {
+    out: *std.ArrayList(u32),
+    // a sequence that continues in the next chunk
+    seq: [4]u8 = undefined,
+    seq_len: u3 = 0,
+    seq_need: u3 = 0,
+
+    fn chunk(d: *Utf8Decoder, bytes: []const u8) void {
+        for (bytes) |b| {
+            if (d.seq_len > 0) {
+                if (b & 0xc0 != 0x80) {
+                    d.out.appendAssumeCapacity(replacement_char);
+                    d.seq_len = 0;
+                } else {
+                    d.seq[d.seq_len] = b;
+                    d.seq_len += 1;
+                    if (d.seq_len == d.seq_need) {
+                        const c = std.unicode.utf8Decode(d.seq[0..d.seq_len]) catch replacement_char;
+                        d.out.appendAssumeCapacity(c);
+                        d.seq_len = 0;
+                    }
+                    continue;
+                }
+            }
+
+            if (b < 0x80) {
+                d.out.appendAssumeCapacity(b);
+                continue;
+            }
+            const seq_len = std.unicode.utf8ByteSequenceLength(b) catch {
+                d.out.appendAssumeCapacity(replacement_char);
+                continue;
+            };
+            d.seq[0] = b;
+            d.seq_len = 1;
+            d.seq_need = seq_len;
+        }
+    }
+
+    fn finish(d: *Utf8Decoder) void {
+        if (d.seq_len > 0) {
+            d.out.appendAssumeCapacity(replacement_char);
+            d.seq_len = 0;
+        }
+    }
+};
+
+/// Passes the chunks of `node` that overlap `start..end`, cut to the range, to `sink.chunk` in order.
+fn visit(node: *const Node, start: usize, end: usize, sink: anytype) void {
+    if (start >= end) {
+        return;
+    }
+    if (node.height == 0) {
+        sink.chunk(node.data.chunk[start..end]);
+        return;
+    }
+
+    const left = node.data.branch.left;
+    const right = node.data.branch.right;
+    if (start < left.len) {
+        visit(left, start, @min(end, left.len), sink);
+    }
+    if (end > left.len) {
+        visit(right, start -| left.len, end - left.len, sink);
+    }
+}
+
+fn acquire(node: *Node) *Node {
+    _ = node.refs.fetchAdd(1, .monotonic);
+    return node;
+}
+
+fn release(allocator: std.mem.Allocator, node: *Node) void {
+    if (node.refs.fetchSub(1, .acq_rel) != 1) {
+        return;
+    }
+
+    if (node.height == 0) {
+        allocator.free(node.data.chunk);
+    } else {
+        release(allocator, node.data.branch.left);
+        release(allocator, node.data.branch.right);
+    }
+    allocator.destroy(node);
+}
+
+fn releaseOptional(allocator: std.mem.Allocator, node: ?*Node) void {
+    if (node) |n| {
+        release(allocator, n);
+    }
+}
+
+// Every function below that takes nodes as owned takes over their references, even when it fails.
+
+fn newChunk(allocator: std.mem.Allocator, bytes: []const u8) Error!*Node {
+    const chunk = try allocator.dupe(u8, bytes);
+    errdefer allocator.free(chunk);
+
+    const node = try allocator.create(Node);
+    node.* = Node{
+        .refs = std.atomic.Value(u32).init(1),
+        .height = 0,
+        .len = chunk.len,
+        .data = .{ .chunk = chunk },
+    };
+    return node;
+}
+
+/// Takes over `left` and `right`.
+fn newBranch(allocator: std.mem.Allocator, left: *Node, right: *Node) Error!*Node {
+    errdefer {
+        release(allocator, left);
+        release(allocator, right);
+    }
+
+    const node = try allocator.create(Node);
+    node.* = Node{
+        .refs = std.atomic.Value(u32).init(1),
+        .height = @max(left.height, right.height) + 1,
+        .len = left.len + right.len,
+        .data = .{ .branch = .{ .left = left, .right = right } },
+    };
+    return node;
+}
+
+/// Takes over `node`, returning its children.
+fn unpack(allocator: std.mem.Allocator, node: *Node) struct { *Node, *Node } {
+    const left = acquire(node.data.branch.left);
+    const right = acquire(node.data.branch.right);
+    release(allocator, node);
+    return .{ left, right };
+}
+
+/// Builds a balanced tree of full chunks.
+fn build(allocator: std.mem.Allocator, bytes: []const u8) Error!?*Node {
+    if (bytes.len == 0) {
+        return null;
+    }
+    if (bytes.len <= max_chunk) {
+        return try newChunk(allocator, bytes);
+    }
+
+    const chunks = std.math.divCeil(usize, bytes.len, max_chunk) catch unreachable;
+    const mid = chunks / 2 * max_chunk;
+    const left = (try build(allocator, bytes[0..mid])).?;
+    const right = (build(allocator, bytes[mid..]) catch |e| {
+        release(allocator, left);
+        return e;
+    }).?;
+    return try newBranch(allocator, left, right);
+}
+
+/// Concatenates two trees, taking over both.
+fn join(allocator: std.mem.Allocator, left_opt: ?*Node, right_opt: ?*Node) Error!?*Node {
+    const left = left_opt orelse return right_opt;
+    const right = right_opt orelse return left;
+
+    if (left.height == 0 and right.height == 0 and left.len + right.len <= max_chunk) {
+        defer {
+            release(allocator, left);
+            release(allocator, right);
+        }
+        const node = try newChunk(allocator, left.data.chunk);
+        const chunk = allocator.realloc(node.data.chunk, left.len + right.len) catch |e| {
+            release(allocator, node);
+            return e;
+        };
+        @memcpy(chunk[left.len..], right.data.chunk);
+        node.data.chunk = chunk;
+        node.len = chunk.len;
+        return node;
+    }
+
+    // The shorter tree is joined into the spine of the taller one, at the first node that is about as high
+    // as itself, and the spine is rebalanced on the way back up.
+    if (left.height > right.height + 1) {
+        const left_left, const left_right = unpack(allocator, left);
+        const joined = join(allocator, left_right, right) catch |e| {
+            release(allocator, left_left);
+            return e;
+        };
+        return try balance(allocator, left_left, joined.?);
+    }
+    if (right.height > left.height + 1) {
+        const right_left, const right_right = unpack(allocator, right);
+        const joined = join(allocator, left, right_left) catch |e| {
+            release(allocator, right_right);
+            return e;
+        };
+        return try balance(allocator, joined.?, right_right);
+    }
+    return try newBranch(allocator, left, right);
+}
+
+/// Joins two trees whose heights differ by at most two, rotating if needed. Takes over both.
+fn balance(allocator: std.mem.Allocator, left: *Node, right: *Node) Error!*Node {
+    if (left.height > right.height + 1) {
+        const ll, const lr = unpack(allocator, left);
+        if (ll.height >= lr.height) {
+            const new_right = newBranch(allocator, lr, right) catch |e| {
+                release(allocator, ll);
+                return e;
+            };
+            return newBranch(allocator, ll, new_right);
+        }
+
+        const lrl, const lrr = unpack(allocator, lr);
+        const new_left = newBranch(allocator, ll, lrl) catch |e| {
+            release(allocator, lrr);
+            release(allocator, right);
+            return e;
+        };
+        const new_right = newBranch(allocator, lrr, right) catch |e| {
+            release(allocator, new_left);
+            return e;
+        };
+        return newBranch(allocator, new_left, new_right);
+    }
+
+    if (right.height > left.height + 1) {
+        const rl, const rr = unpack(allocator, right);
+        if (rr.height >= rl.height) {
+            const new_left = newBranch(allocator, left, rl) catch |e| {
+                release(allocator, rr);
+                return e;
+            };
+            return newBranch(allocator, new_left, rr);
+        }
+
+        const rll, const rlr = unpack(allocator, rl);
+        const new_left = newBranch(allocator, left, rll) catch |e| {
+            release(allocator, rlr);
+            release(allocator, rr);
+            return e;
+        };
+        const new_right = newBranch(allocator, rlr, rr) catch |e| {
+            release(allocator, new_left);
+            return e;
+        };
+        return newBranch(allocator, new_left, new_right);
+    }
+
+    return newBranch(allocator, left, right);
+}
+
+/// Splits `node` before the byte at `index`. `node` stays with the caller, the halves are new references.
+fn split(allocator: std.mem.Allocator, node_opt: ?*Node, index: usize) Error!struct { ?*Node, ?*Node } {
+    const node = node_opt orelse return .{ null, null };
+    if (index == 0) {
+        return .{ null, acquire(node) };
+    }
+    if (index == node.len) {
+        return .{ acquire(node), null };
+    }
+
+    if (node.height == 0) {
+        const left = try newChunk(allocator, node.data.chunk[0..index]);
+        const right = newChunk(allocator, node.data.chunk[index..]) catch |e| {
+            release(allocator, left);
+            return e;
+        };
+        return .{ left, right };
+    }
+
+    const left = node.data.branch.left;
+    const right = node.data.branch.right;
+    if (index <= left.len) {
+        const left_left, const left_right = try split(allocator, left, index);
+        const joined = join(allocator, left_right, acquire(right)) catch |e| {
+            releaseOptional(allocator, left_left);
+            return e;
+        };
+        return .{ left_left, joined };
+    }
+
+    const right_left, const right_right = try split(allocator, right, index - left.len);
+    const joined = join(allocator, acquire(left), right_left) catch |e| {
+        releaseOptional(allocator, right_right);
+        return e;
+    };
+    return .{ joined, right_right };
+}
+
+test "edits match a flat copy and keep earlier versions" {
+    const allocator = std.testing.allocator;
+
+    var expected = std.ArrayList(u8).init(allocator);
+    defer expected.deinit();
+    for (0..10_000) |i| {
+        try expected.append(@intCast('a' + i % 26));
+    }
+
+    var rope = try Self.init(allocator, expected.items);
+    defer rope.deinit(allocator);
+
+    var original = rope.share();
+    defer original.deinit(allocator);
+
+    var prng = std.rand.DefaultPrng.init(0);
+    const random = prng.random();
+    for (0..2_000) |_| {
+        if (random.boolean() and expected.items.len > 0) {
+            const index = random.uintLessThan(usize, expected.items.len);
+            const count = random.uintAtMost(usize, @min(expected.items.len - index, 3000));
+            try expected.replaceRange(index, count, "");
+            try rope.delete(allocator, index, count);
+        } else {
+            const index = random.uintAtMost(usize, expected.items.len);
+            const text = "0123456789"[0..random.uintAtMost(usize, 10)];
+            try expected.insertSlice(index, text);
+            try rope.insert(allocator, index, text);
+        }
+    }
+
+    const contents = try allocator.alloc(u8, rope.len());
+    defer allocator.free(contents);
+    rope.read(0, contents);
+    try std.testing.expectEqualStrings(expected.items, contents);
+    try std.testing.expect(rope.root == null or rope.root.?.height <= 2 * std.math.log2_int_ceil(usize, @max(2, rope.len())));
+
+    try std.testing.expectEqual(@as(usize, 10_000), original.len());
+    var first = [_]u8{0} ** 3;
+    original.read(0, &first);
+    try std.testing.expectEqualStrings("abc", &first);
+}
+
+test "utf-32" {
+    const allocator = std.testing.allocator;
+
+    var rope = try Self.init(allocator, "a\u{e9}");
+    defer rope.deinit(allocator);
+    try rope.insert(allocator, rope.len(), "\u{1f600}b");
+    try rope.insert(allocator, 1, "\u{4e2d}");
+
+    var out = std.ArrayList(u32).init(allocator);
+    defer out.deinit();
+    try rope.readUtf32(0, rope.len(), &out);
+    try std.testing.expectEqualSlices(u32, &.{ 'a', 0x4e2d, 0xe9, 0x1f600, 'b' }, out.items);
+
+    // starts inside the 3 byte sequence
+    out.clearRetainingCapacity();
+    try rope.readUtf32(2, 4, &out);
+    try std.testing.expectEqualSlices(u32, &.{ replacement_char, replacement_char }, out.items);
+}
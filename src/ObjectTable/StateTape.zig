@@ -0,0 +1,1047 @@
+//! A flat alternative to the pointer based state tree of `Object`.
+//!
+//! The state of an object is laid out as a run of words, following a `Layout` that is computed once per
+//! type. The layout is a pre-order array of nodes with precomputed offsets, so the state of a struct field,
+//! array element, optional child or union payload sits inline in its parent's words. Only lists and maps
+//! need storage that can grow; each of those gets its own segment of words, referenced from its parent by
+//! segment index. The root is segment 0, so a segment word of 0 means "no segment".
+//!
+//! Since state is addressed by segment and offset instead of by pointer, the undo log of an update stays
+//! valid no matter how segments grow or move.
+const std = @import("std");
+const cy = @import("cycle");
+const serde = @import("serde.zig");
+const keys = @import("keys.zig");
+
+allocator: std.mem.Allocator,
+layout: *const Layout,
+interner: keys.Interner,
+segments: std.ArrayListUnmanaged(Segment) = .{},
+// always has capacity for every segment, so that releasing a segment can't fail
+free_segments: std.ArrayListUnmanaged(u32) = .{},
+
+pub const Layout = struct {
+    nodes: []const Node,
+    fields: []const Field,
+
+    pub fn init(allocator: std.mem.Allocator, t: cy.def.Type) !Layout {
+        var builder = LayoutBuilder{
+            .nodes = std.ArrayList(Node).init(allocator),
+            .fields = std.ArrayList(Field).init(allocator),
+        };
+        errdefer {
+            builder.nodes.deinit();
+            builder.fields.deinit();
+        }
+
+        _ = try builder.add(t);
+
+        const nodes = try builder.nodes.toOwnedSlice();
+        errdefer allocator.free(nodes);
+        return Layout{
+            .nodes = nodes,
+            .fields = try builder.fields.toOwnedSlice(),
+        };
+    }
+
+    pub fn deinit(self: *Layout, allocator: std.mem.Allocator) void {
+        allocator.free(self.nodes);
+        allocator.free(self.fields);
+        self.* = undefined;
+    }
+
+    fn width(self: *const Layout, node: u32) u32 {
+        return self.nodes[node].width;
+    }
+};
+
+pub const Node = struct {
+    kind: Kind,
+    /// Words taken up inline in the parent.
+    width: u32,
+    /// Whether this node or any of its descendants refers to a segment.
+    has_segments: bool,
+    /// Optional, Array, List and Map: the node of the child, element or value.
+    child: u32 = 0,
+    /// Array: the number of elements. Struct and Union: the number of fields.
+    len: u32 = 0,
+    /// Struct and Union: the index of the first field in `Layout.fields`.
+    fields: u32 = 0,
+
+    const stateless = Node{
+        .kind = .Stateless,
+        .width = 0,
+        .has_segments = false,
+    };
+};
+
+pub const Kind = enum {
+    Stateless,
+    // len
+    String,
+    // present flag, followed by the child
+    Optional,
+    // elements back to back
+    Array,
+    // len, for lists of stateless elements
+    ListLen,
+    // segment index
+    List,
+    // segment index
+    Map,
+    // stateful fields back to back, shared by structs and tuples
+    Struct,
+    // tag, followed by the widest field
+    Union,
+};
+
+pub const Field = struct {
+    node: u32,
+    offset: u32,
+};
+
+const LayoutBuilder = struct {
+    nodes: std.ArrayList(Node),
+    fields: std.ArrayList(Field),
+
+    fn add(self: *LayoutBuilder, t: cy.def.Type) std.mem.Allocator.Error!u32 {
+        const index: u32 = @intCast(self.nodes.items.len);
+        try self.nodes.append(undefined);
+
+        const node: Node = switch (t) {
+            .Void, .Bool, .Int, .Float, .Enum, .Ref, .Any => Node.stateless,
+            .String => Node{
+                .kind = .String,
+                .width = 1,
+                .has_segments = false,
+            },
+            .Optional => |info| blk: {
+                const child = try self.add(info.child.*);
+                break :blk Node{
+                    .kind = .Optional,
+                    .width = 1 + self.nodes.items[child].width,
+                    .has_segments = self.nodes.items[child].has_segments,
+                    .child = child,
+                };
+            },
+            .Array => |info| blk: {
+                const child = try self.add(info.child.*);
+                if (self.nodes.items[child].kind == .Stateless or info.len == 0) {
+                    break :blk Node.stateless;
+                }
+                break :blk Node{
+                    .kind = .Array,
+                    .width = @intCast(info.len * self.nodes.items[child].width),
+                    .has_segments = self.nodes.items[child].has_segments,
+                    .child = child,
+                    .len = @intCast(info.len),
+                };
+            },
+            .List => |info| blk: {
+                const child = try self.add(info.child.*);
+                const stateless_child = self.nodes.items[child].kind == .Stateless;
+                break :blk Node{
+                    .kind = if (stateless_child) .ListLen else .List,
+                    .width = 1,
+                    .has_segments = !stateless_child,
+                    .child = child,
+                };
+            },
+            .Map => |info| blk: {
+                const child = try self.add(info.value.*);
+                break :blk Node{
+                    .kind = .Map,
+                    .width = 1,
+                    .has_segments = true,
+                    .child = child,
+                };
+            },
+            .Struct => |info| try self.addFields(.Struct, info.fields),
+            .Tuple => |info| try self.addFields(.Struct, info.fields),
+            .Union => |info| try self.addFields(.Union, info.fields),
+        };
+
+        self.nodes.items[index] = node;
+        return index;
+    }
+
+    fn addFields(self: *LayoutBuilder, kind: Kind, fields: anytype) std.mem.Allocator.Error!Node {
+        // the fields of a node are contiguous, so they're reserved before any nested fields are added
+        const start: u32 = @intCast(self.fields.items.len);
+        try self.fields.appendNTimes(undefined, fields.len);
+
+        var width: u32 = 0;
+        var stateful = false;
+        var has_segments = false;
+        for (fields, 0..) |f, i| {
+            const child = try self.add(f.type);
+            const child_node = self.nodes.items[child];
+            if (kind == .Union) {
+                self.fields.items[start + i] = Field{ .node = child, .offset = 1 };
+                width = @max(width, child_node.width);
+            } else {
+                self.fields.items[start + i] = Field{ .node = child, .offset = width };
+                width += child_node.width;
+            }
+            stateful = stateful or child_node.kind != .Stateless;
+            has_segments = has_segments or child_node.has_segments;
+        }
+
+        if (!stateful) {
+            return Node.stateless;
+        }
+        return Node{
+            .kind = kind,
+            .width = if (kind == .Union) 1 + width else width,
+            .has_segments = has_segments,
+            .len = @intCast(fields.len),
+            .fields = start,
+        };
+    }
+};
+
+const Segment = union(enum) {
+    /// The elements of a list, back to back.
+    List: std.ArrayListUnmanaged(u64),
+    Map: MapSegment,
+    Free,
+};
+
+const MapSegment = struct {
+    slots: keys.MapUnmanaged(u32) = .{},
+    /// The values of the map, one slot per entry.
+    words: std.ArrayListUnmanaged(u64) = .{},
+    free: std.ArrayListUnmanaged(u32) = .{},
+};
+
+const Loc = struct {
+    seg: u32,
+    offset: usize,
+
+    fn plus(loc: Loc, offset: usize) Loc {
+        return Loc{
+            .seg = loc.seg,
+            .offset = loc.offset + offset,
+        };
+    }
+};
+
+const root = Loc{ .seg = 0, .offset = 0 };
+
+pub const Error = std.mem.Allocator.Error || error{InvalidUnion};
+
+const Self = @This();
+
+pub fn init(allocator: std.mem.Allocator, layout: *const Layout, bytes: []const u8) Error!Self {
+    var self = Self{
+        .allocator = allocator,
+        .layout = layout,
+        .interner = keys.Interner.init(allocator),
+    };
+    errdefer self.deinit();
+
+    _ = try self.newSegment(.{ .List = .{} });
+    try self.segments.items[0].List.appendNTimes(allocator, 0, layout.width(0));
+    try self.initNode(0, root, bytes);
+    return self;
+}
+
+/// Releases every segment without walking the state.
+pub fn deinit(self: *Self) void {
+    for (self.segments.items) |*segment| {
+        self.deinitSegment(segment);
+    }
+    self.segments.deinit(self.allocator);
+    self.free_segments.deinit(self.allocator);
+    self.interner.deinit();
+    self.* = undefined;
+}
+
+/// The number of bytes held by the tape, including spare capacity.
+pub fn memoryUsage(self: *const Self) usize {
+    var bytes = self.segments.capacity * @sizeOf(Segment) + self.free_segments.capacity * @sizeOf(u32);
+    bytes += self.interner.keys.capacity() * (@sizeOf(keys.Key) + @sizeOf(u32) + 1);
+    var key_iter = self.interner.keys.keyIterator();
+    while (key_iter.next()) |key| {
+        bytes += key.bytes.len;
+    }
+
+    for (self.segments.items) |segment| {
+        switch (segment) {
+            .List => |list| {
+                bytes += list.capacity * @sizeOf(u64);
+            },
+            .Map => |map| {
+                bytes += map.slots.capacity() * (@sizeOf(keys.Key) + @sizeOf(u32) + 1);
+                bytes += map.words.capacity * @sizeOf(u64);
+                bytes += map.free.capacity * @sizeOf(u32);
+            },
+            .Free => {},
+        }
+    }
+    return bytes;
+}
+
+fn newSegment(self: *Self, segment: Segment) !u32 {
+    if (self.free_segments.popOrNull()) |seg| {
+        self.segments.items[seg] = segment;
+        return seg;
+    }
+
+    try self.free_segments.ensureTotalCapacity(self.allocator, self.segments.items.len + 1);
+    try self.segments.append(self.allocator, segment);
+    return @intCast(self.segments.items.len - 1);
+}
+
+fn freeSegment(self: *Self, seg: u32) void {
+    switch (self.segments.items[seg]) {
+        .List, .Free => {},
+        .Map => |map| {
+            var iter = map.slots.keyIterator();
+            while (iter.next()) |key| {
+                self.interner.release(key.*);
+            }
+        },
+    }
+    self.deinitSegment(&self.segments.items[seg]);
+    self.segments.items[seg] = .Free;
+    self.free_segments.appendAssumeCapacity(seg);
+}
+
+fn deinitSegment(self: *Self, segment: *Segment) void {
+    switch (segment.*) {
+        .List => |*list| list.deinit(self.allocator),
+        // the keys are released by the caller, or freed along with the interner
+        .Map => |*map| {
+            map.slots.deinit(self.allocator);
+            map.words.deinit(self.allocator);
+            map.free.deinit(self.allocator);
+        },
+        .Free => {},
+    }
+}
+
+fn segmentWords(self: *Self, seg: u32) []u64 {
+    return switch (self.segments.items[seg]) {
+        .List => |list| list.items,
+        .Map => |map| map.words.items,
+        .Free => unreachable,
+    };
+}
+
+fn words(self: *Self, loc: Loc, len: usize) []u64 {
+    return self.segmentWords(loc.seg)[loc.offset..][0..len];
+}
+
+fn word(self: *Self, loc: Loc) *u64 {
+    return &self.segmentWords(loc.seg)[loc.offset];
+}
+
+/// Writes the state of `bytes` into the zeroed words at `loc`. If this fails partway, the segments created
+/// so far are referenced from the words, and are released along with them.
+fn initNode(self: *Self, node_index: u32, loc: Loc, bytes: []const u8) Error!void {
+    const node = self.layout.nodes[node_index];
+    switch (node.kind) {
+        .Stateless => {},
+        .String => {
+            self.word(loc).* = cy.chan.read([]const u8, bytes).len;
+        },
+        .Optional => {
+            if (serde.readOptional(bytes)) |child_bytes| {
+                self.word(loc).* = 1;
+                try self.initNode(node.child, loc.plus(1), child_bytes);
+            }
+        },
+        .Array => {
+            const child_width = self.layout.width(node.child);
+            var elems = serde.ElemIterator.init(bytes);
+            for (0..node.len) |i| {
+                try self.initNode(node.child, loc.plus(i * child_width), elems.next());
+            }
+        },
+        .ListLen => {
+            self.word(loc).* = serde.NewList.init(bytes).len();
+        },
+        .List => {
+            const elems = serde.NewList.init(bytes);
+            const child_width = self.layout.width(node.child);
+
+            const seg = try self.newSegment(.{ .List = .{} });
+            self.word(loc).* = seg;
+            try self.segments.items[seg].List.appendNTimes(self.allocator, 0, elems.len() * child_width);
+
+            var offset: usize = 0;
+            var iter = elems.iterator();
+            while (iter.nextBytes()) |elem| : (offset += child_width) {
+                try self.initNode(node.child, Loc{ .seg = seg, .offset = offset }, elem);
+            }
+        },
+        .Map => {
+            const entries = serde.NewMap.init(bytes);
+            const seg = try self.newSegment(.{ .Map = .{} });
+            self.word(loc).* = seg;
+            try self.segments.items[seg].Map.slots.ensureUnusedCapacity(self.allocator, @intCast(entries.len()));
+            try self.interner.ensureUnusedCapacity(@intCast(entries.len()));
+
+            var iter = entries.iterator();
+            while (iter.next()) |entry| {
+                const key = keys.Key.init(entry.fieldBytes(.key));
+                const map = &self.segments.items[seg].Map;
+
+                const slot = if (map.slots.get(key)) |existing| blk: {
+                    const value = self.slotLoc(seg, existing, node.child);
+                    self.releaseNode(node.child, self.words(value, self.layout.width(node.child)));
+                    @memset(self.words(value, self.layout.width(node.child)), 0);
+                    break :blk existing;
+                } else blk: {
+                    const new_slot = try self.allocSlot(seg, node.child);
+                    map.slots.putAssumeCapacityNoClobber(try self.interner.intern(key), new_slot);
+                    break :blk new_slot;
+                };
+                try self.initNode(node.child, self.slotLoc(seg, slot, node.child), entry.fieldBytes(.value));
+            }
+        },
+        .Struct => {
+            var fields = serde.ElemIterator.init(bytes);
+            for (self.layout.fields[node.fields..][0..node.len]) |f| {
+                try self.initNode(f.node, loc.plus(f.offset), fields.next());
+            }
+        },
+        .Union => {
+            const val = serde.Union(void).init(bytes);
+            const tag = val.tagValue();
+            if (tag >= node.len) {
+                return error.InvalidUnion;
+            }
+
+            self.word(loc).* = tag;
+            const f = self.layout.fields[node.fields + tag];
+            try self.initNode(f.node, loc.plus(f.offset), val.fieldBytes());
+        },
+    }
+}
+
+/// Releases the segments referenced from `node_words`, which may live outside of the tape.
+fn releaseNode(self: *Self, node_index: u32, node_words: []const u64) void {
+    const node = self.layout.nodes[node_index];
+    if (!node.has_segments) {
+        return;
+    }
+
+    switch (node.kind) {
+        .Stateless, .String, .ListLen => {},
+        .Optional => {
+            if (node_words[0] != 0) {
+                self.releaseNode(node.child, node_words[1..]);
+            }
+        },
+        .Array => {
+            const child_width = self.layout.width(node.child);
+            for (0..node.len) |i| {
+                self.releaseNode(node.child, node_words[i * child_width ..][0..child_width]);
+            }
+        },
+        .List => {
+            const seg: u32 = @intCast(node_words[0]);
+            if (seg == 0) {
+                return;
+            }
+
+            const child_width = self.layout.width(node.child);
+            const items = self.segments.items[seg].List.items;
+            var offset: usize = 0;
+            while (offset < items.len) : (offset += child_width) {
+                self.releaseNode(node.child, items[offset..][0..child_width]);
+            }
+            self.freeSegment(seg);
+        },
+        .Map => {
+            const seg: u32 = @intCast(node_words[0]);
+            if (seg == 0) {
+                return;
+            }
+
+            const child_width = self.layout.width(node.child);
+            var iter = self.segments.items[seg].Map.slots.valueIterator();
+            while (iter.next()) |slot| {
+                self.releaseNode(node.child, self.words(self.slotLoc(seg, slot.*, node.child), child_width));
+            }
+            self.freeSegment(seg);
+        },
+        .Struct => {
+            for (self.layout.fields[node.fields..][0..node.len]) |f| {
+                self.releaseNode(f.node, node_words[f.offset..][0..self.layout.width(f.node)]);
+            }
+        },
+        .Union => {
+            const f = self.layout.fields[node.fields + @as(u32, @intCast(node_words[0]))];
+            self.releaseNode(f.node, node_words[f.offset..][0..self.layout.width(f.node)]);
+        },
+    }
+}
+
+fn slotLoc(self: *const Self, seg: u32, slot: u32, value_node: u32) Loc {
+    return Loc{
+        .seg = seg,
+        .offset = @as(usize, slot) * self.layout.width(value_node),
+    };
+}
+
+/// Returns a zeroed slot for a new map value. Stateless values all share slot 0.
+fn allocSlot(self: *Self, seg: u32, value_node: u32) !u32 {
+    const value_width = self.layout.width(value_node);
+    if (value_width == 0) {
+        return 0;
+    }
+
+    const map = &self.segments.items[seg].Map;
+    if (map.free.popOrNull()) |slot| {
+        return slot;
+    }
+
+    const slot: u32 = @intCast(map.words.items.len / value_width);
+    try map.free.ensureTotalCapacity(self.allocator, slot + 1);
+    try map.words.appendNTimes(self.allocator, 0, value_width);
+    return slot;
+}
+
+fn releaseSlot(self: *Self, seg: u32, slot: u32, value_node: u32) void {
+    const value_width = self.layout.width(value_node);
+    if (value_width == 0) {
+        return;
+    }
+
+    const value = self.words(self.slotLoc(seg, slot, value_node), value_width);
+    self.releaseNode(value_node, value);
+    @memset(value, 0);
+    self.segments.items[seg].Map.free.appendAssumeCapacity(slot);
+}
+
+/// Validates and applies the mutation in `bytes` in a single pass, leaving the tape unchanged if any op
+/// turns out to be invalid.
+pub fn update(self: *Self, bytes: []const u8) Error!bool {
+    var txn = Transaction.init(self.allocator);
+    defer txn.deinit();
+
+    const valid = self.updateNode(&txn, 0, root, bytes) catch |e| switch (e) {
+        error.InvalidUnion => false,
+        else => |err| {
+            self.rollback(&txn);
+            return err;
+        },
+    };
+
+    if (valid) {
+        self.commit(&txn);
+    } else {
+        self.rollback(&txn);
+    }
+    return valid;
+}
+
+const Transaction = struct {
+    log: std.ArrayList(Undo),
+    // words overwritten or removed by the update
+    saved: std.ArrayList(u64),
+
+    const Undo = union(enum) {
+        /// The word at `loc` held `prev` before the change.
+        Word: struct {
+            loc: Loc,
+            prev: u64,
+        },
+        /// The words of `node` at `loc` were replaced, their previous contents start at `saved`.
+        Region: struct {
+            loc: Loc,
+            node: u32,
+            saved: usize,
+        },
+        /// An element of `node` was inserted into a list at `loc`.
+        Insert: struct {
+            loc: Loc,
+            node: u32,
+        },
+        /// An element of `node` was removed from a list at `loc`, its words start at `saved`.
+        Remove: struct {
+            loc: Loc,
+            node: u32,
+            saved: usize,
+        },
+        /// A new entry was put into a map.
+        MapPut: struct {
+            seg: u32,
+            node: u32,
+            key: keys.Key,
+        },
+        /// An entry was removed from a map. Its key and slot are released on commit.
+        MapRemove: struct {
+            seg: u32,
+            node: u32,
+            key: keys.Key,
+            slot: u32,
+        },
+    };
+
+    fn init(allocator: std.mem.Allocator) Transaction {
+        return Transaction{
+            .log = std.ArrayList(Undo).init(allocator),
+            .saved = std.ArrayList(u64).init(allocator),
+        };
+    }
+
+    fn deinit(self: *Transaction) void {
+        self.log.deinit();
+        self.saved.deinit();
+        self.* = undefined;
+    }
+
+    /// Must be called before making the change recorded by `push`, so that recording it can't fail.
+    fn reserve(self: *Transaction, saved_words: usize) !void {
+        try self.log.ensureUnusedCapacity(1);
+        try self.saved.ensureUnusedCapacity(saved_words);
+    }
+
+    fn push(self: *Transaction, undo: Undo) void {
+        self.log.appendAssumeCapacity(undo);
+    }
+
+    fn save(self: *Transaction, saved_words: []const u64) usize {
+        const start = self.saved.items.len;
+        self.saved.appendSliceAssumeCapacity(saved_words);
+        return start;
+    }
+};
+
+fn commit(self: *Self, txn: *Transaction) void {
+    for (txn.log.items) |undo| {
+        switch (undo) {
+            .Word, .Insert, .MapPut => {},
+            .Region => |r| {
+                self.releaseNode(r.node, txn.saved.items[r.saved..][0..self.layout.width(r.node)]);
+            },
+            .Remove => |r| {
+                self.releaseNode(r.node, txn.saved.items[r.saved..][0..self.layout.width(r.node)]);
+            },
+            .MapRemove => |r| {
+                self.releaseSlot(r.seg, r.slot, r.node);
+                self.interner.release(r.key);
+            },
+        }
+    }
+}
+
+fn rollback(self: *Self, txn: *Transaction) void {
+    var i = txn.log.items.len;
+    while (i > 0) {
+        i -= 1;
+        switch (txn.log.items[i]) {
+            .Word => |r| {
+                self.word(r.loc).* = r.prev;
+            },
+            .Region => |r| {
+                const region = self.words(r.loc, self.layout.width(r.node));
+                self.releaseNode(r.node, region);
+                @memcpy(region, txn.saved.items[r.saved..][0..region.len]);
+            },
+            .Insert => |r| {
+                const elem_width = self.layout.width(r.node);
+                self.releaseNode(r.node, self.words(r.loc, elem_width));
+                removeWords(&self.segments.items[r.loc.seg].List, r.loc.offset, elem_width);
+            },
+            .Remove => |r| {
+                const elem_width = self.layout.width(r.node);
+                // the removal left its words as spare capacity
+                const list = &self.segments.items[r.loc.seg].List;
+                insertZeroedWords(list, r.loc.offset, elem_width);
+                @memcpy(list.items[r.loc.offset..][0..elem_width], txn.saved.items[r.saved..][0..elem_width]);
+            },
+            .MapPut => |r| {
+                const map = &self.segments.items[r.seg].Map;
+                const kv = map.slots.fetchRemove(r.key).?;
+                self.releaseSlot(r.seg, kv.value, r.node);
+                self.interner.release(kv.key);
+            },
+            .MapRemove => |r| {
+                self.segments.items[r.seg].Map.slots.putAssumeCapacityNoClobber(r.key, r.slot);
+            },
+        }
+    }
+}
+
+fn updateNode(self: *Self, txn: *Transaction, node_index: u32, loc: Loc, bytes: []const u8) Error!bool {
+    const node = self.layout.nodes[node_index];
+    switch (node.kind) {
+        .Stateless => {},
+        .String => {
+            try txn.reserve(0);
+            const len = self.word(loc);
+            txn.push(.{ .Word = .{ .loc = loc, .prev = len.* } });
+
+            var ops = serde.MutateString.init(bytes).iterator();
+            while (ops.next()) |op| {
+                switch (op.tag()) {
+                    .Append, .Prepend => {
+                        len.* += cy.chan.read([]const u8, op.fieldBytes()).len;
+                    },
+                    .Insert => {
+                        const ins = serde.MutateStringInsertOp.init(op.fieldBytes());
+                        if (ins.fieldValue(.index) > len.*) {
+                            return false;
+                        }
+                        len.* += cy.chan.read([]const u8, ins.fieldBytes(.elem)).len;
+                    },
+                    .Delete => {
+                        const del = serde.MutateStringDeleteOp.init(op.fieldBytes());
+                        const index = del.fieldValue(.index);
+                        const del_len = del.fieldValue(.len);
+                        if (index >= len.* or del_len > len.* - index) {
+                            return false;
+                        }
+                        len.* -= del_len;
+                    },
+                }
+            }
+        },
+        .Optional => {
+            const opt = serde.MutateOptional.init(bytes);
+            switch (opt.tag()) {
+                .New => {
+                    try self.replaceRegion(txn, node_index, loc);
+                    self.word(loc).* = 1;
+                    try self.initNode(node.child, loc.plus(1), opt.fieldBytes());
+                },
+                .Mutate => {
+                    if (self.word(loc).* == 0) {
+                        return false;
+                    }
+                    return self.updateNode(txn, node.child, loc.plus(1), opt.fieldBytes());
+                },
+                .None => {
+                    try self.replaceRegion(txn, node_index, loc);
+                },
+            }
+        },
+        .Array => {
+            const child_width = self.layout.width(node.child);
+            var ops = serde.MutateArray.init(bytes).iterator();
+            while (ops.next()) |op| {
+                const index = op.fieldValue(.index);
+                if (index >= node.len) {
+                    return false;
+                }
+
+                const elem = loc.plus(@as(usize, @intCast(index)) * child_width);
+                if (!try self.updateNode(txn, node.child, elem, op.fieldBytes(.elem))) {
+                    return false;
+                }
+            }
+        },
+        .ListLen => {
+            try txn.reserve(0);
+            const len = self.word(loc);
+            txn.push(.{ .Word = .{ .loc = loc, .prev = len.* } });
+
+            var ops = serde.MutateList.init(bytes).iterator();
+            while (ops.next()) |op| {
+                switch (op.tag()) {
+                    .Append, .Prepend => {
+                        len.* += 1;
+                    },
+                    .Insert => {
+                        const ins = serde.MutateListInsertOp.init(op.fieldBytes());
+                        if (ins.fieldValue(.index) > len.*) {
+                            return false;
+                        }
+                        len.* += 1;
+                    },
+                    .Delete => {
+                        if (op.fieldValue(.Delete) >= len.*) {
+                            return false;
+                        }
+                        len.* -= 1;
+                    },
+                    .Mutate => {
+                        const mut = serde.MutateListMutateOp.init(op.fieldBytes());
+                        if (mut.fieldValue(.index) >= len.*) {
+                            return false;
+                        }
+                    },
+                }
+            }
+        },
+        .List => {
+            return self.updateList(txn, node.child, @intCast(self.word(loc).*), serde.MutateList.init(bytes));
+        },
+        .Map => {
+            // Unlike `Object`, values live in slots, so there's nothing to reserve besides the keys.
+            return self.updateMap(txn, node.child, @intCast(self.word(loc).*), serde.MutateMap.init(bytes));
+        },
+        .Struct => {
+            var fields = serde.ElemIterator.init(bytes);
+            for (self.layout.fields[node.fields..][0..node.len]) |f| {
+                const field_bytes = fields.next();
+                if (self.layout.nodes[f.node].kind == .Stateless) {
+                    continue;
+                }
+
+                if (serde.readOptional(field_bytes)) |value| {
+                    if (!try self.updateNode(txn, f.node, loc.plus(f.offset), value)) {
+                        return false;
+                    }
+                }
+            }
+        },
+        .Union => {
+            const mut = serde.Union(void).init(bytes);
+            const tag = mut.tagValue();
+            if (tag >= node.len) {
+                return false;
+            }
+
+            const f = self.layout.fields[node.fields + tag];
+            const field = serde.MutateUnionField.init(mut.fieldBytes());
+            switch (field.tag()) {
+                .New => {
+                    try self.replaceRegion(txn, node_index, loc);
+                    self.word(loc).* = tag;
+                    try self.initNode(f.node, loc.plus(f.offset), field.fieldBytes());
+                },
+                .Mutate => {
+                    if (self.word(loc).* != tag) {
+                        return false;
+                    }
+                    return self.updateNode(txn, f.node, loc.plus(f.offset), field.fieldBytes());
+                },
+            }
+        },
+    }
+    return true;
+}
+
+fn updateList(self: *Self, txn: *Transaction, elem_node: u32, seg: u32, ops: serde.MutateList) Error!bool {
+    const elem_width = self.layout.width(elem_node);
+
+    var iter = ops.iterator();
+    while (iter.next()) |op| {
+        const len = self.segments.items[seg].List.items.len / elem_width;
+        switch (op.tag()) {
+            .Append => try self.insertElem(txn, elem_node, seg, len, op.fieldBytes()),
+            .Prepend => try self.insertElem(txn, elem_node, seg, 0, op.fieldBytes()),
+            .Insert => {
+                const ins = serde.MutateListInsertOp.init(op.fieldBytes());
+                const index = ins.fieldValue(.index);
+                if (index > len) {
+                    return false;
+                }
+                try self.insertElem(txn, elem_node, seg, @intCast(index), ins.fieldBytes(.elem));
+            },
+            .Delete => {
+                const index = op.fieldValue(.Delete);
+                if (index >= len) {
+                    return false;
+                }
+
+                try txn.reserve(elem_width);
+                const elem = Loc{ .seg = seg, .offset = @as(usize, @intCast(index)) * elem_width };
+                const saved = txn.save(self.words(elem, elem_width));
+                removeWords(&self.segments.items[seg].List, elem.offset, elem_width);
+                txn.push(.{ .Remove = .{ .loc = elem, .node = elem_node, .saved = saved } });
+            },
+            .Mutate => {
+                const mut = serde.MutateListMutateOp.init(op.fieldBytes());
+                const index = mut.fieldValue(.index);
+                if (index >= len) {
+                    return false;
+                }
+
+                const elem = Loc{ .seg = seg, .offset = @as(usize, @intCast(index)) * elem_width };
+                if (!try self.updateNode(txn, elem_node, elem, mut.fieldBytes(.elem))) {
+                    return false;
+                }
+            },
+        }
+    }
+    return true;
+}
+
+fn insertElem(self: *Self, txn: *Transaction, elem_node: u32, seg: u32, index: usize, bytes: []const u8) Error!void {
+    const elem_width = self.layout.width(elem_node);
+    const elem = Loc{ .seg = seg, .offset = index * elem_width };
+
+    try txn.reserve(0);
+    const list = &self.segments.items[seg].List;
+    try list.ensureUnusedCapacity(self.allocator, elem_width);
+    insertZeroedWords(list, elem.offset, elem_width);
+    txn.push(.{ .Insert = .{ .loc = elem, .node = elem_node } });
+
+    try self.initNode(elem_node, elem, bytes);
+}
+
+fn updateMap(self: *Self, txn: *Transaction, value_node: u32, seg: u32, ops: serde.MutateMap) Error!bool {
+    var puts: u32 = 0;
+    var iter = ops.iterator();
+    while (iter.next()) |op| {
+        if (op.tag() == .Put) {
+            puts += 1;
+        }
+    }
+    try self.segments.items[seg].Map.slots.ensureUnusedCapacity(self.allocator, puts);
+    try self.interner.ensureUnusedCapacity(puts);
+
+    iter = ops.iterator();
+    while (iter.next()) |op| {
+        switch (op.tag()) {
+            .Put => {
+                const entry = serde.MapEntry.init(op.fieldBytes());
+                const key = keys.Key.init(entry.fieldBytes(.key));
+
+                if (self.segments.items[seg].Map.slots.get(key)) |slot| {
+                    const value = self.slotLoc(seg, slot, value_node);
+                    try self.replaceRegion(txn, value_node, value);
+                    try self.initNode(value_node, value, entry.fieldBytes(.value));
+                    continue;
+                }
+
+                try txn.reserve(0);
+                const slot = try self.allocSlot(seg, value_node);
+                const owned_key = self.interner.intern(key) catch |e| {
+                    self.releaseSlot(seg, slot, value_node);
+                    return e;
+                };
+                self.segments.items[seg].Map.slots.putAssumeCapacityNoClobber(owned_key, slot);
+                txn.push(.{ .MapPut = .{ .seg = seg, .node = value_node, .key = owned_key } });
+
+                try self.initNode(value_node, self.slotLoc(seg, slot, value_node), entry.fieldBytes(.value));
+            },
+            .Remove => {
+                try txn.reserve(0);
+                const kv = self.segments.items[seg].Map.slots.fetchRemove(keys.Key.init(op.fieldBytes())) orelse return false;
+                txn.push(.{ .MapRemove = .{ .seg = seg, .node = value_node, .key = kv.key, .slot = kv.value } });
+            },
+            .Mutate => {
+                const entry = serde.MapEntry.init(op.fieldBytes());
+                const slot = self.segments.items[seg].Map.slots.get(keys.Key.init(entry.fieldBytes(.key))) orelse return false;
+                const value = self.slotLoc(seg, slot, value_node);
+                if (!try self.updateNode(txn, value_node, value, entry.fieldBytes(.value))) {
+                    return false;
+                }
+            },
+        }
+    }
+    return true;
+}
+
+/// Saves and zeroes the words of `node` at `loc`, ready for new state to be written.
+fn replaceRegion(self: *Self, txn: *Transaction, node_index: u32, loc: Loc) !void {
+    const width = self.layout.width(node_index);
+    try txn.reserve(width);
+
+    const region = self.words(loc, width);
+    const saved = txn.save(region);
+    @memset(region, 0);
+    txn.push(.{ .Region = .{ .loc = loc, .node = node_index, .saved = saved } });
+}
+
+/// Inserts `count` zeroed words at `offset`, the list must already have the capacity for them.
+fn insertZeroedWords(list: *std.ArrayListUnmanaged(u64), offset: usize, count: usize) void {
+    const old_len = list.items.len;
+    list.items.len += count;
+    std.mem.copyBackwards(u64, list.items[offset + count ..], list.items[offset..old_len]);
+    @memset(list.items[offset..][0..count], 0);
+}
+
+fn removeWords(list: *std.ArrayListUnmanaged(u64), offset: usize, count: usize) void {
+    std.mem.copyForwards(u64, list.items[offset..], list.items[offset + count ..]);
+    list.items.len -= count;
+}
+
+const test_type = cy.def.Type{
+    .Struct = cy.def.Type.Struct{
+        .fields = &[_]cy.def.Type.Struct.Field{
+            .{ .name = "flag", .type = .Bool },
+            .{ .name = "name", .type = .String },
+            .{
+                .name = "tags",
+                .type = cy.def.Type{
+                    .List = cy.def.Type.List{ .child = &@as(cy.def.Type, .String) },
+                },
+            },
+        },
+    },
+};
+
+test "layout" {
+    var layout = try Layout.init(std.testing.allocator, test_type);
+    defer layout.deinit(std.testing.allocator);
+
+    const node = layout.nodes[0];
+    try std.testing.expectEqual(Kind.Struct, node.kind);
+    try std.testing.expectEqual(@as(u32, 2), node.width);
+    try std.testing.expect(node.has_segments);
+
+    const fields = layout.fields[node.fields..][0..node.len];
+    try std.testing.expectEqual(Kind.Stateless, layout.nodes[fields[0].node].kind);
+    try std.testing.expectEqual(@as(u32, 0), fields[1].offset);
+    try std.testing.expectEqual(@as(u32, 1), fields[2].offset);
+    try std.testing.expectEqual(Kind.List, layout.nodes[fields[2].node].kind);
+}
+
+test "update applies valid mutations and rolls back invalid ones" {
+    const allocator = std.testing.allocator;
+
+    var layout = try Layout.init(allocator, test_type);
+    defer layout.deinit(allocator);
+
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    var scratch = std.ArrayList(u8).init(allocator);
+    defer scratch.deinit();
+
+    try serde.writeElem(&value, &[_]u8{1});
+    try serde.writeString(&value, "ab");
+    try scratch.appendSlice(std.mem.asBytes(&@as(usize, 2)));
+    try serde.writeString(&scratch, "x");
+    try serde.writeString(&scratch, "yz");
+    try serde.writeElem(&value, scratch.items);
+
+    var tape = try Self.init(allocator, &layout, value.items);
+    defer tape.deinit();
+
+    const tags: u32 = @intCast(tape.word(root.plus(1)).*);
+    try std.testing.expectEqual(@as(u64, 2), tape.word(root).*);
+    try std.testing.expectEqual(@as(usize, 2), tape.segments.items[tags].List.items.len);
+
+    // appending a tag
+    var mutation = std.ArrayList(u8).init(allocator);
+    defer mutation.deinit();
+    var op = std.ArrayList(u8).init(allocator);
+    defer op.deinit();
+
+    try serde.writeString(&op, "new");
+    scratch.clearRetainingCapacity();
+    try scratch.append(1);
+    try scratch.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    try serde.writeOp(&scratch, @intFromEnum(serde.MutateListOp.Tag.Append), op.items);
+
+    try serde.writeElem(&mutation, &[_]u8{0});
+    try serde.writeElem(&mutation, &[_]u8{0});
+    try serde.writeElem(&mutation, scratch.items);
+
+    try std.testing.expect(try tape.update(mutation.items));
+    try std.testing.expectEqual(@as(usize, 3), tape.segments.items[tags].List.items.len);
+
+    // appending a tag, then deleting one that doesn't exist
+    scratch.clearRetainingCapacity();
+    try scratch.append(1);
+    try scratch.appendSlice(std.mem.asBytes(&@as(usize, 2)));
+    try serde.writeOp(&scratch, @intFromEnum(serde.MutateListOp.Tag.Append), op.items);
+    try serde.writeOp(&scratch, @intFromEnum(serde.MutateListOp.Tag.Delete), std.mem.asBytes(&@as(usize, 10)));
+
+    mutation.clearRetainingCapacity();
+    try serde.writeElem(&mutation, &[_]u8{0});
+    try serde.writeElem(&mutation, &[_]u8{0});
+    try serde.writeElem(&mutation, scratch.items);
+
+    try std.testing.expect(!try tape.update(mutation.items));
+    try std.testing.expectEqual(@as(usize, 3), tape.segments.items[tags].List.items.len);
+}
@@ -0,0 +1,272 @@
+//! Subscriptions to parts of objects, by the path of the part from the root of its object. Given the change set
+//! of an update, `notify` finds the subscribers whose part changed, so that each of them can refresh just that
+//! instead of the whole object.
+const std = @import("std");
+const ChangeSet = @import("ChangeSet.zig");
+const ObjectHandle = @import("../ObjectTable.zig").ObjectHandle;
+
+allocator: std.mem.Allocator,
+// The root of the paths subscribed to in each object, by the bits of its handle.
+objects: std.AutoHashMapUnmanaged(u64, *Node) = .{},
+
+/// Identifies a subscriber to the caller, which is told who to notify and does so itself.
+pub const Subscriber = u64;
+
+const Node = struct {
+    // children by struct field, list or array index and union variant
+    steps: std.AutoArrayHashMapUnmanaged(PackedStep, *Node) = .{},
+    // children by map key
+    keys: std.StringArrayHashMapUnmanaged(*Node) = .{},
+    subscribers: std.ArrayListUnmanaged(Subscriber) = .{},
+
+    fn create(allocator: std.mem.Allocator) !*Node {
+        const node = try allocator.create(Node);
+        node.* = Node{};
+        return node;
+    }
+
+    fn destroy(node: *Node, allocator: std.mem.Allocator) void {
+        for (node.steps.values()) |child| {
+            child.destroy(allocator);
+        }
+        for (node.keys.keys(), node.keys.values()) |key, child| {
+            allocator.free(key);
+            child.destroy(allocator);
+        }
+        node.steps.deinit(allocator);
+        node.keys.deinit(allocator);
+        node.subscribers.deinit(allocator);
+        allocator.destroy(node);
+    }
+
+    fn isEmpty(node: *const Node) bool {
+        return node.steps.count() == 0 and node.keys.count() == 0 and node.subscribers.items.len == 0;
+    }
+
+    fn child(node: *const Node, step: ChangeSet.Step) ?*Node {
+        return switch (step) {
+            .Key => |key| node.keys.get(key),
+            else => node.steps.get(PackedStep.from(step)),
+        };
+    }
+
+    fn collect(node: *const Node, out: *std.ArrayList(Subscriber)) !void {
+        try out.appendSlice(node.subscribers.items);
+        for (node.steps.values()) |c| {
+            try c.collect(out);
+        }
+        for (node.keys.values()) |c| {
+            try c.collect(out);
+        }
+    }
+};
+
+const PackedStep = struct {
+    tag: std.meta.Tag(ChangeSet.Step),
+    value: u64,
+
+    fn from(step: ChangeSet.Step) PackedStep {
+        return PackedStep{
+            .tag = step,
+            .value = switch (step) {
+                .Field, .Variant => |v| v,
+                .Index => |index| index,
+                .Key => unreachable,
+            },
+        };
+    }
+};
+
+const Self = @This();
+
+pub fn init(allocator: std.mem.Allocator) Self {
+    return Self{
+        .allocator = allocator,
+    };
+}
+
+pub fn deinit(self: *Self) void {
+    var iter = self.objects.valueIterator();
+    while (iter.next()) |root| {
+        root.*.destroy(self.allocator);
+    }
+    self.objects.deinit(self.allocator);
+    self.* = undefined;
+}
+
+/// Subscribes to the part of `object` at `path`, and so to everything under it. An empty path subscribes to
+/// the whole object.
+pub fn subscribe(self: *Self, object: ObjectHandle, path: []const ChangeSet.Step, subscriber: Subscriber) !void {
+    const root_gop = try self.objects.getOrPut(self.allocator, @bitCast(object));
+    if (!root_gop.found_existing) {
+        root_gop.value_ptr.* = Node.create(self.allocator) catch |e| {
+            self.objects.removeByPtr(root_gop.key_ptr);
+            return e;
+        };
+    }
+
+    // Nodes created on the way are left empty if this fails, and dropped by the next `unsubscribe` below them.
+    var node = root_gop.value_ptr.*;
+    for (path) |step| {
+        node = switch (step) {
+            .Key => |key| blk: {
+                const gop = try node.keys.getOrPut(self.allocator, key);
+                if (!gop.found_existing) {
+                    errdefer node.keys.swapRemoveAt(gop.index);
+                    const owned_key = try self.allocator.dupe(u8, key);
+                    errdefer self.allocator.free(owned_key);
+                    gop.value_ptr.* = try Node.create(self.allocator);
+                    gop.key_ptr.* = owned_key;
+                }
+                break :blk gop.value_ptr.*;
+            },
+            else => blk: {
+                const gop = try node.steps.getOrPut(self.allocator, PackedStep.from(step));
+                if (!gop.found_existing) {
+                    errdefer node.steps.swapRemoveAt(gop.index);
+                    gop.value_ptr.* = try Node.create(self.allocator);
+                }
+                break :blk gop.value_ptr.*;
+            },
+        };
+    }
+    try node.subscribers.append(self.allocator, subscriber);
+}
+
+/// Undoes a `subscribe` with the same arguments, dropping the nodes left without subscribers.
+pub fn unsubscribe(self: *Self, object: ObjectHandle, path: []const ChangeSet.Step, subscriber: Subscriber) void {
+    const root = self.objects.get(@bitCast(object)) orelse return;
+    self.unsubscribeNode(root, path, subscriber);
+    if (root.isEmpty()) {
+        root.destroy(self.allocator);
+        _ = self.objects.remove(@bitCast(object));
+    }
+}
+
+fn unsubscribeNode(self: *Self, node: *Node, path: []const ChangeSet.Step, subscriber: Subscriber) void {
+    if (path.len == 0) {
+        if (std.mem.indexOfScalar(Subscriber, node.subscribers.items, subscriber)) |i| {
+            _ = node.subscribers.swapRemove(i);
+        }
+        return;
+    }
+
+    const next = node.child(path[0]) orelse return;
+    self.unsubscribeNode(next, path[1..], subscriber);
+    if (!next.isEmpty()) {
+        return;
+    }
+    switch (path[0]) {
+        .Key => |key| {
+            const kv = node.keys.fetchSwapRemove(key).?;
+            self.allocator.free(kv.key);
+        },
+        else => _ = node.steps.swapRemove(PackedStep.from(path[0])),
+    }
+    next.destroy(self.allocator);
+}
+
+/// Appends the subscribers of `object` affected by `changes` to `out`, sorted and each once. These are the
+/// subscribers to the path of a change, to any part above it, which contains it, and to any part below it,
+/// which was replaced along with it. Inserting or removing a list item also affects the later items, which
+/// moved.
+pub fn notify(self: *const Self, object: ObjectHandle, changes: *const ChangeSet, out: *std.ArrayList(Subscriber)) !void {
+    const root = self.objects.get(@bitCast(object)) orelse return;
+    const start = out.items.len;
+
+    for (0..changes.count()) |i| {
+        const entry = changes.get(i);
+        var node: ?*Node = root;
+        for (entry.path, 0..) |step, depth| {
+            try out.appendSlice(node.?.subscribers.items);
+
+            const last = depth + 1 == entry.path.len;
+            if (last and step == .Index and (entry.kind == .Insert or entry.kind == .Remove)) {
+                try collectFrom(node.?, step.Index, out);
+                node = null;
+                break;
+            }
+            node = node.?.child(step);
+            if (node == null) {
+                break;
+            }
+        }
+        if (node) |n| {
+            try n.collect(out);
+        }
+    }
+
+    const notified = out.items[start..];
+    std.mem.sort(Subscriber, notified, {}, std.sort.asc(Subscriber));
+    var len: usize = 0;
+    for (notified) |s| {
+        if (len == 0 or notified[len - 1] != s) {
+            notified[len] = s;
+            len += 1;
+        }
+    }
+    out.shrinkRetainingCapacity(start + len);
+}
+
+// Collects the list items of `node` from `index` on.
+fn collectFrom(node: *const Node, index: u64, out: *std.ArrayList(Subscriber)) !void {
+    for (node.steps.keys(), node.steps.values()) |step, c| {
+        if (step.tag == .Index and step.value >= index) {
+            try c.collect(out);
+        }
+    }
+}
+
+test "notify" {
+    const allocator = std.testing.allocator;
+
+    var subs = Self.init(allocator);
+    defer subs.deinit();
+
+    const object = ObjectHandle{ .slot = 1, .shard = 2, .generation = 0 };
+    const other = ObjectHandle{ .slot = 2, .shard = 2, .generation = 0 };
+    try subs.subscribe(object, &.{}, 1);
+    try subs.subscribe(object, &.{.{ .Field = 0 }}, 2);
+    try subs.subscribe(object, &.{ .{ .Field = 1 }, .{ .Index = 2 } }, 3);
+    try subs.subscribe(object, &.{ .{ .Field = 1 }, .{ .Index = 5 }, .{ .Key = "k" } }, 4);
+    try subs.subscribe(object, &.{ .{ .Field = 1 }, .{ .Index = 0 } }, 5);
+    try subs.subscribe(other, &.{}, 6);
+
+    var changes = ChangeSet.init(allocator);
+    defer changes.deinit();
+    var out = std.ArrayList(Subscriber).init(allocator);
+    defer out.deinit();
+
+    try changes.enter(.{ .Field = 0 });
+    try changes.record(.Text, null);
+    changes.leave();
+    try subs.notify(object, &changes, &out);
+    try std.testing.expectEqualSlices(Subscriber, &.{ 1, 2 }, out.items);
+
+    // a removal moves the later items of the list
+    changes.clear();
+    out.clearRetainingCapacity();
+    try changes.enter(.{ .Field = 1 });
+    try changes.record(.Remove, .{ .Index = 1 });
+    changes.leave();
+    try subs.notify(object, &changes, &out);
+    try std.testing.expectEqualSlices(Subscriber, &.{ 1, 3, 4 }, out.items);
+
+    changes.clear();
+    out.clearRetainingCapacity();
+    try changes.enter(.{ .Field = 1 });
+    try changes.enter(.{ .Index = 5 });
+    try changes.record(.Set, .{ .Key = "other" });
+    changes.leave();
+    changes.leave();
+    try subs.notify(object, &changes, &out);
+    try std.testing.expectEqualSlices(Subscriber, &.{1}, out.items);
+
+    subs.unsubscribe(object, &.{ .{ .Field = 1 }, .{ .Index = 5 }, .{ .Key = "k" } }, 4);
+    subs.unsubscribe(object, &.{ .{ .Field = 1 }, .{ .Index = 2 } }, 3);
+    changes.clear();
+    out.clearRetainingCapacity();
+    try changes.record(.Set, null);
+    try subs.notify(object, &changes, &out);
+    try std.testing.expectEqualSlices(Subscriber, &.{ 1, 2, 5 }, out.items);
+}
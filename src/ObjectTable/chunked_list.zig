@@ -0,0 +1,537 @@
+//! A list stored as a B+ tree of chunks, for lists too long to move around on every insertion.
+//!
+//! Items live in leaf chunks in list order, and every branch keeps the item count of each of its children,
+//! so finding, inserting and removing an item by index is O(log n) while iterating still walks contiguous
+//! chunks. Appending at the end of a full chunk starts a new chunk instead of splitting it in half, which
+//! keeps lists that are built by appending densely packed.
+//!
+//! Every branch below the root has at least two children and every leaf below the root at least one item,
+//! so a list of n items is at most log2(n) levels high. `Spare` relies on that bound to reserve the nodes
+//! that re-inserting removed items can take, so that undoing a removal can't fail.
+const std = @import("std");
+
+pub fn ChunkedList(comptime T: type) type {
+    return struct {
+        root: *Node,
+        // levels of branches above the leaves
+        height: u8,
+        len: usize,
+
+        pub const leaf_cap = @max(8, 512 / @sizeOf(T));
+        pub const branch_cap = 32;
+
+        // below these, a node is merged with or refilled from a sibling
+        const min_leaf = leaf_cap / 4;
+        const min_branch = branch_cap / 4;
+
+        const Node = struct {
+            len: u32,
+            data: union {
+                items: [leaf_cap]T,
+                branch: Branch,
+                next: ?*Node,
+            },
+        };
+
+        const Branch = struct {
+            children: [branch_cap]*Node,
+            // number of items under each child
+            counts: [branch_cap]usize,
+        };
+
+        /// Nodes handed to insertions and taken back from removals. Nodes for re-inserting removed items are
+        /// kept in reserve, so that a removal can always be undone without allocating.
+        pub const Spare = struct {
+            free: ?*Node = null,
+            count: usize = 0,
+            // removed items that may be inserted again, into lists of at most `max_len` items
+            removes: usize = 0,
+            max_len: usize = 0,
+
+            pub fn deinit(self: *Spare, allocator: std.mem.Allocator) void {
+                while (self.free) |node| {
+                    self.free = node.data.next;
+                    allocator.destroy(node);
+                }
+                self.* = undefined;
+            }
+
+            /// Must be called before `list` takes part in any insertion or removal, with an upper bound on
+            /// the number of items it will hold until the spare nodes are released.
+            pub fn prepare(self: *Spare, allocator: std.mem.Allocator, max_len: usize) !void {
+                const len = @max(self.max_len, max_len);
+                try self.fill(allocator, reserved(self.removes, len));
+                self.max_len = len;
+            }
+
+            fn reserved(removes: usize, max_len: usize) usize {
+                // inserting splits at most one node per level and adds a root
+                return removes * (std.math.log2_int_ceil(usize, @max(max_len, 2)) + 2);
+            }
+
+            fn fill(self: *Spare, allocator: std.mem.Allocator, total: usize) !void {
+                while (self.count < total) {
+                    self.put(try allocator.create(Node));
+                }
+            }
+
+            fn take(self: *Spare) *Node {
+                const node = self.free.?;
+                self.free = node.data.next;
+                self.count -= 1;
+                return node;
+            }
+
+            fn put(self: *Spare, node: *Node) void {
+                node.* = Node{
+                    .len = 0,
+                    .data = .{ .next = self.free },
+                };
+                self.free = node;
+                self.count += 1;
+            }
+        };
+
+        pub const Iterator = struct {
+            list: *const Self,
+            index: usize = 0,
+            leaf: ?*const Node = null,
+            offset: usize = 0,
+
+            pub fn next(it: *Iterator) ?T {
+                if (it.index == it.list.len) {
+                    return null;
+                }
+                if (it.leaf == null or it.offset == it.leaf.?.len) {
+                    const leaf, const offset = it.list.locate(it.index);
+                    it.leaf = leaf;
+                    it.offset = offset;
+                }
+                const item = it.leaf.?.data.items[it.offset];
+                it.index += 1;
+                it.offset += 1;
+                return item;
+            }
+        };
+
+        const Self = @This();
+
+        /// Packs `items` into full leaves.
+        pub fn fromSlice(allocator: std.mem.Allocator, items: []const T) !Self {
+            var num_nodes: usize = 0;
+            var level_len = @max(1, std.math.divCeil(usize, items.len, leaf_cap) catch unreachable);
+            var height: u8 = 0;
+            while (true) {
+                num_nodes += level_len;
+                if (level_len == 1) break;
+                level_len = std.math.divCeil(usize, level_len, branch_cap) catch unreachable;
+                height += 1;
+            }
+
+            const nodes = try allocator.alloc(*Node, num_nodes);
+            defer allocator.free(nodes);
+            var created: usize = 0;
+            errdefer for (nodes[0..created]) |node| {
+                allocator.destroy(node);
+            };
+            while (created < nodes.len) : (created += 1) {
+                nodes[created] = try allocator.create(Node);
+            }
+
+            level_len = @max(1, std.math.divCeil(usize, items.len, leaf_cap) catch unreachable);
+            for (nodes[0..level_len], 0..) |node, i| {
+                const chunk = items[i * leaf_cap .. @min(items.len, (i + 1) * leaf_cap)];
+                node.* = Node{
+                    .len = @intCast(chunk.len),
+                    .data = .{ .items = undefined },
+                };
+                @memcpy(node.data.items[0..chunk.len], chunk);
+            }
+
+            // Children are spread evenly over the branches of each level, so that none ends up with a
+            // single child.
+            var level = nodes[0..level_len];
+            var rest = nodes[level_len..];
+            var child_height: u8 = 0;
+            while (level.len > 1) : (child_height += 1) {
+                const parents = rest[0 .. std.math.divCeil(usize, level.len, branch_cap) catch unreachable];
+                rest = rest[parents.len..];
+                var start: usize = 0;
+                for (parents, 0..) |parent, i| {
+                    const end = level.len * (i + 1) / parents.len;
+                    parent.* = Node{
+                        .len = @intCast(end - start),
+                        .data = .{ .branch = undefined },
+                    };
+                    for (level[start..end], 0..) |child, c| {
+                        parent.data.branch.children[c] = child;
+                        parent.data.branch.counts[c] = countOf(child, child_height);
+                    }
+                    start = end;
+                }
+                level = parents;
+            }
+
+            return Self{
+                .root = level[0],
+                .height = height,
+                .len = items.len,
+            };
+        }
+
+        /// Releases the nodes, the items are left to the caller.
+        pub fn deinit(self: *Self, allocator: std.mem.Allocator) void {
+            destroyNode(allocator, self.root, self.height);
+            self.* = undefined;
+        }
+
+        fn destroyNode(allocator: std.mem.Allocator, node: *Node, height: u8) void {
+            if (height > 0) {
+                for (node.data.branch.children[0..node.len]) |child| {
+                    destroyNode(allocator, child, height - 1);
+                }
+            }
+            allocator.destroy(node);
+        }
+
+        pub fn iterator(self: *const Self) Iterator {
+            return Iterator{ .list = self };
+        }
+
+        pub fn get(self: *const Self, index: usize) T {
+            std.debug.assert(index < self.len);
+            const leaf, const offset = self.locate(index);
+            return leaf.data.items[offset];
+        }
+
+        fn locate(self: *const Self, index: usize) struct { *const Node, usize } {
+            var node: *const Node = self.root;
+            var offset = index;
+            var height = self.height;
+            while (height > 0) : (height -= 1) {
+                const branch = &node.data.branch;
+                var i: usize = 0;
+                while (offset >= branch.counts[i]) : (i += 1) {
+                    offset -= branch.counts[i];
+                }
+                node = branch.children[i];
+            }
+            return .{ node, offset };
+        }
+
+        /// Inserts `item` before the item at `index`. The nodes it takes come from `spare`, which must have
+        /// been prepared for this list.
+        pub fn insert(self: *Self, spare: *Spare, allocator: std.mem.Allocator, index: usize, item: T) !void {
+            try spare.fill(allocator, Spare.reserved(spare.removes, spare.max_len) + self.height + 2);
+            self.insertReserved(spare, index, item);
+        }
+
+        /// Inserts without allocating, taking reserved nodes. Only meant to undo a `remove`.
+        pub fn insertReserved(self: *Self, spare: *Spare, index: usize, item: T) void {
+            std.debug.assert(index <= self.len);
+            if (insertNode(spare, self.root, self.height, index, item)) |split| {
+                const root = spare.take();
+                root.* = Node{
+                    .len = 2,
+                    .data = .{ .branch = undefined },
+                };
+                root.data.branch.children[0] = self.root;
+                root.data.branch.counts[0] = countOf(self.root, self.height);
+                root.data.branch.children[1] = split;
+                root.data.branch.counts[1] = countOf(split, self.height);
+                self.root = root;
+                self.height += 1;
+            }
+            self.len += 1;
+        }
+
+        /// Returns the node split off from `node`, if it was full.
+        fn insertNode(spare: *Spare, node: *Node, height: u8, index: usize, item: T) ?*Node {
+            if (height == 0) {
+                if (node.len < leaf_cap) {
+                    insertItem(node, index, item);
+                    return null;
+                }
+
+                const right = spare.take();
+                right.* = Node{
+                    .len = 0,
+                    .data = .{ .items = undefined },
+                };
+                moveItems(node, if (index == leaf_cap) leaf_cap else leaf_cap / 2, right);
+                if (index <= node.len and node.len < leaf_cap) {
+                    insertItem(node, index, item);
+                } else {
+                    insertItem(right, index - node.len, item);
+                }
+                return right;
+            }
+
+            const branch = &node.data.branch;
+            var i: usize = 0;
+            var offset = index;
+            while (i + 1 < node.len and offset > branch.counts[i]) : (i += 1) {
+                offset -= branch.counts[i];
+            }
+
+            const split = insertNode(spare, branch.children[i], height - 1, offset, item) orelse {
+                branch.counts[i] += 1;
+                return null;
+            };
+            branch.counts[i] = countOf(branch.children[i], height - 1);
+            const split_count = countOf(split, height - 1);
+            if (node.len < branch_cap) {
+                insertChild(node, i + 1, split, split_count);
+                return null;
+            }
+
+            const right = spare.take();
+            right.* = Node{
+                .len = 0,
+                .data = .{ .branch = undefined },
+            };
+            // the new right branch gets two children even when appending, so that it doesn't end up with one
+            moveChildren(node, if (i + 1 == branch_cap) branch_cap - 1 else branch_cap / 2, right);
+            if (i + 1 <= node.len and node.len < branch_cap) {
+                insertChild(node, i + 1, split, split_count);
+            } else {
+                insertChild(right, i + 1 - node.len, split, split_count);
+            }
+            return right;
+        }
+
+        /// Removes the item at `index`. The nodes it frees go to `spare`, which must have been prepared for
+        /// this list with the removal counted in.
+        pub fn remove(self: *Self, spare: *Spare, allocator: std.mem.Allocator, index: usize) !T {
+            try spare.fill(allocator, Spare.reserved(spare.removes + 1, spare.max_len));
+            spare.removes += 1;
+            return self.removeUnreserved(spare, index);
+        }
+
+        /// Removes without reserving the nodes to insert the item again. Only meant to undo an `insert`.
+        pub fn removeUnreserved(self: *Self, spare: *Spare, index: usize) T {
+            std.debug.assert(index < self.len);
+            const item = removeNode(spare, self.root, self.height, index);
+            self.len -= 1;
+            if (self.height > 0 and self.root.len == 1) {
+                const root = self.root;
+                self.root = root.data.branch.children[0];
+                self.height -= 1;
+                spare.put(root);
+            }
+            return item;
+        }
+
+        fn removeNode(spare: *Spare, node: *Node, height: u8, index: usize) T {
+            if (height == 0) {
+                const items = node.data.items[0..node.len];
+                const item = items[index];
+                std.mem.copyForwards(T, items[index..], items[index + 1 ..]);
+                node.len -= 1;
+                return item;
+            }
+
+            const branch = &node.data.branch;
+            var i: usize = 0;
+            var offset = index;
+            while (offset >= branch.counts[i]) : (i += 1) {
+                offset -= branch.counts[i];
+            }
+
+            const item = removeNode(spare, branch.children[i], height - 1, offset);
+            branch.counts[i] -= 1;
+            rebalance(spare, node, i, height - 1);
+            return item;
+        }
+
+        /// Merges the `i`th child of `parent` into a sibling, or refills it from one, once it runs low.
+        fn rebalance(spare: *Spare, parent: *Node, i: usize, child_height: u8) void {
+            const branch = &parent.data.branch;
+            const min: usize = if (child_height == 0) min_leaf else min_branch;
+            if (branch.children[i].len >= min or parent.len == 1) {
+                return;
+            }
+
+            const left = if (i + 1 < parent.len) i else i - 1;
+            const l = branch.children[left];
+            const r = branch.children[left + 1];
+            const cap: usize = if (child_height == 0) leaf_cap else branch_cap;
+            const total = l.len + r.len;
+
+            if (total <= cap) {
+                if (child_height == 0) {
+                    moveItems(r, 0, l);
+                } else {
+                    moveChildren(r, 0, l);
+                }
+                branch.counts[left] += branch.counts[left + 1];
+                removeChild(parent, left + 1);
+                spare.put(r);
+                return;
+            }
+
+            // leaves both halves with close to `total / 2`, either by moving the tail of the left node
+            // to the front of the right node or the front of the right node to the tail of the left node
+            const keep = total / 2;
+            if (child_height == 0) {
+                if (l.len > keep) {
+                    moveItemsFront(l, keep, r);
+                } else {
+                    takeItemsFront(l, keep - l.len, r);
+                }
+            } else {
+                if (l.len > keep) {
+                    moveChildrenFront(l, keep, r);
+                } else {
+                    takeChildrenFront(l, keep - l.len, r);
+                }
+            }
+            branch.counts[left] = countOf(l, child_height);
+            branch.counts[left + 1] = countOf(r, child_height);
+        }
+
+        fn countOf(node: *const Node, height: u8) usize {
+            if (height == 0) {
+                return node.len;
+            }
+            var count: usize = 0;
+            for (node.data.branch.counts[0..node.len]) |c| {
+                count += c;
+            }
+            return count;
+        }
+
+        fn insertItem(node: *Node, index: usize, item: T) void {
+            const items = node.data.items[0 .. node.len + 1];
+            std.mem.copyBackwards(T, items[index + 1 ..], items[index .. items.len - 1]);
+            items[index] = item;
+            node.len += 1;
+        }
+
+        /// Appends the items of `from` past `keep` to `to`.
+        fn moveItems(from: *Node, keep: usize, to: *Node) void {
+            const moved = from.data.items[keep..from.len];
+            @memcpy(to.data.items[to.len..][0..moved.len], moved);
+            to.len += @intCast(moved.len);
+            from.len = @intCast(keep);
+        }
+
+        /// Prepends the items of `from` past `keep` to `to`.
+        fn moveItemsFront(from: *Node, keep: usize, to: *Node) void {
+            const moved = from.len - keep;
+            std.mem.copyBackwards(T, to.data.items[moved .. to.len + moved], to.data.items[0..to.len]);
+            @memcpy(to.data.items[0..moved], from.data.items[keep..from.len]);
+            to.len += @intCast(moved);
+            from.len = @intCast(keep);
+        }
+
+        /// Appends the first `count` items of `from` to `to`.
+        fn takeItemsFront(to: *Node, count: usize, from: *Node) void {
+            @memcpy(to.data.items[to.len..][0..count], from.data.items[0..count]);
+            std.mem.copyForwards(T, from.data.items[0 .. from.len - count], from.data.items[count..from.len]);
+            to.len += @intCast(count);
+            from.len -= @intCast(count);
+        }
+
+        fn insertChild(node: *Node, index: usize, child: *Node, count: usize) void {
+            const branch = &node.data.branch;
+            const len = node.len + 1;
+            std.mem.copyBackwards(*Node, branch.children[index + 1 .. len], branch.children[index .. len - 1]);
+            std.mem.copyBackwards(usize, branch.counts[index + 1 .. len], branch.counts[index .. len - 1]);
+            branch.children[index] = child;
+            branch.counts[index] = count;
+            node.len += 1;
+        }
+
+        fn removeChild(node: *Node, index: usize) void {
+            const branch = &node.data.branch;
+            std.mem.copyForwards(*Node, branch.children[index .. node.len - 1], branch.children[index + 1 .. node.len]);
+            std.mem.copyForwards(usize, branch.counts[index .. node.len - 1], branch.counts[index + 1 .. node.len]);
+            node.len -= 1;
+        }
+
+        /// Appends the children of `from` past `keep` to `to`.
+        fn moveChildren(from: *Node, keep: usize, to: *Node) void {
+            const moved = from.len - keep;
+            @memcpy(to.data.branch.children[to.len..][0..moved], from.data.branch.children[keep..from.len]);
+            @memcpy(to.data.branch.counts[to.len..][0..moved], from.data.branch.counts[keep..from.len]);
+            to.len += @intCast(moved);
+            from.len = @intCast(keep);
+        }
+
+        /// Prepends the children of `from` past `keep` to `to`.
+        fn moveChildrenFront(from: *Node, keep: usize, to: *Node) void {
+            const moved = from.len - keep;
+            const f = &from.data.branch;
+            const t = &to.data.branch;
+            std.mem.copyBackwards(*Node, t.children[moved .. to.len + moved], t.children[0..to.len]);
+            std.mem.copyBackwards(usize, t.counts[moved .. to.len + moved], t.counts[0..to.len]);
+            @memcpy(t.children[0..moved], f.children[keep..from.len]);
+            @memcpy(t.counts[0..moved], f.counts[keep..from.len]);
+            to.len += @intCast(moved);
+            from.len = @intCast(keep);
+        }
+
+        /// Appends the first `count` children of `from` to `to`.
+        fn takeChildrenFront(to: *Node, count: usize, from: *Node) void {
+            const f = &from.data.branch;
+            const t = &to.data.branch;
+            @memcpy(t.children[to.len..][0..count], f.children[0..count]);
+            @memcpy(t.counts[to.len..][0..count], f.counts[0..count]);
+            std.mem.copyForwards(*Node, f.children[0 .. from.len - count], f.children[count..from.len]);
+            std.mem.copyForwards(usize, f.counts[0 .. from.len - count], f.counts[count..from.len]);
+            to.len += @intCast(count);
+            from.len -= @intCast(count);
+        }
+    };
+}
+
+test "insert, remove and iterate" {
+    const allocator = std.testing.allocator;
+    const List = ChunkedList(u32);
+
+    var expected = std.ArrayList(u32).init(allocator);
+    defer expected.deinit();
+    for (0..1000) |i| {
+        try expected.append(@intCast(i));
+    }
+
+    var list = try List.fromSlice(allocator, expected.items);
+    defer list.deinit(allocator);
+
+    var spare = List.Spare{};
+    defer spare.deinit(allocator);
+    try spare.prepare(allocator, 21_000);
+
+    var prng = std.rand.DefaultPrng.init(0);
+    const random = prng.random();
+    for (0..20_000) |i| {
+        if (expected.items.len > 0 and random.uintLessThan(u32, 3) == 0) {
+            const index = random.uintLessThan(usize, expected.items.len);
+            try std.testing.expectEqual(expected.orderedRemove(index), try list.remove(&spare, allocator, index));
+        } else {
+            const index = random.uintAtMost(usize, expected.items.len);
+            try expected.insert(index, @intCast(i));
+            try list.insert(&spare, allocator, index, @intCast(i));
+        }
+    }
+
+    try std.testing.expectEqual(expected.items.len, list.len);
+    var iter = list.iterator();
+    for (expected.items, 0..) |item, i| {
+        try std.testing.expectEqual(item, iter.next().?);
+        try std.testing.expectEqual(item, list.get(i));
+    }
+    try std.testing.expectEqual(@as(?u32, null), iter.next());
+
+    // undoing the removals in reverse never needs more nodes than were reserved for them
+    const reinserted = expected.items.len;
+    while (list.len > 0) {
+        _ = try list.remove(&spare, allocator, list.len / 2);
+    }
+    const count = spare.count;
+    for (0..reinserted) |i| {
+        list.insertReserved(&spare, i / 2, @intCast(i));
+    }
+    try std.testing.expect(count - spare.count <= List.Spare.reserved(spare.removes, spare.max_len));
+}
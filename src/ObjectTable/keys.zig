@@ -0,0 +1,103 @@
+//! Map keys of object state. Keys carry their hash, so that a key is hashed once per op no matter how many
+//! tables it is looked up in, and are interned per object, so that maps sharing keys share their bytes.
+const std = @import("std");
+
+pub const Key = struct {
+    hash: u64,
+    bytes: []const u8,
+
+    pub fn init(bytes: []const u8) Key {
+        return Key{
+            .hash = std.hash.Wyhash.hash(0, bytes),
+            .bytes = bytes,
+        };
+    }
+};
+
+pub const Context = struct {
+    pub fn hash(_: Context, key: Key) u64 {
+        return key.hash;
+    }
+
+    pub fn eql(_: Context, a: Key, b: Key) bool {
+        return a.hash == b.hash and std.mem.eql(u8, a.bytes, b.bytes);
+    }
+};
+
+pub fn Map(comptime V: type) type {
+    return std.HashMap(Key, V, Context, std.hash_map.default_max_load_percentage);
+}
+
+pub fn MapUnmanaged(comptime V: type) type {
+    return std.HashMapUnmanaged(Key, V, Context, std.hash_map.default_max_load_percentage);
+}
+
+/// Reference counted key storage. Every key held by a map is a reference to an interned key.
+pub const Interner = struct {
+    allocator: std.mem.Allocator,
+    keys: MapUnmanaged(u32) = .{},
+
+    pub fn init(allocator: std.mem.Allocator) Interner {
+        return Interner{ .allocator = allocator };
+    }
+
+    pub fn deinit(self: *Interner) void {
+        var iter = self.keys.keyIterator();
+        while (iter.next()) |key| {
+            self.allocator.free(key.bytes);
+        }
+        self.keys.deinit(self.allocator);
+        self.* = undefined;
+    }
+
+    /// Makes room for `count` new keys, so that interning that many can only fail when copying their bytes.
+    pub fn ensureUnusedCapacity(self: *Interner, count: u32) !void {
+        try self.keys.ensureUnusedCapacity(self.allocator, count);
+    }
+
+    /// Returns the interned copy of `key`, taking a reference to it.
+    pub fn intern(self: *Interner, key: Key) !Key {
+        const entry = try self.keys.getOrPut(self.allocator, key);
+        if (!entry.found_existing) {
+            entry.key_ptr.bytes = self.allocator.dupe(u8, key.bytes) catch |e| {
+                self.keys.removeByPtr(entry.key_ptr);
+                return e;
+            };
+            entry.value_ptr.* = 0;
+        }
+        entry.value_ptr.* += 1;
+        return entry.key_ptr.*;
+    }
+
+    /// Drops a reference taken by `intern`, freeing the key once it is no longer referenced.
+    pub fn release(self: *Interner, key: Key) void {
+        const entry = self.keys.getEntry(key).?;
+        entry.value_ptr.* -= 1;
+        if (entry.value_ptr.* == 0) {
+            const bytes = entry.key_ptr.bytes;
+            self.keys.removeByPtr(entry.key_ptr);
+            self.allocator.free(bytes);
+        }
+    }
+
+    pub fn count(self: *const Interner) usize {
+        return self.keys.count();
+    }
+};
+
+test "interned keys are shared and freed with their last reference" {
+    var interner = Interner.init(std.testing.allocator);
+    defer interner.deinit();
+
+    var bytes = "key".*;
+    const a = try interner.intern(Key.init(&bytes));
+    const b = try interner.intern(Key.init("key"));
+    try std.testing.expect(a.bytes.ptr == b.bytes.ptr);
+    try std.testing.expect(a.bytes.ptr != &bytes);
+    try std.testing.expectEqual(@as(usize, 1), interner.count());
+
+    interner.release(a);
+    try std.testing.expectEqual(@as(usize, 1), interner.count());
+    interner.release(b);
+    try std.testing.expectEqual(@as(usize, 0), interner.count());
+}
@@ -4,6 +4,11 @@ const cy = @import("cycle");
 pub const NewList = Slice(void);
 pub const NewMap = Slice(MapEntry);
 
+pub const MutateString = Slice(MutateStringOp);
+pub const MutateStringOp = Union(StringOp);
+pub const MutateStringInsertOp = Struct(std.meta.FieldType(StringOp, .Insert));
+pub const MutateStringDeleteOp = Struct(std.meta.FieldType(StringOp, .Delete));
+
 pub const MutateOptional = Union(cy.obj.MutateOptional(void));
 
 pub const MutateArray = Slice(MutateArrayOp);
@@ -24,6 +29,8 @@ pub const MapEntry = Struct(struct {
     value: void,
 });
 
+const StringOp = std.meta.Child(cy.obj.MutateString);
+
 const VoidChild = struct {
     pub const child = void;
 };
@@ -48,6 +55,7 @@ pub fn Slice(comptime Elem: type) type {
             return cy.chan.read(usize, self.bytes);
         }
 
+        /// Random access walks every preceding element, prefer `iterator` or `index` when visiting many elements.
         pub fn elem(self: Self, i: usize) Elem {
             return Elem.init(readElem(self.bytes[elem_offset..], i));
         }
@@ -59,25 +67,90 @@ pub fn Slice(comptime Elem: type) type {
         pub fn elemBytes(self: Self, i: usize) []const u8 {
             return readElem(self.bytes[elem_offset..], i);
         }
+
+        pub fn iterator(self: Self) Iterator {
+            return Iterator{
+                .elems = ElemIterator.init(self.bytes[elem_offset..]),
+                .remaining = self.len(),
+            };
+        }
+
+        /// Builds an offset table over the elements so that `Indexed.elem` is O(1).
+        pub fn index(self: Self, allocator: std.mem.Allocator) !Indexed {
+            return Indexed{
+                .table = try ElemTable.init(allocator, self.bytes[elem_offset..], self.len()),
+            };
+        }
+
+        pub const Iterator = struct {
+            elems: ElemIterator,
+            remaining: usize,
+
+            pub fn next(self: *Iterator) ?Elem {
+                const bytes = self.nextBytes() orelse return null;
+                return Elem.init(bytes);
+            }
+
+            pub fn nextBytes(self: *Iterator) ?[]const u8 {
+                if (self.remaining == 0) {
+                    return null;
+                }
+                self.remaining -= 1;
+                return self.elems.next();
+            }
+        };
+
+        pub const Indexed = struct {
+            table: ElemTable,
+
+            pub fn deinit(self: *Indexed, allocator: std.mem.Allocator) void {
+                self.table.deinit(allocator);
+                self.* = undefined;
+            }
+
+            pub fn len(self: Indexed) usize {
+                return self.table.len();
+            }
+
+            pub fn elem(self: Indexed, i: usize) Elem {
+                return Elem.init(self.table.get(i));
+            }
+
+            pub fn elemBytes(self: Indexed, i: usize) []const u8 {
+                return self.table.get(i);
+            }
+        };
     };
 }
 
 pub fn Struct(comptime Type: type) type {
     return struct {
         bytes: []const u8,
+        offsets: [num_fields]usize,
 
+        const num_fields = std.meta.fields(Type).len;
         const Self = @This();
 
+        /// Records the offset of every field up front so that field access doesn't re-walk the preceding fields.
         pub fn init(bytes: []const u8) Self {
-            return Self{ .bytes = bytes };
+            var self = Self{
+                .bytes = bytes,
+                .offsets = undefined,
+            };
+            var offset: usize = 0;
+            for (&self.offsets) |*field_offset| {
+                field_offset.* = offset;
+                offset += @sizeOf(usize) + cy.chan.read(usize, bytes[offset..]);
+            }
+            return self;
         }
 
         pub fn fieldValue(self: Self, field: std.meta.FieldEnum(Type)) std.meta.FieldType(Type, field) {
-            return cy.chan.read(std.meta.FieldType(Type, field), readElem(self.bytes, @intFromEnum(field)));
+            return cy.chan.read(std.meta.FieldType(Type, field), self.fieldBytes(field));
         }
 
         pub fn fieldBytes(self: Self, field: std.meta.FieldEnum(Type)) []const u8 {
-            return readElem(self.bytes, @intFromEnum(field));
+            return cy.chan.read([]const u8, self.bytes[self.offsets[@intFromEnum(field)]..]);
         }
     };
 }
@@ -86,7 +159,7 @@ pub fn Union(comptime Type: type) type {
     return struct {
         bytes: []const u8,
 
-        const Tag = std.meta.FieldEnum(Type);
+        pub const Tag = std.meta.FieldEnum(Type);
         const Self = @This();
 
         pub fn init(bytes: []const u8) Self {
@@ -105,6 +178,7 @@ pub fn Union(comptime Type: type) type {
             return cy.chan.read(std.meta.FieldType(Type, t), self.fieldBytes());
         }
 
+        /// The payload directly follows the tag, so this is always O(1).
         pub fn fieldBytes(self: Self) []const u8 {
             const offset = @sizeOf(u16);
             return cy.chan.read([]const u8, self.bytes[offset..]);
@@ -119,6 +193,7 @@ pub fn readOptional(bytes: []const u8) ?[]const u8 {
     return null;
 }
 
+/// Walks the `i` preceding elements, use `ElemIterator` or `ElemTable` when visiting many elements.
 pub fn readElem(bytes: []const u8, i: usize) []const u8 {
     var offset: usize = 0;
     for (0..i) |_| {
@@ -128,3 +203,152 @@ pub fn readElem(bytes: []const u8, i: usize) []const u8 {
     }
     return cy.chan.read([]const u8, bytes[offset..]);
 }
+
+// Writing is the other way around from the views above, for the mutations that are put together rather
+// than received, and for tests and benchmarks that write them by hand.
+
+pub fn writeElem(out: *std.ArrayList(u8), payload: []const u8) std.mem.Allocator.Error!void {
+    try out.appendSlice(std.mem.asBytes(&payload.len));
+    try out.appendSlice(payload);
+}
+
+/// Elements are written in place, with their length filled in by `endElem` once they're complete.
+pub fn beginElem(out: *std.ArrayList(u8)) std.mem.Allocator.Error!usize {
+    const start = out.items.len;
+    try out.appendNTimes(0, @sizeOf(usize));
+    return start;
+}
+
+pub fn endElem(out: *std.ArrayList(u8), start: usize) void {
+    const len = out.items.len - start - @sizeOf(usize);
+    @memcpy(out.items[start..][0..@sizeOf(usize)], std.mem.asBytes(&len));
+}
+
+/// Writes an element holding a union of `tag` and `payload`, which is how every op of a list is laid out.
+pub fn writeOp(out: *std.ArrayList(u8), tag: u16, payload: []const u8) std.mem.Allocator.Error!void {
+    const op = try beginElem(out);
+    try out.appendSlice(std.mem.asBytes(&tag));
+    try writeElem(out, payload);
+    endElem(out, op);
+}
+
+/// Writes an element holding the string `str`, as a field, an item or a map value holds it.
+pub fn writeString(out: *std.ArrayList(u8), str: []const u8) std.mem.Allocator.Error!void {
+    const start = try beginElem(out);
+    try writeElem(out, str);
+    endElem(out, start);
+}
+
+/// Writes an edit of a string as an op of `MutateString`. Deletes take the length of `text`.
+pub fn writeStringOp(out: *std.ArrayList(u8), tag: MutateStringOp.Tag, index: usize, text: []const u8) std.mem.Allocator.Error!void {
+    const op = try beginElem(out);
+    try out.appendSlice(std.mem.asBytes(&@as(u16, @intFromEnum(tag))));
+    const payload = try beginElem(out);
+    switch (tag) {
+        .Append, .Prepend => try writeElem(out, text),
+        .Insert => {
+            try writeElem(out, std.mem.asBytes(&@as(StringIndex, @intCast(index))));
+            try writeString(out, text);
+        },
+        .Delete => {
+            try writeElem(out, std.mem.asBytes(&@as(StringIndex, @intCast(index))));
+            try writeElem(out, std.mem.asBytes(&@as(StringLen, @intCast(text.len))));
+        },
+    }
+    endElem(out, payload);
+    endElem(out, op);
+}
+
+const StringIndex = @TypeOf(MutateStringInsertOp.init(undefined).fieldValue(.index));
+const StringLen = @TypeOf(MutateStringDeleteOp.init(undefined).fieldValue(.len));
+
+/// Visits length-prefixed elements in order, each call to `next` is O(1).
+pub const ElemIterator = struct {
+    bytes: []const u8,
+    offset: usize = 0,
+
+    pub fn init(bytes: []const u8) ElemIterator {
+        return ElemIterator{ .bytes = bytes };
+    }
+
+    pub fn next(self: *ElemIterator) []const u8 {
+        const elem = cy.chan.read([]const u8, self.bytes[self.offset..]);
+        self.offset += @sizeOf(usize) + elem.len;
+        return elem;
+    }
+
+    pub fn skip(self: *ElemIterator) void {
+        self.offset += @sizeOf(usize) + cy.chan.read(usize, self.bytes[self.offset..]);
+    }
+};
+
+/// Offsets of `count` length-prefixed elements, built in a single pass.
+pub const ElemTable = struct {
+    bytes: []const u8,
+    offsets: []usize,
+
+    pub fn init(allocator: std.mem.Allocator, bytes: []const u8, count: usize) !ElemTable {
+        const offsets = try allocator.alloc(usize, count);
+        var offset: usize = 0;
+        for (offsets) |*elem_offset| {
+            elem_offset.* = offset;
+            offset += @sizeOf(usize) + cy.chan.read(usize, bytes[offset..]);
+        }
+        return ElemTable{
+            .bytes = bytes,
+            .offsets = offsets,
+        };
+    }
+
+    pub fn deinit(self: *ElemTable, allocator: std.mem.Allocator) void {
+        allocator.free(self.offsets);
+        self.* = undefined;
+    }
+
+    pub fn len(self: ElemTable) usize {
+        return self.offsets.len;
+    }
+
+    pub fn get(self: ElemTable, i: usize) []const u8 {
+        return cy.chan.read([]const u8, self.bytes[self.offsets[i]..]);
+    }
+};
+
+test "element access" {
+    const allocator = std.testing.allocator;
+    const elems = [_][]const u8{ "a", "", "bcd", "efgh" };
+
+    var bytes = std.ArrayList(u8).init(allocator);
+    defer bytes.deinit();
+    for ([_]usize{ 0, 1, elems.len }) |count| {
+        bytes.clearRetainingCapacity();
+        try bytes.appendSlice(std.mem.asBytes(&count));
+        for (elems[0..count]) |elem| {
+            try writeElem(&bytes, elem);
+        }
+
+        const slice = MutateString.init(bytes.items);
+        try std.testing.expectEqual(count, slice.len());
+        var indexed = try slice.index(allocator);
+        defer indexed.deinit(allocator);
+        try std.testing.expectEqual(count, indexed.len());
+
+        var iter = slice.iterator();
+        var elem_iter = ElemIterator.init(bytes.items[@sizeOf(usize)..]);
+        var skipping = ElemIterator.init(bytes.items[@sizeOf(usize)..]);
+        for (0..count) |i| {
+            const expected = slice.elemBytes(i);
+            try std.testing.expectEqualStrings(elems[i], expected);
+            try std.testing.expectEqualStrings(expected, indexed.elemBytes(i));
+            try std.testing.expectEqualStrings(expected, indexed.elem(i).bytes);
+            try std.testing.expectEqualStrings(expected, iter.nextBytes().?);
+            try std.testing.expectEqualStrings(expected, elem_iter.next());
+            if (i % 2 == 0) {
+                skipping.skip();
+            } else {
+                try std.testing.expectEqualStrings(expected, skipping.next());
+            }
+        }
+        try std.testing.expect(iter.nextBytes() == null);
+    }
+}
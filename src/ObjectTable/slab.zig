@@ -0,0 +1,436 @@
+//! A slab allocator for the state trees of objects. The table gives the objects of a source one pool in each
+//! of its shards, so that objects holding only a few small states share their slabs instead of each
+//! reserving slabs of its own.
+//!
+//! Small allocations are carved out of fixed size slabs. The size classes are built around the size of
+//! `Elem`, so that boxed states and short state slices pack without waste. Allocations larger than the
+//! biggest class go straight to the parent allocator.
+//!
+//! Each slab keeps its own free list and live count. Slabs with free slots are kept at the front of their
+//! class's list, so allocating never searches. A slab that becomes empty is released back to the parent
+//! (one empty slab per class is kept as a spare), which lets shrinking objects give memory back.
+//!
+//! `deinit` releases the slabs and large allocations in bulk, without visiting the individual allocations.
+//!
+//! Thread safe, since the versions of objects held by snapshots are released on the threads of their
+//! readers while the writer of the shard keeps allocating.
+const std = @import("std");
+
+pub fn SlabAllocator(comptime Elem: type) type {
+    return struct {
+        parent: std.mem.Allocator,
+        mutex: std.Thread.Mutex = .{},
+        classes: [size_classes.len]Class = [_]Class{.{}} ** size_classes.len,
+        large: ?*Large = null,
+
+        /// Bytes handed out, rounded up to their size class. Read through `usage` while other threads may
+        /// use the pool.
+        live_bytes: usize = 0,
+        /// Bytes held from the parent allocator.
+        reserved_bytes: usize = 0,
+
+        pub const slab_size = 16 * 1024;
+        pub const size_classes = sizeClasses();
+
+        const slab_log2_align = std.math.log2_int(usize, slab_size);
+        const header_size = std.mem.alignForward(usize, @sizeOf(Slab), max_slot_align);
+        const max_slot_align = 64;
+
+        const Slab = struct {
+            class: u8,
+            live: u32 = 0,
+            // offset of the first slot that has never been handed out
+            bump: u32 = header_size,
+            free: ?*FreeSlot = null,
+            prev: ?*Slab = null,
+            next: ?*Slab = null,
+
+            fn isFull(slab: *const Slab) bool {
+                return slab.free == null and slab.bump + size_classes[slab.class] > slab_size;
+            }
+        };
+
+        const FreeSlot = struct {
+            next: ?*FreeSlot,
+        };
+
+        const Class = struct {
+            // slabs with free slots always precede full slabs
+            head: ?*Slab = null,
+            tail: ?*Slab = null,
+            spare: ?*Slab = null,
+
+            fn pushFront(class: *Class, slab: *Slab) void {
+                slab.prev = null;
+                slab.next = class.head;
+                if (class.head) |head| {
+                    head.prev = slab;
+                } else {
+                    class.tail = slab;
+                }
+                class.head = slab;
+            }
+
+            fn pushBack(class: *Class, slab: *Slab) void {
+                slab.next = null;
+                slab.prev = class.tail;
+                if (class.tail) |tail| {
+                    tail.next = slab;
+                } else {
+                    class.head = slab;
+                }
+                class.tail = slab;
+            }
+
+            fn remove(class: *Class, slab: *Slab) void {
+                if (slab.prev) |prev| {
+                    prev.next = slab.next;
+                } else {
+                    class.head = slab.next;
+                }
+                if (slab.next) |next| {
+                    next.prev = slab.prev;
+                } else {
+                    class.tail = slab.prev;
+                }
+                slab.prev = null;
+                slab.next = null;
+            }
+        };
+
+        const Large = struct {
+            len: usize,
+            log2_align: u8,
+            prev: ?*Large,
+            next: ?*Large,
+        };
+
+        pub const Usage = struct {
+            live_bytes: usize,
+            reserved_bytes: usize,
+        };
+
+        const Self = @This();
+
+        pub fn init(parent: std.mem.Allocator) Self {
+            return Self{ .parent = parent };
+        }
+
+        pub fn deinit(self: *Self) void {
+            for (&self.classes) |*class| {
+                var slab = class.head;
+                while (slab) |s| {
+                    slab = s.next;
+                    self.releaseSlab(s);
+                }
+                if (class.spare) |spare| {
+                    self.releaseSlab(spare);
+                }
+            }
+
+            var large = self.large;
+            while (large) |l| {
+                large = l.next;
+                const base = @as([*]u8, @ptrCast(l)) + @sizeOf(Large) - largeHeaderLen(l.log2_align);
+                self.parent.rawFree(base[0..l.len], l.log2_align, @returnAddress());
+            }
+            self.* = undefined;
+        }
+
+        pub fn allocator(self: *Self) std.mem.Allocator {
+            return std.mem.Allocator{
+                .ptr = self,
+                .vtable = &.{
+                    .alloc = alloc,
+                    .resize = resize,
+                    .free = free,
+                },
+            };
+        }
+
+        pub fn usage(self: *Self) Usage {
+            self.mutex.lock();
+            defer self.mutex.unlock();
+            return Usage{ .live_bytes = self.live_bytes, .reserved_bytes = self.reserved_bytes };
+        }
+
+        /// Releases the spare empty slab of every class.
+        pub fn trim(self: *Self) void {
+            self.mutex.lock();
+            defer self.mutex.unlock();
+
+            for (&self.classes) |*class| {
+                if (class.spare) |spare| {
+                    self.releaseSlab(spare);
+                    class.spare = null;
+                }
+            }
+        }
+
+        fn alloc(ctx: *anyopaque, len: usize, log2_align: u8, ret_addr: usize) ?[*]u8 {
+            const self: *Self = @ptrCast(@alignCast(ctx));
+            self.mutex.lock();
+            defer self.mutex.unlock();
+
+            const ci = classOf(len, log2_align) orelse return self.allocLarge(len, log2_align, ret_addr);
+            const class = &self.classes[ci];
+
+            const slab = if (class.head != null and !class.head.?.isFull())
+                class.head.?
+            else blk: {
+                const new_slab = self.newSlab(ci) orelse return null;
+                class.pushFront(new_slab);
+                break :blk new_slab;
+            };
+
+            const slot: [*]u8 = if (slab.free) |free_slot| blk: {
+                slab.free = free_slot.next;
+                break :blk @ptrCast(free_slot);
+            } else blk: {
+                const bump_slot = @as([*]u8, @ptrCast(slab)) + slab.bump;
+                slab.bump += size_classes[ci];
+                break :blk bump_slot;
+            };
+
+            slab.live += 1;
+            if (slab.isFull()) {
+                class.remove(slab);
+                class.pushBack(slab);
+            }
+            self.live_bytes += size_classes[ci];
+            return slot;
+        }
+
+        fn resize(ctx: *anyopaque, buf: []u8, log2_align: u8, new_len: usize, ret_addr: usize) bool {
+            _ = ret_addr;
+            const self: *Self = @ptrCast(@alignCast(ctx));
+            self.mutex.lock();
+            defer self.mutex.unlock();
+
+            const ci = classOf(buf.len, log2_align) orelse {
+                // large allocations can shrink in place as long as they stay large
+                if (new_len <= buf.len and classOf(new_len, log2_align) == null) {
+                    self.live_bytes -= buf.len - new_len;
+                    return true;
+                }
+                return false;
+            };
+            return classOf(new_len, log2_align) == ci;
+        }
+
+        fn free(ctx: *anyopaque, buf: []u8, log2_align: u8, ret_addr: usize) void {
+            const self: *Self = @ptrCast(@alignCast(ctx));
+            self.mutex.lock();
+            defer self.mutex.unlock();
+
+            const ci = classOf(buf.len, log2_align) orelse return self.freeLarge(buf, ret_addr);
+            const class = &self.classes[ci];
+
+            const slab: *Slab = @ptrFromInt(@intFromPtr(buf.ptr) & ~@as(usize, slab_size - 1));
+            const was_full = slab.isFull();
+
+            const slot: *FreeSlot = @ptrCast(@alignCast(buf.ptr));
+            slot.next = slab.free;
+            slab.free = slot;
+            slab.live -= 1;
+            self.live_bytes -= size_classes[ci];
+
+            if (slab.live == 0) {
+                class.remove(slab);
+                self.retireSlab(class, slab);
+            } else if (was_full) {
+                class.remove(slab);
+                class.pushFront(slab);
+            }
+        }
+
+        fn newSlab(self: *Self, ci: usize) ?*Slab {
+            const class = &self.classes[ci];
+            if (class.spare) |spare| {
+                class.spare = null;
+                return spare;
+            }
+
+            const bytes = self.parent.rawAlloc(slab_size, slab_log2_align, @returnAddress()) orelse return null;
+            self.reserved_bytes += slab_size;
+
+            const slab: *Slab = @ptrCast(@alignCast(bytes));
+            slab.* = Slab{ .class = @intCast(ci) };
+            return slab;
+        }
+
+        fn retireSlab(self: *Self, class: *Class, slab: *Slab) void {
+            if (class.spare == null) {
+                slab.* = Slab{ .class = slab.class };
+                class.spare = slab;
+            } else {
+                self.releaseSlab(slab);
+            }
+        }
+
+        fn releaseSlab(self: *Self, slab: *Slab) void {
+            const bytes: [*]u8 = @ptrCast(slab);
+            self.parent.rawFree(bytes[0..slab_size], slab_log2_align, @returnAddress());
+            self.reserved_bytes -= slab_size;
+        }
+
+        fn allocLarge(self: *Self, len: usize, log2_align: u8, ret_addr: usize) ?[*]u8 {
+            const large_log2_align = @max(log2_align, std.math.log2_int(usize, @alignOf(Large)));
+            const header_len = largeHeaderLen(large_log2_align);
+            const base = self.parent.rawAlloc(header_len + len, large_log2_align, ret_addr) orelse return null;
+
+            const large: *Large = @ptrCast(@alignCast(base + header_len - @sizeOf(Large)));
+            large.* = Large{
+                .len = header_len + len,
+                .log2_align = large_log2_align,
+                .prev = null,
+                .next = self.large,
+            };
+            if (self.large) |head| {
+                head.prev = large;
+            }
+            self.large = large;
+
+            self.live_bytes += len;
+            self.reserved_bytes += large.len;
+            return base + header_len;
+        }
+
+        fn freeLarge(self: *Self, buf: []u8, ret_addr: usize) void {
+            const large: *Large = @ptrFromInt(@intFromPtr(buf.ptr) - @sizeOf(Large));
+            if (large.prev) |prev| {
+                prev.next = large.next;
+            } else {
+                self.large = large.next;
+            }
+            if (large.next) |next| {
+                next.prev = large.prev;
+            }
+
+            self.live_bytes -= buf.len;
+            self.reserved_bytes -= large.len;
+
+            const base = buf.ptr - largeHeaderLen(large.log2_align);
+            self.parent.rawFree(base[0..large.len], large.log2_align, ret_addr);
+        }
+
+        fn largeHeaderLen(log2_align: u8) usize {
+            return std.mem.alignForward(usize, @sizeOf(Large), @as(usize, 1) << @intCast(log2_align));
+        }
+
+        fn classOf(len: usize, log2_align: u8) ?usize {
+            const alignment = @as(usize, 1) << @intCast(log2_align);
+            for (size_classes, 0..) |size, ci| {
+                if (len <= size and alignment <= slotAlign(size)) {
+                    return ci;
+                }
+            }
+            return null;
+        }
+
+        fn slotAlign(size: usize) usize {
+            return @min(@as(usize, 1) << @intCast(@ctz(size)), max_slot_align);
+        }
+
+        fn sizeClasses() [num_size_classes]u32 {
+            var classes: [num_size_classes]u32 = undefined;
+            var i: usize = 0;
+            for ([_]usize{ 16, 32 }) |small| {
+                if (small < elem_size) {
+                    classes[i] = @intCast(small);
+                    i += 1;
+                }
+            }
+            var size = elem_size;
+            while (i < classes.len) : (i += 1) {
+                classes[i] = @intCast(size);
+                size *= 2;
+            }
+            return classes;
+        }
+
+        const elem_size = std.mem.alignForward(usize, @sizeOf(Elem), @alignOf(FreeSlot));
+
+        // every class holds at least eight slots
+        const num_size_classes = blk: {
+            var n: usize = 0;
+            for ([_]usize{ 16, 32 }) |small| {
+                if (small < elem_size) n += 1;
+            }
+            var size = elem_size;
+            while (size <= (slab_size - 64) / 8) : (size *= 2) {
+                n += 1;
+            }
+            break :blk n;
+        };
+    };
+}
+
+const TestElem = struct {
+    a: u64,
+    b: u64,
+    c: u64,
+};
+
+test "size classes" {
+    const Slabs = SlabAllocator(TestElem);
+    try std.testing.expectEqual(@as(u32, 16), Slabs.size_classes[0]);
+    try std.testing.expectEqual(@as(u32, @sizeOf(TestElem)), Slabs.size_classes[1]);
+    try std.testing.expectEqual(@as(u32, @sizeOf(TestElem) * 2), Slabs.size_classes[2]);
+}
+
+test "alloc and free" {
+    var slabs = SlabAllocator(TestElem).init(std.testing.allocator);
+    defer slabs.deinit();
+    const allocator = slabs.allocator();
+
+    const one = try allocator.create(TestElem);
+    const many = try allocator.alloc(TestElem, 5);
+    const large = try allocator.alloc(u8, 32 * 1024);
+
+    one.* = .{ .a = 1, .b = 2, .c = 3 };
+    @memset(large, 7);
+    try std.testing.expect(slabs.live_bytes >= @sizeOf(TestElem) * 6 + large.len);
+
+    allocator.destroy(one);
+    allocator.free(many);
+    allocator.free(large);
+    try std.testing.expectEqual(@as(usize, 0), slabs.live_bytes);
+}
+
+test "empty slabs are released" {
+    const Slabs = SlabAllocator(TestElem);
+    var slabs = Slabs.init(std.testing.allocator);
+    defer slabs.deinit();
+    const allocator = slabs.allocator();
+
+    var elems = std.ArrayList(*TestElem).init(std.testing.allocator);
+    defer elems.deinit();
+
+    for (0..Slabs.slab_size / @sizeOf(TestElem) * 3) |_| {
+        try elems.append(try allocator.create(TestElem));
+    }
+    try std.testing.expect(slabs.reserved_bytes >= 3 * Slabs.slab_size);
+
+    for (elems.items) |elem| {
+        allocator.destroy(elem);
+    }
+    try std.testing.expectEqual(@as(usize, Slabs.slab_size), slabs.reserved_bytes);
+
+    slabs.trim();
+    try std.testing.expectEqual(@as(usize, 0), slabs.reserved_bytes);
+}
+
+test "deinit releases live allocations" {
+    var slabs = SlabAllocator(TestElem).init(std.testing.allocator);
+    const allocator = slabs.allocator();
+
+    for (0..1000) |i| {
+        const elems = try allocator.alloc(TestElem, i % 7 + 1);
+        elems[0].a = i;
+    }
+    _ = try allocator.alloc(u8, 100 * 1024);
+
+    // std.testing.allocator reports anything deinit misses
+    slabs.deinit();
+}
@@ -1 +1,1230 @@
+//! Keeps the objects of an `ObjectTable` across runs. Every update the table applies is appended to a
+//! memory-mapped log, made of segments of up to `Options.segment_bytes`. Sealed segments are folded into a
+//! compact snapshot, either by `checkpoint` or by a compactor thread in the background. At startup `replay`
+//! maps the latest snapshot and applies it, followed by only the segments written after it.
+//!
+//! Types are stored by their names and definition the first time an update uses them, since TypeIds depend
+//! on the order that plugins register their schemes in and differ from one run to the next.
 const std = @import("std");
+const builtin = @import("builtin");
+const cy = @import("cycle");
+const win = @import("windows.zig");
+const ObjectTable = @import("ObjectTable.zig");
+const TypeTable = @import("TypeTable.zig");
+const Coalescer = @import("ObjectTable/Coalescer.zig");
+const serde = @import("ObjectTable/serde.zig");
+const fixtures = @import("fixtures.zig");
+
+allocator: std.mem.Allocator,
+// Owned by the caller, and must stay open for as long as the store. Opened with `.iterate = true`.
+dir: std.fs.Dir,
+options: Options,
+// Held while the log is written or its segments change. Updates to different shards append concurrently.
+mutex: std.Thread.Mutex = .{},
+// The segments of the log in order, the last of which is appended to. Boxed, so that reservations can
+// point to them while the list grows.
+segments: std.ArrayListUnmanaged(*Segment) = .{},
+// The types that records refer to, by their index.
+types: std.ArrayListUnmanaged(StoredType) = .{},
+refs: std.AutoHashMapUnmanaged(u64, u32) = .{},
+// The records of `types`, which every snapshot starts with.
+type_records: std.ArrayListUnmanaged(u8) = .{},
+stats: Stats = .{},
+// Held for the whole of a compaction, so that `checkpoint` and the compactor don't write the snapshot at once.
+compact_mutex: std.Thread.Mutex = .{},
+compactor: ?std.Thread = null,
+// Signalled when a segment may have become ready for compaction, and when the compactor should stop.
+wake: std.Thread.Condition = .{},
+stopping: bool = false,
+
+pub const Options = struct {
+    /// Size past which the log moves on to a new segment, leaving the old one to be compacted.
+    segment_bytes: usize = 64 << 20,
+    /// Size that a segment file starts at. It doubles whenever it fills up.
+    initial_segment_bytes: usize = 1 << 20,
+    /// Upper bound of snapshot bytes written per byte of log compacted. As every compaction rewrites the
+    /// whole snapshot, the compactor waits for enough sealed segments to stay under it.
+    max_write_amplification: f64 = 4,
+    /// Log size at which the compactor folds whatever is sealed, regardless of the write amplification.
+    max_log_bytes: usize = 1 << 30,
+};
+
+pub const Stats = struct {
+    compactions: u64 = 0,
+    /// Compactions that failed, whose segments are left for the next one.
+    failed_compactions: u64 = 0,
+    /// Log bytes folded into snapshots, and the time it took, which give the compaction throughput.
+    compacted_bytes: u64 = 0,
+    compaction_ns: u64 = 0,
+    /// Snapshot bytes written, which over `compacted_bytes` is the write amplification.
+    snapshot_bytes_written: u64 = 0,
+    /// Records and bytes that a replay would go through right now.
+    snapshot_records: u64 = 0,
+    snapshot_bytes: u64 = 0,
+    log_records: u64 = 0,
+    log_bytes: u64 = 0,
+};
+
+pub const Kind = enum(u8) {
+    /// Fills the space reserved for an update that wasn't applied after all.
+    Skip,
+    Type,
+    Create,
+    Mutate,
+    /// Removes an object, which holds only its names.
+    Remove,
+};
+
+/// Space in the log for the record of an update, which `commit` writes once the update is applied.
+pub const Reservation = struct {
+    segment: *Segment,
+    offset: usize,
+    len: usize,
+    kind: Kind,
+    ref: u32,
+    mutation: ObjectTable.Mutation,
+};
+
+pub const Replay = struct {
+    snapshot_records: usize = 0,
+    log_records: usize = 0,
+};
+
+const StoredType = struct {
+    type_id: cy.def.TypeId,
+    type: cy.def.Type,
+};
+
+// One file of the log. Only the last segment is appended to. The ones before it are sealed, and can be
+// compacted once their last reservation is committed.
+const Segment = struct {
+    number: u64,
+    file: std.fs.File,
+    mapping: Mapping,
+    end: usize,
+    records: usize,
+    pending: usize = 0,
+
+    fn create(allocator: std.mem.Allocator, dir: std.fs.Dir, number: u64, capacity: usize) !*Segment {
+        var name_buf: [segment_name_len]u8 = undefined;
+        const file = try dir.createFile(segmentName(&name_buf, number), .{ .read = true });
+        errdefer file.close();
+
+        var mapping = try Mapping.map(file, capacity, true);
+        errdefer mapping.unmap();
+        const header = Header{ .magic = segment_magic, .version = format_version, .segment = number };
+        @memcpy(mapping.bytes[0..@sizeOf(Header)], std.mem.asBytes(&header));
+
+        const segment = try allocator.create(Segment);
+        segment.* = Segment{
+            .number = number,
+            .file = file,
+            .mapping = mapping,
+            .end = @sizeOf(Header),
+            .records = 0,
+        };
+        return segment;
+    }
+
+    /// Returns null if the file doesn't hold a segment, which is left behind when creating one was
+    /// interrupted.
+    fn open(allocator: std.mem.Allocator, dir: std.fs.Dir, number: u64) !?*Segment {
+        var name_buf: [segment_name_len]u8 = undefined;
+        const file = try dir.openFile(segmentName(&name_buf, number), .{ .mode = .read_write });
+        errdefer file.close();
+
+        const size = try file.getEndPos();
+        if (size < @sizeOf(Header)) {
+            file.close();
+            return null;
+        }
+        var mapping = try Mapping.map(file, size, true);
+        errdefer mapping.unmap();
+
+        const header = std.mem.bytesToValue(Header, mapping.bytes[0..@sizeOf(Header)]);
+        if (!std.mem.eql(u8, &header.magic, &segment_magic) or header.segment != number) {
+            mapping.unmap();
+            file.close();
+            return null;
+        }
+        if (header.version != format_version) {
+            return error.UnsupportedVersion;
+        }
+
+        const segment = try allocator.create(Segment);
+        const end, const records = scanRecords(mapping.bytes);
+        segment.* = Segment{
+            .number = number,
+            .file = file,
+            .mapping = mapping,
+            .end = end,
+            .records = records,
+        };
+        return segment;
+    }
+
+    fn destroy(self: *Segment, allocator: std.mem.Allocator) void {
+        self.mapping.unmap();
+        self.file.close();
+        allocator.destroy(self);
+    }
+
+    fn grow(self: *Segment, capacity: usize) !void {
+        // mapped again before the old mapping goes away, which is still there if this fails
+        const grown = try Mapping.map(self.file, capacity, true);
+        self.mapping.unmap();
+        self.mapping = grown;
+    }
+};
+
+const snapshot_name = "objects.snapshot";
+const snapshot_tmp_name = "objects.snapshot.tmp";
+const segment_prefix = "objects.log.";
+const segment_name_len = segment_prefix.len + 20;
+
+fn segmentName(buf: *[segment_name_len]u8, number: u64) []const u8 {
+    return std.fmt.bufPrint(buf, segment_prefix ++ "{d}", .{number}) catch unreachable;
+}
+
+fn parseSegmentName(name: []const u8) ?u64 {
+    if (!std.mem.startsWith(u8, name, segment_prefix)) {
+        return null;
+    }
+    return std.fmt.parseInt(u64, name[segment_prefix.len..], 10) catch null;
+}
+
+// `segment` is the number of a log segment, or the first segment that isn't folded into a snapshot yet.
+const Header = extern struct {
+    magic: [4]u8,
+    version: u32,
+    segment: u64,
+};
+
+const snapshot_magic = "CYSN".*;
+const segment_magic = "CYLG".*;
+const format_version = 1;
+
+// Every record starts with the length and the CRC32 of its body, and the next one starts at the following
+// multiple of 8. The padding is part of the body, so that a skip record can fill any reservation. A zero
+// length or a wrong checksum ends the records, which is where an interrupted write leaves off.
+const frame_len = 8;
+const record_align = 8;
+
+// Records are replayed in batches, each applied to the shards of the table in parallel.
+const replay_batch = 1 << 14;
+
+const Self = @This();
+
+/// Opens the store in `dir`, which is created empty if it doesn't hold one yet. `replay` loads its objects.
+pub fn open(allocator: std.mem.Allocator, dir: std.fs.Dir, options: Options) !Self {
+    std.debug.assert(options.initial_segment_bytes >= @sizeOf(Header));
+    const first_segment = try readSnapshotHeader(dir);
+
+    var self = Self{
+        .allocator = allocator,
+        .dir = dir,
+        .options = options,
+    };
+    errdefer self.deinit();
+
+    var numbers = std.ArrayList(u64).init(allocator);
+    defer numbers.deinit();
+    var iter = dir.iterate();
+    while (try iter.next()) |entry| {
+        if (entry.kind != .file) {
+            continue;
+        }
+        if (parseSegmentName(entry.name)) |number| {
+            try numbers.append(number);
+        }
+    }
+    std.mem.sort(u64, numbers.items, {}, std.sort.asc(u64));
+
+    var name_buf: [segment_name_len]u8 = undefined;
+    for (numbers.items) |number| {
+        // already folded into the snapshot, and left behind when removing it was interrupted
+        if (number < first_segment) {
+            try dir.deleteFile(segmentName(&name_buf, number));
+            continue;
+        }
+
+        const segment = try Segment.open(allocator, dir, number) orelse {
+            try dir.deleteFile(segmentName(&name_buf, number));
+            continue;
+        };
+        self.segments.append(allocator, segment) catch |e| {
+            segment.destroy(allocator);
+            return e;
+        };
+        self.stats.log_records += segment.records;
+        self.stats.log_bytes += segment.end;
+    }
+
+    if (self.segments.items.len == 0) {
+        const segment = try Segment.create(allocator, dir, first_segment, options.initial_segment_bytes);
+        self.segments.append(allocator, segment) catch |e| {
+            segment.destroy(allocator);
+            return e;
+        };
+        self.stats.log_bytes += segment.end;
+    }
+    return self;
+}
+
+/// Stops the compactor. Records already committed are kept, and reach the disk even if they haven't been
+/// synced.
+pub fn deinit(self: *Self) void {
+    if (self.compactor) |thread| {
+        self.mutex.lock();
+        self.stopping = true;
+        self.wake.signal();
+        self.mutex.unlock();
+        thread.join();
+    }
+
+    for (self.segments.items) |segment| {
+        segment.mapping.flush() catch {};
+        segment.destroy(self.allocator);
+    }
+    self.segments.deinit(self.allocator);
+    self.types.deinit(self.allocator);
+    self.refs.deinit(self.allocator);
+    self.type_records.deinit(self.allocator);
+    self.* = undefined;
+}
+
+/// Starts compacting sealed segments in the background, on a thread of its own that never blocks updates.
+/// The store must not move until it's deinitialized.
+pub fn startCompactor(self: *Self) !void {
+    std.debug.assert(self.compactor == null);
+    self.compactor = try std.Thread.spawn(.{}, runCompactor, .{self});
+}
+
+/// Writes the committed records through to the disk, after which they survive a crash of the system.
+pub fn sync(self: *Self) !void {
+    self.mutex.lock();
+    defer self.mutex.unlock();
+
+    for (self.segments.items) |segment| {
+        try segment.mapping.flush();
+    }
+}
+
+/// Returns the compaction and replay length metrics.
+pub fn metrics(self: *Self) Stats {
+    self.mutex.lock();
+    defer self.mutex.unlock();
+    return self.stats;
+}
+
+/// Loads the stored objects into `table` and their types into `type_table`. The table must be empty and the
+/// store not attached to it yet. Applies the snapshot and then every segment of the log, in batches on
+/// `pool`.
+pub fn replay(self: *Self, table: *ObjectTable, type_table: *TypeTable, pool: *std.Thread.Pool) !Replay {
+    std.debug.assert(table.store == null);
+
+    var batch = try ReplayBatch.init(self.allocator, table, type_table, pool);
+    defer batch.deinit();
+
+    var result = Replay{};
+    if (try self.mapSnapshot()) |snapshot| {
+        var s = snapshot;
+        defer s.unmap();
+        result.snapshot_records = try self.replayRecords(&batch, s.bytes, s.bytes.len);
+        self.stats.snapshot_records = scanRecords(s.bytes)[1];
+        self.stats.snapshot_bytes = s.bytes.len;
+    }
+    for (self.segments.items) |segment| {
+        result.log_records += try self.replayRecords(&batch, segment.mapping.bytes, segment.end);
+    }
+    return result;
+}
+
+/// Reserves space in the log for the record of an update about to be applied, which must be passed to
+/// `commit` once it is. Stores the type of the update first if it's new to the store.
+pub fn reserve(self: *Self, type_table: *const TypeTable, kind: Kind, mutation: ObjectTable.Mutation) !Reservation {
+    self.mutex.lock();
+    defer self.mutex.unlock();
+
+    const ref = try self.storeType(type_table, mutation.type_id);
+    const len = try recordLen(&.{ mutation.scheme_name, mutation.source_name, mutation.object_name, mutation.bytes });
+    const segment, const offset = try self.allocate(len);
+    segment.pending += 1;
+    return Reservation{
+        .segment = segment,
+        .offset = offset,
+        .len = len,
+        .kind = kind,
+        .ref = ref,
+        .mutation = mutation,
+    };
+}
+
+/// Same as `reserve`, for the removal of an object.
+pub fn reserveRemove(self: *Self, scheme_name: []const u8, source_name: []const u8, object_name: []const u8) !Reservation {
+    self.mutex.lock();
+    defer self.mutex.unlock();
+
+    const len = try recordLen(&.{ scheme_name, source_name, object_name });
+    const segment, const offset = try self.allocate(len);
+    segment.pending += 1;
+    return Reservation{
+        .segment = segment,
+        .offset = offset,
+        .len = len,
+        .kind = .Remove,
+        .ref = 0,
+        .mutation = ObjectTable.Mutation{
+            .scheme_name = scheme_name,
+            .source_name = source_name,
+            .object_name = object_name,
+            .type_id = undefined,
+            .bytes = &.{},
+        },
+    };
+}
+
+/// Writes the record of the update that `reservation` was made for, or a record to skip over when it wasn't
+/// applied.
+pub fn commit(self: *Self, reservation: Reservation, applied: bool) void {
+    self.mutex.lock();
+    defer self.mutex.unlock();
+
+    const segment = reservation.segment;
+    const dest = segment.mapping.bytes[reservation.offset..][0..reservation.len];
+    if (applied) {
+        const m = reservation.mutation;
+        const strings = [_][]const u8{ m.scheme_name, m.source_name, m.object_name, m.bytes };
+        encodeRecord(dest, reservation.kind, reservation.ref, strings[0..stringCount(reservation.kind)]);
+    } else {
+        encodeRecord(dest, .Skip, 0, &.{});
+    }
+
+    segment.pending -= 1;
+    if (segment.pending == 0 and segment != self.active()) {
+        self.wake.signal();
+    }
+}
+
+/// Seals the log and folds it into a new snapshot right away. The snapshot keeps only the latest creation
+/// of each object and the mutations since, with consecutive mutations merged wherever the coalescer can.
+pub fn checkpoint(self: *Self) !void {
+    const through = blk: {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        if (self.active().end > @sizeOf(Header)) {
+            try self.seal();
+        }
+        for (self.segments.items[0 .. self.segments.items.len - 1]) |segment| {
+            if (segment.pending > 0) {
+                return error.UpdatesPending;
+            }
+        }
+        break :blk self.active().number;
+    };
+    try self.compact(through);
+}
+
+fn active(self: *const Self) *Segment {
+    return self.segments.items[self.segments.items.len - 1];
+}
+
+// Must be called with the store locked. Moves the log on to a new segment.
+fn seal(self: *Self) !void {
+    const segment = try Segment.create(self.allocator, self.dir, self.active().number + 1, self.options.initial_segment_bytes);
+    self.segments.append(self.allocator, segment) catch |e| {
+        segment.destroy(self.allocator);
+        var name_buf: [segment_name_len]u8 = undefined;
+        self.dir.deleteFile(segmentName(&name_buf, segment.number)) catch {};
+        return e;
+    };
+    self.stats.log_bytes += segment.end;
+    self.wake.signal();
+}
+
+fn runCompactor(self: *Self) void {
+    self.mutex.lock();
+    defer self.mutex.unlock();
+
+    while (!self.stopping) {
+        const through = self.compactable() orelse {
+            self.wake.wait(&self.mutex);
+            continue;
+        };
+
+        self.mutex.unlock();
+        const result = self.compact(through);
+        self.mutex.lock();
+
+        result catch {
+            // retried once another segment is sealed
+            self.stats.failed_compactions += 1;
+            self.wake.wait(&self.mutex);
+        };
+    }
+}
+
+// Must be called with the store locked. Returns the number of the first segment that's not to be compacted,
+// or null if compacting now would go over the limits.
+fn compactable(self: *Self) ?u64 {
+    var through: ?u64 = null;
+    var bytes: usize = 0;
+    for (self.segments.items[0 .. self.segments.items.len - 1]) |segment| {
+        if (segment.pending > 0) {
+            break;
+        }
+        through = segment.number + 1;
+        bytes += segment.end;
+    }
+    if (through == null) {
+        return null;
+    }
+
+    const amplification = @as(f64, @floatFromInt(self.stats.snapshot_bytes)) / @as(f64, @floatFromInt(bytes));
+    if (amplification > self.options.max_write_amplification and self.stats.log_bytes < self.options.max_log_bytes) {
+        return null;
+    }
+    return through;
+}
+
+// What's left of the records of one object once they're folded.
+const History = struct {
+    ref: u32,
+    create: ?[]const u8 = null,
+    mutations: std.ArrayListUnmanaged([]const u8) = .{},
+};
+
+const Names = [3][]const u8;
+
+const NamesContext = struct {
+    pub fn hash(_: NamesContext, names: Names) u32 {
+        var hasher = std.hash.Wyhash.init(0);
+        for (names) |name| {
+            hasher.update(name);
+            hasher.update(&.{0});
+        }
+        return @truncate(hasher.final());
+    }
+
+    pub fn eql(_: NamesContext, a: Names, b: Names, _: usize) bool {
+        for (a, b) |x, y| {
+            if (!std.mem.eql(u8, x, y)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+const Histories = std.ArrayHashMapUnmanaged(Names, History, NamesContext, true);
+
+// Folds the sealed segments numbered below `through` into a new snapshot, and removes them once it's in
+// place. Only holds the store lock to look at the segments and to drop them afterwards: sealed segments
+// without pending reservations don't change, so they are read without it.
+fn compact(self: *Self, through: u64) !void {
+    self.compact_mutex.lock();
+    defer self.compact_mutex.unlock();
+
+    var timer = try std.time.Timer.start();
+    var arena = std.heap.ArenaAllocator.init(self.allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    const segments, const types, const type_records = blk: {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        var count: usize = 0;
+        while (count < self.segments.items.len - 1 and self.segments.items[count].number < through) {
+            count += 1;
+        }
+        break :blk .{
+            try allocator.dupe(*Segment, self.segments.items[0..count]),
+            try allocator.dupe(StoredType, self.types.items),
+            try allocator.dupe(u8, self.type_records.items),
+        };
+    };
+    if (segments.len == 0) {
+        // compacted by someone else in the meantime
+        return;
+    }
+
+    var coalescer = Coalescer.init(self.allocator);
+    defer coalescer.deinit();
+
+    // the histories point into the snapshot and the segments until the new snapshot is written
+    var histories = Histories{};
+    var snapshot = try self.mapSnapshot();
+    defer if (snapshot) |*s| s.unmap();
+    if (snapshot) |s| {
+        try fold(allocator, &coalescer, types, &histories, s.bytes, s.bytes.len);
+    }
+    var compacted_bytes: usize = 0;
+    for (segments) |segment| {
+        try fold(allocator, &coalescer, types, &histories, segment.mapping.bytes, segment.end);
+        compacted_bytes += segment.end;
+    }
+
+    const written = try self.writeSnapshot(type_records, types.len, histories, segments[segments.len - 1].number + 1);
+    // Windows doesn't replace a file that's still mapped
+    if (snapshot) |*s| {
+        s.unmap();
+        snapshot = null;
+    }
+    // from here on the segments are no longer needed, even if removing them is interrupted
+    try self.dir.rename(snapshot_tmp_name, snapshot_name);
+
+    {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        const remaining = self.segments.items[segments.len..];
+        std.mem.copyForwards(*Segment, self.segments.items, remaining);
+        self.segments.shrinkRetainingCapacity(remaining.len);
+        for (segments) |segment| {
+            self.stats.log_records -= segment.records;
+            self.stats.log_bytes -= segment.end;
+        }
+        self.stats.compactions += 1;
+        self.stats.compacted_bytes += compacted_bytes;
+        self.stats.compaction_ns += timer.read();
+        self.stats.snapshot_bytes_written += written.bytes;
+        self.stats.snapshot_bytes = written.bytes;
+        self.stats.snapshot_records = written.records;
+    }
+
+    var name_buf: [segment_name_len]u8 = undefined;
+    for (segments) |segment| {
+        const number = segment.number;
+        segment.destroy(self.allocator);
+        self.dir.deleteFile(segmentName(&name_buf, number)) catch {};
+    }
+}
+
+fn fold(
+    allocator: std.mem.Allocator,
+    coalescer: *Coalescer,
+    types: []const StoredType,
+    histories: *Histories,
+    bytes: []const u8,
+    end: usize,
+) !void {
+    var merged = std.ArrayList(u8).init(allocator);
+    var offset: usize = @sizeOf(Header);
+    while (frameBody(bytes[0..end], offset)) |body| {
+        offset += frame_len + body.len;
+        const record = try decodeRecord(body);
+        if (record.kind == .Remove) {
+            // left out of the snapshot, which only writes objects with a creation
+            if (histories.getPtr(record.strings[0..3].*)) |history| {
+                history.create = null;
+                history.mutations.clearRetainingCapacity();
+            }
+            continue;
+        }
+        if (record.kind != .Create and record.kind != .Mutate) {
+            continue;
+        }
+        if (record.ref >= types.len) {
+            return error.CorruptStore;
+        }
+
+        const gop = try histories.getOrPut(allocator, record.strings[0..3].*);
+        if (!gop.found_existing) {
+            gop.value_ptr.* = History{ .ref = record.ref };
+        }
+        const history = gop.value_ptr;
+
+        if (record.kind == .Create) {
+            history.ref = record.ref;
+            history.create = record.strings[3];
+            history.mutations.clearRetainingCapacity();
+            continue;
+        }
+
+        // Only merges with a mutation that's at most twice as large, which keeps the bytes copied for a
+        // frequently edited object at O(n log n) instead of copying its whole history on every record.
+        var mutation = record.strings[3];
+        while (history.mutations.getLastOrNull()) |last| {
+            if (last.len > 2 * mutation.len) {
+                break;
+            }
+            merged.clearRetainingCapacity();
+            if (!try coalescer.merge(types[history.ref].type, last, mutation, &merged)) {
+                break;
+            }
+            _ = history.mutations.pop();
+            mutation = try allocator.dupe(u8, merged.items);
+        }
+        try history.mutations.append(allocator, mutation);
+    }
+}
+
+const Written = struct {
+    bytes: u64,
+    records: u64,
+};
+
+fn writeSnapshot(self: *Self, type_records: []const u8, type_count: usize, histories: Histories, first_segment: u64) !Written {
+    const file = try self.dir.createFile(snapshot_tmp_name, .{});
+    defer file.close();
+
+    var buffered = std.io.bufferedWriter(file.writer());
+    var counting = std.io.countingWriter(buffered.writer());
+    const writer = counting.writer();
+
+    const header = Header{ .magic = snapshot_magic, .version = format_version, .segment = first_segment };
+    try writer.writeAll(std.mem.asBytes(&header));
+    try writer.writeAll(type_records);
+    var records: u64 = type_count;
+
+    var record = std.ArrayList(u8).init(self.allocator);
+    defer record.deinit();
+    for (histories.keys(), histories.values()) |names, history| {
+        // only objects created while the store was attached can be restored
+        const create = history.create orelse continue;
+        try writeRecord(writer, &record, .Create, history.ref, names, create);
+        for (history.mutations.items) |mutation| {
+            try writeRecord(writer, &record, .Mutate, history.ref, names, mutation);
+        }
+        records += 1 + history.mutations.items.len;
+    }
+
+    try buffered.flush();
+    try file.sync();
+    return Written{ .bytes = counting.bytes_written, .records = records };
+}
+
+fn writeRecord(writer: anytype, record: *std.ArrayList(u8), kind: Kind, ref: u32, names: Names, bytes: []const u8) !void {
+    const strings = [_][]const u8{ names[0], names[1], names[2], bytes };
+    try record.resize(try recordLen(&strings));
+    encodeRecord(record.items, kind, ref, &strings);
+    try writer.writeAll(record.items);
+}
+
+// Must be called with the store locked.
+fn storeType(self: *Self, type_table: *const TypeTable, type_id: cy.def.TypeId) !u32 {
+    if (self.refs.get(@bitCast(type_id))) |ref| {
+        return ref;
+    }
+
+    const t = try type_table.get(type_id);
+    const names = try type_table.names(type_id);
+    var type_bytes = std.ArrayList(u8).init(self.allocator);
+    defer type_bytes.deinit();
+    try cy.chan.write(t, &type_bytes);
+
+    const strings = [_][]const u8{ names.scheme, names.object, type_bytes.items };
+    const len = try recordLen(&strings);
+    try self.types.ensureUnusedCapacity(self.allocator, 1);
+    try self.refs.ensureUnusedCapacity(self.allocator, 1);
+    try self.type_records.ensureUnusedCapacity(self.allocator, len);
+    const segment, const offset = try self.allocate(len);
+
+    const ref: u32 = @intCast(self.types.items.len);
+    const record = segment.mapping.bytes[offset..][0..len];
+    encodeRecord(record, .Type, ref, &strings);
+    self.type_records.appendSliceAssumeCapacity(record);
+    self.types.appendAssumeCapacity(StoredType{ .type_id = type_id, .type = t });
+    self.refs.putAssumeCapacityNoClobber(@bitCast(type_id), ref);
+    return ref;
+}
+
+// A snapshot holds every type known when it was written, some of which may be stored again in the segments
+// after it.
+fn loadType(self: *Self, type_table: *TypeTable, record: Record, raw: []const u8) !void {
+    if (record.ref < self.types.items.len) {
+        return;
+    }
+    if (record.ref > self.types.items.len) {
+        return error.CorruptStore;
+    }
+
+    const view = cy.chan.read(cy.def.Type, record.strings[2]);
+    const type_id = try type_table.update(record.strings[0], record.strings[1], view);
+    try self.types.ensureUnusedCapacity(self.allocator, 1);
+    try self.refs.ensureUnusedCapacity(self.allocator, 1);
+    try self.type_records.appendSlice(self.allocator, raw);
+
+    self.types.appendAssumeCapacity(StoredType{ .type_id = type_id, .type = try type_table.get(type_id) });
+    self.refs.putAssumeCapacity(@bitCast(type_id), record.ref);
+}
+
+fn replayRecords(self: *Self, batch: *ReplayBatch, bytes: []const u8, end: usize) !usize {
+    var count: usize = 0;
+    var offset: usize = @sizeOf(Header);
+    while (frameBody(bytes[0..end], offset)) |body| {
+        const raw = bytes[offset..][0 .. frame_len + body.len];
+        offset += raw.len;
+
+        const record = try decodeRecord(body);
+        switch (record.kind) {
+            .Skip => {},
+            .Type => try self.loadType(batch.type_table, record, raw),
+            .Create, .Mutate => {
+                if (record.ref >= self.types.items.len) {
+                    return error.CorruptStore;
+                }
+                try batch.add(ObjectTable.Mutation{
+                    .scheme_name = record.strings[0],
+                    .source_name = record.strings[1],
+                    .object_name = record.strings[2],
+                    .type_id = self.types.items[record.ref].type_id,
+                    .bytes = record.strings[3],
+                });
+                count += 1;
+            },
+            .Remove => {
+                // the updates before it have to be applied first
+                try batch.flush();
+                _ = try batch.table.remove(record.strings[0], record.strings[1], record.strings[2]);
+                count += 1;
+            },
+        }
+    }
+    // the records point into the mapping, which may go away after this
+    try batch.flush();
+    return count;
+}
+
+const ReplayBatch = struct {
+    allocator: std.mem.Allocator,
+    table: *ObjectTable,
+    type_table: *TypeTable,
+    pool: *std.Thread.Pool,
+    mutations: []ObjectTable.Mutation,
+    results: []bool,
+    len: usize = 0,
+
+    fn init(allocator: std.mem.Allocator, table: *ObjectTable, type_table: *TypeTable, pool: *std.Thread.Pool) !ReplayBatch {
+        const mutations = try allocator.alloc(ObjectTable.Mutation, replay_batch);
+        errdefer allocator.free(mutations);
+        return ReplayBatch{
+            .allocator = allocator,
+            .table = table,
+            .type_table = type_table,
+            .pool = pool,
+            .mutations = mutations,
+            .results = try allocator.alloc(bool, replay_batch),
+        };
+    }
+
+    fn deinit(self: *ReplayBatch) void {
+        self.allocator.free(self.mutations);
+        self.allocator.free(self.results);
+        self.* = undefined;
+    }
+
+    fn add(self: *ReplayBatch, mutation: ObjectTable.Mutation) !void {
+        self.mutations[self.len] = mutation;
+        self.len += 1;
+        if (self.len == self.mutations.len) {
+            try self.flush();
+        }
+    }
+
+    fn flush(self: *ReplayBatch) !void {
+        if (self.len == 0) {
+            return;
+        }
+        try self.table.updateBatch(self.pool, self.type_table, self.mutations[0..self.len], self.results[0..self.len]);
+        self.len = 0;
+    }
+};
+
+// Must be called with the store locked. Seals the active segment first once it's full, and grows the
+// new one if the record doesn't fit.
+fn allocate(self: *Self, len: usize) !struct { *Segment, usize } {
+    var segment = self.active();
+    if (segment.end > @sizeOf(Header) and segment.end + len > self.options.segment_bytes) {
+        // the active segment just keeps growing if a new one can't be started
+        if (self.seal()) {
+            segment = self.active();
+        } else |_| {}
+    }
+
+    const capacity = segment.mapping.bytes.len;
+    if (len > capacity - segment.end) {
+        var new_capacity = capacity;
+        while (len > new_capacity - segment.end) {
+            new_capacity *= 2;
+        }
+        try segment.grow(new_capacity);
+    }
+
+    const offset = segment.end;
+    segment.end += len;
+    segment.records += 1;
+    self.stats.log_records += 1;
+    self.stats.log_bytes += len;
+    return .{ segment, offset };
+}
+
+fn mapSnapshot(self: *Self) !?Mapping {
+    const file = self.dir.openFile(snapshot_name, .{}) catch |e| switch (e) {
+        error.FileNotFound => return null,
+        else => return e,
+    };
+    defer file.close();
+
+    const size = try file.getEndPos();
+    if (size < @sizeOf(Header)) {
+        return error.CorruptStore;
+    }
+    return try Mapping.map(file, size, false);
+}
+
+// Returns the first segment that isn't folded into the snapshot.
+fn readSnapshotHeader(dir: std.fs.Dir) !u64 {
+    const file = dir.openFile(snapshot_name, .{}) catch |e| switch (e) {
+        error.FileNotFound => return 0,
+        else => return e,
+    };
+    defer file.close();
+
+    var header: Header = undefined;
+    if (try file.readAll(std.mem.asBytes(&header)) < @sizeOf(Header) or
+        !std.mem.eql(u8, &header.magic, &snapshot_magic))
+    {
+        return error.CorruptStore;
+    }
+    if (header.version != format_version) {
+        return error.UnsupportedVersion;
+    }
+    return header.segment;
+}
+
+// Holds the scheme, object and type of a Type record, and the scheme, source and object names and the bytes
+// of an update, of which a Remove record has only the names.
+const Record = struct {
+    kind: Kind,
+    ref: u32,
+    strings: [4][]const u8 = undefined,
+};
+
+fn stringCount(kind: Kind) usize {
+    return switch (kind) {
+        .Skip => 0,
+        .Type, .Remove => 3,
+        .Create, .Mutate => 4,
+    };
+}
+
+fn recordLen(strings: []const []const u8) !usize {
+    var body_len: usize = 1 + @sizeOf(u32);
+    for (strings) |s| {
+        body_len += @sizeOf(u32) + s.len;
+    }
+    const len = std.mem.alignForward(usize, frame_len + body_len, record_align);
+    if (len - frame_len > std.math.maxInt(u32)) {
+        return error.RecordTooLarge;
+    }
+    return len;
+}
+
+fn encodeRecord(dest: []u8, kind: Kind, ref: u32, strings: []const []const u8) void {
+    const body = dest[frame_len..];
+    body[0] = @intFromEnum(kind);
+    std.mem.writeInt(u32, body[1..5], ref, .little);
+    var pos: usize = 5;
+    for (strings) |s| {
+        std.mem.writeInt(u32, body[pos..][0..4], @intCast(s.len), .little);
+        pos += 4;
+        @memcpy(body[pos..][0..s.len], s);
+        pos += s.len;
+    }
+    @memset(body[pos..], 0);
+
+    std.mem.writeInt(u32, dest[0..4], @intCast(body.len), .little);
+    std.mem.writeInt(u32, dest[4..8], std.hash.Crc32.hash(body), .little);
+}
+
+fn decodeRecord(body: []const u8) !Record {
+    if (body.len < 5) {
+        return error.CorruptStore;
+    }
+    const kind = std.meta.intToEnum(Kind, body[0]) catch return error.CorruptStore;
+    var record = Record{
+        .kind = kind,
+        .ref = std.mem.readInt(u32, body[1..5], .little),
+    };
+
+    var pos: usize = 5;
+    for (record.strings[0..stringCount(kind)]) |*s| {
+        if (body.len - pos < 4) {
+            return error.CorruptStore;
+        }
+        const len = std.mem.readInt(u32, body[pos..][0..4], .little);
+        pos += 4;
+        if (body.len - pos < len) {
+            return error.CorruptStore;
+        }
+        s.* = body[pos..][0..len];
+        pos += len;
+    }
+    return record;
+}
+
+// Returns the body of the record at `offset`, or null if there's no complete record there.
+fn frameBody(bytes: []const u8, offset: usize) ?[]const u8 {
+    if (offset > bytes.len or bytes.len - offset < frame_len) {
+        return null;
+    }
+    const len = std.mem.readInt(u32, bytes[offset..][0..4], .little);
+    const crc = std.mem.readInt(u32, bytes[offset + 4 ..][0..4], .little);
+    if (len == 0 or len > bytes.len - offset - frame_len) {
+        return null;
+    }
+    const body = bytes[offset + frame_len ..][0..len];
+    return if (std.hash.Crc32.hash(body) == crc) body else null;
+}
+
+// Returns the end of the records that follow the header, and their number.
+fn scanRecords(bytes: []const u8) struct { usize, usize } {
+    var offset: usize = @sizeOf(Header);
+    var count: usize = 0;
+    while (frameBody(bytes, offset)) |body| {
+        offset += frame_len + body.len;
+        count += 1;
+    }
+    return .{ offset, count };
+}
+
+// A whole file mapped into memory, shared with the file when it's writable.
+const Mapping = struct {
+    bytes: []align(std.mem.page_size) u8,
+
+    /// Grows the file to `len` first if it's writable and shorter.
+    fn map(file: std.fs.File, len: usize, writable: bool) !Mapping {
+        if (builtin.os.tag == .windows) {
+            // the mapping grows the file itself
+            const protect = if (writable) win.PAGE_READWRITE else win.PAGE_READONLY;
+            const size: u64 = len;
+            const handle = win.CreateFileMappingW(file.handle, null, protect, @intCast(size >> 32), @truncate(size), null) orelse
+                return error.MapFailed;
+            defer win.CloseHandle(handle);
+
+            const access = if (writable) win.FILE_MAP_WRITE else win.FILE_MAP_READ;
+            const ptr = win.MapViewOfFile(handle, access, 0, 0, len) orelse return error.MapFailed;
+            const bytes: [*]align(std.mem.page_size) u8 = @ptrCast(@alignCast(ptr));
+            return Mapping{ .bytes = bytes[0..len] };
+        }
+
+        if (writable and try file.getEndPos() < len) {
+            try file.setEndPos(len);
+        }
+        const prot: u32 = if (writable) std.posix.PROT.READ | std.posix.PROT.WRITE else std.posix.PROT.READ;
+        return Mapping{ .bytes = try std.posix.mmap(null, len, prot, .{ .TYPE = .SHARED }, file.handle, 0) };
+    }
+
+    fn unmap(self: *Mapping) void {
+        if (builtin.os.tag == .windows) {
+            _ = win.UnmapViewOfFile(self.bytes.ptr);
+        } else {
+            std.posix.munmap(self.bytes);
+        }
+        self.* = undefined;
+    }
+
+    fn flush(self: Mapping) !void {
+        if (builtin.os.tag == .windows) {
+            if (win.FlushViewOfFile(self.bytes.ptr, self.bytes.len) == win.FALSE) {
+                return error.FlushFailed;
+            }
+        } else {
+            try std.posix.msync(self.bytes, std.posix.MSF.SYNC);
+        }
+    }
+};
+
+fn expectNotInSnapshot(store: *Self, object_name: []const u8) !void {
+    var snapshot = (try store.mapSnapshot()).?;
+    defer snapshot.unmap();
+
+    var offset: usize = @sizeOf(Header);
+    while (frameBody(snapshot.bytes, offset)) |body| {
+        offset += frame_len + body.len;
+        const record = try decodeRecord(body);
+        if (record.kind == .Create or record.kind == .Mutate) {
+            try std.testing.expect(!std.mem.eql(u8, record.strings[2], object_name));
+        }
+    }
+}
+
+test {
+    const allocator = std.testing.allocator;
+
+    var tmp = std.testing.tmpDir(.{ .iterate = true });
+    defer tmp.cleanup();
+
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    try cy.chan.write(@as([]const u8, "text"), &value);
+
+    // appends "!" to the string
+    var append = std.ArrayList(u8).init(allocator);
+    defer append.deinit();
+    try append.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    try serde.writeStringOp(&append, .Append, 0, "!");
+
+    // deletes past the end of the string
+    var invalid = std.ArrayList(u8).init(allocator);
+    defer invalid.deinit();
+    try invalid.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    try serde.writeStringOp(&invalid, .Delete, 1000, "!");
+
+    var pool: std.Thread.Pool = undefined;
+    try pool.init(.{ .allocator = allocator, .n_jobs = 2 });
+    defer pool.deinit();
+
+    // The first run checkpoints halfway through, so the second one replays both the snapshot and the log.
+    // "gone" is removed before the checkpoint and "later" after it, and the second run checkpoints again.
+    for (0..2) |run| {
+        var type_table = TypeTable.init(allocator);
+        defer type_table.deinit();
+        var table = try ObjectTable.init(allocator);
+        defer table.deinit();
+
+        var store = try Self.open(allocator, tmp.dir, .{ .initial_segment_bytes = 4096 });
+        defer store.deinit();
+        const replayed = try store.replay(&table, &type_table, &pool);
+        table.store = &store;
+
+        if (run == 0) {
+            try std.testing.expectEqual(Replay{}, replayed);
+
+            const type_id = try fixtures.registerObject(&type_table);
+
+            try std.testing.expect(try table.update("scheme", "source", "obj", &type_table, type_id, value.items));
+            for (0..100) |_| {
+                try std.testing.expect(try table.update("scheme", "source", "obj", &type_table, type_id, append.items));
+            }
+            for ([_][]const u8{ "gone", "later" }) |name| {
+                try std.testing.expect(try table.update("scheme", "source", name, &type_table, type_id, value.items));
+            }
+            try std.testing.expect(try table.update("scheme", "source", "gone", &type_table, type_id, append.items));
+            try std.testing.expect(try table.remove("scheme", "source", "gone"));
+
+            try store.checkpoint();
+            try std.testing.expectEqual(@as(u64, 1), store.metrics().compactions);
+            try expectNotInSnapshot(&store, "gone");
+
+            try std.testing.expect(try table.update("scheme", "source", "obj", &type_table, type_id, append.items));
+            // rejected, so it leaves a skip record behind
+            try std.testing.expect(!try table.update("scheme", "source", "obj", &type_table, type_id, invalid.items));
+            try std.testing.expect(try table.remove("scheme", "source", "later"));
+            continue;
+        }
+
+        try std.testing.expect(replayed.snapshot_records < 102);
+        // the append and the removal
+        try std.testing.expectEqual(@as(usize, 2), replayed.log_records);
+
+        var snapshot = try table.snapshot();
+        defer snapshot.deinit();
+        const rope = snapshot.get("scheme", "source", "obj").?.text().?;
+        try std.testing.expectEqual(@as(usize, 4 + 101), rope.len());
+        var last = [_]u8{0} ** 2;
+        rope.read(rope.len() - 2, &last);
+        try std.testing.expectEqualStrings("!!", &last);
+        try std.testing.expect(snapshot.get("scheme", "source", "gone") == null);
+        try std.testing.expect(snapshot.get("scheme", "source", "later") == null);
+
+        // the append, the skip record of the rejected update and the removal
+        try std.testing.expectEqual(@as(u64, 3), store.metrics().log_records);
+
+        // the removal drops the creation of "later" that the first snapshot holds
+        try store.checkpoint();
+        try expectNotInSnapshot(&store, "later");
+        try expectNotInSnapshot(&store, "gone");
+        try store.startCompactor();
+    }
+}
+
+test "compactor" {
+    const allocator = std.testing.allocator;
+    const appends = 200;
+
+    var tmp = std.testing.tmpDir(.{ .iterate = true });
+    defer tmp.cleanup();
+
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    try cy.chan.write(@as([]const u8, "text"), &value);
+
+    var append = std.ArrayList(u8).init(allocator);
+    defer append.deinit();
+    try append.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    try serde.writeStringOp(&append, .Append, 0, "!");
+
+    var pool: std.Thread.Pool = undefined;
+    try pool.init(.{ .allocator = allocator, .n_jobs = 2 });
+    defer pool.deinit();
+
+    // segments small enough that the updates of the first run seal several of them
+    const options = Options{ .segment_bytes = 512, .initial_segment_bytes = 4096 };
+
+    // the first run leaves the folding to the compactor, the second replays what it wrote
+    for (0..2) |run| {
+        var type_table = TypeTable.init(allocator);
+        defer type_table.deinit();
+        var table = try ObjectTable.init(allocator);
+        defer table.deinit();
+
+        var store = try Self.open(allocator, tmp.dir, options);
+        defer store.deinit();
+        const replayed = try store.replay(&table, &type_table, &pool);
+        table.store = &store;
+
+        if (run == 0) {
+            try store.startCompactor();
+
+            const type_id = try fixtures.registerObject(&type_table);
+
+            try std.testing.expect(try table.update("scheme", "source", "obj", &type_table, type_id, value.items));
+            for (0..appends) |_| {
+                try std.testing.expect(try table.update("scheme", "source", "obj", &type_table, type_id, append.items));
+            }
+
+            var waited: usize = 0;
+            while (store.metrics().compactions == 0) : (waited += 1) {
+                if (waited == 10_000) {
+                    return error.CompactorStalled;
+                }
+                std.time.sleep(std.time.ns_per_ms);
+            }
+            const stats = store.metrics();
+            try std.testing.expectEqual(@as(u64, 0), stats.failed_compactions);
+            try std.testing.expect(stats.compacted_bytes > 0);
+            try std.testing.expect(stats.snapshot_bytes > 0);
+            continue;
+        }
+
+        try std.testing.expect(replayed.snapshot_records > 0);
+        var snapshot = try table.snapshot();
+        defer snapshot.deinit();
+        try std.testing.expectEqual(@as(usize, 4 + appends), snapshot.get("scheme", "source", "obj").?.text().?.len());
+
+        // a single small segment after a whole snapshot is held off by the write amplification, until the
+        // log reaches `max_log_bytes`
+        try store.checkpoint();
+        const type_id = store.types.items[0].type_id;
+        try std.testing.expect(try table.update("scheme", "source", "obj", &type_table, type_id, append.items));
+
+        store.mutex.lock();
+        defer store.mutex.unlock();
+        try store.seal();
+        const sealed = store.segments.items[0];
+        const amplification = @as(f64, @floatFromInt(store.stats.snapshot_bytes)) / @as(f64, @floatFromInt(sealed.end));
+
+        store.options.max_write_amplification = amplification / 2;
+        try std.testing.expectEqual(@as(?u64, null), store.compactable());
+        store.options.max_log_bytes = store.stats.log_bytes;
+        try std.testing.expectEqual(@as(?u64, sealed.number + 1), store.compactable());
+
+        store.options.max_log_bytes = options.max_log_bytes;
+        store.options.max_write_amplification = amplification * 2;
+        try std.testing.expectEqual(@as(?u64, sealed.number + 1), store.compactable());
+    }
+}
@@ -1,15 +1,24 @@
+//! Translates between the type ids of the editor and those of a plugin, which numbers the schemes, objects
+//! and versions it knows from zero. Both sides are dense, so each direction is a table indexed by the parts
+//! of an id rather than a hash map.
 const std = @import("std");
 const cy = @import("cycle");
 const TypeTable = @import("TypeTable.zig");
 
-editor_to_plugin: std.AutoHashMap(u64, u64),
-plugin_to_editor: std.AutoHashMap(u64, u64),
+allocator: std.mem.Allocator,
+editor_to_plugin: Remap,
+plugin_to_editor: Remap,
+
+pub const Direction = enum {
+    EditorToPlugin,
+    PluginToEditor,
+};
 
 const Self = @This();
 
 pub fn init(allocator: std.mem.Allocator, table: *TypeTable, view: cy.chan.View([]const cy.def.ObjectScheme)) !Self {
-    var editor_to_plugin = std.AutoHashMap(u64, u64).init(allocator);
-    var plugin_to_editor = std.AutoHashMap(u64, u64).init(allocator);
+    var pairs = std.ArrayList(Pair).init(allocator);
+    defer pairs.deinit();
 
     for (0..view.len()) |si| {
         const scheme = view.elem(si);
@@ -29,32 +38,141 @@ pub fn init(allocator: std.mem.Allocator, table: *TypeTable, view: cy.chan.View(
                     .version = @intCast(vi),
                 };
 
-                try editor_to_plugin.put(@bitCast(editor_id), @bitCast(plugin_id));
-                try plugin_to_editor.put(@bitCast(plugin_id), @bitCast(editor_id));
+                try pairs.append(Pair{ .from = editor_id, .to = plugin_id });
             }
         }
     }
 
+    var editor_to_plugin = try Remap.init(allocator, pairs.items);
+    errdefer editor_to_plugin.deinit(allocator);
+    for (pairs.items) |*pair| {
+        std.mem.swap(cy.def.TypeId, &pair.from, &pair.to);
+    }
+    const plugin_to_editor = try Remap.init(allocator, pairs.items);
+
     return Self{
+        .allocator = allocator,
         .editor_to_plugin = editor_to_plugin,
         .plugin_to_editor = plugin_to_editor,
     };
 }
 
 pub fn pluginId(self: *const Self, editor_id: cy.def.TypeId) cy.def.TypeId {
-    return @bitCast(self.editor_to_plugin.get(@bitCast(editor_id)).?);
+    return self.editor_to_plugin.get(editor_id).?;
 }
 
 pub fn editorId(self: *const Self, plugin_id: cy.def.TypeId) cy.def.TypeId {
-    return @bitCast(self.plugin_to_editor.get(@bitCast(plugin_id)).?);
+    return self.plugin_to_editor.get(plugin_id).?;
+}
+
+/// Translates every id in `ids` in place, such as all of those in a message. Returns false at the first id
+/// that isn't known, leaving it and those after it as they were.
+pub fn translateBatch(self: *const Self, direction: Direction, ids: []cy.def.TypeId) bool {
+    return switch (direction) {
+        .EditorToPlugin => self.editor_to_plugin.translate(ids),
+        .PluginToEditor => self.plugin_to_editor.translate(ids),
+    };
 }
 
 pub fn deinit(self: *Self) void {
-    self.editor_to_plugin.deinit();
-    self.plugin_to_editor.deinit();
+    self.editor_to_plugin.deinit(self.allocator);
+    self.plugin_to_editor.deinit(self.allocator);
     self.* = undefined;
 }
 
+const Pair = struct {
+    from: cy.def.TypeId,
+    to: cy.def.TypeId,
+};
+
+// The ids that some ids are translated to, in one flat array as in `TypeTable/Directory.zig`. The objects of
+// a scheme are next to each other and each has room for `1 << version_bits` versions, so an id is found with
+// the start of its scheme and one more load.
+const Remap = struct {
+    // The first object of each scheme, followed by the end of the last scheme.
+    schemes: []u32,
+    // Versions skipped between known ones, and the room past the last version of an object, are `unknown`.
+    ids: []u64,
+    version_bits: u6,
+
+    const unknown = std.math.maxInt(u64);
+
+    fn init(allocator: std.mem.Allocator, pairs: []const Pair) !Remap {
+        var scheme_count: usize = 0;
+        var version_count: u64 = 1;
+        for (pairs) |pair| {
+            scheme_count = @max(scheme_count, @as(usize, pair.from.scheme) + 1);
+            version_count = @max(version_count, @as(u64, pair.from.version) + 1);
+        }
+        const version_bits: u6 = @intCast(std.math.log2_int_ceil(u64, version_count));
+
+        // counts first, turned into where each scheme starts
+        const schemes = try allocator.alloc(u32, scheme_count + 1);
+        errdefer allocator.free(schemes);
+        @memset(schemes, 0);
+        for (pairs) |pair| {
+            schemes[pair.from.scheme] = @max(schemes[pair.from.scheme], @as(u32, @intCast(pair.from.name)) + 1);
+        }
+        startsFromCounts(schemes);
+
+        const ids = try allocator.alloc(u64, @as(usize, schemes[scheme_count]) << version_bits);
+        @memset(ids, unknown);
+        for (pairs) |pair| {
+            const object = @as(usize, schemes[pair.from.scheme]) + pair.from.name;
+            ids[(object << version_bits) | pair.from.version] = @bitCast(pair.to);
+        }
+
+        return Remap{
+            .schemes = schemes,
+            .ids = ids,
+            .version_bits = version_bits,
+        };
+    }
+
+    fn deinit(self: *Remap, allocator: std.mem.Allocator) void {
+        allocator.free(self.schemes);
+        allocator.free(self.ids);
+        self.* = undefined;
+    }
+
+    fn get(self: *const Remap, id: cy.def.TypeId) ?cy.def.TypeId {
+        const bits = self.lookup(id);
+        return if (bits != unknown) @bitCast(bits) else null;
+    }
+
+    fn lookup(self: *const Remap, id: cy.def.TypeId) u64 {
+        if (@as(usize, id.scheme) + 1 >= self.schemes.len or @as(u64, id.version) >> self.version_bits != 0) {
+            return unknown;
+        }
+        const object = @as(usize, self.schemes[id.scheme]) + id.name;
+        if (object >= self.schemes[id.scheme + 1]) {
+            return unknown;
+        }
+        return self.ids[(object << self.version_bits) | id.version];
+    }
+
+    // The loads of each id only depend on the id itself, so those of one id overlap with those of the next.
+    fn translate(self: *const Remap, ids: []cy.def.TypeId) bool {
+        for (ids) |*id| {
+            const bits = self.lookup(id.*);
+            if (bits == unknown) {
+                return false;
+            }
+            id.* = @bitCast(bits);
+        }
+        return true;
+    }
+};
+
+fn startsFromCounts(counts: []u32) void {
+    var start: u32 = 0;
+    for (counts) |*count| {
+        const next = start + count.*;
+        count.* = start;
+        start = next;
+    }
+}
+
 test {
     const allocator = std.testing.allocator;
 
@@ -143,6 +261,23 @@ test {
 
         try expectOppositeTypeIds(index, false, false, true);
         try expectOppositeTypeIds(index, false, false, false);
+
+        // every id of the plugin a few times over, with an unknown one at the end
+        var ids: [19]cy.def.TypeId = undefined;
+        for (&ids, 0..) |*id, i| {
+            id.* = cy.def.TypeId{ .scheme = @intCast(i % 2), .name = @intCast(i / 2 % 2), .version = @intCast(i / 4 % 2) };
+        }
+        const editor_ids = ids;
+        try std.testing.expect(index.translateBatch(.EditorToPlugin, &ids));
+        for (editor_ids, ids) |editor_id, plugin_id| {
+            try std.testing.expectEqualDeep(index.pluginId(editor_id), plugin_id);
+        }
+        try std.testing.expect(index.translateBatch(.PluginToEditor, &ids));
+        try std.testing.expectEqualDeep(editor_ids, ids);
+
+        ids[18].scheme = 2;
+        try std.testing.expect(!index.translateBatch(.EditorToPlugin, &ids));
+        try std.testing.expectEqual(@as(@TypeOf(ids[18].scheme), 2), ids[18].scheme);
     }
 }
 
@@ -1,8 +1,30 @@
 const std = @import("std");
 const cy = @import("cycle");
+const CountingAllocator = @import("CountingAllocator.zig");
+const Interner = @import("TypeTable/Interner.zig");
+const Directory = @import("TypeTable/Directory.zig");
+const Object = @import("ObjectTable/Object.zig");
+const Plan = Object.Plan;
 
 allocator: std.mem.Allocator,
 schemes: Schemes,
+// Holds and counts the types of each scheme, by the index of the scheme.
+interners: std.ArrayListUnmanaged(*Interner) = .{},
+// The first version of each object with a given structural hash, so that registering a type that's already
+// known takes a lookup and a single comparison rather than one against every version.
+versions: std.AutoHashMapUnmanaged(VersionKey, usize) = .{},
+// Every type by its id, for `get`.
+directory: Directory = .{},
+// The appliers of the types registered by `specialize`, by the bits of their ids.
+appliers: std.AutoHashMapUnmanaged(u64, Object.Applier) = .{},
+// The plan of updates to every registered type, by the bits of its id. The plans are held by the interners.
+plans: std.AutoHashMapUnmanaged(u64, *const Plan) = .{},
+
+const VersionKey = struct {
+    scheme: usize,
+    name: usize,
+    hash: u64,
+};
 
 const Schemes = std.StringArrayHashMap(Objects);
 const Objects = std.StringArrayHashMap(Types);
@@ -16,25 +38,51 @@ pub fn init(allocator: std.mem.Allocator) Self {
     };
 }
 
+/// The types and names of objects are held by the interner of their scheme, and go with it.
 pub fn deinit(self: *Self) void {
-    var scheme_iter = self.schemes.iterator();
-    while (scheme_iter.next()) |scheme| {
-        var object_iter = scheme.value_ptr.iterator();
-        while (object_iter.next()) |object| {
-            for (object.value_ptr.items) |t| {
-                deinitType(self.allocator, t);
-            }
-            object.value_ptr.deinit();
-            self.allocator.free(object.key_ptr.*);
+    for (self.schemes.keys(), self.schemes.values(), self.interners.items) |scheme_name, *objects, interner| {
+        for (objects.values()) |*types| {
+            types.deinit();
         }
-        scheme.value_ptr.deinit();
-        self.allocator.free(scheme.key_ptr.*);
+        objects.deinit();
+        interner.destroy(self.allocator);
+        self.allocator.free(scheme_name);
     }
     self.schemes.deinit();
+    self.interners.deinit(self.allocator);
+    self.versions.deinit(self.allocator);
+    self.directory.deinit(self.allocator);
+    self.appliers.deinit(self.allocator);
+    self.plans.deinit(self.allocator);
     self.* = undefined;
 }
 
+/// The memory taken up by the types of the scheme, null if it isn't registered.
+pub fn usage(self: *const Self, scheme_name: []const u8) ?CountingAllocator.Stats {
+    const index = self.schemes.getIndex(scheme_name) orelse return null;
+    return self.interners.items[index].counter.stats();
+}
+
+/// Writes the memory taken up by the types of each scheme as a JSON object, by the name of the scheme.
+pub fn writeUsageJson(self: *const Self, writer: anytype) !void {
+    var json = std.json.writeStream(writer, .{ .whitespace = .indent_2 });
+    defer json.deinit();
+
+    try json.beginObject();
+    for (self.schemes.keys(), self.interners.items) |scheme_name, interner| {
+        try json.objectField(scheme_name);
+        try json.write(interner.counter.stats());
+    }
+    try json.endObject();
+}
+
 pub fn get(self: *const Self, id: cy.def.TypeId) !cy.def.Type {
+    return self.directory.get(id) orelse self.find(id);
+}
+
+/// Finds the type through the maps it's registered in, which tells the part of an unknown id that's missing.
+/// Slower than `get`, which only falls back to it for ids it doesn't know.
+pub fn find(self: *const Self, id: cy.def.TypeId) !cy.def.Type {
     const schemes: []const Objects = self.schemes.values();
     if (id.scheme >= schemes.len) {
         return error.SchemeNotDefined;
@@ -53,6 +101,49 @@ pub fn get(self: *const Self, id: cy.def.TypeId) !cy.def.Type {
     return types[id.version];
 }
 
+/// The applier specialized for the type by `specialize`, if any.
+pub fn applier(self: *const Self, id: cy.def.TypeId) ?Object.Applier {
+    return self.appliers.get(@bitCast(id));
+}
+
+/// The plan of updates to the type, compiled when it was registered.
+pub fn plan(self: *const Self, id: cy.def.TypeId) ?*const Plan {
+    return self.plans.get(@bitCast(id));
+}
+
+/// Registers every version of every object of a scheme known at compile time, such as one declared with
+/// `cy.def.Scheme`, along with appliers of their updates specialized for each version.
+pub fn specialize(self: *Self, comptime Scheme: type) !void {
+    const scheme = comptime cy.def.ObjectScheme.from(Scheme);
+    var bytes = std.ArrayList(u8).init(self.allocator);
+    defer bytes.deinit();
+    try cy.chan.write(scheme, &bytes);
+
+    const view = cy.chan.read(cy.def.ObjectScheme, bytes.items);
+    inline for (scheme.objects, 0..) |object, oi| {
+        const object_view = view.field(.objects).elem(oi);
+        inline for (object.versions, 0..) |version, vi| {
+            const id = try self.update(view.field(.name), object_view.field(.name), object_view.field(.versions).elem(vi));
+            try self.appliers.put(self.allocator, @bitCast(id), Object.specialize(version));
+        }
+    }
+}
+
+pub const Names = struct {
+    scheme: []const u8,
+    object: []const u8,
+};
+
+/// Returns the names that the type was registered under, which stay the same across runs unlike its id.
+pub fn names(self: *const Self, id: cy.def.TypeId) !Names {
+    _ = try self.get(id);
+    const objects: *const Objects = &self.schemes.values()[id.scheme];
+    return Names{
+        .scheme = self.schemes.keys()[id.scheme],
+        .object = objects.keys()[id.name],
+    };
+}
+
 pub fn update(
     self: *Self,
     scheme_name: []const u8,
@@ -61,26 +152,67 @@ pub fn update(
 ) !cy.def.TypeId {
     const scheme_gop = try self.schemes.getOrPut(scheme_name);
     if (!scheme_gop.found_existing) {
-        scheme_gop.key_ptr.* = try self.allocator.dupe(u8, scheme_name);
-        scheme_gop.value_ptr.* = Objects.init(self.allocator);
+        errdefer self.schemes.swapRemoveAt(scheme_gop.index);
+        try self.interners.ensureUnusedCapacity(self.allocator, 1);
+        const key = try self.allocator.dupe(u8, scheme_name);
+        errdefer self.allocator.free(key);
+
+        const interner = try Interner.create(self.allocator);
+        self.interners.appendAssumeCapacity(interner);
+        scheme_gop.key_ptr.* = key;
+        scheme_gop.value_ptr.* = Objects.init(interner.allocator());
     }
     const objects: *Objects = scheme_gop.value_ptr;
+    const interner = self.interners.items[scheme_gop.index];
 
     const object_gop = try objects.getOrPut(object_name);
     if (!object_gop.found_existing) {
-        object_gop.key_ptr.* = try self.allocator.dupe(u8, object_name);
-        object_gop.value_ptr.* = Types.init(self.allocator);
+        object_gop.key_ptr.* = interner.internName(object_name) catch |err| {
+            objects.swapRemoveAt(object_gop.index);
+            return err;
+        };
+        object_gop.value_ptr.* = Types.init(interner.allocator());
     }
     const types: *Types = object_gop.value_ptr;
 
-    return idOf(scheme_gop.index, object_gop.index, types.items, view) orelse {
-        const t = try initType(self.allocator, view);
-        try types.append(t);
-        return cy.def.TypeId{
-            .scheme = @intCast(scheme_gop.index),
-            .name = @intCast(object_gop.index),
-            .version = @intCast(types.items.len - 1),
-        };
+    const key = VersionKey{
+        .scheme = scheme_gop.index,
+        .name = object_gop.index,
+        .hash = hashView(view),
+    };
+    if (self.versions.get(key)) |version| {
+        if (typeEql(types.items[version], view)) {
+            return typeId(key, version);
+        }
+        // Only the first version with a hash is indexed, so the type may still be any other one.
+        if (idOf(key.scheme, key.name, types.items, view)) |id| {
+            return id;
+        }
+    }
+
+    try self.versions.ensureUnusedCapacity(self.allocator, 1);
+    try types.ensureUnusedCapacity(1);
+    try self.plans.ensureUnusedCapacity(self.allocator, 1);
+    const t = try interner.intern(view);
+    const version = types.items.len;
+    const id = typeId(key, version);
+    const t_plan = try interner.plan(t);
+    try self.directory.put(self.allocator, id, t);
+    types.appendAssumeCapacity(t);
+    self.plans.putAssumeCapacityNoClobber(@bitCast(id), t_plan);
+
+    const version_gop = self.versions.getOrPutAssumeCapacity(key);
+    if (!version_gop.found_existing) {
+        version_gop.value_ptr.* = version;
+    }
+    return id;
+}
+
+fn typeId(key: VersionKey, version: usize) cy.def.TypeId {
+    return cy.def.TypeId{
+        .scheme = @intCast(key.scheme),
+        .name = @intCast(key.name),
+        .version = @intCast(version),
     };
 }
 
@@ -97,7 +229,8 @@ fn idOf(scheme: usize, name: usize, types: []const cy.def.Type, view: cy.chan.Vi
     return null;
 }
 
-fn typeEql(t: cy.def.Type, view: cy.chan.View(cy.def.Type)) bool {
+/// Compares a stored type to one read from the wire.
+pub fn typeEql(t: cy.def.Type, view: cy.chan.View(cy.def.Type)) bool {
     const tag = view.tag();
     if (t != tag) {
         return false;
@@ -198,217 +331,152 @@ fn typeEql(t: cy.def.Type, view: cy.chan.View(cy.def.Type)) bool {
     };
 }
 
-fn initType(allocator: std.mem.Allocator, view: cy.chan.View(cy.def.Type)) std.mem.Allocator.Error!cy.def.Type {
-    const tag = view.tag();
-    return switch (tag) {
-        .Void => .Void,
-        .Bool => .Bool,
-        .String => .String,
-        .Any => .Any,
-        .Int => blk: {
-            const value = view.value(.Int);
-            break :blk cy.def.Type{
-                .Int = cy.def.Type.Int{
-                    .signedness = value.field(.signedness),
-                    .bits = value.field(.bits),
-                },
-            };
-        },
-        .Float => blk: {
-            const value = view.value(.Float);
-            break :blk cy.def.Type{
-                .Float = cy.def.Type.Float{
-                    .bits = value.field(.bits),
-                },
-            };
-        },
-        .Optional => blk: {
-            const value = view.value(.Optional);
-            break :blk cy.def.Type{
-                .Optional = cy.def.Type.Optional{
-                    .child = try allocType(allocator, value.field(.child)),
-                },
-            };
-        },
-        .Array => blk: {
-            const value = view.value(.Array);
-            break :blk cy.def.Type{
-                .Array = cy.def.Type.Array{
-                    .len = value.field(.len),
-                    .child = try allocType(allocator, value.field(.child)),
-                },
-            };
-        },
-        .List => blk: {
-            const value = view.value(.List);
-            break :blk cy.def.Type{
-                .List = cy.def.Type.List{
-                    .child = try allocType(allocator, value.field(.child)),
-                },
-            };
-        },
-        .Map => blk: {
-            const value = view.value(.Map);
-            break :blk cy.def.Type{
-                .Map = cy.def.Type.Map{
-                    .key = try allocType(allocator, value.field(.key)),
-                    .value = try allocType(allocator, value.field(.value)),
-                },
-            };
-        },
-        .Struct => blk: {
-            const value = view.value(.Struct);
-            const fields_view = value.field(.fields);
-            const fields = try allocator.alloc(cy.def.Type.Struct.Field, fields_view.len());
-            for (0..fields_view.len()) |i| {
-                const field = fields_view.elem(i);
-                fields[i] = cy.def.Type.Struct.Field{
-                    .name = try allocator.dupe(u8, field.field(.name)),
-                    .type = try initType(allocator, field.field(.type)),
-                };
-            }
-            break :blk cy.def.Type{
-                .Struct = cy.def.Type.Struct{
-                    .fields = fields,
-                },
-            };
-        },
-        .Tuple => blk: {
-            const value = view.value(.Tuple);
-            const fields_view = value.field(.fields);
-            const fields = try allocator.alloc(cy.def.Type.Tuple.Field, fields_view.len());
-            for (0..fields_view.len()) |i| {
-                fields[i] = cy.def.Type.Tuple.Field{
-                    .type = try initType(allocator, fields_view.elem(i)),
-                };
-            }
-            break :blk cy.def.Type{
-                .Tuple = cy.def.Type.Tuple{
-                    .fields = fields,
-                },
-            };
-        },
-        .Union => blk: {
-            const value = view.value(.Union);
-            const fields_view = value.field(.fields);
-            const fields = try allocator.alloc(cy.def.Type.Union.Field, fields_view.len());
-            for (0..fields_view.len()) |i| {
-                const field = fields_view.elem(i);
-                fields[i] = cy.def.Type.Union.Field{
-                    .name = try allocator.dupe(u8, field.field(.name)),
-                    .type = try initType(allocator, field.field(.type)),
-                };
-            }
-            break :blk cy.def.Type{
-                .Union = cy.def.Type.Union{
-                    .fields = fields,
-                },
-            };
-        },
-        .Enum => blk: {
-            const value = view.value(.Union);
-            const fields_view = value.field(.fields);
-            const fields = try allocator.alloc(cy.def.Type.Enum.Field, fields_view.len());
-            for (0..fields_view.len()) |i| {
-                const field = fields_view.elem(i);
-                fields[i] = cy.def.Type.Enum.Field{
-                    .name = try allocator.dupe(u8, field.field(.name)),
-                };
-            }
-            break :blk cy.def.Type{
-                .Enum = cy.def.Type.Enum{
-                    .fields = fields,
-                },
-            };
-        },
-        .Ref => blk: {
-            const value = view.value(.Ref);
-            break :blk cy.def.Type{
-                .Ref = switch (value.tag()) {
-                    .Internal => cy.def.Type.Ref{
-                        .Internal = cy.def.Type.Ref.Internal{
-                            .name = try allocator.dupe(u8, value.value(.Internal).field(.name)),
-                        },
-                    },
-                    .External => cy.def.Type.Ref{
-                        .External = cy.def.Type.Ref.External{
-                            .scheme = try allocator.dupe(u8, value.value(.External).field(.scheme)),
-                            .name = try allocator.dupe(u8, value.value(.External).field(.name)),
-                        },
-                    },
-                },
-            };
-        },
-    };
-}
-
-fn allocType(allocator: std.mem.Allocator, view: cy.chan.View(cy.def.Type)) !*cy.def.Type {
-    const child = try allocator.create(cy.def.Type);
-    child.* = try initType(allocator, view);
-    return child;
-}
-
-fn deinitType(allocator: std.mem.Allocator, t: cy.def.Type) void {
+/// Hashes the structure of `t` from the hashes of the types it's made of, so that equal types hash the same
+/// as their views do with `hashView`.
+pub fn hashType(t: cy.def.Type) u64 {
+    var h = std.hash.Wyhash.init(0);
+    hashInt(&h, @intFromEnum(t));
     switch (t) {
-        // non-allocating
-        .Void, .Bool, .String, .Int, .Float, .Any => {},
-        .Optional => |info| {
-            deinitType(allocator, info.child.*);
-            allocator.destroy(info.child);
+        .Void, .Bool, .String, .Any => {},
+        .Int => |info| {
+            hashInt(&h, @intFromEnum(info.signedness));
+            hashInt(&h, info.bits);
         },
+        .Float => |info| hashInt(&h, info.bits),
+        .Optional => |info| hashInt(&h, hashType(info.child.*)),
         .Array => |info| {
-            deinitType(allocator, info.child.*);
-            allocator.destroy(info.child);
-        },
-        .List => |info| {
-            deinitType(allocator, info.child.*);
-            allocator.destroy(info.child);
+            hashInt(&h, info.len);
+            hashInt(&h, hashType(info.child.*));
         },
+        .List => |info| hashInt(&h, hashType(info.child.*)),
         .Map => |info| {
-            deinitType(allocator, info.key.*);
-            allocator.destroy(info.key);
-
-            deinitType(allocator, info.value.*);
-            allocator.destroy(info.value);
+            hashInt(&h, hashType(info.key.*));
+            hashInt(&h, hashType(info.value.*));
         },
         .Struct => |info| {
+            hashInt(&h, info.fields.len);
             for (info.fields) |f| {
-                allocator.free(f.name);
-                deinitType(allocator, f.type);
+                hashName(&h, f.name);
+                hashInt(&h, hashType(f.type));
             }
-            allocator.free(info.fields);
         },
         .Tuple => |info| {
+            hashInt(&h, info.fields.len);
             for (info.fields) |f| {
-                deinitType(allocator, f.type);
+                hashInt(&h, hashType(f.type));
             }
-            allocator.free(info.fields);
         },
         .Union => |info| {
+            hashInt(&h, info.fields.len);
             for (info.fields) |f| {
-                allocator.free(f.name);
-                deinitType(allocator, f.type);
+                hashName(&h, f.name);
+                hashInt(&h, hashType(f.type));
             }
-            allocator.free(info.fields);
         },
         .Enum => |info| {
+            hashInt(&h, info.fields.len);
             for (info.fields) |f| {
-                allocator.free(f.name);
+                hashName(&h, f.name);
             }
-            allocator.free(info.fields);
         },
         .Ref => |info| {
+            hashInt(&h, @intFromEnum(info));
             switch (info) {
-                .Internal => |ref| {
-                    allocator.free(ref.name);
-                },
+                .Internal => |ref| hashName(&h, ref.name),
                 .External => |ref| {
-                    allocator.free(ref.scheme);
-                    allocator.free(ref.name);
+                    hashName(&h, ref.scheme);
+                    hashName(&h, ref.name);
                 },
             }
         },
     }
+    return h.final();
+}
+
+/// Hashes a type as it's read from the wire, the same as `hashType` does once it's been read.
+pub fn hashView(view: cy.chan.View(cy.def.Type)) u64 {
+    var h = std.hash.Wyhash.init(0);
+    const tag = view.tag();
+    hashInt(&h, @intFromEnum(tag));
+    switch (tag) {
+        .Void, .Bool, .String, .Any => {},
+        .Int => {
+            const value = view.value(.Int);
+            hashInt(&h, @intFromEnum(value.field(.signedness)));
+            hashInt(&h, value.field(.bits));
+        },
+        .Float => hashInt(&h, view.value(.Float).field(.bits)),
+        .Optional => hashInt(&h, hashView(view.value(.Optional).field(.child))),
+        .Array => {
+            const value = view.value(.Array);
+            hashInt(&h, value.field(.len));
+            hashInt(&h, hashView(value.field(.child)));
+        },
+        .List => hashInt(&h, hashView(view.value(.List).field(.child))),
+        .Map => {
+            const value = view.value(.Map);
+            hashInt(&h, hashView(value.field(.key)));
+            hashInt(&h, hashView(value.field(.value)));
+        },
+        .Struct => {
+            const fields = view.value(.Struct).field(.fields);
+            hashInt(&h, fields.len());
+            for (0..fields.len()) |i| {
+                const field = fields.elem(i);
+                hashName(&h, field.field(.name));
+                hashInt(&h, hashView(field.field(.type)));
+            }
+        },
+        .Tuple => {
+            const fields = view.value(.Tuple).field(.fields);
+            hashInt(&h, fields.len());
+            for (0..fields.len()) |i| {
+                hashInt(&h, hashView(fields.elem(i)));
+            }
+        },
+        .Union => {
+            const fields = view.value(.Union).field(.fields);
+            hashInt(&h, fields.len());
+            for (0..fields.len()) |i| {
+                const field = fields.elem(i);
+                hashName(&h, field.field(.name));
+                hashInt(&h, hashView(field.field(.type)));
+            }
+        },
+        .Enum => {
+            const fields = view.value(.Enum).field(.fields);
+            hashInt(&h, fields.len());
+            for (0..fields.len()) |i| {
+                hashName(&h, fields.elem(i).field(.name));
+            }
+        },
+        .Ref => {
+            const value = view.value(.Ref);
+            const ref_tag = value.tag();
+            hashInt(&h, @intFromEnum(ref_tag));
+            switch (ref_tag) {
+                .Internal => hashName(&h, value.value(.Internal).field(.name)),
+                .External => {
+                    const ref = value.value(.External);
+                    hashName(&h, ref.field(.scheme));
+                    hashName(&h, ref.field(.name));
+                },
+            }
+        },
+    }
+    return h.final();
+}
+
+// Every integer is hashed at the same width, so that the fields of a type and of its view hash the same
+// whatever their types.
+fn hashInt(h: *std.hash.Wyhash, value: u64) void {
+    h.update(std.mem.asBytes(&value));
+}
+
+// Names are prefixed with their length, so that the boundaries between them are part of the hash.
+fn hashName(h: *std.hash.Wyhash, name: []const u8) void {
+    hashInt(h, name.len);
+    h.update(name);
 }
 
 const TestScheme1 = cy.def.Scheme("scheme1", .{
@@ -564,4 +632,73 @@ test {
             .version = 1,
         }, index);
     }
+
+    try std.testing.expect(table.usage("scheme1").?.live_bytes > table.usage("scheme2").?.live_bytes);
+    try std.testing.expect(table.usage("scheme3") == null);
+}
+
+test "structural hash" {
+    const allocator = std.testing.allocator;
+
+    var table = Self.init(allocator);
+    defer table.deinit();
+
+    var out = std.ArrayList(u8).init(allocator);
+    defer out.deinit();
+    try cy.chan.write(cy.def.ObjectScheme.from(TestScheme1), &out);
+
+    const view = cy.chan.read(cy.def.ObjectScheme, out.items);
+    const objects = view.field(.objects);
+    var hashes: [4]u64 = undefined;
+    for (0..objects.len()) |i| {
+        const object = objects.elem(i);
+        for (0..object.field(.versions).len()) |v| {
+            const version = object.field(.versions).elem(v);
+            const id = try table.update(view.field(.name), object.field(.name), version);
+            hashes[i * 2 + v] = hashView(version);
+            try std.testing.expectEqual(hashes[i * 2 + v], hashType(try table.get(id)));
+        }
+    }
+    for (hashes, 0..) |a, i| {
+        for (hashes[i + 1 ..]) |b| {
+            try std.testing.expect(a != b);
+        }
+    }
+}
+
+test "shared types" {
+    const allocator = std.testing.allocator;
+
+    var table = Self.init(allocator);
+    defer table.deinit();
+
+    var out = std.ArrayList(u8).init(allocator);
+    defer out.deinit();
+    try cy.chan.write(cy.def.ObjectScheme.from(TestScheme1), &out);
+
+    const view = cy.chan.read(cy.def.ObjectScheme, out.items);
+    const objects = view.field(.objects);
+    const obj_one = objects.elem(0);
+    const obj_two = objects.elem(1);
+    const one = try table.get(try table.update(view.field(.name), obj_one.field(.name), obj_one.field(.versions).elem(0)));
+    const two = try table.get(try table.update(view.field(.name), obj_two.field(.name), obj_two.field(.versions).elem(0)));
+    const three = try table.get(try table.update(view.field(.name), obj_two.field(.name), obj_two.field(.versions).elem(1)));
+
+    // the u32 of [12]u32 and of Map(String, u32), and the name "f1" of a struct and of a union field
+    try std.testing.expectEqual(one.Struct.fields[6].type.Array.child, two.Tuple.fields[1].type.Map.value);
+    try std.testing.expectEqual(one.Struct.fields[0].name.ptr, three.Union.fields[0].name.ptr);
+}
+
+test "specialize" {
+    const allocator = std.testing.allocator;
+
+    var table = Self.init(allocator);
+    defer table.deinit();
+    try table.specialize(TestScheme2);
+
+    const id = cy.def.TypeId{ .scheme = 0, .name = 0, .version = 1 };
+    try std.testing.expect(table.applier(id) != null);
+    try std.testing.expect(table.plan(id) != null);
+    try std.testing.expectEqualStrings("f2", (try table.get(id)).Struct.fields[1].name);
+    try std.testing.expect(table.applier(.{ .scheme = 0, .name = 0, .version = 2 }) == null);
 }
@@ -0,0 +1,116 @@
+//! Every registered type in a single flat array, so that finding the type of an id is a load of the range
+//! of its scheme and one of the type itself, rather than a walk through the maps the type is registered in.
+//!
+//! Each object has room for the same number of versions, a power of two, and the objects of a scheme are
+//! next to each other, in a range with room for more. A scheme that outgrows its range is moved to a range
+//! twice as large at the end, and an object that outgrows the room for versions rebuilds the whole array.
+const std = @import("std");
+const cy = @import("cycle");
+
+entries: std.ArrayListUnmanaged(?cy.def.Type) = .{},
+schemes: std.ArrayListUnmanaged(Range) = .{},
+// every object has room for `1 << version_bits` versions
+version_bits: std.math.Log2Int(usize) = 0,
+
+// The objects of a scheme, in objects rather than entries.
+const Range = struct {
+    base: usize,
+    len: usize,
+    capacity: usize,
+};
+
+const Self = @This();
+
+pub fn deinit(self: *Self, allocator: std.mem.Allocator) void {
+    self.entries.deinit(allocator);
+    self.schemes.deinit(allocator);
+    self.* = undefined;
+}
+
+pub fn get(self: *const Self, id: cy.def.TypeId) ?cy.def.Type {
+    if (id.scheme >= self.schemes.items.len) {
+        return null;
+    }
+    const range = self.schemes.items[id.scheme];
+    if (id.name >= range.len or @as(usize, id.version) >> self.version_bits != 0) {
+        return null;
+    }
+    return self.entries.items[((range.base + id.name) << self.version_bits) | id.version];
+}
+
+/// Indices that are skipped over are left empty.
+pub fn put(self: *Self, allocator: std.mem.Allocator, id: cy.def.TypeId, t: cy.def.Type) !void {
+    while (@as(usize, id.version) >> self.version_bits != 0) {
+        try self.rebuild(allocator, self.version_bits + 1);
+    }
+    while (id.scheme >= self.schemes.items.len) {
+        try self.schemes.append(allocator, Range{
+            .base = self.entries.items.len >> self.version_bits,
+            .len = 0,
+            .capacity = 0,
+        });
+    }
+
+    const range = &self.schemes.items[id.scheme];
+    if (id.name >= range.capacity) {
+        const capacity = @max(4, range.capacity * 2, @as(usize, id.name) + 1);
+        const base = self.entries.items.len >> self.version_bits;
+        try self.entries.appendNTimes(allocator, null, capacity << self.version_bits);
+        // the old range is left empty until the next rebuild
+        const old = self.entries.items[range.base << self.version_bits ..][0 .. range.len << self.version_bits];
+        @memcpy(self.entries.items[base << self.version_bits ..][0..old.len], old);
+        range.base = base;
+        range.capacity = capacity;
+    }
+    range.len = @max(range.len, @as(usize, id.name) + 1);
+    self.entries.items[((range.base + id.name) << self.version_bits) | id.version] = t;
+}
+
+fn rebuild(self: *Self, allocator: std.mem.Allocator, version_bits: std.math.Log2Int(usize)) !void {
+    var objects: usize = 0;
+    for (self.schemes.items) |range| {
+        objects += range.capacity;
+    }
+    var entries = try std.ArrayListUnmanaged(?cy.def.Type).initCapacity(allocator, objects << version_bits);
+    entries.appendNTimesAssumeCapacity(null, objects << version_bits);
+
+    var base: usize = 0;
+    for (self.schemes.items) |*range| {
+        for (0..range.len) |name| {
+            const versions = self.entries.items[(range.base + name) << self.version_bits ..][0 .. @as(usize, 1) << self.version_bits];
+            @memcpy(entries.items[(base + name) << version_bits ..][0..versions.len], versions);
+        }
+        range.base = base;
+        base += range.capacity;
+    }
+
+    self.entries.deinit(allocator);
+    self.entries = entries;
+    self.version_bits = version_bits;
+}
+
+test {
+    const allocator = std.testing.allocator;
+
+    var directory = Self{};
+    defer directory.deinit(allocator);
+
+    // enough objects and versions to move a scheme and to rebuild
+    for (0..3) |scheme| {
+        for (0..10) |name| {
+            for (0..3) |version| {
+                try directory.put(allocator, .{
+                    .scheme = @intCast(scheme),
+                    .name = @intCast(name),
+                    .version = @intCast(version),
+                }, .{ .Int = .{ .signedness = .unsigned, .bits = @intCast(scheme * 64 + name * 4 + version) } });
+            }
+        }
+    }
+
+    try std.testing.expect(directory.get(.{ .scheme = 2, .name = 5, .version = 2 }).?.Int.bits == 150);
+    try std.testing.expect(directory.get(.{ .scheme = 0, .name = 9, .version = 0 }).?.Int.bits == 36);
+    try std.testing.expect(directory.get(.{ .scheme = 2, .name = 5, .version = 3 }) == null);
+    try std.testing.expect(directory.get(.{ .scheme = 0, .name = 10, .version = 0 }) == null);
+    try std.testing.expect(directory.get(.{ .scheme = 3, .name = 0, .version = 0 }) == null);
+}
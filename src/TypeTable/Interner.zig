@@ -0,0 +1,223 @@
+//! Holds the types of one scheme. Every type is built once into an arena and shared from there on: a subtree
+//! that's already known, by its structural hash, is pointed to rather than copied, and names are kept once
+//! however many types and versions use them. Nothing is freed before the whole scheme is, so releasing the
+//! types is releasing the arena.
+const std = @import("std");
+const cy = @import("cycle");
+const CountingAllocator = @import("../CountingAllocator.zig");
+const TypeTable = @import("../TypeTable.zig");
+const Plan = @import("../ObjectTable/Plan.zig");
+
+// Counts everything the scheme holds, including the maps of its objects, which are made with `allocator`.
+counter: CountingAllocator,
+arena: std.heap.ArenaAllocator,
+// Every distinct type by its structural hash. Of two types with the same hash only the first is kept here,
+// and the other is never shared.
+types: std.AutoHashMapUnmanaged(u64, *cy.def.Type) = .{},
+names: std.StringHashMapUnmanaged(void) = .{},
+
+const Self = @This();
+
+/// Boxed, since the arena and the maps of the scheme hold on to its counter.
+pub fn create(parent: std.mem.Allocator) !*Self {
+    const self = try parent.create(Self);
+    self.* = Self{
+        .counter = CountingAllocator.init(parent),
+        .arena = undefined,
+    };
+    self.arena = std.heap.ArenaAllocator.init(self.counter.allocator());
+    return self;
+}
+
+pub fn destroy(self: *Self, parent: std.mem.Allocator) void {
+    self.types.deinit(self.allocator());
+    self.names.deinit(self.allocator());
+    self.arena.deinit();
+    parent.destroy(self);
+}
+
+pub fn allocator(self: *Self) std.mem.Allocator {
+    return self.counter.allocator();
+}
+
+/// Returns the type in `view`, which shares every part of it that's already known.
+pub fn intern(self: *Self, view: cy.chan.View(cy.def.Type)) !cy.def.Type {
+    return (try self.internChild(view)).*;
+}
+
+/// Returns the copy of `name` kept for the scheme.
+pub fn internName(self: *Self, name: []const u8) ![]const u8 {
+    const gop = try self.names.getOrPut(self.allocator(), name);
+    if (!gop.found_existing) {
+        gop.key_ptr.* = self.arena.allocator().dupe(u8, name) catch |err| {
+            self.names.removeByPtr(gop.key_ptr);
+            return err;
+        };
+    }
+    return gop.key_ptr.*;
+}
+
+/// Compiles the plan of updates to `t`, which is kept as long as the types.
+pub fn plan(self: *Self, t: cy.def.Type) !*const Plan {
+    const arena = self.arena.allocator();
+    const p = try arena.create(Plan);
+    p.* = try Plan.init(arena, t);
+    return p;
+}
+
+fn internChild(self: *Self, view: cy.chan.View(cy.def.Type)) std.mem.Allocator.Error!*cy.def.Type {
+    const hash = TypeTable.hashView(view);
+    const existing = self.types.get(hash);
+    if (existing) |t| {
+        if (TypeTable.typeEql(t.*, view)) {
+            return t;
+        }
+    }
+
+    // The children are interned first, and may grow the map.
+    const t = try self.arena.allocator().create(cy.def.Type);
+    t.* = try self.build(view);
+    if (existing == null) {
+        try self.types.put(self.allocator(), hash, t);
+    }
+    return t;
+}
+
+fn build(self: *Self, view: cy.chan.View(cy.def.Type)) std.mem.Allocator.Error!cy.def.Type {
+    const arena = self.arena.allocator();
+    return switch (view.tag()) {
+        .Void => .Void,
+        .Bool => .Bool,
+        .String => .String,
+        .Any => .Any,
+        .Int => blk: {
+            const value = view.value(.Int);
+            break :blk cy.def.Type{
+                .Int = cy.def.Type.Int{
+                    .signedness = value.field(.signedness),
+                    .bits = value.field(.bits),
+                },
+            };
+        },
+        .Float => blk: {
+            const value = view.value(.Float);
+            break :blk cy.def.Type{
+                .Float = cy.def.Type.Float{
+                    .bits = value.field(.bits),
+                },
+            };
+        },
+        .Optional => blk: {
+            const value = view.value(.Optional);
+            break :blk cy.def.Type{
+                .Optional = cy.def.Type.Optional{
+                    .child = try self.internChild(value.field(.child)),
+                },
+            };
+        },
+        .Array => blk: {
+            const value = view.value(.Array);
+            break :blk cy.def.Type{
+                .Array = cy.def.Type.Array{
+                    .len = value.field(.len),
+                    .child = try self.internChild(value.field(.child)),
+                },
+            };
+        },
+        .List => blk: {
+            const value = view.value(.List);
+            break :blk cy.def.Type{
+                .List = cy.def.Type.List{
+                    .child = try self.internChild(value.field(.child)),
+                },
+            };
+        },
+        .Map => blk: {
+            const value = view.value(.Map);
+            break :blk cy.def.Type{
+                .Map = cy.def.Type.Map{
+                    .key = try self.internChild(value.field(.key)),
+                    .value = try self.internChild(value.field(.value)),
+                },
+            };
+        },
+        .Struct => blk: {
+            const fields_view = view.value(.Struct).field(.fields);
+            const fields = try arena.alloc(cy.def.Type.Struct.Field, fields_view.len());
+            for (fields, 0..) |*f, i| {
+                const field = fields_view.elem(i);
+                f.* = cy.def.Type.Struct.Field{
+                    .name = try self.internName(field.field(.name)),
+                    .type = (try self.internChild(field.field(.type))).*,
+                };
+            }
+            break :blk cy.def.Type{
+                .Struct = cy.def.Type.Struct{
+                    .fields = fields,
+                },
+            };
+        },
+        .Tuple => blk: {
+            const fields_view = view.value(.Tuple).field(.fields);
+            const fields = try arena.alloc(cy.def.Type.Tuple.Field, fields_view.len());
+            for (fields, 0..) |*f, i| {
+                f.* = cy.def.Type.Tuple.Field{
+                    .type = (try self.internChild(fields_view.elem(i))).*,
+                };
+            }
+            break :blk cy.def.Type{
+                .Tuple = cy.def.Type.Tuple{
+                    .fields = fields,
+                },
+            };
+        },
+        .Union => blk: {
+            const fields_view = view.value(.Union).field(.fields);
+            const fields = try arena.alloc(cy.def.Type.Union.Field, fields_view.len());
+            for (fields, 0..) |*f, i| {
+                const field = fields_view.elem(i);
+                f.* = cy.def.Type.Union.Field{
+                    .name = try self.internName(field.field(.name)),
+                    .type = (try self.internChild(field.field(.type))).*,
+                };
+            }
+            break :blk cy.def.Type{
+                .Union = cy.def.Type.Union{
+                    .fields = fields,
+                },
+            };
+        },
+        .Enum => blk: {
+            const fields_view = view.value(.Enum).field(.fields);
+            const fields = try arena.alloc(cy.def.Type.Enum.Field, fields_view.len());
+            for (fields, 0..) |*f, i| {
+                f.* = cy.def.Type.Enum.Field{
+                    .name = try self.internName(fields_view.elem(i).field(.name)),
+                };
+            }
+            break :blk cy.def.Type{
+                .Enum = cy.def.Type.Enum{
+                    .fields = fields,
+                },
+            };
+        },
+        .Ref => blk: {
+            const value = view.value(.Ref);
+            break :blk cy.def.Type{
+                .Ref = switch (value.tag()) {
+                    .Internal => cy.def.Type.Ref{
+                        .Internal = cy.def.Type.Ref.Internal{
+                            .name = try self.internName(value.value(.Internal).field(.name)),
+                        },
+                    },
+                    .External => cy.def.Type.Ref{
+                        .External = cy.def.Type.Ref.External{
+                            .scheme = try self.internName(value.value(.External).field(.scheme)),
+                            .name = try self.internName(value.value(.External).field(.name)),
+                        },
+                    },
+                },
+            };
+        },
+    };
+}
@@ -0,0 +1,61 @@
+const std = @import("std");
+
+const suites = .{
+    .{ "serde", @import("bench/serde.zig") },
+    .{ "state", @import("bench/state.zig") },
+    .{ "table", @import("bench/table.zig") },
+    .{ "store", @import("bench/store.zig") },
+    .{ "objects", @import("bench/objects.zig") },
+    .{ "types", @import("bench/types.zig") },
+};
+
+pub fn main() !void {
+    var gpa = std.heap.GeneralPurposeAllocator(.{}){};
+    defer _ = gpa.deinit();
+    const allocator = gpa.allocator();
+
+    const args = try std.process.argsAlloc(allocator);
+    defer std.process.argsFree(allocator, args);
+
+    const stdout = std.io.getStdOut().writer();
+    inline for (suites) |suite| {
+        // `bench <suite> fuzz [iterations] [seed]` runs the fuzzer of a suite that has one
+        if (@hasDecl(suite[1], "fuzz") and args.len >= 3 and std.mem.eql(u8, args[1], suite[0]) and std.mem.eql(u8, args[2], "fuzz")) {
+            const iterations = if (args.len >= 4) try std.fmt.parseInt(usize, args[3], 10) else 100_000;
+            const seed = if (args.len >= 5) try std.fmt.parseInt(u64, args[4], 10) else @as(u64, @truncate(@as(u128, @bitCast(std.time.nanoTimestamp()))));
+            try stdout.print("{s} fuzz, seed {d}:\n", .{ suite[0], seed });
+            try suite[1].fuzz(allocator, stdout, iterations, seed);
+            continue;
+        }
+        if (args.len < 2 or std.mem.eql(u8, args[1], suite[0])) {
+            try stdout.print("{s}:\n", .{suite[0]});
+            try suite[1].run(allocator, stdout);
+        }
+    }
+}
+
+/// Returns the mean nanoseconds per call of `func` over `iterations` calls.
+pub fn measure(iterations: usize, comptime func: anytype, args: anytype) !u64 {
+    var timer = try std.time.Timer.start();
+    for (0..iterations) |_| {
+        const result = @call(.never_inline, func, args);
+        if (@typeInfo(@TypeOf(result)) == .ErrorUnion) {
+            std.mem.doNotOptimizeAway(try result);
+        } else {
+            std.mem.doNotOptimizeAway(result);
+        }
+    }
+    return timer.read() / iterations;
+}
+
+pub fn report(writer: anytype, name: []const u8, ns: u64) !void {
+    try writer.print("  {s: <40} {d: >12} ns\n", .{ name, ns });
+}
+
+pub fn reportBytes(writer: anytype, name: []const u8, bytes: usize) !void {
+    try writer.print("  {s: <40} {d: >12} B\n", .{ name, bytes });
+}
+
+pub fn reportValue(writer: anytype, name: []const u8, value: f64, unit: []const u8) !void {
+    try writer.print("  {s: <40} {d: >12.2} {s}\n", .{ name, value, unit });
+}
@@ -0,0 +1,729 @@
+//! Runs random but valid mutation streams through `Object.update`, one for every kind of type and one for
+//! a document nesting all of them. The streams are generated up front against a model of the state that only
+//! keeps what decides whether an op is valid: string and list lengths, map keys and which optional and union
+//! variants are set.
+//!
+//! `fuzz` mixes mutations with one invalid op somewhere inside them into the stream, and checks that each of
+//! them is rejected and leaves the object exactly as it was.
+const std = @import("std");
+const cy = @import("cycle");
+const bench = @import("../bench.zig");
+const serde = @import("../ObjectTable/serde.zig");
+const Object = @import("../ObjectTable/Object.zig");
+const TypeTable = @import("../TypeTable.zig");
+const CountingAllocator = @import("../CountingAllocator.zig");
+
+const stream_len = 20_000;
+const rounds = 5;
+// Values nest at most this deep and lists grow to about this many items, so the state stays small enough
+// that the stream measures the ops rather than walking huge values.
+const max_depth = 4;
+const max_items = 16;
+
+const Value = union(enum) {
+    text: cy.def.String,
+    number: u32,
+    lines: cy.def.List(cy.def.String),
+    nothing: void,
+};
+
+const Item = struct {
+    name: cy.def.String,
+    done: bool,
+    counts: ?cy.def.List(u32),
+};
+
+pub const BenchScheme = cy.def.Scheme("objects", .{
+    cy.def.Object("Text", .{cy.def.String}),
+    cy.def.Object("Maybe", .{?cy.def.String}),
+    cy.def.Object("Grid", .{[4]?cy.def.String}),
+    cy.def.Object("Lines", .{cy.def.List(cy.def.String)}),
+    cy.def.Object("Flags", .{cy.def.List(bool)}),
+    cy.def.Object("Props", .{cy.def.Map(cy.def.String, Value)}),
+    cy.def.Object("Choice", .{Value}),
+    cy.def.Object("Pair", .{struct { cy.def.String, u32 }}),
+    cy.def.Object("Doc", .{
+        struct {
+            flag: bool,
+            count: u32,
+            ratio: f32,
+            unit: void,
+            mode: enum { a, b, c },
+            title: cy.def.String,
+            note: ?cy.def.String,
+            items: cy.def.List(Item),
+            props: cy.def.Map(cy.def.String, Value),
+            point: struct { f32, f32 },
+            link: cy.def.This("Doc"),
+        },
+    }),
+});
+
+const object_names = [_][]const u8{ "Text", "Maybe", "Grid", "Lines", "Flags", "Props", "Choice", "Pair", "Doc" };
+
+const StringIndex = @TypeOf(serde.MutateStringInsertOp.init(undefined).fieldValue(.index));
+const StringLen = @TypeOf(serde.MutateStringDeleteOp.init(undefined).fieldValue(.len));
+const ArrayIndex = @TypeOf(serde.MutateArrayOp.init(undefined).fieldValue(.index));
+const ListIndex = @TypeOf(serde.MutateListMutateOp.init(undefined).fieldValue(.index));
+const ListInsertIndex = @TypeOf(serde.MutateListInsertOp.init(undefined).fieldValue(.index));
+const ListDeleteIndex = @TypeOf(serde.MutateListOp.init(undefined).fieldValue(.Delete));
+
+// Map keys are drawn from a small pool, so that puts replace entries as often as they add them.
+const map_keys = [_][]const u8{ "a", "b", "c", "d", "e", "f", "g", "h" };
+const missing_key = "missing";
+
+const ObjectType = struct {
+    name: []const u8,
+    id: cy.def.TypeId,
+    type: cy.def.Type,
+};
+
+pub fn run(allocator: std.mem.Allocator, writer: anytype) !void {
+    var type_table = TypeTable.init(allocator);
+    defer type_table.deinit();
+    var types: [object_names.len]ObjectType = undefined;
+    try loadTypes(allocator, &type_table, &types);
+
+    for (types) |t| {
+        try runStream(allocator, writer, t);
+    }
+}
+
+fn runStream(allocator: std.mem.Allocator, writer: anytype, t: ObjectType) !void {
+    var arena = std.heap.ArenaAllocator.init(allocator);
+    defer arena.deinit();
+    var prng = std.rand.DefaultPrng.init(0);
+    var gen = Generator{ .arena = arena.allocator(), .random = prng.random() };
+
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    var shape = try gen.writeValue(t.type, &value, 0);
+
+    var mutations = std.ArrayList(u8).init(allocator);
+    defer mutations.deinit();
+    const ends = try allocator.alloc(usize, stream_len);
+    defer allocator.free(ends);
+    for (ends) |*end| {
+        try gen.writeMutation(t.type, &mutations, &shape, 0);
+        end.* = mutations.items.len;
+    }
+
+    // Only what the pool asks of the allocator is counted, the slabs rather than each state.
+    var counting = CountingAllocator.init(allocator);
+    var ns: u64 = 0;
+    var allocations: usize = 0;
+    for (0..rounds) |_| {
+        var pool = Object.StatePool.init(counting.allocator());
+        defer pool.deinit();
+        const counted = pool.allocator();
+        var object = try Object.init(counted, t.id, t.type, value.items);
+        defer object.deinit(counted);
+
+        const before = counting.stats().allocations;
+        var timer = try std.time.Timer.start();
+        var start: usize = 0;
+        for (ends) |end| {
+            if (!try object.update(counted, mutations.items[start..end])) {
+                return error.MutationRejected;
+            }
+            start = end;
+        }
+        ns += timer.read();
+        allocations += counting.stats().allocations - before;
+    }
+
+    const ops: f64 = @floatFromInt(gen.ops * rounds);
+    const seconds = @as(f64, @floatFromInt(ns)) / std.time.ns_per_s;
+    var name_buf: [64]u8 = undefined;
+    try bench.reportValue(writer, try std.fmt.bufPrint(&name_buf, "{s} ops", .{t.name}), ops / seconds, "/s");
+    try bench.reportValue(writer, try std.fmt.bufPrint(&name_buf, "{s} mutation bytes", .{t.name}), @as(f64, @floatFromInt(mutations.items.len * rounds)) / seconds, "B/s");
+    try bench.reportValue(writer, try std.fmt.bufPrint(&name_buf, "{s} allocations", .{t.name}), @as(f64, @floatFromInt(allocations)) / ops, "/op");
+}
+
+/// Runs `iterations` mutations through objects of every type starting from `seed`, about a quarter of them
+/// invalid, and fails on the first one that's handled wrong.
+pub fn fuzz(allocator: std.mem.Allocator, writer: anytype, iterations: usize, seed: u64) !void {
+    var type_table = TypeTable.init(allocator);
+    defer type_table.deinit();
+    var types: [object_names.len]ObjectType = undefined;
+    try loadTypes(allocator, &type_table, &types);
+
+    var prng = std.rand.DefaultPrng.init(seed);
+    const random = prng.random();
+
+    for (types) |t| {
+        var arena = std.heap.ArenaAllocator.init(allocator);
+        defer arena.deinit();
+        var scratch = std.heap.ArenaAllocator.init(allocator);
+        defer scratch.deinit();
+        var gen = Generator{ .arena = arena.allocator(), .random = random };
+
+        var bytes = std.ArrayList(u8).init(allocator);
+        defer bytes.deinit();
+        var shape = try gen.writeValue(t.type, &bytes, 0);
+        var object = try Object.init(allocator, t.id, t.type, bytes.items);
+        defer object.deinit(allocator);
+
+        var valid: usize = 0;
+        var invalid: usize = 0;
+        for (0..iterations / types.len) |i| {
+            bytes.clearRetainingCapacity();
+            if (random.uintLessThan(u8, 4) != 0) {
+                try gen.writeMutation(t.type, &bytes, &shape, 0);
+                if (!try object.update(allocator, bytes.items)) {
+                    return fail(writer, t.name, i, "rejected a valid mutation");
+                }
+                valid += 1;
+                continue;
+            }
+
+            // The invalid mutation is generated against a copy of the model, which it mustn't change.
+            _ = scratch.reset(.retain_capacity);
+            if (!try writeInvalid(&gen, scratch.allocator(), t.type, &bytes, &shape)) {
+                continue;
+            }
+
+            var before = try object.clone(allocator);
+            defer before.deinit(allocator);
+            if (try object.update(allocator, bytes.items)) {
+                return fail(writer, t.name, i, "accepted an invalid mutation");
+            }
+            if (!object.eql(&before)) {
+                return fail(writer, t.name, i, "was changed by a rejected mutation");
+            }
+            invalid += 1;
+        }
+        try writer.print("  {s: <40} {d: >12} valid {d: >8} invalid\n", .{ t.name, valid, invalid });
+    }
+}
+
+fn fail(writer: anytype, name: []const u8, iteration: usize, what: []const u8) !void {
+    try writer.print("  {s} {s} at iteration {d}\n", .{ name, what, iteration });
+    return error.FuzzFailed;
+}
+
+// Tries a few times, since a mutation may leave out every part that an invalid op could go into.
+fn writeInvalid(gen: *Generator, scratch: std.mem.Allocator, t: cy.def.Type, out: *std.ArrayList(u8), shape: *const Shape) !bool {
+    var bad = Generator{ .arena = scratch, .random = gen.random };
+    for (0..100) |_| {
+        out.clearRetainingCapacity();
+        var copy = try shape.clone(scratch);
+        bad.corrupt = true;
+        try bad.writeMutation(t, out, &copy, 0);
+        if (!bad.corrupt) {
+            return true;
+        }
+    }
+    return false;
+}
+
+fn loadTypes(allocator: std.mem.Allocator, type_table: *TypeTable, types: []ObjectType) !void {
+    var scheme = std.ArrayList(u8).init(allocator);
+    defer scheme.deinit();
+    try cy.chan.write(cy.def.ObjectScheme.from(BenchScheme), &scheme);
+
+    const view = cy.chan.read(cy.def.ObjectScheme, scheme.items);
+    for (types, object_names, 0..) |*t, name, i| {
+        const object = view.field(.objects).elem(i);
+        std.debug.assert(std.mem.eql(u8, name, object.field(.name)));
+        const id = try type_table.update(view.field(.name), object.field(.name), object.field(.versions).elem(0));
+        t.* = ObjectType{
+            .name = name,
+            .id = id,
+            .type = try type_table.get(id),
+        };
+    }
+}
+
+// The part of the state that decides whether an op is valid.
+const Shape = union(enum) {
+    Scalar,
+    String: usize,
+    Optional: ?*Shape,
+    // struct and tuple fields and array elements
+    Fields: []Shape,
+    List: std.ArrayListUnmanaged(Shape),
+    Map: std.StringArrayHashMapUnmanaged(Shape),
+    Union: struct {
+        tag: u16,
+        child: *Shape,
+    },
+
+    fn clone(shape: *const Shape, allocator: std.mem.Allocator) std.mem.Allocator.Error!Shape {
+        return switch (shape.*) {
+            .Scalar, .String => shape.*,
+            .Optional => |child| Shape{
+                .Optional = if (child) |c| try box(allocator, try c.clone(allocator)) else null,
+            },
+            .Fields => |fields| blk: {
+                const copy = try allocator.alloc(Shape, fields.len);
+                for (copy, fields) |*c, *f| {
+                    c.* = try f.clone(allocator);
+                }
+                break :blk Shape{ .Fields = copy };
+            },
+            .List => |list| blk: {
+                var copy = try std.ArrayListUnmanaged(Shape).initCapacity(allocator, list.items.len);
+                for (list.items) |*item| {
+                    copy.appendAssumeCapacity(try item.clone(allocator));
+                }
+                break :blk Shape{ .List = copy };
+            },
+            .Map => |map| blk: {
+                var copy = std.StringArrayHashMapUnmanaged(Shape){};
+                try copy.ensureTotalCapacity(allocator, map.count());
+                for (map.keys(), map.values()) |key, *value| {
+                    copy.putAssumeCapacity(key, try value.clone(allocator));
+                }
+                break :blk Shape{ .Map = copy };
+            },
+            .Union => |u| Shape{
+                .Union = .{
+                    .tag = u.tag,
+                    .child = try box(allocator, try u.child.clone(allocator)),
+                },
+            },
+        };
+    }
+};
+
+fn box(allocator: std.mem.Allocator, shape: Shape) !*Shape {
+    const boxed = try allocator.create(Shape);
+    boxed.* = shape;
+    return boxed;
+}
+
+const Generator = struct {
+    // holds the model, which is never freed piecemeal
+    arena: std.mem.Allocator,
+    random: std.rand.Random,
+    // Set while generating an invalid mutation, until its invalid op has been written.
+    corrupt: bool = false,
+    // ops written so far, counting every op of a list, map or string and every replaced value
+    ops: usize = 0,
+
+    const Error = std.mem.Allocator.Error;
+
+    /// Writes a random value of type `t` and returns its model.
+    fn writeValue(gen: *Generator, t: cy.def.Type, out: *std.ArrayList(u8), depth: usize) Error!Shape {
+        switch (t) {
+            // The table never reads values without state, only their framing has to be right.
+            .Void, .Ref, .Any => return .Scalar,
+            .Bool => try out.append(gen.random.int(u1)),
+            .Int => |info| try gen.writeBytes(out, std.math.divCeil(usize, info.bits, 8) catch unreachable),
+            .Float => |info| try gen.writeBytes(out, info.bits / 8),
+            .Enum => try gen.writeBytes(out, @sizeOf(u16)),
+            .String => {
+                var text: [8]u8 = undefined;
+                const len = gen.random.uintAtMost(usize, text.len);
+                gen.fillText(text[0..len]);
+                try serde.writeElem(out, text[0..len]);
+                return Shape{ .String = len };
+            },
+            .Optional => |info| {
+                if (depth >= max_depth or gen.random.boolean()) {
+                    try out.append(0);
+                    return Shape{ .Optional = null };
+                }
+                try out.append(1);
+                return Shape{ .Optional = try box(gen.arena, try gen.writeValue(info.child.*, out, depth + 1)) };
+            },
+            .Array => |info| {
+                const elems = try gen.arena.alloc(Shape, @intCast(info.len));
+                for (elems) |*elem| {
+                    const start = try serde.beginElem(out);
+                    elem.* = try gen.writeValue(info.child.*, out, depth + 1);
+                    serde.endElem(out, start);
+                }
+                return Shape{ .Fields = elems };
+            },
+            .List => |info| {
+                const count = if (depth >= max_depth) 0 else gen.random.uintAtMost(usize, 3);
+                try out.appendSlice(std.mem.asBytes(&count));
+                var items = try std.ArrayListUnmanaged(Shape).initCapacity(gen.arena, count);
+                for (0..count) |_| {
+                    const start = try serde.beginElem(out);
+                    items.appendAssumeCapacity(try gen.writeValue(info.child.*, out, depth + 1));
+                    serde.endElem(out, start);
+                }
+                return Shape{ .List = items };
+            },
+            .Map => |info| {
+                const count = if (depth >= max_depth) 0 else gen.random.uintAtMost(usize, 3);
+                try out.appendSlice(std.mem.asBytes(&count));
+                var map = std.StringArrayHashMapUnmanaged(Shape){};
+                for (0..count) |_| {
+                    const key = map_keys[gen.random.uintLessThan(usize, map_keys.len)];
+                    const start = try serde.beginElem(out);
+                    try serde.writeElem(out, key);
+                    const value = try serde.beginElem(out);
+                    try map.put(gen.arena, key, try gen.writeValue(info.value.*, out, depth + 1));
+                    serde.endElem(out, value);
+                    serde.endElem(out, start);
+                }
+                return Shape{ .Map = map };
+            },
+            .Struct => |info| return gen.writeFields(info, out, depth),
+            .Tuple => |info| return gen.writeFields(info, out, depth),
+            .Union => |info| {
+                const tag = gen.random.uintLessThan(u16, @intCast(info.fields.len));
+                try writeTag(out, tag);
+                const start = try serde.beginElem(out);
+                const child = try gen.writeValue(info.fields[tag].type, out, depth + 1);
+                serde.endElem(out, start);
+                return Shape{ .Union = .{ .tag = tag, .child = try box(gen.arena, child) } };
+            },
+        }
+        return .Scalar;
+    }
+
+    fn writeFields(gen: *Generator, info: anytype, out: *std.ArrayList(u8), depth: usize) Error!Shape {
+        const fields = try gen.arena.alloc(Shape, info.fields.len);
+        for (fields, info.fields) |*field, f| {
+            const start = try serde.beginElem(out);
+            field.* = try gen.writeValue(f.type, out, depth + 1);
+            serde.endElem(out, start);
+        }
+        return Shape{ .Fields = fields };
+    }
+
+    /// Writes a random mutation of a value of type `t` modelled by `shape`, and updates the model to match.
+    fn writeMutation(gen: *Generator, t: cy.def.Type, out: *std.ArrayList(u8), shape: *Shape, depth: usize) Error!void {
+        switch (t) {
+            .Void, .Bool, .Int, .Float, .Enum, .Ref, .Any => {
+                _ = try gen.writeValue(t, out, depth);
+                gen.ops += 1;
+            },
+            .String => try gen.writeText(out, &shape.String),
+            .Optional => |info| try gen.writeOptional(info.child.*, out, shape, depth),
+            .Array => |info| {
+                const elems = shape.Fields;
+                const count = 1 + gen.random.uintLessThan(usize, 2);
+                try out.appendSlice(std.mem.asBytes(&count));
+                for (0..count) |_| {
+                    const op = try serde.beginElem(out);
+                    defer serde.endElem(out, op);
+                    if (gen.shouldCorrupt()) {
+                        try serde.writeElem(out, std.mem.asBytes(&@as(ArrayIndex, @intCast(elems.len))));
+                        try serde.writeElem(out, "");
+                        continue;
+                    }
+                    const index = gen.random.uintLessThan(usize, elems.len);
+                    try serde.writeElem(out, std.mem.asBytes(&@as(ArrayIndex, @intCast(index))));
+                    const elem = try serde.beginElem(out);
+                    try gen.writeMutation(info.child.*, out, &elems[index], depth + 1);
+                    serde.endElem(out, elem);
+                }
+            },
+            .List => |info| try gen.writeList(info.child.*, out, &shape.List, depth),
+            .Map => |info| try gen.writeMap(info.value.*, out, &shape.Map, depth),
+            .Struct => |info| try gen.writeFieldMutations(info, out, shape.Fields, depth),
+            .Tuple => |info| try gen.writeFieldMutations(info, out, shape.Fields, depth),
+            .Union => |info| try gen.writeUnion(info, out, shape, depth),
+        }
+    }
+
+    fn writeText(gen: *Generator, out: *std.ArrayList(u8), len: *usize) Error!void {
+        const count = 1 + gen.random.uintLessThan(usize, 3);
+        try out.appendSlice(std.mem.asBytes(&count));
+        for (0..count) |_| {
+            const op = try serde.beginElem(out);
+            defer serde.endElem(out, op);
+            gen.ops += 1;
+
+            var text: [4]u8 = undefined;
+            const text_len = 1 + gen.random.uintLessThan(usize, text.len);
+            gen.fillText(text[0..text_len]);
+
+            if (gen.shouldCorrupt()) {
+                if (gen.random.boolean()) {
+                    try writeTextInsert(out, len.* + 1, text[0..text_len]);
+                } else {
+                    try writeTextDelete(out, len.*, 1);
+                }
+                continue;
+            }
+            // deletes are favoured once the text is long, so that it stays short
+            const kinds: u8 = if (len.* == 0) 3 else if (len.* > 64) 6 else 4;
+            switch (gen.random.uintLessThan(u8, kinds)) {
+                0, 1 => {
+                    const tag: serde.MutateStringOp.Tag = if (gen.random.boolean()) .Append else .Prepend;
+                    try writeTag(out, @intFromEnum(tag));
+                    try serde.writeString(out, text[0..text_len]);
+                    len.* += text_len;
+                },
+                2 => {
+                    try writeTextInsert(out, gen.random.uintAtMost(usize, len.*), text[0..text_len]);
+                    len.* += text_len;
+                },
+                else => {
+                    const index = gen.random.uintLessThan(usize, len.*);
+                    const delete_len = 1 + gen.random.uintLessThan(usize, len.* - index);
+                    try writeTextDelete(out, index, delete_len);
+                    len.* -= delete_len;
+                },
+            }
+        }
+    }
+
+    fn writeOptional(gen: *Generator, child_type: cy.def.Type, out: *std.ArrayList(u8), shape: *Shape, depth: usize) Error!void {
+        const child = shape.Optional;
+        if (child == null and gen.shouldCorrupt()) {
+            try writeTag(out, @intFromEnum(serde.MutateOptional.Tag.Mutate));
+            try serde.writeElem(out, "");
+            return;
+        }
+
+        if (child != null and gen.random.uintLessThan(u8, 3) != 0) {
+            try writeTag(out, @intFromEnum(serde.MutateOptional.Tag.Mutate));
+            const payload = try serde.beginElem(out);
+            try gen.writeMutation(child_type, out, child.?, depth + 1);
+            serde.endElem(out, payload);
+            return;
+        }
+
+        gen.ops += 1;
+        if (gen.random.boolean()) {
+            try writeTag(out, @intFromEnum(serde.MutateOptional.Tag.None));
+            try serde.writeElem(out, "");
+            shape.* = Shape{ .Optional = null };
+            return;
+        }
+        try writeTag(out, @intFromEnum(serde.MutateOptional.Tag.New));
+        const payload = try serde.beginElem(out);
+        shape.* = Shape{ .Optional = try box(gen.arena, try gen.writeValue(child_type, out, depth + 1)) };
+        serde.endElem(out, payload);
+    }
+
+    fn writeList(gen: *Generator, child_type: cy.def.Type, out: *std.ArrayList(u8), items: *std.ArrayListUnmanaged(Shape), depth: usize) Error!void {
+        const count = 1 + gen.random.uintLessThan(usize, 3);
+        try out.appendSlice(std.mem.asBytes(&count));
+        for (0..count) |_| {
+            const op = try serde.beginElem(out);
+            defer serde.endElem(out, op);
+            const len = items.items.len;
+
+            if (gen.shouldCorrupt()) {
+                gen.ops += 1;
+                switch (gen.random.uintLessThan(u8, 3)) {
+                    0 => {
+                        try writeTag(out, @intFromEnum(serde.MutateListOp.Tag.Delete));
+                        try serde.writeElem(out, std.mem.asBytes(&@as(ListDeleteIndex, @intCast(len))));
+                    },
+                    1 => {
+                        try writeTag(out, @intFromEnum(serde.MutateListOp.Tag.Insert));
+                        const payload = try serde.beginElem(out);
+                        try serde.writeElem(out, std.mem.asBytes(&@as(ListInsertIndex, @intCast(len + 1))));
+                        const value = try serde.beginElem(out);
+                        _ = try gen.writeValue(child_type, out, depth + 1);
+                        serde.endElem(out, value);
+                        serde.endElem(out, payload);
+                    },
+                    else => {
+                        try writeTag(out, @intFromEnum(serde.MutateListOp.Tag.Mutate));
+                        const payload = try serde.beginElem(out);
+                        try serde.writeElem(out, std.mem.asBytes(&@as(ListIndex, @intCast(len))));
+                        try serde.writeElem(out, "");
+                        serde.endElem(out, payload);
+                    },
+                }
+                continue;
+            }
+
+            // Mutates half the time once there's an item, inserts or deletes otherwise, deleting more often
+            // once the list is long.
+            const kind = if (len == 0) gen.random.uintLessThan(u8, 3) else if (gen.random.boolean()) 4 else if (len >= max_items) 3 else gen.random.uintLessThan(u8, 4);
+            if (kind != 4) {
+                gen.ops += 1;
+            }
+            switch (kind) {
+                0, 1 => {
+                    const tag: serde.MutateListOp.Tag = if (kind == 0) .Append else .Prepend;
+                    try writeTag(out, @intFromEnum(tag));
+                    const value = try serde.beginElem(out);
+                    const item = try gen.writeValue(child_type, out, depth + 1);
+                    serde.endElem(out, value);
+                    try items.insert(gen.arena, if (kind == 0) len else 0, item);
+                },
+                2 => {
+                    const index = gen.random.uintAtMost(usize, len);
+                    try writeTag(out, @intFromEnum(serde.MutateListOp.Tag.Insert));
+                    const payload = try serde.beginElem(out);
+                    try serde.writeElem(out, std.mem.asBytes(&@as(ListInsertIndex, @intCast(index))));
+                    const value = try serde.beginElem(out);
+                    const item = try gen.writeValue(child_type, out, depth + 1);
+                    serde.endElem(out, value);
+                    serde.endElem(out, payload);
+                    try items.insert(gen.arena, index, item);
+                },
+                3 => {
+                    const index = gen.random.uintLessThan(usize, len);
+                    try writeTag(out, @intFromEnum(serde.MutateListOp.Tag.Delete));
+                    try serde.writeElem(out, std.mem.asBytes(&@as(ListDeleteIndex, @intCast(index))));
+                    _ = items.orderedRemove(index);
+                },
+                else => {
+                    const index = gen.random.uintLessThan(usize, len);
+                    try writeTag(out, @intFromEnum(serde.MutateListOp.Tag.Mutate));
+                    const payload = try serde.beginElem(out);
+                    try serde.writeElem(out, std.mem.asBytes(&@as(ListIndex, @intCast(index))));
+                    const mutation = try serde.beginElem(out);
+                    try gen.writeMutation(child_type, out, &items.items[index], depth + 1);
+                    serde.endElem(out, mutation);
+                    serde.endElem(out, payload);
+                },
+            }
+        }
+    }
+
+    fn writeMap(gen: *Generator, value_type: cy.def.Type, out: *std.ArrayList(u8), map: *std.StringArrayHashMapUnmanaged(Shape), depth: usize) Error!void {
+        const count = 1 + gen.random.uintLessThan(usize, 3);
+        try out.appendSlice(std.mem.asBytes(&count));
+        for (0..count) |_| {
+            const op = try serde.beginElem(out);
+            defer serde.endElem(out, op);
+
+            if (gen.shouldCorrupt()) {
+                gen.ops += 1;
+                if (gen.random.boolean()) {
+                    try writeTag(out, @intFromEnum(serde.MutateMapOp.Tag.Remove));
+                    try serde.writeElem(out, missing_key);
+                } else {
+                    try writeTag(out, @intFromEnum(serde.MutateMapOp.Tag.Mutate));
+                    const payload = try serde.beginElem(out);
+                    try serde.writeElem(out, missing_key);
+                    try serde.writeElem(out, "");
+                    serde.endElem(out, payload);
+                }
+                continue;
+            }
+
+            const kind = if (map.count() == 0) 0 else gen.random.uintLessThan(u8, 4);
+            switch (kind) {
+                0 => {
+                    gen.ops += 1;
+                    const key = map_keys[gen.random.uintLessThan(usize, map_keys.len)];
+                    try writeTag(out, @intFromEnum(serde.MutateMapOp.Tag.Put));
+                    const payload = try serde.beginElem(out);
+                    try serde.writeElem(out, key);
+                    const value = try serde.beginElem(out);
+                    try map.put(gen.arena, key, try gen.writeValue(value_type, out, depth + 1));
+                    serde.endElem(out, value);
+                    serde.endElem(out, payload);
+                },
+                1 => {
+                    gen.ops += 1;
+                    const key = map.keys()[gen.random.uintLessThan(usize, map.count())];
+                    try writeTag(out, @intFromEnum(serde.MutateMapOp.Tag.Remove));
+                    try serde.writeElem(out, key);
+                    _ = map.orderedRemove(key);
+                },
+                else => {
+                    const index = gen.random.uintLessThan(usize, map.count());
+                    try writeTag(out, @intFromEnum(serde.MutateMapOp.Tag.Mutate));
+                    const payload = try serde.beginElem(out);
+                    try serde.writeElem(out, map.keys()[index]);
+                    const mutation = try serde.beginElem(out);
+                    try gen.writeMutation(value_type, out, &map.values()[index], depth + 1);
+                    serde.endElem(out, mutation);
+                    serde.endElem(out, payload);
+                },
+            }
+        }
+    }
+
+    fn writeFieldMutations(gen: *Generator, info: anytype, out: *std.ArrayList(u8), fields: []Shape, depth: usize) Error!void {
+        for (info.fields, fields) |f, *field| {
+            const start = try serde.beginElem(out);
+            defer serde.endElem(out, start);
+            if (gen.random.uintLessThan(u8, 3) != 0) {
+                try out.append(0);
+                continue;
+            }
+            try out.append(1);
+            try gen.writeMutation(f.type, out, field, depth + 1);
+        }
+    }
+
+    fn writeUnion(gen: *Generator, info: anytype, out: *std.ArrayList(u8), shape: *Shape, depth: usize) Error!void {
+        const current = shape.Union.tag;
+        if (gen.shouldCorrupt()) {
+            gen.ops += 1;
+            // a tag past the last variant, or a mutation of a variant that isn't set
+            const tag: u16 = if (info.fields.len > 1 and gen.random.boolean())
+                (current + 1) % @as(u16, @intCast(info.fields.len))
+            else
+                @intCast(info.fields.len);
+            try writeTag(out, tag);
+            const field = try serde.beginElem(out);
+            try writeTag(out, @intFromEnum(serde.MutateUnionField.Tag.Mutate));
+            try serde.writeElem(out, "");
+            serde.endElem(out, field);
+            return;
+        }
+
+        if (gen.random.boolean()) {
+            try writeTag(out, current);
+            const field = try serde.beginElem(out);
+            try writeTag(out, @intFromEnum(serde.MutateUnionField.Tag.Mutate));
+            const payload = try serde.beginElem(out);
+            try gen.writeMutation(info.fields[current].type, out, shape.Union.child, depth + 1);
+            serde.endElem(out, payload);
+            serde.endElem(out, field);
+            return;
+        }
+
+        gen.ops += 1;
+        const tag = gen.random.uintLessThan(u16, @intCast(info.fields.len));
+        try writeTag(out, tag);
+        const field = try serde.beginElem(out);
+        try writeTag(out, @intFromEnum(serde.MutateUnionField.Tag.New));
+        const payload = try serde.beginElem(out);
+        const child = try gen.writeValue(info.fields[tag].type, out, depth + 1);
+        serde.endElem(out, payload);
+        serde.endElem(out, field);
+        shape.* = Shape{ .Union = .{ .tag = tag, .child = try box(gen.arena, child) } };
+    }
+
+    // Only ever true once per invalid mutation, at a random one of the ops that could be made invalid.
+    fn shouldCorrupt(gen: *Generator) bool {
+        if (!gen.corrupt or gen.random.uintLessThan(u8, 4) != 0) {
+            return false;
+        }
+        gen.corrupt = false;
+        return true;
+    }
+
+    fn writeBytes(gen: *Generator, out: *std.ArrayList(u8), len: usize) Error!void {
+        for (0..len) |_| {
+            try out.append(gen.random.int(u8));
+        }
+    }
+
+    fn fillText(gen: *Generator, text: []u8) void {
+        for (text) |*c| {
+            c.* = 'a' + gen.random.uintLessThan(u8, 26);
+        }
+    }
+};
+
+fn writeTag(out: *std.ArrayList(u8), tag: u16) !void {
+    try out.appendSlice(std.mem.asBytes(&tag));
+}
+
+fn writeTextInsert(out: *std.ArrayList(u8), index: usize, text: []const u8) !void {
+    try writeTag(out, @intFromEnum(serde.MutateStringOp.Tag.Insert));
+    const payload = try serde.beginElem(out);
+    try serde.writeElem(out, std.mem.asBytes(&@as(StringIndex, @intCast(index))));
+    try serde.writeString(out, text);
+    serde.endElem(out, payload);
+}
+
+fn writeTextDelete(out: *std.ArrayList(u8), index: usize, len: usize) !void {
+    try writeTag(out, @intFromEnum(serde.MutateStringOp.Tag.Delete));
+    const payload = try serde.beginElem(out);
+    try serde.writeElem(out, std.mem.asBytes(&@as(StringIndex, @intCast(index))));
+    try serde.writeElem(out, std.mem.asBytes(&@as(StringLen, @intCast(len))));
+    serde.endElem(out, payload);
+}
+
@@ -0,0 +1,79 @@
+const std = @import("std");
+const bench = @import("../bench.zig");
+const serde = @import("../ObjectTable/serde.zig");
+
+const wide_struct_fields = 64;
+const long_list_ops = 20_000;
+
+pub fn run(allocator: std.mem.Allocator, writer: anytype) !void {
+    var out = std.ArrayList(u8).init(allocator);
+    defer out.deinit();
+
+    for (0..wide_struct_fields) |i| {
+        try serde.writeElem(&out, std.mem.asBytes(&i));
+    }
+    const fields = out.items;
+
+    try bench.report(writer, "struct fields via readElem", try bench.measure(10_000, readEachElem, .{ fields, wide_struct_fields }));
+    try bench.report(writer, "struct fields via ElemIterator", try bench.measure(10_000, iterateElems, .{ fields, wide_struct_fields }));
+
+    var list = std.ArrayList(u8).init(allocator);
+    defer list.deinit();
+
+    try list.appendSlice(std.mem.asBytes(&@as(usize, long_list_ops)));
+    for (0..long_list_ops) |i| {
+        try serde.writeElem(&list, std.mem.asBytes(&i));
+    }
+    const ops = serde.NewList.init(list.items);
+
+    try bench.report(writer, "list ops via Slice.elemBytes", try bench.measure(3, sliceElemBytes, .{ops}));
+    try bench.report(writer, "list ops via Slice.iterator", try bench.measure(1_000, sliceIterator, .{ops}));
+    try bench.report(writer, "list ops via Slice.index", try bench.measure(1_000, sliceIndex, .{ allocator, ops }));
+}
+
+fn readEachElem(bytes: []const u8, count: usize) usize {
+    var sum: usize = 0;
+    for (0..count) |i| {
+        sum +%= serde.readElem(bytes, i)[0];
+    }
+    return sum;
+}
+
+fn iterateElems(bytes: []const u8, count: usize) usize {
+    var sum: usize = 0;
+    var elems = serde.ElemIterator.init(bytes);
+    for (0..count) |_| {
+        sum +%= elems.next()[0];
+    }
+    return sum;
+}
+
+fn sliceElemBytes(ops: serde.NewList) usize {
+    var sum: usize = 0;
+    for (0..ops.len()) |i| {
+        sum +%= ops.elemBytes(i)[0];
+    }
+    return sum;
+}
+
+fn sliceIterator(ops: serde.NewList) usize {
+    var sum: usize = 0;
+    var iter = ops.iterator();
+    while (iter.nextBytes()) |elem| {
+        sum +%= elem[0];
+    }
+    return sum;
+}
+
+fn sliceIndex(allocator: std.mem.Allocator, ops: serde.NewList) !usize {
+    var indexed = try ops.index(allocator);
+    defer indexed.deinit(allocator);
+
+    var sum: usize = 0;
+    var i = indexed.len();
+    while (i > 0) {
+        i -= 1;
+        sum +%= indexed.elemBytes(i)[0];
+    }
+    return sum;
+}
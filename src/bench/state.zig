@@ -0,0 +1,428 @@
+const std = @import("std");
+const cy = @import("cycle");
+const bench = @import("../bench.zig");
+const serde = @import("../ObjectTable/serde.zig");
+const Object = @import("../ObjectTable/Object.zig");
+const StateTape = @import("../ObjectTable/StateTape.zig");
+
+const list_items = 10_000;
+const map_entries = 200_000;
+const map_batch = 1_000;
+const text_len = 4 * 1024 * 1024;
+const wide_fields = 32;
+const deep_levels = 16;
+const deep_points = 8;
+
+const item_type = cy.def.Type{
+    .Struct = cy.def.Type.Struct{
+        .fields = &[_]cy.def.Type.Struct.Field{
+            .{ .name = "name", .type = .String },
+            .{
+                .name = "note",
+                .type = cy.def.Type{
+                    .Optional = cy.def.Type.Optional{ .child = &@as(cy.def.Type, .String) },
+                },
+            },
+            .{ .name = "done", .type = .Bool },
+        },
+    },
+};
+
+const object_type = cy.def.Type{
+    .Struct = cy.def.Type.Struct{
+        .fields = &[_]cy.def.Type.Struct.Field{
+            .{ .name = "title", .type = .String },
+            .{
+                .name = "items",
+                .type = cy.def.Type{
+                    .List = cy.def.Type.List{ .child = &item_type },
+                },
+            },
+        },
+    },
+};
+
+// Alternates numbers and strings, so that updating it goes back and forth between fields with and without
+// state.
+const wide_type = blk: {
+    var fields: [wide_fields]cy.def.Type.Struct.Field = undefined;
+    for (&fields, 0..) |*f, i| {
+        f.* = .{
+            .name = std.fmt.comptimePrint("f{d}", .{i}),
+            .type = if (i % 2 == 0) cy.def.Type{ .Int = cy.def.Type.Int{ .signedness = .unsigned, .bits = 32 } } else .String,
+        };
+    }
+    const final = fields;
+    break :blk cy.def.Type{
+        .Struct = cy.def.Type.Struct{
+            .fields = &final,
+        },
+    };
+};
+
+const u32_type = cy.def.Type{ .Int = cy.def.Type.Int{ .signedness = .unsigned, .bits = 32 } };
+
+const point_type = cy.def.Type{
+    .Tuple = cy.def.Type.Tuple{
+        .fields = &[_]cy.def.Type.Tuple.Field{ .{ .type = u32_type }, .{ .type = u32_type } },
+    },
+};
+
+// Nests a struct per level down to a string, with fields without state next to the one leading down, which
+// is where following the type spends its time.
+const deep_type = blk: {
+    var t: cy.def.Type = .String;
+    for (0..deep_levels) |_| {
+        const fields = [_]cy.def.Type.Struct.Field{
+            .{
+                .name = "points",
+                .type = cy.def.Type{
+                    .Array = cy.def.Type.Array{ .len = deep_points, .child = &point_type },
+                },
+            },
+            .{ .name = "count", .type = u32_type },
+            .{ .name = "child", .type = t },
+        };
+        t = cy.def.Type{
+            .Struct = cy.def.Type.Struct{
+                .fields = &fields,
+            },
+        };
+    }
+    const final = t;
+    break :blk final;
+};
+
+const map_type = cy.def.Type{
+    .Map = cy.def.Type.Map{
+        .key = &@as(cy.def.Type, .String),
+        .value = &@as(cy.def.Type, .String),
+    },
+};
+
+const type_id = cy.def.TypeId{
+    .scheme = 0,
+    .name = 0,
+    .version = 0,
+};
+
+pub fn run(allocator: std.mem.Allocator, writer: anytype) !void {
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    try writeValue(&value);
+
+    var rename = std.ArrayList(u8).init(allocator);
+    defer rename.deinit();
+    try writeRename(&rename, list_items / 2);
+
+    var shift = std.ArrayList(u8).init(allocator);
+    defer shift.deinit();
+    try writeShift(&shift);
+
+    var layout = try StateTape.Layout.init(allocator, object_type);
+    defer layout.deinit(allocator);
+
+    var pool = Object.StatePool.init(allocator);
+    defer pool.deinit();
+    var object = try Object.init(pool.allocator(), type_id, object_type, value.items);
+    defer object.deinit(pool.allocator());
+
+    var tape = try StateTape.init(allocator, &layout, value.items);
+    defer tape.deinit();
+
+    const usage = pool.usage();
+    try bench.reportBytes(writer, "object state (live)", usage.live_bytes);
+    try bench.reportBytes(writer, "object state (reserved)", usage.reserved_bytes);
+    try bench.reportBytes(writer, "state tape", tape.memoryUsage());
+
+    try bench.report(writer, "init via Object", try bench.measure(100, initObject, .{ allocator, value.items }));
+    try bench.report(writer, "init via StateTape", try bench.measure(100, initTape, .{ allocator, &layout, value.items }));
+
+    try bench.report(writer, "rename item via Object", try bench.measure(100_000, updateObject, .{ &object, pool.allocator(), rename.items }));
+    try bench.report(writer, "rename item via StateTape", try bench.measure(100_000, updateTape, .{ &tape, rename.items }));
+
+    try bench.report(writer, "prepend and delete via Object", try bench.measure(10_000, updateObject, .{ &object, pool.allocator(), shift.items }));
+    try bench.report(writer, "prepend and delete via StateTape", try bench.measure(10_000, updateTape, .{ &tape, shift.items }));
+
+    try runMap(allocator, writer);
+    try runText(allocator, writer);
+    try runSpecialized(allocator, writer);
+    try runPlanned(allocator, writer);
+}
+
+fn runPlanned(allocator: std.mem.Allocator, writer: anytype) !void {
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    try writeDeep(&value, deep_levels);
+
+    var edit = std.ArrayList(u8).init(allocator);
+    defer edit.deinit();
+    try writeDeepEdit(&edit, deep_levels);
+
+    var plan = try Object.Plan.init(allocator, deep_type);
+    defer plan.deinit(allocator);
+
+    var generic = try Object.init(allocator, type_id, deep_type, value.items);
+    defer generic.deinit(allocator);
+    var planned = try Object.init(allocator, type_id, deep_type, value.items);
+    defer planned.deinit(allocator);
+    planned.plan = &plan;
+
+    try bench.report(writer, "deep struct update, generic", try bench.measure(100_000, updateObject, .{ &generic, allocator, edit.items }));
+    try bench.report(writer, "deep struct update, planned", try bench.measure(100_000, updateObject, .{ &planned, allocator, edit.items }));
+}
+
+fn writeDeep(out: *std.ArrayList(u8), level: usize) std.mem.Allocator.Error!void {
+    if (level == 0) {
+        try serde.writeElem(out, "text");
+        return;
+    }
+
+    const points = try serde.beginElem(out);
+    for (0..deep_points) |_| {
+        const point = try serde.beginElem(out);
+        try serde.writeElem(out, std.mem.asBytes(&@as(u32, 0)));
+        try serde.writeElem(out, std.mem.asBytes(&@as(u32, 0)));
+        serde.endElem(out, point);
+    }
+    serde.endElem(out, points);
+    try serde.writeElem(out, std.mem.asBytes(&@as(u32, 0)));
+
+    const child = try serde.beginElem(out);
+    try writeDeep(out, level - 1);
+    serde.endElem(out, child);
+}
+
+/// Types a character into the string at the bottom and deletes it again, leaving every other field as is.
+fn writeDeepEdit(out: *std.ArrayList(u8), level: usize) std.mem.Allocator.Error!void {
+    if (level == 0) {
+        try out.appendSlice(std.mem.asBytes(&@as(usize, 2)));
+        try serde.writeStringOp(out, .Insert, 0, "x");
+        try serde.writeStringOp(out, .Delete, 0, "x");
+        return;
+    }
+
+    try serde.writeElem(out, &[_]u8{0});
+    try serde.writeElem(out, &[_]u8{0});
+    const child = try serde.beginElem(out);
+    try out.append(1);
+    try writeDeepEdit(out, level - 1);
+    serde.endElem(out, child);
+}
+
+fn runSpecialized(allocator: std.mem.Allocator, writer: anytype) !void {
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    for (0..wide_fields) |i| {
+        if (i % 2 == 0) {
+            try serde.writeElem(&value, std.mem.asBytes(&@as(u32, 0)));
+        } else {
+            try serde.writeString(&value, "field");
+        }
+    }
+
+    // sets the last number and types a character into the last string and deletes it again
+    var edit = std.ArrayList(u8).init(allocator);
+    defer edit.deinit();
+    for (0..wide_fields - 2) |_| {
+        try serde.writeElem(&edit, &[_]u8{0});
+    }
+    try serde.writeElem(&edit, &[_]u8{ 1, 1, 0, 0, 0 });
+    const text = try serde.beginElem(&edit);
+    try edit.append(1);
+    try edit.appendSlice(std.mem.asBytes(&@as(usize, 2)));
+    try serde.writeStringOp(&edit, .Insert, 0, "x");
+    try serde.writeStringOp(&edit, .Delete, 0, "x");
+    serde.endElem(&edit, text);
+
+    var generic = try Object.init(allocator, type_id, wide_type, value.items);
+    defer generic.deinit(allocator);
+    var specialized = try Object.init(allocator, type_id, wide_type, value.items);
+    defer specialized.deinit(allocator);
+    specialized.applier = Object.specialize(wide_type);
+
+    try bench.report(writer, "wide struct update, generic", try bench.measure(100_000, updateObject, .{ &generic, allocator, edit.items }));
+    try bench.report(writer, "wide struct update, specialized", try bench.measure(100_000, updateObject, .{ &specialized, allocator, edit.items }));
+}
+
+fn runText(allocator: std.mem.Allocator, writer: anytype) !void {
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    try value.appendSlice(std.mem.asBytes(&@as(usize, text_len)));
+    for (0..text_len) |i| {
+        try value.append(@intCast('a' + i % 26));
+    }
+
+    // types a character in the middle of the text and deletes it again
+    var edit = std.ArrayList(u8).init(allocator);
+    defer edit.deinit();
+    try edit.appendSlice(std.mem.asBytes(&@as(usize, 2)));
+    try serde.writeStringOp(&edit, .Insert, text_len / 2, "x");
+    try serde.writeStringOp(&edit, .Delete, text_len / 2, "x");
+
+    var object = try Object.init(allocator, type_id, .String, value.items);
+    defer object.deinit(allocator);
+
+    var chars = std.ArrayList(u32).init(allocator);
+    defer chars.deinit();
+
+    try bench.report(writer, "text edit via Object", try bench.measure(10_000, updateObject, .{ &object, allocator, edit.items }));
+    try bench.report(writer, "text read 4 KiB as UTF-32", try bench.measure(10_000, readText, .{ object.text().?, &chars }));
+}
+
+fn readText(rope: *const Object.Rope, chars: *std.ArrayList(u32)) !void {
+    chars.clearRetainingCapacity();
+    try rope.readUtf32(text_len / 3, text_len / 3 + 4096, chars);
+}
+
+fn runMap(allocator: std.mem.Allocator, writer: anytype) !void {
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    try value.appendSlice(std.mem.asBytes(&@as(usize, map_entries)));
+    for (0..map_entries) |i| {
+        try writeEntry(&value, i);
+    }
+
+    var puts = std.ArrayList(u8).init(allocator);
+    defer puts.deinit();
+    try puts.appendSlice(std.mem.asBytes(&@as(usize, map_batch)));
+    for (0..map_batch) |i| {
+        const op = try serde.beginElem(&puts);
+        try puts.appendSlice(std.mem.asBytes(&@as(u16, @intFromEnum(serde.MutateMapOp.Tag.Put))));
+        try writeEntry(&puts, i * (map_entries / map_batch));
+        serde.endElem(&puts, op);
+    }
+
+    var layout = try StateTape.Layout.init(allocator, map_type);
+    defer layout.deinit(allocator);
+
+    var object = try Object.init(allocator, type_id, map_type, value.items);
+    defer object.deinit(allocator);
+
+    var tape = try StateTape.init(allocator, &layout, value.items);
+    defer tape.deinit();
+
+    try bench.report(writer, "map init via Object", try bench.measure(5, initMapObject, .{ allocator, value.items }));
+    try bench.report(writer, "map put batch via Object", try bench.measure(1_000, updateObject, .{ &object, allocator, puts.items }));
+    try bench.report(writer, "map put batch via StateTape", try bench.measure(1_000, updateTape, .{ &tape, puts.items }));
+}
+
+fn initMapObject(allocator: std.mem.Allocator, bytes: []const u8) !void {
+    var object = try Object.init(allocator, type_id, map_type, bytes);
+    object.deinit(allocator);
+}
+
+fn initObject(allocator: std.mem.Allocator, bytes: []const u8) !void {
+    var pool = Object.StatePool.init(allocator);
+    defer pool.deinit();
+    var object = try Object.init(pool.allocator(), type_id, object_type, bytes);
+    object.deinit(pool.allocator());
+}
+
+fn initTape(allocator: std.mem.Allocator, layout: *const StateTape.Layout, bytes: []const u8) !void {
+    var tape = try StateTape.init(allocator, layout, bytes);
+    tape.deinit();
+}
+
+fn updateObject(object: *Object, allocator: std.mem.Allocator, bytes: []const u8) !bool {
+    return object.update(allocator, bytes);
+}
+
+fn updateTape(tape: *StateTape, bytes: []const u8) !bool {
+    return tape.update(bytes);
+}
+
+fn writeItem(out: *std.ArrayList(u8), i: usize) !void {
+    const start = try serde.beginElem(out);
+    try serde.writeString(out, "item");
+
+    const note = try serde.beginElem(out);
+    if (i % 2 == 0) {
+        try out.append(1);
+        try serde.writeElem(out, "note");
+    } else {
+        try out.append(0);
+    }
+    serde.endElem(out, note);
+
+    try serde.writeElem(out, &[_]u8{0});
+    serde.endElem(out, start);
+}
+
+fn writeEntry(out: *std.ArrayList(u8), i: usize) !void {
+    var key: [32]u8 = undefined;
+    const start = try serde.beginElem(out);
+    try serde.writeElem(out, try std.fmt.bufPrint(&key, "entry-{d}", .{i}));
+    try serde.writeString(out, "value");
+    serde.endElem(out, start);
+}
+
+fn writeValue(out: *std.ArrayList(u8)) !void {
+    try serde.writeString(out, "title");
+
+    const items = try serde.beginElem(out);
+    try out.appendSlice(std.mem.asBytes(&@as(usize, list_items)));
+    for (0..list_items) |i| {
+        try writeItem(out, i);
+    }
+    serde.endElem(out, items);
+}
+
+fn writeListOp(out: *std.ArrayList(u8), tag: serde.MutateListOp.Tag) !usize {
+    const start = try serde.beginElem(out);
+    try out.appendSlice(std.mem.asBytes(&@as(u16, @intFromEnum(tag))));
+    return start;
+}
+
+/// Appends to the name of the item at `index`.
+fn writeRename(out: *std.ArrayList(u8), index: usize) !void {
+    try serde.writeElem(out, &[_]u8{0});
+
+    const items = try serde.beginElem(out);
+    try out.append(1);
+    try out.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    {
+        const op = try writeListOp(out, .Mutate);
+        const payload = try serde.beginElem(out);
+        try serde.writeElem(out, std.mem.asBytes(&index));
+
+        const item = try serde.beginElem(out);
+        const name = try serde.beginElem(out);
+        try out.append(1);
+        try out.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+        {
+            const str_op = try serde.beginElem(out);
+            try out.appendSlice(std.mem.asBytes(&@as(u16, @intFromEnum(serde.MutateStringOp.Tag.Append))));
+            try serde.writeString(out, "x");
+            serde.endElem(out, str_op);
+        }
+        serde.endElem(out, name);
+        try serde.writeElem(out, &[_]u8{0});
+        try serde.writeElem(out, &[_]u8{0});
+        serde.endElem(out, item);
+
+        serde.endElem(out, payload);
+        serde.endElem(out, op);
+    }
+    serde.endElem(out, items);
+}
+
+/// Prepends an item and deletes it again, which moves every element of the list twice.
+fn writeShift(out: *std.ArrayList(u8)) !void {
+    try serde.writeElem(out, &[_]u8{0});
+
+    const items = try serde.beginElem(out);
+    try out.append(1);
+    try out.appendSlice(std.mem.asBytes(&@as(usize, 2)));
+    {
+        const op = try writeListOp(out, .Prepend);
+        try writeItem(out, 0);
+        serde.endElem(out, op);
+    }
+    {
+        const op = try writeListOp(out, .Delete);
+        try serde.writeElem(out, std.mem.asBytes(&@as(usize, 0)));
+        serde.endElem(out, op);
+    }
+    serde.endElem(out, items);
+}
@@ -0,0 +1,129 @@
+const std = @import("std");
+const cy = @import("cycle");
+const bench = @import("../bench.zig");
+const table_bench = @import("table.zig");
+const serde = @import("../ObjectTable/serde.zig");
+const ObjectTable = @import("../ObjectTable.zig");
+const Store = @import("../Store.zig");
+const TypeTable = @import("../TypeTable.zig");
+
+const objects = 1 << 20;
+const batch_size = 1 << 14;
+const dir_name = "bench-store";
+
+pub fn run(allocator: std.mem.Allocator, writer: anytype) !void {
+    std.fs.cwd().deleteTree(dir_name) catch {};
+    var dir = try std.fs.cwd().makeOpenPath(dir_name, .{ .iterate = true });
+    defer {
+        dir.close();
+        std.fs.cwd().deleteTree(dir_name) catch {};
+    }
+
+    var pool: std.Thread.Pool = undefined;
+    try pool.init(.{ .allocator = allocator });
+    defer pool.deinit();
+
+    try fill(allocator, dir, &pool);
+    try bench.report(writer, "replay log of 1M objects", try timeReplay(allocator, dir, &pool));
+
+    const stats = try checkpoint(allocator, dir, &pool);
+    try bench.report(writer, "compact log of 1M objects", stats.compaction_ns);
+    try bench.reportBytes(writer, "log compacted", stats.compacted_bytes);
+    try bench.reportBytes(writer, "snapshot written", stats.snapshot_bytes_written);
+    try writer.print("  {s: <40} {d: >12} MiB/s\n", .{
+        "compaction throughput",
+        stats.compacted_bytes * std.time.ns_per_s / @max(1, stats.compaction_ns) >> 20,
+    });
+
+    try bench.report(writer, "replay snapshot of 1M objects", try timeReplay(allocator, dir, &pool));
+}
+
+// Creates every object and then appends to the title of each, all of it left in the log.
+fn fill(allocator: std.mem.Allocator, dir: std.fs.Dir, pool: *std.Thread.Pool) !void {
+    var type_table = TypeTable.init(allocator);
+    defer type_table.deinit();
+    var table = try ObjectTable.init(allocator);
+    defer table.deinit();
+
+    var store = try Store.open(allocator, dir, .{});
+    defer store.deinit();
+    _ = try store.replay(&table, &type_table, pool);
+    table.store = &store;
+
+    var scheme = std.ArrayList(u8).init(allocator);
+    defer scheme.deinit();
+    try cy.chan.write(cy.def.ObjectScheme.from(table_bench.BenchScheme), &scheme);
+
+    const view = cy.chan.read(cy.def.ObjectScheme, scheme.items);
+    const doc = view.field(.objects).elem(0);
+    const type_id = try type_table.update(view.field(.name), doc.field(.name), doc.field(.versions).elem(0));
+
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    try serde.writeString(&value, "title");
+    try serde.writeElem(&value, std.mem.asBytes(&@as(u32, 0)));
+
+    var append = std.ArrayList(u8).init(allocator);
+    defer append.deinit();
+    try table_bench.writeAppend(&append);
+
+    var names = std.ArrayList(u8).init(allocator);
+    defer names.deinit();
+    const mutations = try allocator.alloc(ObjectTable.Mutation, batch_size);
+    defer allocator.free(mutations);
+    const results = try allocator.alloc(bool, batch_size);
+    defer allocator.free(results);
+
+    for ([_][]const u8{ value.items, append.items }) |bytes| {
+        var start: usize = 0;
+        while (start < objects) : (start += batch_size) {
+            names.clearRetainingCapacity();
+            for (0..batch_size) |i| {
+                try names.writer().print("doc-{d:0>8}", .{start + i});
+            }
+
+            const name_len = names.items.len / batch_size;
+            for (mutations, 0..) |*mutation, i| {
+                mutation.* = ObjectTable.Mutation{
+                    .scheme_name = "bench",
+                    .source_name = "source",
+                    .object_name = names.items[i * name_len ..][0..name_len],
+                    .type_id = type_id,
+                    .bytes = bytes,
+                };
+            }
+            try table.updateBatch(pool, &type_table, mutations, results);
+        }
+    }
+}
+
+// Times loading the store into a fresh table.
+fn timeReplay(allocator: std.mem.Allocator, dir: std.fs.Dir, pool: *std.Thread.Pool) !u64 {
+    var type_table = TypeTable.init(allocator);
+    defer type_table.deinit();
+    var table = try ObjectTable.init(allocator);
+    defer table.deinit();
+
+    var store = try Store.open(allocator, dir, .{});
+    defer store.deinit();
+
+    var timer = try std.time.Timer.start();
+    const replayed = try store.replay(&table, &type_table, pool);
+    std.debug.assert(replayed.snapshot_records + replayed.log_records >= objects);
+    return timer.read();
+}
+
+// Folds the whole log into a snapshot.
+fn checkpoint(allocator: std.mem.Allocator, dir: std.fs.Dir, pool: *std.Thread.Pool) !Store.Stats {
+    var type_table = TypeTable.init(allocator);
+    defer type_table.deinit();
+    var table = try ObjectTable.init(allocator);
+    defer table.deinit();
+
+    var store = try Store.open(allocator, dir, .{});
+    defer store.deinit();
+    _ = try store.replay(&table, &type_table, pool);
+
+    try store.checkpoint();
+    return store.metrics();
+}
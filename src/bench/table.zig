@@ -0,0 +1,183 @@
+const std = @import("std");
+const cy = @import("cycle");
+const bench = @import("../bench.zig");
+const ObjectTable = @import("../ObjectTable.zig");
+const TypeTable = @import("../TypeTable.zig");
+const serde = @import("../ObjectTable/serde.zig");
+
+const objects = 4_096;
+const batch_size = 16_384;
+const churn_rounds = 20;
+
+pub const BenchScheme = cy.def.Scheme("bench", .{
+    cy.def.Object("Doc", .{
+        struct {
+            title: cy.def.String,
+            count: u32,
+        },
+    }),
+});
+
+pub fn run(allocator: std.mem.Allocator, writer: anytype) !void {
+    var type_table = TypeTable.init(allocator);
+    defer type_table.deinit();
+
+    var scheme = std.ArrayList(u8).init(allocator);
+    defer scheme.deinit();
+    try cy.chan.write(cy.def.ObjectScheme.from(BenchScheme), &scheme);
+
+    const view = cy.chan.read(cy.def.ObjectScheme, scheme.items);
+    const doc = view.field(.objects).elem(0);
+    const type_id = try type_table.update(view.field(.name), doc.field(.name), doc.field(.versions).elem(0));
+
+    var value = std.ArrayList(u8).init(allocator);
+    defer value.deinit();
+    try serde.writeString(&value, "title");
+    try serde.writeElem(&value, std.mem.asBytes(&@as(u32, 0)));
+
+    var append = std.ArrayList(u8).init(allocator);
+    defer append.deinit();
+    try writeAppend(&append);
+
+    var names = std.ArrayList(u8).init(allocator);
+    defer names.deinit();
+    const name_ends = try allocator.alloc(usize, objects);
+    defer allocator.free(name_ends);
+    for (name_ends, 0..) |*end, i| {
+        try names.writer().print("doc-{d}", .{i});
+        end.* = names.items.len;
+    }
+
+    const creates = try allocator.alloc(ObjectTable.Mutation, objects);
+    defer allocator.free(creates);
+    for (creates, 0..) |*mutation, i| {
+        mutation.* = ObjectTable.Mutation{
+            .scheme_name = "bench",
+            .source_name = "source",
+            .object_name = names.items[if (i == 0) 0 else name_ends[i - 1]..name_ends[i]],
+            .type_id = type_id,
+            .bytes = value.items,
+        };
+    }
+
+    // every object is appended to several times per batch
+    const appends = try allocator.alloc(ObjectTable.Mutation, batch_size);
+    defer allocator.free(appends);
+    for (appends, 0..) |*mutation, i| {
+        mutation.* = creates[i % objects];
+        mutation.bytes = append.items;
+    }
+
+    const results = try allocator.alloc(bool, batch_size);
+    defer allocator.free(results);
+
+    const cpu_count = std.Thread.getCpuCount() catch 1;
+    var threads: usize = 1;
+    while (true) : (threads = @min(threads * 2, cpu_count)) {
+        var table = try ObjectTable.init(allocator);
+        defer table.deinit();
+
+        var pool: std.Thread.Pool = undefined;
+        try pool.init(.{ .allocator = allocator, .n_jobs = @intCast(threads) });
+        defer pool.deinit();
+
+        try table.updateBatch(&pool, &type_table, creates, results[0..objects]);
+
+        var name_buf: [64]u8 = undefined;
+        const name = try std.fmt.bufPrint(&name_buf, "batch update on {d} threads", .{threads});
+        try bench.report(writer, name, try bench.measure(20, ObjectTable.updateBatch, .{ &table, &pool, &type_table, appends, results }));
+
+        if (threads == cpu_count) {
+            break;
+        }
+    }
+
+    try runHandles(allocator, writer, &type_table, creates, append.items);
+    try runChurn(allocator, writer, &type_table, creates);
+}
+
+fn runHandles(
+    allocator: std.mem.Allocator,
+    writer: anytype,
+    type_table: *const TypeTable,
+    creates: []const ObjectTable.Mutation,
+    append: []const u8,
+) !void {
+    var table = try ObjectTable.init(allocator);
+    defer table.deinit();
+
+    const handles = try allocator.alloc(ObjectTable.ObjectHandle, creates.len);
+    defer allocator.free(handles);
+    for (creates, handles) |mutation, *handle| {
+        _ = try table.update(mutation.scheme_name, mutation.source_name, mutation.object_name, type_table, mutation.type_id, mutation.bytes);
+        handle.* = try table.resolve(mutation.scheme_name, mutation.source_name, mutation.object_name);
+    }
+
+    try bench.report(writer, "update by names", try bench.measure(20, updateByNames, .{ &table, type_table, creates, append }));
+    try bench.report(writer, "update by handles", try bench.measure(20, updateByHandles, .{ &table, type_table, creates[0].type_id, handles, append }));
+    try bench.reportBytes(writer, "table names", table.accounting.names.stats().live_bytes);
+    try bench.reportBytes(writer, "table state", table.accounting.state.stats().live_bytes);
+}
+
+// Creates every object and removes it again, round after round. The table should hold no more memory after
+// the last round than after the first.
+fn runChurn(allocator: std.mem.Allocator, writer: anytype, type_table: *const TypeTable, creates: []const ObjectTable.Mutation) !void {
+    var gpa = std.heap.GeneralPurposeAllocator(.{ .enable_memory_limit = true }){};
+    defer _ = gpa.deinit();
+
+    var table = try ObjectTable.init(gpa.allocator());
+    defer table.deinit();
+
+    const handles = try allocator.alloc(ObjectTable.ObjectHandle, creates.len);
+    defer allocator.free(handles);
+
+    try churn(&table, type_table, creates, handles);
+    const first = gpa.total_requested_bytes;
+    try bench.report(writer, "create and remove", try bench.measure(churn_rounds, churn, .{ &table, type_table, creates, handles }));
+    try bench.reportBytes(writer, "table after first churn round", first);
+    try bench.reportBytes(writer, "table after last churn round", gpa.total_requested_bytes);
+}
+
+fn churn(
+    table: *ObjectTable,
+    type_table: *const TypeTable,
+    creates: []const ObjectTable.Mutation,
+    handles: []ObjectTable.ObjectHandle,
+) !void {
+    for (creates, handles) |mutation, *handle| {
+        handle.* = try table.resolve(mutation.scheme_name, mutation.source_name, mutation.object_name);
+        _ = try table.updateHandle(handle.*, type_table, mutation.type_id, mutation.bytes);
+    }
+    for (handles) |handle| {
+        _ = try table.removeHandle(handle);
+    }
+}
+
+fn updateByNames(table: *ObjectTable, type_table: *const TypeTable, creates: []const ObjectTable.Mutation, append: []const u8) !void {
+    for (creates) |mutation| {
+        _ = try table.update(mutation.scheme_name, mutation.source_name, mutation.object_name, type_table, mutation.type_id, append);
+    }
+}
+
+fn updateByHandles(
+    table: *ObjectTable,
+    type_table: *const TypeTable,
+    type_id: cy.def.TypeId,
+    handles: []const ObjectTable.ObjectHandle,
+    append: []const u8,
+) !void {
+    for (handles) |handle| {
+        _ = try table.updateHandle(handle, type_table, type_id, append);
+    }
+}
+
+// Appends a character to the title and leaves the count unchanged.
+pub fn writeAppend(out: *std.ArrayList(u8)) !void {
+    const title = try serde.beginElem(out);
+    try out.append(1);
+    try out.appendSlice(std.mem.asBytes(&@as(usize, 1)));
+    try serde.writeStringOp(out, .Append, 0, "x");
+    serde.endElem(out, title);
+
+    try serde.writeElem(out, &[_]u8{0});
+}
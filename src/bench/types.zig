@@ -0,0 +1,141 @@
+const std = @import("std");
+const cy = @import("cycle");
+const bench = @import("../bench.zig");
+const TypeTable = @import("../TypeTable.zig");
+const TypeIndex = @import("../TypeIndex.zig");
+
+const schemes = 64;
+const objects_per_scheme = 64;
+const lookups = 4_096;
+
+const Doc = .{
+    struct {
+        title: cy.def.String,
+        count: u32,
+    },
+    struct {
+        title: cy.def.String,
+        count: u32,
+        tags: cy.def.List(cy.def.String),
+    },
+};
+
+pub const BenchScheme = cy.def.Scheme("types", .{
+    cy.def.Object("Doc", Doc),
+});
+
+fn PluginScheme(comptime name: []const u8) type {
+    return cy.def.Scheme(name, .{
+        cy.def.Object("Doc0", Doc),
+        cy.def.Object("Doc1", Doc),
+        cy.def.Object("Doc2", Doc),
+        cy.def.Object("Doc3", Doc),
+        cy.def.Object("Doc4", Doc),
+        cy.def.Object("Doc5", Doc),
+        cy.def.Object("Doc6", Doc),
+        cy.def.Object("Doc7", Doc),
+    });
+}
+
+pub fn run(allocator: std.mem.Allocator, writer: anytype) !void {
+    var table = TypeTable.init(allocator);
+    defer table.deinit();
+
+    var scheme = std.ArrayList(u8).init(allocator);
+    defer scheme.deinit();
+    try cy.chan.write(cy.def.ObjectScheme.from(BenchScheme), &scheme);
+
+    const view = cy.chan.read(cy.def.ObjectScheme, scheme.items);
+    const versions = view.field(.objects).elem(0).field(.versions);
+
+    var scheme_name = std.ArrayList(u8).init(allocator);
+    defer scheme_name.deinit();
+    var object_name = std.ArrayList(u8).init(allocator);
+    defer object_name.deinit();
+    var ids = std.ArrayList(cy.def.TypeId).init(allocator);
+    defer ids.deinit();
+    for (0..schemes) |s| {
+        scheme_name.clearRetainingCapacity();
+        try scheme_name.writer().print("scheme-{d}", .{s});
+        for (0..objects_per_scheme) |o| {
+            object_name.clearRetainingCapacity();
+            try object_name.writer().print("doc-{d}", .{o});
+            for (0..versions.len()) |v| {
+                try ids.append(try table.update(scheme_name.items, object_name.items, versions.elem(v)));
+            }
+        }
+    }
+
+    // random ids, so that lookups don't walk the tables in order
+    var prng = std.rand.DefaultPrng.init(0);
+    const random = prng.random();
+    const targets = try allocator.alloc(cy.def.TypeId, lookups);
+    defer allocator.free(targets);
+    for (targets) |*id| {
+        id.* = ids.items[random.uintLessThan(usize, ids.items.len)];
+    }
+
+    const ns_get: f64 = @floatFromInt(try bench.measure(1_000, getAll, .{ &table, targets }));
+    const ns_find: f64 = @floatFromInt(try bench.measure(1_000, findAll, .{ &table, targets }));
+    try bench.reportValue(writer, "type lookup via directory", ns_get / lookups, "ns");
+    try bench.reportValue(writer, "type lookup via registration maps", ns_find / lookups, "ns");
+
+    // The plugin's schemes are registered after the others, so its ids and the editor's differ.
+    var plugin_schemes = std.ArrayList(u8).init(allocator);
+    defer plugin_schemes.deinit();
+    const schemes_of_plugin: []const cy.def.ObjectScheme = &.{
+        cy.def.ObjectScheme.from(PluginScheme("plugin-0")),
+        cy.def.ObjectScheme.from(PluginScheme("plugin-1")),
+        cy.def.ObjectScheme.from(PluginScheme("plugin-2")),
+        cy.def.ObjectScheme.from(PluginScheme("plugin-3")),
+    };
+    try cy.chan.write(schemes_of_plugin, &plugin_schemes);
+    var index = try TypeIndex.init(allocator, &table, cy.chan.read([]const cy.def.ObjectScheme, plugin_schemes.items));
+    defer index.deinit();
+
+    const editor_ids = try allocator.alloc(cy.def.TypeId, lookups);
+    defer allocator.free(editor_ids);
+    for (editor_ids) |*id| {
+        id.* = index.editorId(.{
+            .scheme = @intCast(random.uintLessThan(usize, schemes_of_plugin.len)),
+            .name = @intCast(random.uintLessThan(usize, 8)),
+            .version = @intCast(random.uintLessThan(usize, 2)),
+        });
+    }
+    const batch = try allocator.alloc(cy.def.TypeId, lookups);
+    defer allocator.free(batch);
+
+    const ns_each: f64 = @floatFromInt(try bench.measure(1_000, translateEach, .{ &index, editor_ids, batch }));
+    const ns_batch: f64 = @floatFromInt(try bench.measure(1_000, translateBatch, .{ &index, editor_ids, batch }));
+    try bench.reportValue(writer, "type id translation one by one", ns_each / lookups, "ns");
+    try bench.reportValue(writer, "type id translation in a batch", ns_batch / lookups, "ns");
+}
+
+fn translateEach(index: *const TypeIndex, ids: []const cy.def.TypeId, out: []cy.def.TypeId) usize {
+    for (ids, out) |id, *plugin_id| {
+        plugin_id.* = index.pluginId(id);
+    }
+    return out.len;
+}
+
+// Batches are translated in place, so the ids are copied first, which counts against the batch.
+fn translateBatch(index: *const TypeIndex, ids: []const cy.def.TypeId, out: []cy.def.TypeId) bool {
+    @memcpy(out, ids);
+    return index.translateBatch(.EditorToPlugin, out);
+}
+
+fn getAll(table: *const TypeTable, ids: []const cy.def.TypeId) !usize {
+    var tags: usize = 0;
+    for (ids) |id| {
+        tags +%= @intFromEnum(try table.get(id));
+    }
+    return tags;
+}
+
+fn findAll(table: *const TypeTable, ids: []const cy.def.TypeId) !usize {
+    var tags: usize = 0;
+    for (ids) |id| {
+        tags +%= @intFromEnum(try table.find(id));
+    }
+    return tags;
+}
@@ -0,0 +1,23 @@
+//! Types shared by the tests of the object table and the store.
+const std = @import("std");
+const cy = @import("cycle");
+const TypeTable = @import("TypeTable.zig");
+
+/// A scheme with one object holding a single string.
+pub const Scheme = cy.def.Scheme("scheme", .{
+    cy.def.Object("Obj", .{
+        cy.def.String,
+    }),
+});
+
+/// Registers the object of `Scheme` with `type_table` and returns its id. Unlike `TypeTable.specialize`, this
+/// leaves the object without a specialized applier, so updates to it take the generic path.
+pub fn registerObject(type_table: *TypeTable) !cy.def.TypeId {
+    var bytes = std.ArrayList(u8).init(std.testing.allocator);
+    defer bytes.deinit();
+    try cy.chan.write(cy.def.ObjectScheme.from(Scheme), &bytes);
+
+    const view = cy.chan.read(cy.def.ObjectScheme, bytes.items);
+    const object = view.field(.objects).elem(0);
+    return type_table.update(view.field(.name), object.field(.name), object.field(.versions).elem(0));
+}
@@ -0,0 +1,25 @@
+//! The root of the tests of the object and type tables, which need the `cycle` plugin library and so aren't
+//! reached from `main.zig`. Run by `zig build test-tables -Dcycle=<path>`, and by `zig build test` when the
+//! option is given.
+
+test {
+    _ = @import("CountingAllocator.zig");
+    _ = @import("TypeIndex.zig");
+    _ = @import("TypeTable.zig");
+    _ = @import("TypeTable/Directory.zig");
+    _ = @import("ObjectTable.zig");
+    _ = @import("ObjectTable/Accounting.zig");
+    _ = @import("ObjectTable/Coalescer.zig");
+    _ = @import("ObjectTable/Column.zig");
+    _ = @import("ObjectTable/Journal.zig");
+    _ = @import("ObjectTable/Object.zig");
+    _ = @import("ObjectTable/Plan.zig");
+    _ = @import("ObjectTable/Rope.zig");
+    _ = @import("ObjectTable/StateTape.zig");
+    _ = @import("ObjectTable/Subscriptions.zig");
+    _ = @import("ObjectTable/chunked_list.zig");
+    _ = @import("ObjectTable/keys.zig");
+    _ = @import("ObjectTable/serde.zig");
+    _ = @import("ObjectTable/slab.zig");
+    _ = @import("Store.zig");
+}
@@ -8,3 +8,35 @@ pub const STARTUPINFOW = windows.STARTUPINFOW;
 
 pub const CreateProcessW = windows.CreateProcessW;
 pub const TerminateProcess = windows.TerminateProcess;
+
+pub const HANDLE = windows.HANDLE;
+pub const PAGE_READONLY = windows.PAGE_READONLY;
+pub const PAGE_READWRITE = windows.PAGE_READWRITE;
+pub const FILE_MAP_READ: windows.DWORD = 0x0004;
+pub const FILE_MAP_WRITE: windows.DWORD = 0x0002;
+
+pub const CloseHandle = windows.CloseHandle;
+
+pub extern "kernel32" fn CreateFileMappingW(
+    hFile: windows.HANDLE,
+    lpFileMappingAttributes: ?*windows.SECURITY_ATTRIBUTES,
+    flProtect: windows.DWORD,
+    dwMaximumSizeHigh: windows.DWORD,
+    dwMaximumSizeLow: windows.DWORD,
+    lpName: ?windows.LPCWSTR,
+) callconv(windows.WINAPI) ?windows.HANDLE;
+
+pub extern "kernel32" fn MapViewOfFile(
+    hFileMappingObject: windows.HANDLE,
+    dwDesiredAccess: windows.DWORD,
+    dwFileOffsetHigh: windows.DWORD,
+    dwFileOffsetLow: windows.DWORD,
+    dwNumberOfBytesToMap: windows.SIZE_T,
+) callconv(windows.WINAPI) ?windows.LPVOID;
+
+pub extern "kernel32" fn UnmapViewOfFile(lpBaseAddress: windows.LPCVOID) callconv(windows.WINAPI) windows.BOOL;
+
+pub extern "kernel32" fn FlushViewOfFile(
+    lpBaseAddress: windows.LPCVOID,
+    dwNumberOfBytesToFlush: windows.SIZE_T,
+) callconv(windows.WINAPI) windows.BOOL;